@@ -365,6 +365,12 @@ emit_vpmaskmovd_to_rax_500(struct builder *bld, int src, int mask)
 	builder_emit_vpmaskmovd_to_rax(bld, src, mask, 500);
 }
 
+static void
+emit_vcvtps2ph_rn(struct builder *bld, int dst, int src)
+{
+	builder_emit_vcvtps2ph(bld, dst, src, 0);
+}
+
 int main(int argc, char *argv[])
 {
 	check_reg_imm_emit_function("vpbroadcastd 0x%2$x(%%rip),%%ymm%1$d",
@@ -421,6 +427,8 @@ int main(int argc, char *argv[])
 	check_binop_emit_function("vpmovsxwd %%xmm%d,%%ymm%d", builder_emit_vpmovsxwd);
 	check_binop_emit_function("vpmovzxwd %%xmm%d,%%ymm%d", builder_emit_vpmovzxwd);
 	check_binop_emit_function("vmovdqa %%ymm%d,%%ymm%d", builder_emit_vmovdqa);
+	check_binop_emit_function("vptest %%ymm%d,%%ymm%d", builder_emit_vptest);
+	check_binop_emit_function("vcvtps2ph $0x0,%%ymm%d,%%xmm%d", emit_vcvtps2ph_rn);
 	check_binop_emit_function("vpmaskmovd %%ymm%2$d,%%ymm%1$d,(%%rax)", emit_vpmaskmovd_to_rax);
 	check_binop_emit_function("vpmaskmovd %%ymm%2$d,%%ymm%1$d,20(%%rax)", emit_vpmaskmovd_to_rax_20);
 	check_binop_emit_function("vpmaskmovd %%ymm%2$d,%%ymm%1$d,500(%%rax)", emit_vpmaskmovd_to_rax_500);
@@ -431,6 +439,7 @@ int main(int argc, char *argv[])
 	check_triop_emit_function("vminps %%ymm%d,%%ymm%d,%%ymm%d", builder_emit_vminps);
 
 	check_triop_emit_function("vpcmpgtd %%ymm%d,%%ymm%d,%%ymm%d", builder_emit_vpcmpgtd);
+	check_triop_emit_function("vpackusdw %%ymm%d,%%ymm%d,%%ymm%d", builder_emit_vpackusdw);
 	check_triop_emit_function("vpcmpeqd %%ymm%d,%%ymm%d,%%ymm%d", builder_emit_vpcmpeqd);
 
 	check_quadop_emit_function("vpblendvb %%ymm%d,%%ymm%d,%%ymm%d,%%ymm%d",
@@ -617,9 +617,9 @@ builder_emit_vpermilps(struct builder *bld, int dst, int imm, int src0)
 
 
 static inline void
-builder_emit_vroundps(struct builder *bld, int dst, int op, int src1)
+builder_emit_vroundps(struct builder *bld, int dst, int op, int src0)
 {
-	int src0 = 0;
+	int src1 = 0;
 
 	builder_emit_short_alu_e3(bld, 0x08, dst, src0, src1);
 	emit(bld, op);
@@ -665,6 +665,20 @@ builder_emit_vpmovsxwd(struct builder *bld, int dst, int src)
 	     0x7d, 0x23, 0xc0 + (dst & 7) * 8 + (src & 7));
 }
 
+static inline void
+builder_emit_vcvtps2ph(struct builder *bld, int dst, int src, int imm)
+{
+	emit(bld, 0xc4, 0xe3 - (src & 8) * 16 - (dst & 8) * 4,
+	     0x7d, 0x1d, 0xc0 + (src & 7) * 8 + (dst & 7), imm);
+}
+
+static inline void
+builder_emit_vptest(struct builder *bld, int src0, int src1)
+{
+	emit(bld, 0xc4, 0xe2 - (src0 & 8) * 16 - (src1 & 8) * 4,
+	     0x7d, 0x17, 0xc0 + (src0 & 7) * 8 + (src1 & 7));
+}
+
 static inline void
 builder_emit_vpmovzxwd(struct builder *bld, int dst, int src)
 {
@@ -0,0 +1,527 @@
+/*
+ * Copyright © 2016 Kristian H. Kristensen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "ksim.h"
+
+/* Block compressed texture decoding. Sampling a BC texture decodes
+ * the 4x4 block once into RGBA8 texels and keeps the result in a
+ * direct mapped cache, so neighbouring samples and filter taps in the
+ * same block don't decode it again. */
+
+static inline uint32_t
+pack_rgba8(uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+{
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+static inline uint64_t
+load_u64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+/* BC1 color block. BC2 and BC3 always use the four color mode. */
+static void
+decode_bc1_color(const uint8_t *src, bool four_color, uint32_t *texels)
+{
+	const uint32_t c0 = src[0] | (src[1] << 8);
+	const uint32_t c1 = src[2] | (src[3] << 8);
+	const uint32_t indices = src[4] | (src[5] << 8) | (src[6] << 16) | (src[7] << 24);
+	uint32_t r[4], g[4], b[4], a[4] = { 255, 255, 255, 255 };
+	uint32_t colors[4];
+
+	r[0] = (c0 >> 11) & 0x1f;
+	g[0] = (c0 >> 5) & 0x3f;
+	b[0] = c0 & 0x1f;
+	r[1] = (c1 >> 11) & 0x1f;
+	g[1] = (c1 >> 5) & 0x3f;
+	b[1] = c1 & 0x1f;
+
+	for (int i = 0; i < 2; i++) {
+		r[i] = (r[i] << 3) | (r[i] >> 2);
+		g[i] = (g[i] << 2) | (g[i] >> 4);
+		b[i] = (b[i] << 3) | (b[i] >> 2);
+	}
+
+	if (four_color || c0 > c1) {
+		r[2] = (2 * r[0] + r[1] + 1) / 3;
+		g[2] = (2 * g[0] + g[1] + 1) / 3;
+		b[2] = (2 * b[0] + b[1] + 1) / 3;
+		r[3] = (r[0] + 2 * r[1] + 1) / 3;
+		g[3] = (g[0] + 2 * g[1] + 1) / 3;
+		b[3] = (b[0] + 2 * b[1] + 1) / 3;
+	} else {
+		/* Three colors and transparent black. */
+		r[2] = (r[0] + r[1]) / 2;
+		g[2] = (g[0] + g[1]) / 2;
+		b[2] = (b[0] + b[1]) / 2;
+		r[3] = g[3] = b[3] = a[3] = 0;
+	}
+
+	for (int i = 0; i < 4; i++)
+		colors[i] = pack_rgba8(r[i], g[i], b[i], a[i]);
+
+	for (int i = 0; i < 16; i++)
+		texels[i] = colors[(indices >> (i * 2)) & 3];
+}
+
+/* BC4 channel block, also used for BC3 alpha and both BC5
+ * channels. Signed blocks decode to two's complement bytes. */
+static void
+decode_bc4_channel(const uint8_t *src, bool snorm, uint8_t *values)
+{
+	const uint64_t indices = load_u64(src) >> 16;
+	int v[8];
+
+	if (snorm) {
+		v[0] = (int8_t) src[0] < -127 ? -127 : (int8_t) src[0];
+		v[1] = (int8_t) src[1] < -127 ? -127 : (int8_t) src[1];
+	} else {
+		v[0] = src[0];
+		v[1] = src[1];
+	}
+
+	if (v[0] > v[1]) {
+		for (int i = 1; i < 7; i++)
+			v[i + 1] = ((7 - i) * v[0] + i * v[1]) / 7;
+	} else {
+		for (int i = 1; i < 5; i++)
+			v[i + 1] = ((5 - i) * v[0] + i * v[1]) / 5;
+		v[6] = snorm ? -127 : 0;
+		v[7] = snorm ? 127 : 255;
+	}
+
+	for (int i = 0; i < 16; i++)
+		values[i] = v[(indices >> (i * 3)) & 7];
+}
+
+/* Two subset BC7 partitions, bit i set for the texels in subset 1. */
+static const uint16_t bc7_partitions2[64] = {
+	0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80,
+	0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+	0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce,
+	0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+	0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a,
+	0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+	0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c,
+	0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22,
+};
+
+static const uint8_t bc7_partitions3[64][16] = {
+	{ 0, 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 1, 2, 2, 2, 2 },
+	{ 0, 0, 0, 1, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 2, 1 },
+	{ 0, 0, 0, 0, 2, 0, 0, 1, 2, 2, 1, 1, 2, 2, 1, 1 },
+	{ 0, 2, 2, 2, 0, 0, 2, 2, 0, 0, 1, 1, 0, 1, 1, 1 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2 },
+	{ 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 2, 2, 0, 0, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1 },
+	{ 0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2 },
+	{ 0, 1, 1, 2, 0, 1, 1, 2, 0, 1, 1, 2, 0, 1, 1, 2 },
+	{ 0, 1, 2, 2, 0, 1, 2, 2, 0, 1, 2, 2, 0, 1, 2, 2 },
+	{ 0, 0, 1, 1, 0, 1, 1, 2, 1, 1, 2, 2, 1, 2, 2, 2 },
+	{ 0, 0, 1, 1, 2, 0, 0, 1, 2, 2, 0, 0, 2, 2, 2, 0 },
+	{ 0, 0, 0, 1, 0, 0, 1, 1, 0, 1, 1, 2, 1, 1, 2, 2 },
+	{ 0, 1, 1, 1, 0, 0, 1, 1, 2, 0, 0, 1, 2, 2, 0, 0 },
+	{ 0, 0, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 2, 2, 0, 0, 2, 2, 1, 1, 1, 1 },
+	{ 0, 1, 1, 1, 0, 1, 1, 1, 0, 2, 2, 2, 0, 2, 2, 2 },
+	{ 0, 0, 0, 1, 0, 0, 0, 1, 2, 2, 2, 1, 2, 2, 2, 1 },
+	{ 0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 2, 2, 0, 1, 2, 2 },
+	{ 0, 0, 0, 0, 1, 1, 0, 0, 2, 2, 1, 0, 2, 2, 1, 0 },
+	{ 0, 1, 2, 2, 0, 1, 2, 2, 0, 0, 1, 1, 0, 0, 0, 0 },
+	{ 0, 0, 1, 2, 0, 0, 1, 2, 1, 1, 2, 2, 2, 2, 2, 2 },
+	{ 0, 1, 1, 0, 1, 2, 2, 1, 1, 2, 2, 1, 0, 1, 1, 0 },
+	{ 0, 0, 0, 0, 0, 1, 1, 0, 1, 2, 2, 1, 1, 2, 2, 1 },
+	{ 0, 0, 2, 2, 1, 1, 0, 2, 1, 1, 0, 2, 0, 0, 2, 2 },
+	{ 0, 1, 1, 0, 0, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2, 2 },
+	{ 0, 0, 1, 1, 0, 1, 2, 2, 0, 1, 2, 2, 0, 0, 1, 1 },
+	{ 0, 0, 0, 0, 2, 0, 0, 0, 2, 2, 1, 1, 2, 2, 2, 1 },
+	{ 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 2, 2, 2 },
+	{ 0, 2, 2, 2, 0, 0, 2, 2, 0, 0, 1, 2, 0, 0, 1, 1 },
+	{ 0, 0, 1, 1, 0, 0, 1, 2, 0, 0, 2, 2, 0, 2, 2, 2 },
+	{ 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0 },
+	{ 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 0, 0, 0, 0 },
+	{ 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0 },
+	{ 0, 1, 2, 0, 2, 0, 1, 2, 1, 2, 0, 1, 0, 1, 2, 0 },
+	{ 0, 0, 1, 1, 2, 2, 0, 0, 1, 1, 2, 2, 0, 0, 1, 1 },
+	{ 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 0, 0, 0, 0, 1, 1 },
+	{ 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 2, 1, 2, 1, 2, 1 },
+	{ 0, 0, 2, 2, 1, 1, 2, 2, 0, 0, 2, 2, 1, 1, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 1, 1, 0, 0, 2, 2, 0, 0, 1, 1 },
+	{ 0, 2, 2, 0, 1, 2, 2, 1, 0, 2, 2, 0, 1, 2, 2, 1 },
+	{ 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 0, 1, 0, 1 },
+	{ 0, 0, 0, 0, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1 },
+	{ 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 },
+	{ 0, 2, 2, 2, 0, 1, 1, 1, 0, 2, 2, 2, 0, 1, 1, 1 },
+	{ 0, 0, 0, 2, 1, 1, 1, 2, 0, 0, 0, 2, 1, 1, 1, 2 },
+	{ 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 2 },
+	{ 0, 2, 2, 2, 0, 1, 1, 1, 0, 1, 1, 1, 0, 2, 2, 2 },
+	{ 0, 0, 0, 2, 1, 1, 1, 2, 1, 1, 1, 2, 0, 0, 0, 2 },
+	{ 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 1, 2 },
+	{ 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 2, 2 },
+	{ 0, 0, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2, 0, 0, 2, 2 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2 },
+	{ 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 1 },
+	{ 0, 2, 2, 2, 1, 2, 2, 2, 0, 2, 2, 2, 1, 2, 2, 2 },
+	{ 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 1, 1, 1, 2, 0, 1, 1, 2, 2, 0, 1, 2, 2, 2, 0 },
+};
+
+/* Texels whose index has an implicit zero high bit, for the second
+ * subset of two subset partitions and the second and third subsets
+ * of three subset partitions. Texel 0 is always an anchor. */
+static const uint8_t bc7_anchors2[64] = {
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+	15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+	 6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15,
+};
+
+static const uint8_t bc7_anchors3[2][64] = {
+	{
+		 3,  3, 15, 15,  8,  3, 15, 15,  8,  8,  6,  6,  6,  5,  3,  3,
+		 3,  3,  8, 15,  3,  3,  6, 10,  5,  8,  8,  6,  8,  5, 15, 15,
+		 8, 15,  3,  5,  6, 10,  8, 15, 15,  3, 15,  5, 15, 15, 15, 15,
+		 3, 15,  5,  5,  5,  8,  5, 10,  5, 10,  8, 13, 15, 12,  3,  3,
+	},
+	{
+		15,  8,  8,  3, 15, 15,  3,  8, 15, 15, 15, 15, 15, 15, 15,  8,
+		15,  8, 15,  3, 15,  8, 15,  8,  3, 15,  6, 10, 15, 15, 10,  8,
+		15,  3, 15, 10, 10,  8,  9, 10,  6, 15,  8, 15,  3,  6,  6,  8,
+		15,  3, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  3, 15, 15,  8,
+	},
+};
+
+static const uint8_t bc7_weights2[4] = { 0, 21, 43, 64 };
+static const uint8_t bc7_weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+static const uint8_t bc7_weights4[16] = {
+	0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+struct bc7_mode {
+	uint8_t subsets;
+	uint8_t partition_bits;
+	uint8_t rotation_bits;
+	uint8_t index_selection_bits;
+	uint8_t color_bits;
+	uint8_t alpha_bits;
+	uint8_t endpoint_pbits;
+	uint8_t shared_pbits;
+	uint8_t index_bits;
+	uint8_t index2_bits;
+};
+
+static const struct bc7_mode bc7_modes[8] = {
+	{ 3, 4, 0, 0, 4, 0, 1, 0, 3, 0 },
+	{ 2, 6, 0, 0, 6, 0, 0, 1, 3, 0 },
+	{ 3, 6, 0, 0, 5, 0, 0, 0, 2, 0 },
+	{ 2, 6, 0, 0, 7, 0, 1, 0, 2, 0 },
+	{ 1, 0, 2, 1, 5, 6, 0, 0, 2, 3 },
+	{ 1, 0, 2, 0, 7, 8, 0, 0, 2, 2 },
+	{ 1, 0, 0, 0, 7, 7, 1, 0, 4, 0 },
+	{ 2, 6, 0, 0, 5, 5, 1, 0, 2, 0 },
+};
+
+struct bit_reader {
+	uint64_t lo, hi;
+	uint32_t pos;
+};
+
+static inline uint32_t
+read_bits(struct bit_reader *b, uint32_t n)
+{
+	uint64_t v;
+
+	if (n == 0)
+		return 0;
+
+	if (b->pos >= 64)
+		v = b->hi >> (b->pos - 64);
+	else if (b->pos + n <= 64)
+		v = b->lo >> b->pos;
+	else
+		v = (b->lo >> b->pos) | (b->hi << (64 - b->pos));
+
+	b->pos += n;
+
+	return v & ((1u << n) - 1);
+}
+
+static inline uint32_t
+bc7_interpolate(uint32_t e0, uint32_t e1, uint32_t index, uint32_t bits)
+{
+	const uint8_t *weights =
+		bits == 2 ? bc7_weights2 : bits == 3 ? bc7_weights3 : bc7_weights4;
+	const uint32_t w = weights[index];
+
+	return ((64 - w) * e0 + w * e1 + 32) >> 6;
+}
+
+static inline uint32_t
+expand_bits(uint32_t v, uint32_t bits)
+{
+	v <<= 8 - bits;
+
+	return v | (v >> bits);
+}
+
+static void
+decode_bc7(const uint8_t *src, uint32_t *texels)
+{
+	struct bit_reader b = { load_u64(src), load_u64(src + 8), 0 };
+	uint8_t endpoints[3][2][4];
+	uint8_t indices[16], indices2[16];
+
+	if (src[0] == 0) {
+		/* Reserved mode, decodes to transparent black. */
+		memset(texels, 0, 16 * sizeof(*texels));
+		return;
+	}
+
+	const uint32_t mode_number = __builtin_ctz(src[0]);
+	const struct bc7_mode *mode = &bc7_modes[mode_number];
+	read_bits(&b, mode_number + 1);
+
+	const uint32_t partition = read_bits(&b, mode->partition_bits);
+	const uint32_t rotation = read_bits(&b, mode->rotation_bits);
+	const uint32_t index_selection = read_bits(&b, mode->index_selection_bits);
+	const uint32_t subsets = mode->subsets;
+
+	for (uint32_t c = 0; c < 3; c++)
+		for (uint32_t s = 0; s < subsets; s++)
+			for (uint32_t e = 0; e < 2; e++)
+				endpoints[s][e][c] = read_bits(&b, mode->color_bits);
+
+	for (uint32_t s = 0; s < subsets; s++)
+		for (uint32_t e = 0; e < 2; e++)
+			endpoints[s][e][3] = read_bits(&b, mode->alpha_bits);
+
+	uint32_t color_bits = mode->color_bits;
+	uint32_t alpha_bits = mode->alpha_bits;
+	if (mode->endpoint_pbits || mode->shared_pbits) {
+		uint32_t pbits[3][2];
+
+		for (uint32_t s = 0; s < subsets; s++) {
+			if (mode->endpoint_pbits) {
+				pbits[s][0] = read_bits(&b, 1);
+				pbits[s][1] = read_bits(&b, 1);
+			} else {
+				pbits[s][0] = pbits[s][1] = read_bits(&b, 1);
+			}
+		}
+
+		for (uint32_t s = 0; s < subsets; s++)
+			for (uint32_t e = 0; e < 2; e++)
+				for (uint32_t c = 0; c < 4; c++)
+					endpoints[s][e][c] = (endpoints[s][e][c] << 1) | pbits[s][e];
+
+		color_bits++;
+		if (alpha_bits > 0)
+			alpha_bits++;
+	}
+
+	for (uint32_t s = 0; s < subsets; s++) {
+		for (uint32_t e = 0; e < 2; e++) {
+			for (uint32_t c = 0; c < 3; c++)
+				endpoints[s][e][c] = expand_bits(endpoints[s][e][c], color_bits);
+			if (alpha_bits > 0)
+				endpoints[s][e][3] = expand_bits(endpoints[s][e][3], alpha_bits);
+			else
+				endpoints[s][e][3] = 255;
+		}
+	}
+
+	uint8_t subset[16];
+	for (uint32_t i = 0; i < 16; i++) {
+		if (subsets == 1)
+			subset[i] = 0;
+		else if (subsets == 2)
+			subset[i] = (bc7_partitions2[partition] >> i) & 1;
+		else
+			subset[i] = bc7_partitions3[partition][i];
+	}
+
+	for (uint32_t i = 0; i < 16; i++) {
+		bool anchor = i == 0;
+
+		if (subsets == 2)
+			anchor |= i == bc7_anchors2[partition];
+		else if (subsets == 3)
+			anchor |= i == bc7_anchors3[0][partition] ||
+				i == bc7_anchors3[1][partition];
+
+		indices[i] = read_bits(&b, mode->index_bits - anchor);
+	}
+
+	if (mode->index2_bits > 0)
+		for (uint32_t i = 0; i < 16; i++)
+			indices2[i] = read_bits(&b, mode->index2_bits - (i == 0));
+
+	for (uint32_t i = 0; i < 16; i++) {
+		const uint8_t (*e)[4] = endpoints[subset[i]];
+		uint32_t color_index = indices[i], color_index_bits = mode->index_bits;
+		uint32_t alpha_index = indices[i], alpha_index_bits = mode->index_bits;
+		uint32_t rgba[4];
+
+		if (mode->index2_bits > 0) {
+			if (index_selection) {
+				color_index = indices2[i];
+				color_index_bits = mode->index2_bits;
+			} else {
+				alpha_index = indices2[i];
+				alpha_index_bits = mode->index2_bits;
+			}
+		}
+
+		for (uint32_t c = 0; c < 3; c++)
+			rgba[c] = bc7_interpolate(e[0][c], e[1][c], color_index, color_index_bits);
+		rgba[3] = bc7_interpolate(e[0][3], e[1][3], alpha_index, alpha_index_bits);
+
+		if (rotation > 0) {
+			const uint32_t t = rgba[3];
+
+			rgba[3] = rgba[rotation - 1];
+			rgba[rotation - 1] = t;
+		}
+
+		texels[i] = pack_rgba8(rgba[0], rgba[1], rgba[2], rgba[3]);
+	}
+}
+
+static void
+decode_block(enum GEN9_SURFACE_FORMAT format, const uint8_t *src, uint32_t *texels)
+{
+	uint8_t r[16], g[16];
+
+	switch (format) {
+	case SF_BC1_UNORM:
+	case SF_BC1_UNORM_SRGB:
+		decode_bc1_color(src, false, texels);
+		break;
+
+	case SF_BC2_UNORM:
+	case SF_BC2_UNORM_SRGB: {
+		const uint64_t alpha = load_u64(src);
+
+		decode_bc1_color(src + 8, true, texels);
+		for (int i = 0; i < 16; i++)
+			texels[i] = (texels[i] & 0x00ffffff) |
+				(((alpha >> (i * 4)) & 0xf) * 17) << 24;
+		break;
+	}
+
+	case SF_BC3_UNORM:
+	case SF_BC3_UNORM_SRGB:
+		decode_bc1_color(src + 8, true, texels);
+		decode_bc4_channel(src, false, r);
+		for (int i = 0; i < 16; i++)
+			texels[i] = (texels[i] & 0x00ffffff) | (r[i] << 24);
+		break;
+
+	case SF_BC4_UNORM:
+	case SF_BC4_SNORM: {
+		const bool snorm = format == SF_BC4_SNORM;
+
+		decode_bc4_channel(src, snorm, r);
+		for (int i = 0; i < 16; i++)
+			texels[i] = pack_rgba8(r[i], 0, 0, snorm ? 127 : 255);
+		break;
+	}
+
+	case SF_BC5_UNORM:
+	case SF_BC5_SNORM: {
+		const bool snorm = format == SF_BC5_SNORM;
+
+		decode_bc4_channel(src, snorm, r);
+		decode_bc4_channel(src + 8, snorm, g);
+		for (int i = 0; i < 16; i++)
+			texels[i] = pack_rgba8(r[i], g[i], 0, snorm ? 127 : 255);
+		break;
+	}
+
+	case SF_BC7_UNORM:
+	case SF_BC7_UNORM_SRGB:
+		decode_bc7(src, texels);
+		break;
+
+	default:
+		stub("block format %d", format);
+		/* Unsupported formats decode to red. */
+		for (int i = 0; i < 16; i++)
+			texels[i] = pack_rgba8(255, 0, 0, 255);
+		break;
+	}
+}
+
+struct decoded_block {
+	const void *src;
+	uint32_t format;
+	uint32_t texels[16];
+};
+
+/* Direct mapped on the block address, so the blocks along a row of
+ * the surface land in consecutive entries. There is a single cache,
+ * since the rasterizer runs shaders on one thread. */
+#define DECODED_BLOCK_CACHE_SIZE 4096
+
+static struct decoded_block decoded_blocks[DECODED_BLOCK_CACHE_SIZE];
+
+const uint32_t *
+get_decoded_block(enum GEN9_SURFACE_FORMAT format, const void *src)
+{
+	const uint32_t shift = __builtin_ctz(format_size(format));
+	const uint32_t index =
+		((uintptr_t) src >> shift) & (DECODED_BLOCK_CACHE_SIZE - 1);
+	struct decoded_block *block = &decoded_blocks[index];
+
+	if (block->src != src || block->format != format) {
+		decode_block(format, src, block->texels);
+		block->src = src;
+		block->format = format;
+	}
+
+	return block->texels;
+}
+
+/* Decoded blocks are only valid until the BO is written. The CPU can
+ * only write between batches, and block compressed surfaces can't be
+ * render targets, so we drop the cache at the start of each batch. */
+void
+invalidate_decoded_blocks(void)
+{
+	for (uint32_t i = 0; i < DECODED_BLOCK_CACHE_SIZE; i++)
+		decoded_blocks[i].src = NULL;
+}
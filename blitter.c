@@ -32,8 +32,11 @@ void blitter_copy(struct blit *b)
 		return;
 	}
 
+	fast_clear_resolve_all();
+
 	uint64_t range;
 	void *dst = map_gtt_offset(b->dst_offset, &range);
+	invalidate_shadow_range(dst, range);
 	void *src = map_gtt_offset(b->src_offset, &range);
 
 	int32_t stride = b->src_pitch * 4;
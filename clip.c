@@ -0,0 +1,345 @@
+/*
+ * Copyright © 2017 Kristian H. Kristensen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "ksim.h"
+
+/* The VS, DS and GS do the perspective divide and viewport transform
+ * in place in the VUE and flag vertices outside the clip volume. For
+ * primitives that have flagged vertices, we undo the transform to
+ * get back to homogeneous clip space, clip there and transform the
+ * new vertices. Primitives with all vertices inside the guardband
+ * never get here. */
+
+enum {
+	CLIP_PLANE_X0,
+	CLIP_PLANE_X1,
+	CLIP_PLANE_Y0,
+	CLIP_PLANE_Y1,
+	CLIP_PLANE_NEAR,
+	CLIP_PLANE_FAR,
+	CLIP_PLANE_COUNT
+};
+
+/* Each clip plane adds at most one vertex to a triangle. */
+#define MAX_CLIP_VERTICES (3 + CLIP_PLANE_COUNT)
+
+/* Header, position and up to 32 attributes. */
+#define MAX_VUE_LENGTH 34
+
+struct clip_vertex {
+	struct vec4 pos;
+	struct reg dist;
+	uint32_t outcode;
+	struct value *vue;
+};
+
+struct clip_state {
+	/* The planes in SoA layout so we can compute the distances
+	 * to all planes for a vertex at once. */
+	__m256 px, py, pz, pw;
+	uint32_t plane_mask;
+	uint32_t vue_length;
+
+	uint32_t vue_count;
+	struct value vues[MAX_CLIP_VERTICES * 2][MAX_VUE_LENGTH];
+};
+
+static void
+init_clip_state(struct clip_state *s)
+{
+	struct rectanglef r;
+	struct reg px, py, pz, pw;
+
+	if (gt.clip.guardband_clip_test_enable) {
+		r = gt.sf.guardband;
+	} else {
+		r = (struct rectanglef) { -1.0f, -1.0f, 1.0f, 1.0f };
+	}
+
+	memset(&px, 0, sizeof(px));
+	memset(&py, 0, sizeof(py));
+	memset(&pz, 0, sizeof(pz));
+	memset(&pw, 0, sizeof(pw));
+	s->plane_mask = 0;
+
+	if (gt.clip.guardband_clip_test_enable ||
+	    gt.clip.viewport_clip_test_enable) {
+		px.f[CLIP_PLANE_X0] = 1.0f;
+		pw.f[CLIP_PLANE_X0] = -r.x0;
+		px.f[CLIP_PLANE_X1] = -1.0f;
+		pw.f[CLIP_PLANE_X1] = r.x1;
+		py.f[CLIP_PLANE_Y0] = 1.0f;
+		pw.f[CLIP_PLANE_Y0] = -r.y0;
+		py.f[CLIP_PLANE_Y1] = -1.0f;
+		pw.f[CLIP_PLANE_Y1] = r.y1;
+		s->plane_mask |= (1 << CLIP_PLANE_X0) | (1 << CLIP_PLANE_X1) |
+			(1 << CLIP_PLANE_Y0) | (1 << CLIP_PLANE_Y1);
+	}
+
+	if (gt.clip.viewport_znear_clip_test_enable) {
+		pz.f[CLIP_PLANE_NEAR] = 1.0f;
+		pw.f[CLIP_PLANE_NEAR] = gt.clip.api_mode == APIMODE_OGL ? 1.0f : 0.0f;
+		s->plane_mask |= 1 << CLIP_PLANE_NEAR;
+	}
+
+	if (gt.clip.viewport_zfar_clip_test_enable) {
+		pz.f[CLIP_PLANE_FAR] = -1.0f;
+		pw.f[CLIP_PLANE_FAR] = 1.0f;
+		s->plane_mask |= 1 << CLIP_PLANE_FAR;
+	}
+
+	s->px = px.reg;
+	s->py = py.reg;
+	s->pz = pz.reg;
+	s->pw = pw.reg;
+
+	s->vue_length = gt.sbe.num_attributes + 2;
+	ksim_assert(s->vue_length <= MAX_VUE_LENGTH);
+	s->vue_count = 0;
+}
+
+static void
+compute_distances(struct clip_state *s, struct clip_vertex *v)
+{
+	__m256 d;
+
+	d = _mm256_mul_ps(s->pw, _mm256_set1_ps(v->pos.w));
+	d = _mm256_fmadd_ps(s->pz, _mm256_set1_ps(v->pos.z), d);
+	d = _mm256_fmadd_ps(s->py, _mm256_set1_ps(v->pos.y), d);
+	d = _mm256_fmadd_ps(s->px, _mm256_set1_ps(v->pos.x), d);
+
+	v->dist.reg = d;
+	v->outcode = _mm256_movemask_ps(d) & s->plane_mask;
+}
+
+static void
+init_clip_vertex(struct clip_state *s, struct clip_vertex *v, struct value *vue)
+{
+	const float *vp = gt.sf.viewport;
+	struct vec4 pos = vue[1].vec4;
+
+	if (gt.sf.viewport_transform_enable) {
+		pos.x = (pos.x - vp[3]) / vp[0];
+		pos.y = (pos.y - vp[4]) / vp[1];
+		pos.z = (pos.z - vp[5]) / vp[2];
+	}
+
+	if (gt.clip.perspective_divide_disable) {
+		pos.w = 1.0f;
+	} else {
+		/* The divide leaves 1/w in the w component. */
+		pos.w = 1.0f / pos.w;
+		pos.x *= pos.w;
+		pos.y *= pos.w;
+		pos.z *= pos.w;
+	}
+
+	v->pos = pos;
+	v->vue = vue;
+	compute_distances(s, v);
+}
+
+/* Interpolate from the inside vertex a towards the outside vertex b.
+ * Always going from the inside vertex makes an edge shared between
+ * two primitives produce the same vertex for both. */
+static struct clip_vertex
+clip_edge(struct clip_state *s, const struct clip_vertex *a,
+	  const struct clip_vertex *b, int plane)
+{
+	const float t = a->dist.f[plane] / (a->dist.f[plane] - b->dist.f[plane]);
+	struct clip_vertex v;
+	uint32_t i;
+
+	ksim_assert(s->vue_count < ARRAY_LENGTH(s->vues));
+	v.vue = s->vues[s->vue_count++];
+	v.vue[0] = a->vue[0];
+
+	/* Attributes are linear in clip space, so we can lerp the VUE
+	 * slots directly, two at a time. This also handles the
+	 * position when there's no perspective divide, since the
+	 * viewport transform is affine. */
+	const __m256 t8 = _mm256_set1_ps(t);
+	for (i = 1; i + 1 < s->vue_length; i += 2) {
+		__m256 va = _mm256_loadu_ps(a->vue[i].f);
+		__m256 vb = _mm256_loadu_ps(b->vue[i].f);
+		__m256 d = _mm256_sub_ps(vb, va);
+		_mm256_storeu_ps(v.vue[i].f, _mm256_fmadd_ps(d, t8, va));
+	}
+	if (i < s->vue_length) {
+		__m128 va = _mm_loadu_ps(a->vue[i].f);
+		__m128 vb = _mm_loadu_ps(b->vue[i].f);
+		__m128 d = _mm_sub_ps(vb, va);
+		_mm_storeu_ps(v.vue[i].f, _mm_fmadd_ps(d, _mm256_castps256_ps128(t8), va));
+	}
+
+	v.pos.x = a->pos.x + (b->pos.x - a->pos.x) * t;
+	v.pos.y = a->pos.y + (b->pos.y - a->pos.y) * t;
+	v.pos.z = a->pos.z + (b->pos.z - a->pos.z) * t;
+	v.pos.w = a->pos.w + (b->pos.w - a->pos.w) * t;
+
+	if (!gt.clip.perspective_divide_disable) {
+		const float *vp = gt.sf.viewport;
+		const float inv_w = 1.0f / v.pos.w;
+		struct vec4 *p = &v.vue[1].vec4;
+
+		p->x = v.pos.x * inv_w;
+		p->y = v.pos.y * inv_w;
+		p->z = v.pos.z * inv_w;
+		p->w = inv_w;
+
+		if (gt.sf.viewport_transform_enable) {
+			p->x = p->x * vp[0] + vp[3];
+			p->y = p->y * vp[1] + vp[4];
+			p->z = p->z * vp[2] + vp[5];
+		}
+	}
+
+	compute_distances(s, &v);
+
+	/* Don't let rounding push the new vertex back out. */
+	v.outcode &= ~(1 << plane);
+
+	return v;
+}
+
+static uint32_t
+clip_polygon(struct clip_state *s, struct clip_vertex *out,
+	     const struct clip_vertex *in, uint32_t count, int plane)
+{
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const struct clip_vertex *a = &in[i];
+		const struct clip_vertex *b = &in[i + 1 == count ? 0 : i + 1];
+		const bool a_inside = (a->outcode & (1 << plane)) == 0;
+		const bool b_inside = (b->outcode & (1 << plane)) == 0;
+
+		if (a_inside)
+			out[n++] = *a;
+
+		if (a_inside && !b_inside)
+			out[n++] = clip_edge(s, a, b, plane);
+		else if (!a_inside && b_inside)
+			out[n++] = clip_edge(s, b, a, plane);
+	}
+
+	return n;
+}
+
+static void
+clip_triangle(struct clip_state *s, struct clip_vertex *v,
+	      enum GEN9_3D_Prim_Topo_Type topology, uint32_t planes)
+{
+	struct clip_vertex buffer[2][MAX_CLIP_VERTICES];
+	struct clip_vertex *in = v;
+	uint32_t count = 3;
+	int plane, i = 0;
+
+	for_each_bit(plane, planes) {
+		count = clip_polygon(s, buffer[i], in, count, plane);
+		if (count < 3)
+			return;
+		in = buffer[i];
+		i = 1 - i;
+	}
+
+	/* Fan the clipped polygon back into triangles. */
+	for (uint32_t j = 1; j + 1 < count; j++) {
+		struct value *vue[3] = { in[0].vue, in[j].vue, in[j + 1].vue };
+		rasterize_primitive(vue, topology);
+	}
+}
+
+static void
+clip_line(struct clip_state *s, struct clip_vertex *v,
+	  enum GEN9_3D_Prim_Topo_Type topology, uint32_t planes)
+{
+	struct clip_vertex a = v[0], b = v[1];
+	int plane;
+
+	for_each_bit(plane, planes) {
+		const uint32_t bit = 1 << plane;
+
+		if (a.outcode & bit & b.outcode)
+			return;
+		else if (a.outcode & bit)
+			a = clip_edge(s, &b, &a, plane);
+		else if (b.outcode & bit)
+			b = clip_edge(s, &a, &b, plane);
+	}
+
+	struct value *vue[2] = { a.vue, b.vue };
+	rasterize_primitive(vue, topology);
+}
+
+void
+clip_primitive(struct value **vue, int count,
+	       enum GEN9_3D_Prim_Topo_Type topology)
+{
+	struct clip_vertex v[3];
+	struct clip_state s;
+	uint32_t outcode_or = 0, outcode_and = ~0;
+
+	init_clip_state(&s);
+
+	for (int i = 0; i < count; i++) {
+		init_clip_vertex(&s, &v[i], vue[i]);
+		outcode_or |= v[i].outcode;
+		outcode_and &= v[i].outcode;
+	}
+
+	/* All vertices outside the same plane: trivial reject. */
+	if (outcode_and)
+		return;
+
+	/* The vertex was flagged, but the primitive is inside the
+	 * clip volume within precision. */
+	if (outcode_or == 0) {
+		rasterize_primitive(vue, topology);
+		return;
+	}
+
+	switch (topology) {
+	case _3DPRIM_POINTLIST:
+		/* A point with a flagged center has outcode_and ==
+		 * outcode_or and was rejected above. */
+		ksim_unreachable("point not trivially rejected");
+		break;
+	case _3DPRIM_RECTLIST:
+		/* Rectlists are in screen space and never clipped.
+		 * Draw them as is, the rasterizer still limits them
+		 * to the drawing rectangle and scissor. */
+		rasterize_primitive(vue, topology);
+		break;
+	case _3DPRIM_LINELIST:
+	case _3DPRIM_LINESTRIP:
+	case _3DPRIM_LINELOOP:
+		clip_line(&s, v, topology, outcode_or);
+		break;
+	default:
+		clip_triangle(&s, v, topology, outcode_or);
+		break;
+	}
+}
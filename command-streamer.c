@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <signal.h>
 
 #include "ksim.h"
@@ -637,6 +638,10 @@ handle_3dstate_stencil_buffer(uint32_t *p)
 	GEN9_3DSTATE_STENCIL_BUFFER_unpack(p, &v);
 
 	ksim_trace(TRACE_CS, "3DSTATE_STENCIL_BUFFER\n");
+
+	gt.stencil.enable = v.StencilBufferEnable;
+	gt.stencil.address = v.SurfaceBaseAddress;
+	gt.stencil.stride = v.SurfacePitch + 1;
 }
 
 static void
@@ -723,6 +728,13 @@ static void
 handle_3dstate_multisample(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_MULTISAMPLE\n");
+
+	struct GEN9_3DSTATE_MULTISAMPLE v;
+	GEN9_3DSTATE_MULTISAMPLE_unpack(p, &v);
+
+	gt.multisample.samples = 1 << v.NumberofMultisamples;
+	if (gt.multisample.samples > 8)
+		stub("16x multisampling");
 }
 
 static void
@@ -733,8 +745,20 @@ handle_3dstate_cc_state_pointers(uint32_t *p)
 	struct GEN9_3DSTATE_CC_STATE_POINTERS v;
 	GEN9_3DSTATE_CC_STATE_POINTERS_unpack(p, &v);
 
-	if (v.ColorCalcStatePointerValid)
-		gt.cc.state = v.ColorCalcStatePointer;
+	if (!v.ColorCalcStatePointerValid)
+		return;
+
+	gt.cc.state = v.ColorCalcStatePointer;
+
+	uint64_t range;
+	void *state = map_gtt_offset(gt.cc.state + gt.dynamic_state_base_address, &range);
+	struct GEN9_COLOR_CALC_STATE cc;
+	GEN9_COLOR_CALC_STATE_unpack(state, &cc);
+
+	gt.cc.blend_constant[0] = cc.BlendConstantColorRed;
+	gt.cc.blend_constant[1] = cc.BlendConstantColorGreen;
+	gt.cc.blend_constant[2] = cc.BlendConstantColorBlue;
+	gt.cc.blend_constant[3] = cc.BlendConstantColorAlpha;
 }
 
 static void
@@ -829,6 +853,7 @@ handle_3dstate_clip(uint32_t *p)
 	gt.clip.perspective_divide_disable = v.PerspectiveDivideDisable;
 	gt.clip.guardband_clip_test_enable = v.GuardbandClipTestEnable;
 	gt.clip.viewport_clip_test_enable = v.ViewportXYClipTestEnable;
+	gt.clip.api_mode = v.APIMode;
 }
 
 static void
@@ -840,6 +865,8 @@ handle_3dstate_sf(uint32_t *p)
 	GEN9_3DSTATE_SF_unpack(p, &v);
 
 	gt.sf.line_width = v.LineWidth;
+	gt.sf.point_width = v.PointWidth;
+	gt.sf.point_width_source = v.PointWidthSource;
 	gt.sf.viewport_transform_enable = v.ViewportTransformEnable;
 	gt.sf.tri_strip_provoking = v.TriangleStripListProvokingVertexSelect;
 	gt.sf.line_strip_provoking = v.LineStripListProvokingVertexSelect;
@@ -899,6 +926,11 @@ static void
 handle_3dstate_sample_mask(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_SAMPLE_MASK\n");
+
+	struct GEN9_3DSTATE_SAMPLE_MASK v;
+	GEN9_3DSTATE_SAMPLE_MASK_unpack(p, &v);
+
+	gt.multisample.sample_mask = v.SampleMask;
 }
 
 static void
@@ -1001,6 +1033,8 @@ handle_3dstate_ps(uint32_t *p)
 	gt.ps.position_offset_xy = v.PositionXYOffsetSelect;
 	gt.ps.push_constant_enable = v.PushConstantEnable;
 	gt.ps.grf_start0 = v.DispatchGRFStartRegisterForConstantSetupData0;
+	gt.ps.grf_start1 = v.DispatchGRFStartRegisterForConstantSetupData1;
+	gt.ps.grf_start2 = v.DispatchGRFStartRegisterForConstantSetupData2;
 	gt.ps.fast_clear = v.RenderTargetFastClearEnable;
 	gt.ps.resolve_type = v.RenderTargetResolveType;
 }
@@ -1063,13 +1097,42 @@ handle_3dstate_blend_state_pointers(uint32_t *p)
 
 	struct GEN9_BLEND_STATE state;
 	GEN9_BLEND_STATE_unpack(bsp, &state);
-	struct GEN9_BLEND_STATE_ENTRY entry;
-	GEN9_BLEND_STATE_ENTRY_unpack(bsp + 4, &entry);
 
-	gt.blend.enable = entry.ColorBufferBlendEnable;
-	gt.blend.src_factor = entry.SourceBlendFactor;
-	gt.blend.dst_factor = entry.DestinationBlendFactor;
-	gt.blend.function = entry.ColorBlendFunction;
+	/* There's only an entry per render target, which may be less
+	 * than the 8 we track. */
+	memset(gt.blend.rt, 0, sizeof(gt.blend.rt));
+	for (uint32_t i = 0;
+	     i < ARRAY_LENGTH(gt.blend.rt) && 4 + (i + 1) * 8 <= range; i++) {
+		struct GEN9_BLEND_STATE_ENTRY entry;
+		struct blend_rt *b = &gt.blend.rt[i];
+
+		GEN9_BLEND_STATE_ENTRY_unpack(bsp + 4 + i * 8, &entry);
+
+		b->enable = entry.ColorBufferBlendEnable;
+		b->src_factor = entry.SourceBlendFactor;
+		b->dst_factor = entry.DestinationBlendFactor;
+		b->function = entry.ColorBlendFunction;
+		if (state.IndependentAlphaBlendEnable) {
+			b->src_alpha_factor = entry.SourceAlphaBlendFactor;
+			b->dst_alpha_factor = entry.DestinationAlphaBlendFactor;
+			b->alpha_function = entry.AlphaBlendFunction;
+		} else {
+			b->src_alpha_factor = entry.SourceBlendFactor;
+			b->dst_alpha_factor = entry.DestinationBlendFactor;
+			b->alpha_function = entry.ColorBlendFunction;
+		}
+		b->logic_op_enable = entry.LogicOpEnable;
+		b->logic_op_function = entry.LogicOpFunction;
+		b->pre_blend_clamp = entry.PreBlendColorClampEnable;
+		b->post_blend_clamp = entry.PostBlendColorClampEnable;
+		b->clamp_range = entry.ColorClampRange;
+		b->write_disable =
+			(entry.WriteDisableRed << 0) | (entry.WriteDisableGreen << 1) |
+			(entry.WriteDisableBlue << 2) | (entry.WriteDisableAlpha << 3);
+	}
+
+	if (state.AlphaToCoverageEnable)
+		stub("alpha to coverage");
 }
 
 static void
@@ -1331,6 +1394,26 @@ handle_3dstate_wm_depth_stencil(uint32_t *p)
 	gt.depth.test_enable = v.DepthTestEnable;
 	gt.depth.write_enable1 = v.DepthBufferWriteEnable;
 	gt.depth.test_function = v.DepthTestFunction;
+
+	gt.stencil.test_enable = v.StencilTestEnable;
+	gt.stencil.write_enable = v.StencilBufferWriteEnable;
+	gt.stencil.double_sided = v.DoubleSidedStencilEnable;
+
+	gt.stencil.front.test_function = v.StencilTestFunction;
+	gt.stencil.front.fail_op = v.StencilFailOp;
+	gt.stencil.front.depth_fail_op = v.StencilPassDepthFailOp;
+	gt.stencil.front.pass_op = v.StencilPassDepthPassOp;
+	gt.stencil.front.test_mask = v.StencilTestMask;
+	gt.stencil.front.write_mask = v.StencilWriteMask;
+	gt.stencil.front.ref = v.StencilReferenceValue;
+
+	gt.stencil.back.test_function = v.BackfaceStencilTestFunction;
+	gt.stencil.back.fail_op = v.BackfaceStencilFailOp;
+	gt.stencil.back.depth_fail_op = v.BackfaceStencilPassDepthFailOp;
+	gt.stencil.back.pass_op = v.BackfaceStencilPassDepthPassOp;
+	gt.stencil.back.test_mask = v.BackfaceStencilTestMask;
+	gt.stencil.back.write_mask = v.BackfaceStencilWriteMask;
+	gt.stencil.back.ref = v.BackfaceStencilReferenceValue;
 }
 
 static void
@@ -1346,6 +1429,8 @@ handle_3dstate_ps_extra(uint32_t *p)
 	gt.ps.attribute_enable = v.AttributeEnable;
 	gt.ps.uses_source_w = v.PixelShaderUsesSourceW;
 	gt.ps.uses_source_depth = v.PixelShaderUsesSourceDepth;
+	gt.ps.per_sample = v.PixelShaderIsPerSample;
+	gt.ps.kills_pixel = v.PixelShaderKillsPixel;
 }
 
 static void
@@ -1386,6 +1471,7 @@ handle_3dstate_wm_hz_op(uint32_t *p)
 	gt.hiz.hz_depth_buffer_resolve_enable = v.HierarchicalDepthBufferResolveEnable;
 	gt.hiz.pixel_position_offset_enable = v.PixelPositionOffsetEnable;
 	gt.hiz.full_surface_depth_and_stencil_clear = v.FullSurfaceDepthandStencilClear;
+	gt.hiz.stencil_clear_value = v.StencilClearValue;
 }
 
 static const command_handler_t pipelined_3dstate_commands[] = {
@@ -1634,6 +1720,8 @@ handle_pipe_control(uint32_t *p)
 {
 	if (gt.hiz.depth_buffer_clear_enable)
 		depth_clear();
+	if (gt.hiz.stencil_buffer_clear_enable)
+		stencil_clear();
 
 	ksim_trace(TRACE_CS, "PIPE_CONTROL\n");
 }
@@ -1699,6 +1787,8 @@ start_batch_buffer(uint64_t address, uint32_t ring)
 	command_handler_t handler;
 
 	gt.curbe_dynamic_state_base = true;
+	invalidate_decoded_blocks();
+	start_shadow_batch();
 	gt.cs.next = map_gtt_offset(address, &range);
 	gt.cs.end = gt.cs.next + range;
 
@@ -217,6 +217,8 @@ emit_dword_atomic_integer(struct kir_program *prog, struct inst *inst)
 	bool valid = get_surface(prog->binding_table_address,
 				 m.binding_table_index, &s);
 	ksim_assert(valid);
+	fast_clear_resolve(&s);
+	invalidate_shadow_surface(&s);
 	args->src = unpack_inst_2src_src0(inst).num;
 	args->buffer = s.pixels;
 	args->simd_mode = m.simd_mode;
@@ -253,6 +255,8 @@ builder_emit_sfid_dataport1(struct kir_program *prog, struct inst *inst)
 		bool valid = get_surface(prog->binding_table_address,
 					 bti, &buffer);
 		ksim_assert(valid);
+		fast_clear_resolve(&buffer);
+		invalidate_shadow_surface(&buffer);
 		args->buffer = buffer.pixels;
 
 		func = sfid_dataport1_untyped_write;
@@ -337,6 +341,7 @@ builder_emit_sfid_dataport_ro(struct kir_program *prog, struct inst *inst)
 				    md.binding_table_index,
 				    &buffer);
 		ksim_assert(valid);
+		fast_clear_resolve(&buffer);
 		switch (md.data_elements) {
 		case OW4:
 			kir_program_comment(prog, "ro dp read 4 ow from bti %d",
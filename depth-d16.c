@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2017 Kristian H. Kristensen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "ksim.h"
+#include "kir.h"
+
+static struct kir_reg
+emit_immv(struct kir_program *prog, const int16_t v[8])
+{
+	struct kir_insn *insn = kir_program_add_insn(prog, kir_immv);
+
+	memcpy(insn->imm.v, v, sizeof(insn->imm.v));
+
+	return kir_program_alu(prog, kir_sxwd, insn->dst);
+}
+
+/* The two rows of a 4x2 block of D16 depth are 8 bytes each and 16
+ * bytes apart in the Y tile, which we can't load with one vmovdqa.
+ * Gather the dword that holds each pair of pixels and shift the odd
+ * pixels down instead. */
+struct kir_reg
+emit_load_d16(struct kir_program *prog, struct kir_reg base)
+{
+	static const int16_t offsets[8] = { 0, 0, 4, 4, 16, 16, 20, 20 };
+	static const int16_t shifts[8] = { 0, 16, 0, 16, 0, 16, 0, 16 };
+
+	struct kir_reg offset = emit_immv(prog, offsets);
+	struct kir_reg mask = kir_program_immd(prog, -1);
+	struct kir_reg pairs = kir_program_gather(prog, base, offset, mask, 1, 0);
+
+	struct kir_reg shift = emit_immv(prog, shifts);
+	struct kir_reg depth = kir_program_alu(prog, kir_shr, shift, pairs);
+	kir_program_immd(prog, 0xffff);
+
+	return kir_program_alu(prog, kir_and, depth, prog->dst);
+}
+
+/* vpmaskmovd can't write single words, so merge the new depth with
+ * the old and write back both rows. vpackusdw packs within each 128
+ * bit lane, so packing the block with itself leaves row 0 in bytes
+ * 0-7 and row 1 in bytes 16-23, just like the tile. */
+void
+emit_store_d16(struct kir_program *prog, struct kir_reg base,
+	       struct kir_reg value, struct kir_reg depth, struct kir_reg mask)
+{
+	static const int16_t rows[8] = { -1, -1, 0, 0, -1, -1, 0, 0 };
+
+	struct kir_reg merged = kir_program_alu(prog, kir_blend, value, depth, mask);
+	struct kir_reg packed = kir_program_alu(prog, kir_packusdw, merged, merged);
+
+	kir_program_mask_store(prog, base, 0, packed, emit_immv(prog, rows));
+}
@@ -494,6 +494,92 @@ int_div_remainder(__m256i _n, __m256i _d)
 	return r.ireg;
 }
 
+/* Pixel shaders discard by clearing channels in f0.1, which is also
+ * the pixel mask for the render target write. We keep the live
+ * channels of the dispatch in mask[0], so clear the discarded
+ * channels there as well. Channels outside the current if-scope don't
+ * execute the discard and stay alive. */
+static void
+emit_discard(struct kir_program *prog, struct kir_reg flag, bool mask_control)
+{
+	uint32_t q = prog->quarter;
+	struct kir_reg live =
+		kir_program_load_v8(prog, offsetof(struct thread, mask[0].q[q]));
+
+	if (prog->scope > 0 && !mask_control) {
+		struct kir_reg scope_mask =
+			kir_program_load_v8(prog, offsetof(struct thread, mask[prog->scope].q[q]));
+		struct kir_reg killed = kir_program_alu(prog, kir_andn, scope_mask, flag);
+		live = kir_program_alu(prog, kir_andn, live, killed);
+	} else {
+		live = kir_program_alu(prog, kir_and, live, flag);
+	}
+
+	kir_program_store_v8(prog, offsetof(struct thread, mask[0].q[q]), live);
+	prog->live_mask_dirty = true;
+}
+
+/* Return early once discards have killed every channel of the
+ * dispatch. This is only checked at control flow and before sends,
+ * after which skipping the rest of the shader pays off. */
+static void
+emit_live_check(struct kir_program *prog)
+{
+	if (!prog->live_mask_dirty)
+		return;
+
+	kir_program_comment(prog, "all channels discarded?");
+	struct kir_reg live =
+		kir_program_load_v8(prog, offsetof(struct thread, mask[0].q[0]));
+	for (uint32_t q = 1; q < prog->kill_width / 8; q++) {
+		struct kir_reg m =
+			kir_program_load_v8(prog, offsetof(struct thread, mask[0].q[q]));
+		live = kir_program_alu(prog, kir_or, live, m);
+	}
+
+	struct kir_insn *insn = kir_program_add_insn(prog, kir_eot_if_dead);
+	insn->eot.src = live;
+
+	prog->live_mask_dirty = false;
+}
+
+/* Besides conditional modifiers, the only flag writes we see are
+ * discarding pixel shaders loading the dispatch pixel mask into f0.1,
+ * ie mov(1) f0.1<1>UW g1.14<0,1,0>UW. Expand the bits into channel
+ * masks like the ones cmp writes. */
+static void
+emit_flag_mov(struct kir_program *prog, struct inst *inst)
+{
+	static const int16_t bits[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	struct inst_dst dst = unpack_inst_2src_dst(inst);
+	struct inst_src src = unpack_inst_2src_src0(inst);
+	uint32_t flag = dst.da1_subnum / 2;
+
+	if (src.file != BRW_GENERAL_REGISTER_FILE || type_size(src.type) != 2) {
+		stub("flag mov from file %d, type %d", src.file, src.type);
+		return;
+	}
+
+	struct kir_reg pixels =
+		kir_program_load_uniform(prog, offsetof(struct thread, grf[src.num]) +
+					 (src.da1_subnum & ~3));
+	if (src.da1_subnum & 2)
+		pixels = kir_program_alu(prog, kir_shri, pixels, 16);
+
+	for (uint32_t q = 0; q < 2; q++) {
+		struct kir_insn *insn = kir_program_add_insn(prog, kir_immv);
+		memcpy(insn->imm.v, bits, sizeof(insn->imm.v));
+		struct kir_reg b = kir_program_alu(prog, kir_sxwd, insn->dst);
+
+		struct kir_reg m = pixels;
+		if (q > 0)
+			m = kir_program_alu(prog, kir_shri, pixels, 8 * q);
+		m = kir_program_alu(prog, kir_and, m, b);
+		m = kir_program_alu(prog, kir_cmpeqd, m, b);
+		kir_program_store_v8(prog, offsetof(struct thread, f[flag].q[q]), m);
+	}
+}
+
 static bool
 compile_inst(struct kir_program *prog, struct inst *inst)
 {
@@ -645,7 +731,11 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 		stub("BRW_OPCODE_CONTINUE");
 		break;
 	case BRW_OPCODE_HALT:
-		stub("BRW_OPCODE_HALT");
+		/* Discards halt the killed channels, which are out of
+		 * mask[0] already. The all-dead check before this
+		 * instruction ends the thread once they're all gone. */
+		if (prog->kill_width == 0)
+			stub("BRW_OPCODE_HALT");
 		break;
 	case BRW_OPCODE_MSAVE:
 		stub("BRW_OPCODE_MSAVE");
@@ -874,7 +964,13 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 		ksim_assert(src0.type == BRW_HW_REG_TYPE_F);
 		ksim_assert(src1.type == BRW_HW_REG_TYPE_F);
 
-		src2 = unpack_inst_2src_src1(inst);
+		/* In SIMD16 the barycentrics are laid out as w1 and
+		 * w2 for the lower 8 channels followed by w1 and w2
+		 * for the upper 8 channels. The region offset for the
+		 * second half only advances one register, so skip
+		 * past the lower w2 here. */
+		src1.num += prog->exec_offset / 8;
+		src2 = src1;
 		src2.num++;
 
 		int subnum = src0.da1_subnum / 4;
@@ -930,6 +1026,9 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 		}
 		uint32_t q = prog->quarter;
 		kir_program_store_v8(prog, offsetof(struct thread, f[flag].q[q]), flag_reg);
+
+		if (prog->kill_width > 0 && flag == 1)
+			emit_discard(prog, flag_reg, unpack_inst_common(inst).mask_control);
 	}
 
 	if (opcode_info[opcode].store_dst)
@@ -951,6 +1050,24 @@ do_compile_inst(struct kir_program *prog, struct inst *inst)
 	else
 		dst = unpack_inst_2src_dst(inst);
 
+	switch (opcode) {
+	case BRW_OPCODE_IF:
+	case BRW_OPCODE_ELSE:
+	case BRW_OPCODE_ENDIF:
+	case BRW_OPCODE_HALT:
+	case BRW_OPCODE_SEND:
+	case BRW_OPCODE_SENDC:
+		emit_live_check(prog);
+		break;
+	case BRW_OPCODE_MOV:
+		if (dst.file == BRW_ARCHITECTURE_REGISTER_FILE &&
+		    dst.num == BRW_ARF_FLAG) {
+			emit_flag_mov(prog, inst);
+			return false;
+		}
+		break;
+	}
+
 	if (exec_size * type_size(dst.type) < 64 ||
 	    opcode == BRW_OPCODE_SEND || opcode == BRW_OPCODE_SENDC) {
 		prog->exec_size = exec_size;
@@ -1020,3 +1137,572 @@ kir_program_emit_shader(struct kir_program *prog, uint64_t kernel_offset)
 	if (trace_mask & (TRACE_EU | TRACE_AVX))
 		fprintf(trace_file, "\n");
 }
+
+/* Meta operations such as clears and copies are rectangles drawn with
+ * tiny pixel shaders. To recognize them, we run the shader over the
+ * channels of a dispatch, tracking for each register element whether
+ * it holds a constant, the pixel position plus an offset or a texel
+ * the shader loaded. If the render target write at the end gets a
+ * constant color or the texel at a fixed offset from the pixel, the
+ * draw can be done as a fill or a copy instead. */
+
+enum meta_value_kind {
+	META_UNKNOWN,
+	META_CONST,
+	META_X,
+	META_Y,
+	META_TEXEL,
+};
+
+struct meta_value {
+	uint8_t kind;
+	uint8_t size;		/* element size in bytes */
+	uint8_t channel;	/* channel of X, Y and TEXEL values */
+	bool is_float;		/* X and Y as float coordinate and offset */
+	uint32_t v;		/* constant, offset or texel component */
+};
+
+struct meta_state {
+	struct meta_value words[128 * 16];
+	const uint32_t *constants;
+	uint32_t constants_start, constants_end;
+	bool ld_valid;
+	struct ps_meta ld;
+};
+
+static const struct meta_value meta_unknown = { .kind = META_UNKNOWN };
+
+static bool
+meta_type_supported(uint32_t type)
+{
+	switch (type) {
+	case BRW_HW_REG_TYPE_UD:
+	case BRW_HW_REG_TYPE_D:
+	case BRW_HW_REG_TYPE_UW:
+	case BRW_HW_REG_TYPE_W:
+	case BRW_HW_REG_TYPE_F:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static struct meta_value
+meta_convert(struct meta_value v, uint32_t from, uint32_t to)
+{
+	const bool from_float = from == BRW_HW_REG_TYPE_F;
+	const bool to_float = to == BRW_HW_REG_TYPE_F;
+	int64_t i;
+
+	switch (v.kind) {
+	case META_CONST:
+		if (from_float && to_float)
+			return v;
+
+		if (from_float)
+			i = u32_to_float(v.v);
+		else if (from == BRW_HW_REG_TYPE_D)
+			i = (int32_t) v.v;
+		else if (from == BRW_HW_REG_TYPE_W)
+			i = (int16_t) v.v;
+		else if (from == BRW_HW_REG_TYPE_UW)
+			i = (uint16_t) v.v;
+		else
+			i = v.v;
+
+		if (to_float)
+			v.v = float_to_u32(i);
+		else if (type_size(to) == 2)
+			v.v = i & 0xffff;
+		else
+			v.v = i;
+		return v;
+
+	case META_X:
+	case META_Y:
+		if (v.is_float == to_float)
+			return v;
+
+		/* Converting to integer truncates, which is the floor
+		 * as long as the coordinate is positive. */
+		if (to_float)
+			v.v = float_to_u32((int32_t) v.v);
+		else
+			v.v = (int32_t) floorf(u32_to_float(v.v));
+		v.is_float = to_float;
+		return v;
+
+	case META_TEXEL:
+		if (type_size(from) == 4 && type_size(to) == 4 && from_float == to_float)
+			return v;
+		return meta_unknown;
+
+	default:
+		return meta_unknown;
+	}
+}
+
+static struct meta_value
+meta_read(struct meta_state *m, uint32_t offset, uint32_t size, uint32_t channel)
+{
+	const uint32_t reg = offset / 32;
+
+	if (offset & (size - 1))
+		return meta_unknown;
+
+	if (m->constants_start <= reg && reg < m->constants_end) {
+		struct meta_value v = { .kind = META_CONST, .size = size };
+
+		memcpy(&v.v, (void *) m->constants +
+		       offset - m->constants_start * 32, size);
+		return v;
+	}
+
+	/* g1.2 - g1.5 hold x and y of the upper left pixel of the
+	 * four subspans of a SIMD8 or SIMD16 dispatch. */
+	if (reg == 1 && size == 2 && 8 <= offset % 32 && offset % 32 < 24) {
+		const uint32_t subspan = (offset % 32 - 8) / 4;
+		const bool y = offset & 2;
+
+		if (subspan != channel / 4)
+			return meta_unknown;
+
+		return (struct meta_value) {
+			.kind = y ? META_Y : META_X,
+			.size = size,
+			.channel = channel,
+			.v = y ? -((channel >> 1) & 1) : -(channel & 1)
+		};
+	}
+
+	struct meta_value v = m->words[offset / 2];
+	if (v.size != size)
+		return meta_unknown;
+
+	if (v.kind != META_CONST && v.channel != channel)
+		return meta_unknown;
+
+	return v;
+}
+
+static void
+meta_write(struct meta_state *m, uint32_t offset, uint32_t size,
+	   uint32_t channel, struct meta_value v)
+{
+	if (offset / 2 + DIV_ROUND_UP(size, 2) > ARRAY_LENGTH(m->words))
+		return;
+
+	for (uint32_t i = 0; i < DIV_ROUND_UP(size, 2); i++)
+		m->words[offset / 2 + i] = meta_unknown;
+
+	if (size == 1)
+		return;
+
+	v.size = size;
+	v.channel = channel;
+	m->words[offset / 2] = v;
+}
+
+static uint32_t
+meta_src_offset(const struct inst_src *src, uint32_t i)
+{
+	return src->num * 32 + src->da1_subnum +
+		((i / src->width) * src->vstride + (i % src->width) * src->hstride) *
+		type_size(src->type);
+}
+
+static uint32_t
+meta_dst_offset(const struct inst_dst *dst, uint32_t i)
+{
+	const uint32_t hstride = (1 << dst->hstride) >> 1;
+
+	return dst->num * 32 + dst->da1_subnum + i * hstride * type_size(dst->type);
+}
+
+static struct meta_value
+meta_read_src(struct meta_state *m, struct inst *inst,
+	      const struct inst_src *src, uint32_t i, uint32_t channel,
+	      uint32_t *type)
+{
+	struct inst_imm imm;
+	struct meta_value v = { .kind = META_CONST, .size = 4 };
+
+	*type = src->type;
+	if (src->file == BRW_IMMEDIATE_VALUE) {
+		imm = unpack_inst_imm(inst);
+		switch (src->type) {
+		case BRW_HW_REG_TYPE_UD:
+		case BRW_HW_REG_TYPE_D:
+		case BRW_HW_REG_TYPE_F:
+			v.v = imm.ud;
+			return v;
+		case BRW_HW_REG_TYPE_UW:
+		case BRW_HW_REG_TYPE_W:
+			v.v = imm.ud & 0xffff;
+			return v;
+		case BRW_HW_REG_IMM_TYPE_UV:
+			*type = BRW_HW_REG_TYPE_UW;
+			v.v = imm.uv[i % 8];
+			return v;
+		case BRW_HW_REG_IMM_TYPE_V:
+			*type = BRW_HW_REG_TYPE_W;
+			v.v = ((int32_t) imm.v[i % 8] << 28) >> 28;
+			return v;
+		case BRW_HW_REG_IMM_TYPE_VF:
+			*type = BRW_HW_REG_TYPE_F;
+			v.v = float_to_u32(imm.vf[i % 4]);
+			return v;
+		default:
+			return meta_unknown;
+		}
+	}
+
+	if (src->file != BRW_GENERAL_REGISTER_FILE ||
+	    src->address_mode != BRW_ADDRESS_DIRECT ||
+	    !meta_type_supported(src->type))
+		return meta_unknown;
+
+	v = meta_read(m, meta_src_offset(src, i), type_size(src->type), channel);
+	if (src->negate || src->abs) {
+		if (v.kind != META_CONST || src->type != BRW_HW_REG_TYPE_F)
+			return meta_unknown;
+		if (src->abs)
+			v.v &= ~0x80000000;
+		if (src->negate)
+			v.v ^= 0x80000000;
+	}
+
+	return v;
+}
+
+static struct meta_value
+meta_alu(uint32_t opcode, uint32_t type, struct meta_value a, struct meta_value b)
+{
+	const bool f = type == BRW_HW_REG_TYPE_F;
+	const uint32_t one = f ? float_to_u32(1.0f) : 1;
+
+	if (b.kind == META_X || b.kind == META_Y) {
+		struct meta_value t = a;
+		a = b;
+		b = t;
+	}
+
+	if (b.kind != META_CONST)
+		return meta_unknown;
+
+	switch (opcode) {
+	case BRW_OPCODE_ADD:
+		if (a.kind != META_CONST && a.kind != META_X && a.kind != META_Y)
+			return meta_unknown;
+		if (f)
+			a.v = float_to_u32(u32_to_float(a.v) + u32_to_float(b.v));
+		else
+			a.v = a.v + b.v;
+		return a;
+	case BRW_OPCODE_MUL:
+		if (a.kind == META_CONST) {
+			if (f)
+				a.v = float_to_u32(u32_to_float(a.v) * u32_to_float(b.v));
+			else
+				a.v = a.v * b.v;
+			return a;
+		} else if ((a.kind == META_X || a.kind == META_Y) && b.v == one) {
+			return a;
+		}
+		return meta_unknown;
+	default:
+		return meta_unknown;
+	}
+}
+
+static uint32_t
+meta_channel_base(struct inst_common common)
+{
+	const uint32_t exec_size = 1 << common.exec_size;
+
+	return common.qtr_control * 8 + (exec_size <= 4 ? common.nib_control * 4 : 0);
+}
+
+static void
+meta_eval_alu(struct meta_state *m, struct inst *inst)
+{
+	struct inst_common common = unpack_inst_common(inst);
+	const uint32_t exec_size = 1 << common.exec_size;
+	const uint32_t base = meta_channel_base(common);
+	struct inst_dst dst;
+
+	if (opcode_info[common.opcode].num_srcs == 3)
+		dst = unpack_inst_3src_dst(inst);
+	else
+		dst = unpack_inst_2src_dst(inst);
+
+	if (dst.file != BRW_GENERAL_REGISTER_FILE)
+		return;
+
+	const bool evaluate =
+		(common.opcode == BRW_OPCODE_MOV ||
+		 common.opcode == BRW_OPCODE_ADD ||
+		 common.opcode == BRW_OPCODE_MUL) &&
+		common.access_mode == BRW_ALIGN_1 &&
+		common.pred_control == 0 &&
+		dst.address_mode == BRW_ADDRESS_DIRECT &&
+		meta_type_supported(dst.type);
+
+	if (!evaluate) {
+		/* Forget everything the instruction may write, erring
+		 * on the side of too much. */
+		const uint32_t size = type_size(dst.type) > 0 ? type_size(dst.type) : 8;
+		const uint32_t end = (exec_size * size * 4 + 32) & ~31;
+		for (uint32_t i = 0; i < end; i += 2)
+			meta_write(m, dst.num * 32 + i, 2, 0, meta_unknown);
+		return;
+	}
+
+	struct inst_src src0 = unpack_inst_2src_src0(inst);
+	struct inst_src src1 = unpack_inst_2src_src1(inst);
+
+	for (uint32_t i = 0; i < exec_size; i++) {
+		const uint32_t channel = base + i;
+		struct meta_value v, v1;
+		uint32_t type;
+
+		v = meta_read_src(m, inst, &src0, i, channel, &type);
+		v = meta_convert(v, type, dst.type);
+		if (common.opcode != BRW_OPCODE_MOV) {
+			v1 = meta_read_src(m, inst, &src1, i, channel, &type);
+			v1 = meta_convert(v1, type, dst.type);
+			v = meta_alu(common.opcode, dst.type, v, v1);
+		}
+
+		if (common.saturate) {
+			if (v.kind == META_CONST && dst.type == BRW_HW_REG_TYPE_F)
+				v.v = float_to_u32(fminf(fmaxf(u32_to_float(v.v), 0.0f), 1.0f));
+			else
+				v = meta_unknown;
+		}
+
+		meta_write(m, meta_dst_offset(&dst, i), type_size(dst.type), channel, v);
+	}
+}
+
+/* Match an ld from the texel at a fixed offset from the pixel, and
+ * write the response as texel values. */
+static void
+meta_eval_ld(struct meta_state *m, struct inst *inst)
+{
+	struct inst_common common = unpack_inst_common(inst);
+	struct inst_send send = unpack_inst_send(inst);
+	const uint32_t desc = send.function_control;
+	const uint32_t message_type = field(desc, 12, 16);
+	const uint32_t simd_mode = field(desc, 17, 18);
+	const uint32_t src = unpack_inst_2src_src0(inst).num;
+	const uint32_t dst = unpack_inst_2src_dst(inst).num;
+	const uint32_t exec_size = simd_mode == 2 ? 16 : 8;
+	const uint32_t regs = exec_size / 8;
+	const uint32_t base = meta_channel_base(common);
+	struct ps_meta ld = {
+		.kind = PS_META_COPY,
+		.bti = field(desc, 0, 7)
+	};
+	bool valid;
+
+	/* ld takes u, v and lod, ld_lz only u and v. */
+	valid = (simd_mode == 1 || simd_mode == 2) &&
+		common.pred_control == 0 && !send.header_present &&
+		((message_type == 0x07 && (send.mlen == 2 * regs || send.mlen == 3 * regs)) ||
+		 (message_type == 0x1a && send.mlen == 2 * regs));
+
+	for (uint32_t i = 0; valid && i < exec_size; i++) {
+		const uint32_t channel = base + i;
+		const uint32_t offset = (src + i / 8) * 32 + (i % 8) * 4;
+		struct meta_value u, v, lod;
+
+		u = meta_read(m, offset, 4, channel);
+		v = meta_read(m, offset + regs * 32, 4, channel);
+		if (send.mlen == 3 * regs) {
+			lod = meta_read(m, offset + 2 * regs * 32, 4, channel);
+			valid = lod.kind == META_CONST && lod.v == 0;
+		}
+
+		valid = valid &&
+			u.kind == META_X && !u.is_float &&
+			v.kind == META_Y && !v.is_float;
+		if (valid && i == 0) {
+			ld.dx = u.v;
+			ld.dy = v.v;
+		}
+		valid = valid && ld.dx == (int32_t) u.v && ld.dy == (int32_t) v.v;
+	}
+
+	if (valid && m->ld_valid &&
+	    (ld.bti != m->ld.bti || ld.dx != m->ld.dx || ld.dy != m->ld.dy))
+		valid = false;
+
+	if (valid) {
+		m->ld = ld;
+		m->ld_valid = true;
+	}
+
+	for (uint32_t r = 0; r < send.rlen; r++) {
+		for (uint32_t i = 0; i < 8; i++) {
+			const uint32_t channel = base + (r % regs) * 8 + i;
+			struct meta_value v = meta_unknown;
+
+			if (valid)
+				v = (struct meta_value) { .kind = META_TEXEL, .v = r / regs };
+
+			meta_write(m, (dst + r) * 32 + i * 4, 4, channel, v);
+		}
+	}
+}
+
+/* Check what the final render target write stores. */
+static bool
+meta_eval_rt_write(struct meta_state *m, struct inst *inst, int width,
+		   struct ps_meta *meta)
+{
+	struct inst_send send = unpack_inst_send(inst);
+	const uint32_t desc = send.function_control;
+	const uint32_t subtype = field(desc, 8, 10);
+	const uint32_t src = unpack_inst_2src_src0(inst).num;
+	uint32_t regs;
+
+	if (field(desc, 0, 7) != 0 || field(desc, 14, 17) != 0x0c ||
+	    send.header_present || unpack_inst_common(inst).pred_control)
+		return false;
+
+	switch (subtype) {
+	case 0: /* SIMD16 */
+		if (width != 16)
+			return false;
+		regs = 2;
+		break;
+	case 1: /* SIMD16 replicated data */
+		regs = 0;
+		break;
+	case 4: /* SIMD8 */
+		if (width != 8)
+			return false;
+		regs = 1;
+		break;
+	default:
+		return false;
+	}
+
+	if (send.mlen != (regs ? 4 * regs : 1))
+		return false;
+
+	enum ps_meta_kind kind = PS_META_NONE;
+	for (uint32_t k = 0; k < 4; k++) {
+		for (int c = 0; c < width; c++) {
+			struct meta_value v;
+
+			if (regs == 0)
+				v = meta_read(m, src * 32 + k * 4, 4, c);
+			else
+				v = meta_read(m, (src + k * regs + c / 8) * 32 + (c % 8) * 4, 4, c);
+
+			if (regs == 0 && v.kind != META_CONST)
+				return false;
+
+			if (v.kind == META_CONST) {
+				if (kind == PS_META_COPY || (c > 0 && meta->color[k] != v.v))
+					return false;
+				kind = PS_META_CONSTANT;
+				meta->color[k] = v.v;
+			} else if (v.kind == META_TEXEL && v.v == k) {
+				if (kind == PS_META_CONSTANT)
+					return false;
+				kind = PS_META_COPY;
+			} else {
+				return false;
+			}
+		}
+	}
+
+	if (kind == PS_META_COPY) {
+		if (!m->ld_valid)
+			return false;
+		meta->bti = m->ld.bti;
+		meta->dx = m->ld.dx;
+		meta->dy = m->ld.dy;
+	}
+
+	meta->kind = kind;
+
+	return true;
+}
+
+bool
+classify_ps(uint64_t kernel_offset, uint32_t grf_start, int width,
+	    const void *constants, uint32_t num_constants,
+	    struct ps_meta *meta)
+{
+	static struct meta_state m;
+	struct inst uncompacted, *inst;
+	uint64_t range;
+	void *p;
+
+	meta->kind = PS_META_NONE;
+	if (width != 8 && width != 16)
+		return false;
+
+	memset(&m, 0, sizeof(m));
+	m.constants = constants;
+	m.constants_start = grf_start;
+	m.constants_end = grf_start + num_constants;
+
+	brw_init_compaction_tables(&ksim_devinfo);
+	p = map_gtt_offset(kernel_offset + gt.instruction_base_address, &range);
+
+	/* Meta shaders are short, give up on anything longer. */
+	for (int n = 0; n < 64; n++) {
+		if (unpack_inst_common(p).cmpt_control) {
+			brw_uncompact_instruction(&ksim_devinfo, &uncompacted, p);
+			inst = &uncompacted;
+			p += 8;
+		} else {
+			inst = p;
+			p += 16;
+		}
+
+		const uint32_t opcode = unpack_inst_common(inst).opcode;
+		struct inst_send send;
+
+		switch (opcode) {
+		case BRW_OPCODE_NOP:
+		case BRW_OPCODE_WAIT:
+			break;
+
+		case BRW_OPCODE_SEND:
+		case BRW_OPCODE_SENDC:
+			send = unpack_inst_send(inst);
+			if (send.eot)
+				return send.sfid == GEN6_SFID_DATAPORT_RENDER_CACHE &&
+					meta_eval_rt_write(&m, inst, width, meta);
+			else if (send.sfid == BRW_SFID_SAMPLER)
+				meta_eval_ld(&m, inst);
+			else
+				return false;
+			break;
+
+		case BRW_OPCODE_JMPI:
+		case BRW_OPCODE_IF:
+		case BRW_OPCODE_ELSE:
+		case BRW_OPCODE_ENDIF:
+		case BRW_OPCODE_DO:
+		case BRW_OPCODE_WHILE:
+		case BRW_OPCODE_BREAK:
+		case BRW_OPCODE_CONTINUE:
+		case BRW_OPCODE_HALT:
+		case BRW_OPCODE_GOTO:
+			return false;
+
+		default:
+			meta_eval_alu(&m, inst);
+			break;
+		}
+	}
+
+	return false;
+}
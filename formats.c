@@ -23,8 +23,8 @@
 
 #include "ksim.h"
 
-#define V 1
-#define SRGB 2
+#define V FORMAT_CAP_VERTEX
+#define SRGB FORMAT_CAP_SRGB
 
 const struct format_info gen_formats[] = {
 	[SF_R32G32B32A32_FLOAT]			= { .size = 16, .channels = 4, .block_size = 1, .caps = V },
@@ -207,17 +207,17 @@ const struct format_info gen_formats[] = {
 	[SF_R8G8B8_USCALED]			= { .size =  3, .channels = 3, .block_size = 1, .caps = V },
 	[SF_R64G64B64A64_FLOAT]			= { .size = 32, .channels = 4, .block_size = 1, .caps = V },
 	[SF_R64G64B64_FLOAT]			= { .size = 24, .channels = 3, .block_size = 1, .caps = V },
-	[SF_BC4_SNORM]				= { .size =  0, .channels = 3, .block_size = 4, .caps = 0 },
-	[SF_BC5_SNORM]				= { .size =  0, .channels = 3, .block_size = 4, .caps = 0 },
+	[SF_BC4_SNORM]				= { .size =  8, .channels = 3, .block_size = 4, .caps = 0 },
+	[SF_BC5_SNORM]				= { .size = 16, .channels = 3, .block_size = 4, .caps = 0 },
 	[SF_R16G16B16_FLOAT]			= { .size =  6, .channels = 3, .block_size = 1, .caps = V },
 	[SF_R16G16B16_UNORM]			= { .size =  6, .channels = 3, .block_size = 1, .caps = V },
 	[SF_R16G16B16_SNORM]			= { .size =  6, .channels = 3, .block_size = 1, .caps = V },
 	[SF_R16G16B16_SSCALED]			= { .size =  6, .channels = 3, .block_size = 1, .caps = V },
 	[SF_R16G16B16_USCALED]			= { .size =  6, .channels = 3, .block_size = 1, .caps = V },
-	[SF_BC6H_SF16]				= { .size =  6, .channels = 3, .block_size = 4, .caps = 0 },
-	[SF_BC7_UNORM]				= { .size =  0, .channels = 3, .block_size = 4, .caps = 0 },
-	[SF_BC7_UNORM_SRGB]			= { .size =  0, .channels = 3, .block_size = 4, .caps = 0 | SRGB },
-	[SF_BC6H_UF16]				= { .size =  0, .channels = 3, .block_size = 4, .caps = 0 },
+	[SF_BC6H_SF16]				= { .size = 16, .channels = 3, .block_size = 4, .caps = 0 },
+	[SF_BC7_UNORM]				= { .size = 16, .channels = 3, .block_size = 4, .caps = 0 },
+	[SF_BC7_UNORM_SRGB]			= { .size = 16, .channels = 3, .block_size = 4, .caps = 0 | SRGB },
+	[SF_BC6H_UF16]				= { .size = 16, .channels = 3, .block_size = 4, .caps = 0 },
 	[SF_PLANAR_420_8]			= { .size =  0, .channels = 3, .block_size = 1, .caps = 0 },
 	[SF_R8G8B8_UNORM_SRGB]			= { .size =  3, .channels = 3, .block_size = 1, .caps = V | SRGB },
 	[SF_ETC1_RGB8]				= { .size =  0, .channels = 3, .block_size = 1, .caps = 0 },
@@ -282,6 +282,196 @@ format_block_size(uint32_t format)
 	return gen_formats[format].block_size;
 }
 
+/* Render target formats, as the type and the width and bit offset of
+ * the R, G, B and A channels in the pixel. A width of 0 means the
+ * channel isn't stored. */
+#define RT(t, rb, ro, gb, go, bb, bo, ab, ao) \
+	{ .type = FORMAT_##t, .bits = { rb, gb, bb, ab }, .offset = { ro, go, bo, ao } }
+
+static const struct format_layout rt_formats[SF_RAW + 1] = {
+	[SF_R32G32B32A32_FLOAT]			= RT(FLOAT, 32, 0, 32, 32, 32, 64, 32, 96),
+	[SF_R32G32B32A32_SINT]			= RT(SINT, 32, 0, 32, 32, 32, 64, 32, 96),
+	[SF_R32G32B32A32_UINT]			= RT(UINT, 32, 0, 32, 32, 32, 64, 32, 96),
+	[SF_R32G32B32X32_FLOAT]			= RT(FLOAT, 32, 0, 32, 32, 32, 64, 0, 0),
+	[SF_R16G16B16A16_UNORM]			= RT(UNORM, 16, 0, 16, 16, 16, 32, 16, 48),
+	[SF_R16G16B16A16_SNORM]			= RT(SNORM, 16, 0, 16, 16, 16, 32, 16, 48),
+	[SF_R16G16B16A16_SINT]			= RT(SINT, 16, 0, 16, 16, 16, 32, 16, 48),
+	[SF_R16G16B16A16_UINT]			= RT(UINT, 16, 0, 16, 16, 16, 32, 16, 48),
+	[SF_R16G16B16A16_FLOAT]			= RT(FLOAT, 16, 0, 16, 16, 16, 32, 16, 48),
+	[SF_R32G32_FLOAT]			= RT(FLOAT, 32, 0, 32, 32, 0, 0, 0, 0),
+	[SF_R32G32_SINT]			= RT(SINT, 32, 0, 32, 32, 0, 0, 0, 0),
+	[SF_R32G32_UINT]			= RT(UINT, 32, 0, 32, 32, 0, 0, 0, 0),
+	[SF_R16G16B16X16_UNORM]			= RT(UNORM, 16, 0, 16, 16, 16, 32, 0, 0),
+	[SF_R16G16B16X16_FLOAT]			= RT(FLOAT, 16, 0, 16, 16, 16, 32, 0, 0),
+	[SF_B8G8R8A8_UNORM]			= RT(UNORM, 8, 16, 8, 8, 8, 0, 8, 24),
+	[SF_B8G8R8A8_UNORM_SRGB]		= RT(UNORM, 8, 16, 8, 8, 8, 0, 8, 24),
+	[SF_R10G10B10A2_UNORM]			= RT(UNORM, 10, 0, 10, 10, 10, 20, 2, 30),
+	[SF_R10G10B10A2_UINT]			= RT(UINT, 10, 0, 10, 10, 10, 20, 2, 30),
+	[SF_R8G8B8A8_UNORM]			= RT(UNORM, 8, 0, 8, 8, 8, 16, 8, 24),
+	[SF_R8G8B8A8_UNORM_SRGB]		= RT(UNORM, 8, 0, 8, 8, 8, 16, 8, 24),
+	[SF_R8G8B8A8_SNORM]			= RT(SNORM, 8, 0, 8, 8, 8, 16, 8, 24),
+	[SF_R8G8B8A8_SINT]			= RT(SINT, 8, 0, 8, 8, 8, 16, 8, 24),
+	[SF_R8G8B8A8_UINT]			= RT(UINT, 8, 0, 8, 8, 8, 16, 8, 24),
+	[SF_R16G16_UNORM]			= RT(UNORM, 16, 0, 16, 16, 0, 0, 0, 0),
+	[SF_R16G16_SNORM]			= RT(SNORM, 16, 0, 16, 16, 0, 0, 0, 0),
+	[SF_R16G16_SINT]			= RT(SINT, 16, 0, 16, 16, 0, 0, 0, 0),
+	[SF_R16G16_UINT]			= RT(UINT, 16, 0, 16, 16, 0, 0, 0, 0),
+	[SF_R16G16_FLOAT]			= RT(FLOAT, 16, 0, 16, 16, 0, 0, 0, 0),
+	[SF_B10G10R10A2_UNORM]			= RT(UNORM, 10, 20, 10, 10, 10, 0, 2, 30),
+	[SF_R11G11B10_FLOAT]			= RT(FLOAT, 11, 0, 11, 11, 10, 22, 0, 0),
+	[SF_R32_SINT]				= RT(SINT, 32, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R32_UINT]				= RT(UINT, 32, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R32_FLOAT]				= RT(FLOAT, 32, 0, 0, 0, 0, 0, 0, 0),
+	[SF_B8G8R8X8_UNORM]			= RT(UNORM, 8, 16, 8, 8, 8, 0, 0, 0),
+	[SF_B8G8R8X8_UNORM_SRGB]		= RT(UNORM, 8, 16, 8, 8, 8, 0, 0, 0),
+	[SF_R8G8B8X8_UNORM]			= RT(UNORM, 8, 0, 8, 8, 8, 16, 0, 0),
+	[SF_R8G8B8X8_UNORM_SRGB]		= RT(UNORM, 8, 0, 8, 8, 8, 16, 0, 0),
+	[SF_B5G6R5_UNORM]			= RT(UNORM, 5, 11, 6, 5, 5, 0, 0, 0),
+	[SF_B5G5R5A1_UNORM]			= RT(UNORM, 5, 10, 5, 5, 5, 0, 1, 15),
+	[SF_B4G4R4A4_UNORM]			= RT(UNORM, 4, 8, 4, 4, 4, 0, 4, 12),
+	[SF_R8G8_UNORM]				= RT(UNORM, 8, 0, 8, 8, 0, 0, 0, 0),
+	[SF_R8G8_SNORM]				= RT(SNORM, 8, 0, 8, 8, 0, 0, 0, 0),
+	[SF_R8G8_SINT]				= RT(SINT, 8, 0, 8, 8, 0, 0, 0, 0),
+	[SF_R8G8_UINT]				= RT(UINT, 8, 0, 8, 8, 0, 0, 0, 0),
+	[SF_R16_UNORM]				= RT(UNORM, 16, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R16_SNORM]				= RT(SNORM, 16, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R16_SINT]				= RT(SINT, 16, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R16_UINT]				= RT(UINT, 16, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R16_FLOAT]				= RT(FLOAT, 16, 0, 0, 0, 0, 0, 0, 0),
+	[SF_A8_UNORM]				= RT(UNORM, 0, 0, 0, 0, 0, 0, 8, 0),
+	[SF_R8_UNORM]				= RT(UNORM, 8, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R8_SNORM]				= RT(SNORM, 8, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R8_SINT]				= RT(SINT, 8, 0, 0, 0, 0, 0, 0, 0),
+	[SF_R8_UINT]				= RT(UINT, 8, 0, 0, 0, 0, 0, 0, 0),
+};
+
+const struct format_layout *
+format_layout(uint32_t format)
+{
+	ksim_assert(format <= SF_RAW);
+
+	if (rt_formats[format].type == 0)
+		return NULL;
+
+	return &rt_formats[format];
+}
+
+/* 8 bit sRGB values decoded to linear. */
+const float srgb_decode_table[256] = {
+	0.0f, 0.000303526991f, 0.000607053982f, 0.000910580973f,
+	0.00121410796f, 0.00151763496f, 0.00182116195f, 0.00212468882f,
+	0.00242821593f, 0.0027317428f, 0.00303526991f, 0.00334653584f,
+	0.00367650739f, 0.00402471703f, 0.00439144205f, 0.00477695325f,
+	0.00518151652f, 0.00560539169f, 0.00604883302f, 0.00651209056f,
+	0.00699541019f, 0.00749903219f, 0.00802319311f, 0.00856812578f,
+	0.00913405884f, 0.00972121768f, 0.010329823f, 0.0109600937f,
+	0.0116122449f, 0.012286488f, 0.0129830325f, 0.0137020834f,
+	0.0144438436f, 0.0152085144f, 0.0159962941f, 0.0168073755f,
+	0.0176419541f, 0.01850022f, 0.0193823613f, 0.0202885624f,
+	0.0212190095f, 0.0221738853f, 0.0231533665f, 0.0241576321f,
+	0.0251868591f, 0.0262412224f, 0.0273208916f, 0.02842604f,
+	0.0295568351f, 0.0307134446f, 0.0318960324f, 0.0331047662f,
+	0.0343398079f, 0.0356013142f, 0.0368894488f, 0.0382043719f,
+	0.0395462364f, 0.0409151986f, 0.0423114114f, 0.043735031f,
+	0.045186203f, 0.0466650873f, 0.0481718257f, 0.0497065671f,
+	0.0512694567f, 0.0528606474f, 0.054480277f, 0.0561284907f,
+	0.0578054301f, 0.0595112368f, 0.0612460524f, 0.0630100146f,
+	0.064803265f, 0.0666259378f, 0.0684781671f, 0.0703600943f,
+	0.0722718537f, 0.0742135718f, 0.0761853829f, 0.078187421f,
+	0.0802198201f, 0.0822827071f, 0.0843762085f, 0.0865004584f,
+	0.0886555836f, 0.0908417106f, 0.0930589661f, 0.0953074694f,
+	0.097587347f, 0.0998987257f, 0.102241732f, 0.104616486f,
+	0.107023105f, 0.10946171f, 0.111932427f, 0.114435375f,
+	0.116970666f, 0.119538426f, 0.122138776f, 0.124771819f,
+	0.127437681f, 0.130136475f, 0.13286832f, 0.135633335f,
+	0.138431609f, 0.141263291f, 0.144128472f, 0.147027269f,
+	0.149959788f, 0.152926147f, 0.155926466f, 0.158960834f,
+	0.162029371f, 0.165132195f, 0.168269396f, 0.171441108f,
+	0.174647406f, 0.177888423f, 0.18116425f, 0.18447499f,
+	0.187820777f, 0.191201687f, 0.194617838f, 0.198069319f,
+	0.20155625f, 0.205078736f, 0.208636865f, 0.212230757f,
+	0.215860501f, 0.219526201f, 0.223227963f, 0.226965874f,
+	0.230740055f, 0.23455058f, 0.238397568f, 0.242281124f,
+	0.246201321f, 0.25015828f, 0.254152089f, 0.258182853f,
+	0.262250662f, 0.266355604f, 0.270497799f, 0.274677306f,
+	0.278894275f, 0.283148736f, 0.287440836f, 0.291770637f,
+	0.296138257f, 0.300543785f, 0.304987311f, 0.309468925f,
+	0.313988715f, 0.318546772f, 0.323143214f, 0.327778101f,
+	0.332451522f, 0.337163627f, 0.341914415f, 0.346704066f,
+	0.351532608f, 0.356400132f, 0.361306787f, 0.366252601f,
+	0.371237695f, 0.376262128f, 0.38132602f, 0.386429429f,
+	0.391572475f, 0.396755219f, 0.401977777f, 0.407240212f,
+	0.412542611f, 0.417885065f, 0.423267663f, 0.428690493f,
+	0.434153646f, 0.439657182f, 0.445201188f, 0.450785786f,
+	0.456411034f, 0.462076992f, 0.467783809f, 0.473531485f,
+	0.479320168f, 0.48514995f, 0.491020858f, 0.496932983f,
+	0.502886474f, 0.50888133f, 0.514917672f, 0.520995557f,
+	0.527115107f, 0.533276379f, 0.539479494f, 0.545724452f,
+	0.55201143f, 0.558340371f, 0.564711511f, 0.571124852f,
+	0.577580452f, 0.584078431f, 0.590618849f, 0.597201765f,
+	0.603827357f, 0.610495567f, 0.617206573f, 0.623960376f,
+	0.630757153f, 0.637596846f, 0.644479692f, 0.651405632f,
+	0.658374846f, 0.665387273f, 0.672443151f, 0.679542482f,
+	0.686685324f, 0.693871737f, 0.701101899f, 0.708375752f,
+	0.715693474f, 0.723055124f, 0.730460763f, 0.73791039f,
+	0.745404184f, 0.752942204f, 0.760524511f, 0.768151164f,
+	0.775822222f, 0.783537805f, 0.791297913f, 0.799102724f,
+	0.806952238f, 0.814846575f, 0.822785735f, 0.830769897f,
+	0.838799f, 0.846873224f, 0.854992628f, 0.863157213f,
+	0.871367097f, 0.8796224f, 0.887923121f, 0.896269381f,
+	0.904661179f, 0.913098633f, 0.921581864f, 0.930110872f,
+	0.938685715f, 0.947306514f, 0.955973327f, 0.964686275f,
+	0.973445296f, 0.982250571f, 0.991102099f, 1.0f
+};
+
+/* Linear to 8 bit sRGB encoding, after Fabian Giesen's table based
+ * conversion. The input is clamped to [2^-13, 1 - ulp], where the 104
+ * entries cover the 13 exponents in steps of 1/8. An entry has a bias
+ * in the top 16 bits and a slope in the low 16 bits, and we
+ * interpolate with the next 8 mantissa bits below the index. The
+ * result is within 0.55 ulp of the exact conversion for all inputs. */
+const uint32_t srgb_encode_table[104] = {
+	0x00330005, 0x00770013, 0x00800005, 0x00800005, 0x00800005, 0x00800005,
+	0x00800005, 0x00800005, 0x00800012, 0x00800012, 0x00810012, 0x008e0012,
+	0x009a0012, 0x00a70012, 0x00f50018, 0x01000012, 0x0100002b, 0x0100002b,
+	0x0101002b, 0x011b002b, 0x01750033, 0x0180002b, 0x0180002b, 0x0182002b,
+	0x01de0061, 0x0200005f, 0x0203005f, 0x02770060, 0x0280005f, 0x02e0005f,
+	0x0300005f, 0x0304005f, 0x037800c6, 0x03e000c6, 0x044800c6, 0x04af00c8,
+	0x050000c6, 0x057a00cd, 0x05de00b6, 0x063e00ae, 0x06990150, 0x0744013a,
+	0x07e40128, 0x087a0121, 0x090e010b, 0x099700fe, 0x0a1a00f5, 0x0a9800ea,
+	0x0b1101c4, 0x0bf301b1, 0x0ccc0191, 0x0d980178, 0x0e55016f, 0x0f0f0157,
+	0x0fbe0148, 0x10630143, 0x110a025c, 0x1239023d, 0x1358021a, 0x14650204,
+	0x156601ea, 0x165a01d3, 0x174501bc, 0x182601a7, 0x18fc0331, 0x1a9802f6,
+	0x1c1702cb, 0x1d7d02ad, 0x1ed4028d, 0x201b026d, 0x21520256, 0x227c0242,
+	0x23a0043e, 0x25c203fa, 0x27c003bf, 0x29a10392, 0x2b690368, 0x2d1f033a,
+	0x2ebe031d, 0x304d02ff, 0x31d205a9, 0x34ab054d, 0x37520509, 0x39d504c0,
+	0x3c37048a, 0x3e7b045a, 0x40a90423, 0x42be03fc, 0x44c30797, 0x488e0716,
+	0x4c1e06ae, 0x4f76065e, 0x52a5060e, 0x55ac05ca, 0x58940588, 0x5b5a0552,
+	0x5e0b0a26, 0x631c097f, 0x67dc08f0, 0x6c55087e, 0x70970811, 0x749f07b8,
+	0x787c076e, 0x7c35071e
+};
+
+uint8_t
+linear_to_srgb8(float f)
+{
+	const uint32_t min = (127 - 13) << 23;
+	const uint32_t almost_one = 0x3f7fffff;
+
+	/* Written so that NaN maps to 0. */
+	if (!(f > u32_to_float(min)))
+		f = u32_to_float(min);
+	if (f > u32_to_float(almost_one))
+		f = u32_to_float(almost_one);
+
+	const uint32_t u = float_to_u32(f);
+	const uint32_t entry = srgb_encode_table[(u - min) >> 20];
+	const uint32_t bias = (entry >> 16) << 9;
+	const uint32_t scale = entry & 0xffff;
+	const uint32_t t = (u >> 12) & 0xff;
+
+	return (bias + scale * t) >> 16;
+}
+
 static const struct format_info depth_formats[] = {
 	[D32_FLOAT]				= { .size = 4 },
 	[D24_UNORM_X8_UINT]			= { .size = 4 },
@@ -431,6 +431,7 @@ flush_gtt_map(struct gtt_map *m)
 		ksim_unreachable();
 	}
 
+	invalidate_shadow_range(m->bo->map, m->bo->size);
 	mprotect(m->virtual, m->length, m->prot & ~PROT_WRITE);
 	trace(TRACE_GEM, "remapping bo %d as read-only\n", get_handle(m->bo));
 }
@@ -607,6 +608,8 @@ dispatch_pread(int fd, unsigned long request,
 	ksim_assert(gem_pread->offset + gem_pread->size > gem_pread->offset);
 	ksim_assert(gem_pread->offset + gem_pread->size <= bo->size);
 
+	fast_clear_resolve_all();
+
 	return pread(memfd, (void *) (uintptr_t) gem_pread->data_ptr,
 		     gem_pread->size, bo->offset + gem_pread->offset);
 }
@@ -630,6 +633,8 @@ dispatch_pwrite(int fd, unsigned long request,
 	ksim_assert(gem_pwrite->offset + gem_pwrite->size > gem_pwrite->offset);
 	ksim_assert(gem_pwrite->offset + gem_pwrite->size <= bo->size);
 
+	invalidate_shadow_range(bo->map + gem_pwrite->offset, gem_pwrite->size);
+
 	return pwrite(memfd, (void *) (uintptr_t) gem_pwrite->data_ptr,
 		      gem_pwrite->size, bo->offset + gem_pwrite->offset);
 }
@@ -659,6 +664,9 @@ dispatch_mmap(int fd, unsigned long request,
 	ksim_assert(gem_mmap->offset + gem_mmap->size > gem_mmap->offset);
 	ksim_assert(gem_mmap->offset + gem_mmap->size <= bo->size);
 
+	fast_clear_resolve_all();
+	invalidate_shadow_range(bo->map + gem_mmap->offset, gem_mmap->size);
+
 	p = mmap(NULL, gem_mmap->size, PROT_READ | PROT_WRITE,
 		 MAP_SHARED, memfd, bo->offset + gem_mmap->offset);
 
@@ -681,6 +689,8 @@ dispatch_mmap_gtt(int fd, unsigned long request,
 		return -1;
 	}
 
+	fast_clear_resolve_all();
+
 	uint32_t tiling = bo->stride & 3;
 	uint32_t stride = bo->stride & ~3u;
 	if (tiling != I915_TILING_NONE) {
@@ -704,6 +714,16 @@ dispatch_set_domain(int fd, unsigned long request,
 		    struct drm_i915_gem_set_domain *set_domain)
 {
 	trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_SET_DOMAIN\n");
+
+	/* The CPU is about to look at the bo, so write out any
+	 * pending fast clears. */
+	fast_clear_resolve_all();
+
+	/* Writes through CPU maps are only announced here. */
+	struct stub_bo *bo = get_bo(set_domain->handle);
+	if (bo != NULL && set_domain->write_domain != 0)
+		invalidate_shadow_range(bo->map, bo->size);
+
 	return 0;
 }
 
@@ -959,6 +979,7 @@ ioctl(int fd, unsigned long request, ...)
 
 	case DRM_IOCTL_I915_GEM_WAIT:
 		trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_WAIT\n");
+		fast_clear_resolve_all();
 		return 0;
 
 	case DRM_IOCTL_I915_GEM_CONTEXT_CREATE: {
@@ -1069,8 +1090,16 @@ munmap(void *addr, size_t length)
 uint32_t trace_mask = TRACE_WARN;
 uint32_t breakpoint_mask = 0;
 FILE *trace_file;
+FILE *stats_file;
 char *framebuffer_filename;
+char *heatmap_filename;
+bool heatmap_cycles;
 bool use_threads;
+uint32_t ps_max_dispatch_width = 32;
+bool tile_order_serpentine;
+bool tile_buffer_enable;
+bool tile_buffer_streaming;
+bool texture_shadow_enable;
 
 static const struct { const char *name; uint32_t flag; } debug_tags[] = {
 	{ "debug",	TRACE_DEBUG },
@@ -1154,6 +1183,22 @@ ksim_stub_init(void)
 			filename = strndup(value, end - value);
 			trace_file = fopen(filename, "w");
 			free(filename);
+		} else if (is_prefix(s, "stats", &value)) {
+			ksim_assert(stats_file == NULL);
+			if (value == NULL)
+				error(EXIT_FAILURE, 0, "ksim: stats needs a file name");
+			filename = strndup(value, end - value);
+			stats_file = fopen(filename, "w");
+			if (stats_file == NULL)
+				error(EXIT_FAILURE, errno, "ksim: failed to open %s", filename);
+			free(filename);
+		} else if (is_prefix(s, "heatmap-cycles", NULL)) {
+			heatmap_cycles = true;
+		} else if (is_prefix(s, "heatmap", &value)) {
+			if (value)
+				heatmap_filename = strndup(value, end - value);
+			else
+				heatmap_filename = strdup("heatmap.png");
 		} else if (is_prefix(s, "framebuffer", &value)) {
 			framebuffer_filename = strndup(value, end - value);
 		} else if (is_prefix(s, "trace", &value)) {
@@ -1161,6 +1206,27 @@ ksim_stub_init(void)
 		} else if (is_prefix(s, "breakpoint", &value)) {
 			breakpoint_mask = parse_trace_flags(value);
 			trace_mask |= breakpoint_mask;
+		} else if (is_prefix(s, "dispatch-width", &value)) {
+			ps_max_dispatch_width = strtol(value, NULL, 0);
+			if (ps_max_dispatch_width != 8 &&
+			    ps_max_dispatch_width != 16 &&
+			    ps_max_dispatch_width != 32)
+				error(EXIT_FAILURE, 0, "ksim: invalid dispatch width");
+		} else if (is_prefix(s, "tile-order", &value)) {
+			if (value != NULL && is_prefix(value, "raster", NULL))
+				tile_order_serpentine = false;
+			else if (value != NULL && is_prefix(value, "serpentine", NULL))
+				tile_order_serpentine = true;
+			else
+				error(EXIT_FAILURE, 0, "ksim: invalid tile order");
+		} else if (is_prefix(s, "tile-buffer", &value)) {
+			tile_buffer_enable = true;
+			if (value != NULL && is_prefix(value, "streaming", NULL))
+				tile_buffer_streaming = true;
+			else if (value != NULL)
+				error(EXIT_FAILURE, 0, "ksim: invalid tile buffer mode");
+		} else if (is_prefix(s, "texture-shadow", NULL)) {
+			texture_shadow_enable = true;
 		}
 	}
 
@@ -373,6 +373,9 @@ kir_insn_format(struct kir_insn *insn, char *buf, size_t size)
 	case kir_d2ps:
 		snprintf(buf, size, "r%-3d = d2ps r%d", insn->dst.n, insn->alu.src0.n);
 		break;
+	case kir_ps2ph:
+		snprintf(buf, size, "r%-3d = ps2ph r%d", insn->dst.n, insn->alu.src0.n);
+		break;
 	case kir_absd:
 		snprintf(buf, size, "r%-3d = absd r%d", insn->dst.n, insn->alu.src0.n);
 		break;
@@ -533,6 +536,10 @@ kir_insn_format(struct kir_insn *insn, char *buf, size_t size)
 		snprintf(buf, size, "r%-3d = cmpgtd r%d r%d", insn->dst.n,
 			 insn->alu.src0.n, insn->alu.src1.n);
 		break;
+	case kir_packusdw:
+		snprintf(buf, size, "r%-3d = packusdw r%d, r%d", insn->dst.n,
+			 insn->alu.src0.n, insn->alu.src1.n);
+		break;
 	case kir_blend:
 		snprintf(buf, size, "r%-3d = blend r%d, r%d, r%d", insn->dst.n,
 			 insn->alu.src0.n, insn->alu.src1.n, insn->alu.src2.n);
@@ -767,6 +774,7 @@ kir_program_compute_live_ranges(struct kir_program *prog)
 		case kir_sxwd:
 		case kir_ps2d:
 		case kir_d2ps:
+		case kir_ps2ph:
 		case kir_absd:
 		case kir_rcp:
 		case kir_sqrt:
@@ -787,6 +795,7 @@ kir_program_compute_live_ranges(struct kir_program *prog)
 		case kir_shr:
 		case kir_shl:
 		case kir_asr:
+		case kir_packusdw:
 		case kir_maxd:
 		case kir_maxw:
 		case kir_maxf:
@@ -996,6 +1005,7 @@ kir_program_copy_propagation(struct kir_program *prog)
 		case kir_sxwd:
 		case kir_ps2d:
 		case kir_d2ps:
+		case kir_ps2ph:
 		case kir_absd:
 		case kir_rcp:
 		case kir_sqrt:
@@ -1015,6 +1025,7 @@ kir_program_copy_propagation(struct kir_program *prog)
 		case kir_shr:
 		case kir_shl:
 		case kir_asr:
+		case kir_packusdw:
 		case kir_maxd:
 		case kir_maxw:
 		case kir_maxf:
@@ -1374,6 +1385,7 @@ kir_program_allocate_registers(struct kir_program *prog)
 		case kir_sxwd:
 		case kir_ps2d:
 		case kir_d2ps:
+		case kir_ps2ph:
 		case kir_absd:
 		case kir_rcp:
 		case kir_sqrt:
@@ -1394,6 +1406,7 @@ kir_program_allocate_registers(struct kir_program *prog)
 		case kir_shr:
 		case kir_shl:
 		case kir_asr:
+		case kir_packusdw:
 		case kir_maxd:
 		case kir_maxw:
 		case kir_maxf:
@@ -1774,6 +1787,11 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 		case kir_d2ps:
 			builder_emit_vcvtdq2ps(bld, insn->dst.n, insn->alu.src0.n);
 			break;
+		case kir_ps2ph:
+			/* Eight halfs in the low 128 bits, rounded to
+			 * nearest even. */
+			builder_emit_vcvtps2ph(bld, insn->dst.n, insn->alu.src0.n, 0);
+			break;
 		case kir_absd:
 			builder_emit_vpabsd(bld, insn->dst.n, insn->alu.src0.n);
 			break;
@@ -1923,6 +1941,10 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 			builder_emit_vpcmpgtd(bld, insn->dst.n,
 					      insn->alu.src0.n, insn->alu.src1.n);
 			break;
+		case kir_packusdw:
+			builder_emit_vpackusdw(bld, insn->dst.n,
+					       insn->alu.src1.n, insn->alu.src0.n);
+			break;
 		case kir_blend:
 			/* FIXME: should use vpblendvb */
 			builder_emit_vpblendvps(bld, insn->dst.n, insn->alu.src2.n,
@@ -1941,7 +1963,8 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 			break;
 
 		case kir_eot_if_dead: {
-			builder_emit_vmovmskps(bld, insn->eot.src.n);
+			/* vptest sets ZF when all channels are dead. */
+			builder_emit_vptest(bld, insn->eot.src.n, insn->eot.src.n);
 			void *branch = builder_emit_jne(bld);
 			builder_emit_ret(bld);
 			builder_align(bld);
@@ -1978,6 +2001,8 @@ kir_program_init(struct kir_program *prog, uint64_t surfaces, uint64_t samplers)
 	prog->scope = 0;
 	prog->urb_offset = 0;
 	prog->urb_length = 0;
+	prog->kill_width = 0;
+	prog->live_mask_dirty = false;
 	prog->binding_table_address = surfaces;
 	prog->sampler_state_address = samplers;
 }
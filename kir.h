@@ -45,6 +45,12 @@ struct kir_program {
 	uint32_t urb_offset;
 	uint32_t urb_length;
 
+	/* Dispatch width of pixel shaders that discard, 0 otherwise,
+	 * and whether a discard has cleared channels of mask[0] since
+	 * the last all-dead check. */
+	uint32_t kill_width;
+	bool live_mask_dirty;
+
 	uint64_t binding_table_address;
 	uint64_t sampler_state_address;
 };
@@ -80,6 +86,7 @@ enum kir_opcode {
 	kir_sxwd,
 	kir_ps2d,
 	kir_d2ps,
+	kir_ps2ph,
 	kir_absd,
 	kir_rcp,
 	kir_sqrt,
@@ -129,6 +136,7 @@ enum kir_opcode {
 	kir_cmpf,	/* src2 is an cmp op immediate, not register */
 	kir_cmpeqd,
 	kir_cmpgtd,
+	kir_packusdw,
 
 	/* alu triops */
 	kir_nmaddf,
@@ -57,8 +57,16 @@ memfd_create(const char *name, unsigned int flags)
 extern uint32_t trace_mask;
 extern uint32_t breakpoint_mask;
 extern FILE *trace_file;
+extern FILE *stats_file;
 extern char *framebuffer_filename;
+extern char *heatmap_filename;
+extern bool heatmap_cycles;
 extern bool use_threads;
+extern uint32_t ps_max_dispatch_width;
+extern bool tile_order_serpentine;
+extern bool tile_buffer_enable;
+extern bool tile_buffer_streaming;
+extern bool texture_shadow_enable;
 
 static inline void
 __ksim_trace(uint32_t tag, const char *fmt, ...)
@@ -188,6 +196,12 @@ max_u64(uint64_t a, uint64_t b)
 	return a > b ? a : b;
 }
 
+static inline uint64_t
+min_u64(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
 static inline float
 u32_to_float(uint32_t ud)
 {
@@ -262,6 +276,9 @@ struct thread {
 	struct reg grf[128];
 	struct reg32 f[2];
 	struct reg32 mask[2];
+	struct reg32 coverage; /* Per channel sample coverage for PS */
+	struct reg rt_dst[4]; /* Render target pixels read back for blending */
+	struct reg rt_pixels[4]; /* Packed render target pixels to store */
 	__m256i constants[32];
 	__m256i spill[64]; /* Needs to be dynamically determined */
 };
@@ -411,6 +428,8 @@ struct gt {
 		uint32_t tri_fan_provoking;
 		struct rectanglef guardband;
 		float line_width;
+		float point_width;
+		uint32_t point_width_source;
 	} sf;
 
 	struct {
@@ -430,6 +449,11 @@ struct gt {
 		struct rectangle scissor_rect;
 	} wm;
 
+	struct {
+		uint32_t samples;
+		uint32_t sample_mask;
+	} multisample;
+
 	struct {
 		bool stencil_buffer_clear_enable;
 		bool depth_buffer_clear_enable;
@@ -438,6 +462,7 @@ struct gt {
 		bool hz_depth_buffer_resolve_enable;
 		bool pixel_position_offset_enable;
 		bool full_surface_depth_and_stencil_clear;
+		uint8_t stencil_clear_value;
 	} hiz;
 
 	struct {
@@ -467,11 +492,15 @@ struct gt {
 		uint64_t ksp1;
 		uint64_t ksp2;
 		uint32_t grf_start0;
+		uint32_t grf_start1;
+		uint32_t grf_start2;
 		struct curbe curbe;
 		uint32_t binding_table_address;
 		uint32_t sampler_state_address;
 		uint32_t position_offset_xy;
 		bool uses_source_depth;
+		bool per_sample;
+		bool kills_pixel;
 		bool uses_source_w;
 		uint32_t input_coverage_mask_state;
 		bool attribute_enable;
@@ -489,11 +518,13 @@ struct gt {
 		bool viewport_clip_test_enable;
 		bool viewport_zfar_clip_test_enable;
 		bool viewport_znear_clip_test_enable;
+		uint32_t api_mode;
 	} clip;
 
 	struct {
 		float *viewport;
 		uint32_t state;
+		float blend_constant[4];
 	} cc;
 
 	struct {
@@ -516,10 +547,43 @@ struct gt {
 	} depth;
 
 	struct {
-		enum GEN9_3D_Color_Buffer_Blend_Factor src_factor;
-		enum GEN9_3D_Color_Buffer_Blend_Factor dst_factor;
-		enum GEN9_3D_Color_Buffer_Blend_Function function;
-		bool enable;
+		bool enable; /* from 3DSTATE_STENCIL_BUFFER */
+		uint64_t address;
+		void *buffer;
+		uint32_t stride;
+		bool test_enable;
+		bool write_enable;
+		bool double_sided;
+		struct stencil_face {
+			uint32_t test_function;
+			uint32_t fail_op;
+			uint32_t depth_fail_op;
+			uint32_t pass_op;
+			uint8_t test_mask;
+			uint8_t write_mask;
+			uint8_t ref;
+		} front, back;
+	} stencil;
+
+	struct {
+		/* Indexed by render target. The alpha factors and
+		 * function are copies of the color ones unless
+		 * independent alpha blend is enabled. */
+		struct blend_rt {
+			bool enable;
+			enum GEN9_3D_Color_Buffer_Blend_Factor src_factor;
+			enum GEN9_3D_Color_Buffer_Blend_Factor dst_factor;
+			enum GEN9_3D_Color_Buffer_Blend_Function function;
+			enum GEN9_3D_Color_Buffer_Blend_Factor src_alpha_factor;
+			enum GEN9_3D_Color_Buffer_Blend_Factor dst_alpha_factor;
+			enum GEN9_3D_Color_Buffer_Blend_Function alpha_function;
+			bool logic_op_enable;
+			enum GEN9_3D_Logic_Op_Function logic_op_function;
+			bool pre_blend_clamp;
+			bool post_blend_clamp;
+			enum GEN9_Color_Clamp clamp_range;
+			uint32_t write_disable; /* RGBA in bits 0-3 */
+		} rt[8];
 	} blend;
 
 	char urb[URB_SIZE] __attribute__((__aligned__(32)));
@@ -641,6 +705,25 @@ ymajor_offset(void *base, int x, int y, int stride, int cpp)
 		ix + column * column_stride + iy * 16;
 }
 
+/* W-major tiles are 64x64 bytes and only used for stencil. The tile
+ * is made of 8x8 blocks that interleave x and y bits, so the 8 bytes
+ * of a 4x2 aligned block are contiguous. */
+static inline void *
+wmajor_offset(void *base, int x, int y, int stride)
+{
+	const int tile_x = x / 64;
+	const int tile_y = y / 64;
+	const int tile_stride = stride / 64;
+	const int ix = x & 63;
+	const int iy = y & 63;
+
+	return base + (tile_y * tile_stride + tile_x) * 4096 +
+		512 * (ix >> 3) + 64 * (iy >> 3) +
+		32 * ((iy >> 2) & 1) + 16 * ((ix >> 2) & 1) +
+		8 * ((iy >> 1) & 1) + 4 * ((ix >> 1) & 1) +
+		2 * (iy & 1) + (ix & 1);
+}
+
 #define for_each_bit(b, dword)                          \
 	for (uint32_t __dword = (dword);		\
 	     (b) = __builtin_ffs(__dword) - 1, __dword;	\
@@ -651,7 +734,7 @@ struct value {
 		struct vec4 { float x, y, z, w; } vec4;
 		struct { int32_t x, y, z, w; } ivec4;
 		struct { uint32_t x, y, z, w; } uvec4;
-		struct { uint32_t clip_flags, rt_index, vp_index, point_width; } header;
+		struct { uint32_t clip_flags, rt_index, vp_index; float point_width; } header;
 		int32_t v[4];
 		uint32_t u[4];
 		float f[4];
@@ -729,6 +812,11 @@ void dispatch_gs(struct value ***vue,
 void dispatch_primitive(void);
 void dispatch_compute(void);
 
+enum format_caps {
+	FORMAT_CAP_VERTEX	= 1,
+	FORMAT_CAP_SRGB		= 2,
+};
+
 struct format_info {
 	uint32_t size;		/* size in bytes of a pixel or compression block */
 	uint32_t channels;
@@ -745,15 +833,36 @@ srgb_format(uint32_t format)
 {
 	ksim_assert(format <= SF_RAW);
 
-	//return gen_formats[format].caps & SRGB;
-	return false;
+	return gen_formats[format].caps & FORMAT_CAP_SRGB;
 }
 
+extern const float srgb_decode_table[256];
+extern const uint32_t srgb_encode_table[104];
+uint8_t linear_to_srgb8(float f);
+
+enum format_type {
+	FORMAT_UNORM = 1,
+	FORMAT_SNORM,
+	FORMAT_FLOAT,
+	FORMAT_UINT,
+	FORMAT_SINT,
+};
+
+struct format_layout {
+	uint8_t type;
+	uint8_t bits[4];	/* RGBA channel widths */
+	uint8_t offset[4];	/* RGBA channel bit offsets in the pixel */
+};
+
+const struct format_layout *format_layout(uint32_t format);
 uint32_t format_size(uint32_t format);
 uint32_t format_channels(uint32_t format);
 uint32_t format_block_size(uint32_t format);
 uint32_t depth_format_size(uint32_t format);
 
+const uint32_t *get_decoded_block(enum GEN9_SURFACE_FORMAT format, const void *src);
+void invalidate_decoded_blocks(void);
+
 struct blit {
 	int32_t raster_op;
 	int32_t cpp_log2;
@@ -768,6 +877,8 @@ struct blit {
 void blitter_copy(struct blit *b);
 
 void rasterize_primitive(struct value **vue, enum GEN9_3D_Prim_Topo_Type topology);
+void clip_primitive(struct value **vue, int count,
+		    enum GEN9_3D_Prim_Topo_Type topology);
 
 struct surface {
 	void *pixels;
@@ -777,17 +888,103 @@ struct surface {
 	int height;
 	int stride;
 	int cpp;
+	int depth;		/* array length or 3D depth */
 	int qpitch;
 	int minimum_array_element;
+	int samples;
+	int min_lod;
+	int mip_count;
+	int halign;		/* mip level alignment in pixels */
+	int valign;
 	enum GEN9_TILE_MODE tile_mode;
+	uint32_t clear_color[4];
 };
 
+/* Tile mode of the sampler's shadow copies of tiled textures, rows
+ * of 4x4 texel blocks. Not a hardware tile mode. */
+#define TILE_BLOCKED ((enum GEN9_TILE_MODE) 4)
+
 bool get_surface(uint32_t binding_table_offset, int i, struct surface *s);
+void surface_level_origin(const struct surface *s, int level, int *x, int *y);
+bool get_shadow_surface(const struct surface *s, struct surface *shadow);
+void invalidate_shadow_range(const void *p, uint64_t size);
+void invalidate_shadow_surface(const struct surface *s);
+void start_shadow_batch(void);
 void dump_surface(const char *filename, struct surface *s);
+void dump_rgba(const char *filename, int width, int height, const uint32_t *pixels);
+void surface_fill_rect(const struct surface *s, const struct rectangle *r,
+		       const void *pixel);
+void surface_copy_rect(const struct surface *dst, const struct rectangle *r,
+		       const struct surface *src, int dx, int dy);
+void surface_read_rect(const struct surface *s, const struct rectangle *r,
+		       void *dst, uint32_t stride);
+void surface_write_rect(const struct surface *s, const struct rectangle *r,
+			const void *src, uint32_t stride, bool streaming);
+
+/* Linear copy of the 32x32 tile of render target 0 that the
+ * rasterizer is in, see wm.c. */
+struct color_tile {
+	uint8_t pixels[32 * 32 * 16] __attribute__((aligned(64)));
+	struct rectangle rect;	/* Part of the surface in the tile */
+	bool valid;
+	bool dirty;
+};
+
+extern struct color_tile color_tile;
+bool color_tile_enabled(const struct surface *s);
+void load_format_simd8(void *p, enum GEN9_SURFACE_FORMAT format,
+		       __m256i offsets, __m256i emask, struct reg *dst, int rlen);
+
+static inline bool
+blend_reads_dst(const struct blend_rt *b)
+{
+	return b->enable || b->logic_op_enable || b->write_disable;
+}
 
 void wm_stall(void);
 void wm_flush(void);
+bool pack_rt_color(uint32_t format, const uint32_t *color, void *pixel);
+void fast_clear_resolve(const struct surface *s);
+void fast_clear_resolve_all(void);
+
+/* Per-draw rasterizer and pixel pipeline counters, written to
+ * stats_file by wm_flush(). The depth-kill and RT write counters
+ * are only collected by shaders compiled with stats_file set. */
+struct ps_stats {
+	uint64_t bbox_tiles;
+	uint64_t tiles;
+	uint64_t empty_blocks;
+	uint64_t partial_blocks;
+	uint64_t full_blocks;
+	uint64_t depth_killed_blocks;
+	uint64_t dispatch_count[3];
+	uint64_t pixel_count;
+	uint64_t rt_bytes;
+};
+
+extern struct ps_stats ps_stats;
 void depth_clear(void);
+void stencil_clear(void);
+
+/* Pixel shaders that write the same color to every pixel or copy
+ * the texel at a fixed offset from the pixel, as found by
+ * classify_ps(). */
+enum ps_meta_kind {
+	PS_META_NONE,
+	PS_META_CONSTANT,
+	PS_META_COPY,
+};
+
+struct ps_meta {
+	enum ps_meta_kind kind;
+	uint32_t color[4];	/* render target write payload */
+	uint32_t bti;		/* texture to copy from */
+	int32_t dx, dy;
+};
+
+bool classify_ps(uint64_t kernel_offset, uint32_t grf_start, int width,
+		 const void *constants, uint32_t num_constants,
+		 struct ps_meta *meta);
 
 /* URB handles are indexes to 64 byte blocks in the URB. */
 
@@ -816,6 +1013,8 @@ void set_urb_allocation(struct urb *urb,
 			uint32_t address, uint32_t size, uint32_t total);
 void *alloc_urb_entry(struct urb *urb);
 void free_urb_entry(struct urb* urb, void *entry);
+void ref_urb_entry(void *entry);
+bool urb_full(struct urb *urb);
 void validate_urb_state(void);
 
 struct kir_program;
@@ -857,6 +1056,11 @@ struct vue_buffer {
 void init_vue_buffer(struct vue_buffer *b);
 void emit_vertex_post_processing(struct kir_program *prog, uint32_t base);
 
+struct kir_reg;
+struct kir_reg emit_load_d16(struct kir_program *prog, struct kir_reg base);
+void emit_store_d16(struct kir_program *prog, struct kir_reg base,
+		    struct kir_reg value, struct kir_reg depth, struct kir_reg mask);
+
 void compile_ps(void);
 void compile_hs(void);
 void compile_ds(void);
@@ -28,6 +28,7 @@ struct vs_thread {
 	struct thread t;
 	struct reg vid;
 	void *index_buffer;
+	uint32_t index_buffer_size;
 	uint32_t iid;
 	uint32_t start_vertex;
 	uint32_t base_vertex;
@@ -42,42 +43,70 @@ ia_state_peek(struct ia_state *s, uint32_t i)
 }
 
 static void
-flush_to_vues(struct vue_buffer *b, uint32_t count, struct ia_state *s)
+flush_to_vues(struct vue_buffer *b, uint32_t count)
 {
-	/* Transpose the SIMD8 vs_thread back into individual VUEs */
-	for (uint32_t c = 0; c < count; c++) {
-		__m256i *vue = urb_handle_to_entry(b->vue_handles.ud[c]);
-		__m256i offsets = (__m256i) (__v8si) { 0, 8, 16, 24, 32, 40, 48, 56 };
-		for (uint32_t i = 0; i < gt.vs.urb.size / 32; i++)
-			vue[i] = _mm256_i32gather_epi32(&b->data[i * 8].d[c], offsets, 4);
-
-		/* FIXME: Cut index: ia_state_flush(), ia_state_cut(); else add... */
-		ia_state_add(s, (struct value *) vue);
- 	}
-
-	ksim_assert(s->head - s->tail <= 64);
+	__m256 *vue[8];
+
+	for (uint32_t c = 0; c < count; c++)
+		vue[c] = urb_handle_to_entry(b->vue_handles.ud[c]);
+
+	/* Transpose the SIMD8 vs_thread back into individual VUEs, one
+	 * 8x8 block of dwords at a time. This is 24 shuffles per block
+	 * in registers instead of a gather per VUE row. */
+	for (uint32_t i = 0; i < gt.vs.urb.size / 32; i++) {
+		const struct reg *r = &b->data[i * 8];
+		__m256 t0, t1, t2, t3, t4, t5, t6, t7;
+		__m256 s0, s1, s2, s3, s4, s5, s6, s7;
+
+		t0 = _mm256_unpacklo_ps(r[0].reg, r[1].reg);
+		t1 = _mm256_unpackhi_ps(r[0].reg, r[1].reg);
+		t2 = _mm256_unpacklo_ps(r[2].reg, r[3].reg);
+		t3 = _mm256_unpackhi_ps(r[2].reg, r[3].reg);
+		t4 = _mm256_unpacklo_ps(r[4].reg, r[5].reg);
+		t5 = _mm256_unpackhi_ps(r[4].reg, r[5].reg);
+		t6 = _mm256_unpacklo_ps(r[6].reg, r[7].reg);
+		t7 = _mm256_unpackhi_ps(r[6].reg, r[7].reg);
+
+		s0 = _mm256_shuffle_ps(t0, t2, 0x44);
+		s1 = _mm256_shuffle_ps(t0, t2, 0xee);
+		s2 = _mm256_shuffle_ps(t1, t3, 0x44);
+		s3 = _mm256_shuffle_ps(t1, t3, 0xee);
+		s4 = _mm256_shuffle_ps(t4, t6, 0x44);
+		s5 = _mm256_shuffle_ps(t4, t6, 0xee);
+		s6 = _mm256_shuffle_ps(t5, t7, 0x44);
+		s7 = _mm256_shuffle_ps(t5, t7, 0xee);
+
+		const __m256 lanes[8] = {
+			_mm256_permute2f128_ps(s0, s4, 0x20),
+			_mm256_permute2f128_ps(s1, s5, 0x20),
+			_mm256_permute2f128_ps(s2, s6, 0x20),
+			_mm256_permute2f128_ps(s3, s7, 0x20),
+			_mm256_permute2f128_ps(s0, s4, 0x31),
+			_mm256_permute2f128_ps(s1, s5, 0x31),
+			_mm256_permute2f128_ps(s2, s6, 0x31),
+			_mm256_permute2f128_ps(s3, s7, 0x31),
+		};
+
+		for (uint32_t c = 0; c < count; c++)
+			vue[c][i] = lanes[c];
+	}
 }
 
+static const struct reg range = { .d = {  0, 1, 2, 3, 4, 5, 6, 7 } };
+
+/* Runs the VS on the first count channels of t, which have their vid
+ * and URB handles set up, and writes the results to the VUEs. */
 static void
-dispatch_vs(struct vs_thread *t, uint32_t iid, uint32_t vid, struct ia_state *state)
+run_vs(struct vs_thread *t, uint32_t iid, uint32_t count)
 {
 	struct reg *grf = &t->t.grf[0];
 
 	/* Not sure what we should make this. */
 	uint32_t fftid = 0;
 
-	uint32_t rest = gt.prim.vertex_count - vid;
-	uint32_t count;
-	if (rest > 8)
-		count = 8;
-	else
-		count = rest;
-
-	static const struct reg range = { .d = {  0, 1, 2, 3, 4, 5, 6, 7 } };
-	t->t.mask[0].q[0] = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), range.ireg);
+	t->t.mask[0].q[0] = _mm256_cmpgt_epi32(_mm256_set1_epi32(count), range.ireg);
 
 	t->iid = iid;
-	t->vid.ireg = _mm256_add_epi32(range.ireg, _mm256_set1_epi32(vid));
 
 	/* Fixed function header */
 	grf[0] = (struct reg) {
@@ -100,19 +129,130 @@ dispatch_vs(struct vs_thread *t, uint32_t iid, uint32_t vid, struct ia_state *st
 		}
 	};
 
+	grf[1].ireg = t->buffer.vue_handles.ireg;
+
+	if (gt.vs.statistics)
+		gt.vs_invocation_count++;
+
+	gt.vs.avx_shader(&t->t);
+
+	flush_to_vues(&t->buffer, count);
+}
+
+static void
+dispatch_vs(struct vs_thread *t, uint32_t iid, uint32_t vid, struct ia_state *state)
+{
+	uint32_t count = min_u64(gt.prim.vertex_count - vid, 8);
+
+	t->vid.ireg = _mm256_add_epi32(range.ireg, _mm256_set1_epi32(vid));
+
 	for (uint32_t c = 0; c < count; c++) {
 		void *entry = alloc_urb_entry(&gt.vs.urb);
 		t->buffer.vue_handles.ud[c] = urb_entry_to_handle(entry);
 	}
 
-	grf[1].ireg = t->buffer.vue_handles.ireg;
+	run_vs(t, iid, count);
 
-	if (gt.vs.statistics)
-		gt.vs_invocation_count++;
+	/* FIXME: Cut index: ia_state_flush(), ia_state_cut(); else add... */
+	for (uint32_t c = 0; c < count; c++)
+		ia_state_add(state, urb_handle_to_entry(t->buffer.vue_handles.ud[c]));
 
-	gt.vs.avx_shader(&t->t);
+	ksim_assert(state->head - state->tail <= 64);
+}
 
-	flush_to_vues(&t->buffer, count, state);
+/* Post-transform vertex cache for indexed draws. We fetch the
+ * indices on the CPU and look them up in a direct-mapped cache of VS
+ * URB entries. Only misses get a channel in the next VS thread, a hit
+ * just takes another reference to the cached entry. The cache holds a
+ * reference to each entry it knows about and is flushed between
+ * instances, since instanced elements make the VS output depend on
+ * the instance id too. */
+#define VERTEX_CACHE_SIZE 64
+
+static struct {
+	uint32_t index;
+	struct value *vue;
+} vertex_cache[VERTEX_CACHE_SIZE];
+
+static void
+flush_vertex_cache(void)
+{
+	for (uint32_t i = 0; i < ARRAY_LENGTH(vertex_cache); i++) {
+		if (vertex_cache[i].vue != NULL)
+			free_urb_entry(&gt.vs.urb, vertex_cache[i].vue);
+		vertex_cache[i].vue = NULL;
+	}
+}
+
+static uint32_t
+fetch_index(struct vs_thread *t, uint32_t i)
+{
+	/* Reads outside the index buffer return 0. */
+	switch (gt.vf.ib.format) {
+	case INDEX_BYTE:
+		if (i >= t->index_buffer_size)
+			return 0;
+		return ((uint8_t *) t->index_buffer)[i];
+	case INDEX_WORD:
+		if (i >= t->index_buffer_size / 2)
+			return 0;
+		return ((uint16_t *) t->index_buffer)[i];
+	case INDEX_DWORD:
+		if (i >= t->index_buffer_size / 4)
+			return 0;
+		return ((uint32_t *) t->index_buffer)[i];
+	default:
+		stub("index format %d", gt.vf.ib.format);
+		return 0;
+	}
+}
+
+/* Adds index buffer slots to the ia state, starting at vid, until we
+ * have 8 vertices to shade or have added 32 slots. Returns the next
+ * slot to add. */
+static uint32_t
+dispatch_indexed_vs(struct vs_thread *t, uint32_t iid, uint32_t vid, struct ia_state *state)
+{
+	const uint32_t end = min_u64(gt.prim.vertex_count, vid + 32);
+	uint32_t count = 0;
+
+	while (vid < end && count < 8) {
+		uint32_t index = fetch_index(t, gt.prim.start_vertex + vid++) +
+			gt.prim.base_vertex;
+		uint32_t slot = index & (ARRAY_LENGTH(vertex_cache) - 1);
+
+		if (vertex_cache[slot].vue == NULL ||
+		    vertex_cache[slot].index != index) {
+			if (vertex_cache[slot].vue != NULL) {
+				free_urb_entry(&gt.vs.urb, vertex_cache[slot].vue);
+				vertex_cache[slot].vue = NULL;
+			}
+
+			/* Entries the cache holds on to may be all that
+			 * keeps the URB full, give them back. */
+			if (urb_full(&gt.vs.urb))
+				flush_vertex_cache();
+
+			vertex_cache[slot].index = index;
+			vertex_cache[slot].vue = alloc_urb_entry(&gt.vs.urb);
+			t->vid.ud[count] = index;
+			t->buffer.vue_handles.ud[count] =
+				urb_entry_to_handle(vertex_cache[slot].vue);
+			count++;
+		}
+
+		/* The VUE is written by run_vs() below, before
+		 * ia_state_flush() looks at it. */
+		ref_urb_entry(vertex_cache[slot].vue);
+		ia_state_add(state, vertex_cache[slot].vue);
+	}
+
+	ksim_assert(state->head - state->tail <= 64);
+
+	if (count > 0)
+		run_vs(t, iid, count);
+
+	return vid;
 }
 
 static void
@@ -164,6 +304,9 @@ void
 prim_queue_init(struct prim_queue *q, enum GEN9_3D_Prim_Topo_Type topology, struct urb *urb)
 {
 	switch (topology) {
+	case _3DPRIM_POINTLIST:
+		q->prim_size = 1;
+		break;
 	case _3DPRIM_LINELIST:
 	case _3DPRIM_LINESTRIP:
 	case _3DPRIM_LINELOOP:
@@ -200,12 +343,13 @@ prim_queue_flush_to_wm(struct prim_queue *q)
 		struct value **vue = q->prim[i];
 		for (int j = 0; j < q->prim_size; j++) {
 			if (vue[j][0].header.clip_flags)
-				goto trivial_reject;
+				goto clip;
 		}
 
 		rasterize_primitive(vue, q->topology);
-	trivial_reject:
-		;
+		continue;
+	clip:
+		clip_primitive(vue, q->prim_size, q->topology);
 	}
 }
 
@@ -367,6 +511,14 @@ ia_state_flush(struct ia_state *s, struct prim_queue *q)
 		}
 		break;
 
+	case _3DPRIM_POINTLIST:
+		while (s->head - s->tail >= 1) {
+			vue[0] = ia_state_peek(s, s->tail + 0);
+			prim_queue_add(q, vue, 0);
+			s->tail += 1;
+		}
+		break;
+
 	case _3DPRIM_LINELIST:
 		while (s->head - s->tail >= 2) {
 			vue[0] = ia_state_peek(s, s->tail + 0);
@@ -561,44 +713,14 @@ emit_vertex_fetch(struct kir_program *prog)
 {
 	kir_program_comment(prog, "vertex fetch");
 
+	/* For indexed draws, dispatch_indexed_vs() has already looked
+	 * up the index for each channel. */
 	struct kir_reg vid = kir_program_load_v8(prog, offsetof(struct vs_thread, vid));
-	if (gt.prim.start_vertex > 0) {
+	if (gt.prim.access_type == SEQUENTIAL && gt.prim.start_vertex > 0) {
 		kir_program_load_uniform(prog, offsetof(struct vs_thread, start_vertex));
 		vid = kir_program_alu(prog, kir_addd, vid, prog->dst);
 	}
 
-	if (gt.prim.access_type == RANDOM) {
-		kir_program_comment(prog, "vertex fetch: index buffer fetch");
-
-		/* FIXME: INDEX_BYTE and INDEX_WORD can read outside
-		 * the index buffer. */
-		uint64_t range;
-		void *index_buffer = map_gtt_offset(gt.vf.ib.address, &range);
-		struct kir_reg dst, base;
-
-		base = kir_program_set_load_base_imm(prog, index_buffer);
-		switch (gt.vf.ib.format) {
-		case INDEX_BYTE:
-			dst = emit_gather(prog, base, vid, 1, 0);
-			dst = kir_program_alu(prog, kir_shli, dst, 24);
-			dst = kir_program_alu(prog, kir_shri, dst, 24);
-			break;
-		case INDEX_WORD:
-			dst = emit_gather(prog, base, vid, 2, 0);
-			dst = kir_program_alu(prog, kir_shli, dst, 16);
-			dst = kir_program_alu(prog, kir_shri, dst, 16);
-			break;
-		case INDEX_DWORD:
-			dst = emit_gather(prog, base, vid, 4, 0);
-			break;
-		}
-
-		if (gt.prim.base_vertex > 0) {
-			kir_program_load_uniform(prog, offsetof(struct vs_thread, base_vertex));
-			dst = kir_program_alu(prog, kir_addd, dst, prog->dst);
-		}
-		vid = dst;
-	}
 
 	for (uint32_t i = 0; i < gt.vf.ve_count; i++) {
 		struct ve *ve = &gt.vf.ve[i];
@@ -754,21 +876,62 @@ emit_clip_test(struct kir_program *prog, uint32_t base)
 {
 	kir_program_comment(prog, "clip tests");
 
-	struct kir_reg x0 = kir_program_load_uniform(prog, vue_offset(base, clip.x0));
-	struct kir_reg x1 = kir_program_load_uniform(prog, vue_offset(base, clip.x1));
-	struct kir_reg y0 = kir_program_load_uniform(prog, vue_offset(base, clip.y0));
-	struct kir_reg y1 = kir_program_load_uniform(prog, vue_offset(base, clip.y1));
+	/* We test in homogeneous clip space before the perspective
+	 * divide, so that vertices behind the eye get flagged too.
+	 * Flagged primitives go through clip_primitive(), which
+	 * must test against the same planes. */
 	struct kir_reg x = kir_program_load_v8(prog, vue_offset(base, x));
 	struct kir_reg y = kir_program_load_v8(prog, vue_offset(base, y));
+	struct kir_reg z = kir_program_load_v8(prog, vue_offset(base, z));
+	struct kir_reg w, f;
+
+	if (gt.clip.perspective_divide_disable)
+		w = kir_program_immf(prog, 1.0f);
+	else
+		w = kir_program_load_v8(prog, vue_offset(base, w));
 
-	struct kir_reg x0f = kir_program_alu(prog, kir_cmpf, x0, x, _CMP_LT_OS);
-	struct kir_reg x1f = kir_program_alu(prog, kir_cmpf, x1, x, _CMP_GT_OS);
-	struct kir_reg y0f = kir_program_alu(prog, kir_cmpf, y0, y, _CMP_LT_OS);
-	struct kir_reg y1f = kir_program_alu(prog, kir_cmpf, y1, y, _CMP_GT_OS);
+	f = kir_program_immd(prog, 0);
 
-	struct kir_reg xf = kir_program_alu(prog, kir_or, x0f, x1f);
-	struct kir_reg yf = kir_program_alu(prog, kir_or, y0f, y1f);
-	struct kir_reg f = kir_program_alu(prog, kir_or, xf, yf);
+	if (gt.clip.guardband_clip_test_enable ||
+	    gt.clip.viewport_clip_test_enable) {
+		struct kir_reg x0 = kir_program_load_uniform(prog, vue_offset(base, clip.x0));
+		struct kir_reg x1 = kir_program_load_uniform(prog, vue_offset(base, clip.x1));
+		struct kir_reg y0 = kir_program_load_uniform(prog, vue_offset(base, clip.y0));
+		struct kir_reg y1 = kir_program_load_uniform(prog, vue_offset(base, clip.y1));
+
+		x0 = kir_program_alu(prog, kir_mulf, x0, w);
+		x1 = kir_program_alu(prog, kir_mulf, x1, w);
+		y0 = kir_program_alu(prog, kir_mulf, y0, w);
+		y1 = kir_program_alu(prog, kir_mulf, y1, w);
+
+		struct kir_reg x0f = kir_program_alu(prog, kir_cmpf, x0, x, _CMP_LT_OS);
+		struct kir_reg x1f = kir_program_alu(prog, kir_cmpf, x1, x, _CMP_GT_OS);
+		struct kir_reg y0f = kir_program_alu(prog, kir_cmpf, y0, y, _CMP_LT_OS);
+		struct kir_reg y1f = kir_program_alu(prog, kir_cmpf, y1, y, _CMP_GT_OS);
+
+		struct kir_reg xf = kir_program_alu(prog, kir_or, x0f, x1f);
+		struct kir_reg yf = kir_program_alu(prog, kir_or, y0f, y1f);
+		f = kir_program_alu(prog, kir_or, xf, yf);
+	}
+
+	if (gt.clip.viewport_znear_clip_test_enable) {
+		struct kir_reg near;
+
+		if (gt.clip.api_mode == APIMODE_OGL) {
+			struct kir_reg zero = kir_program_immf(prog, 0.0f);
+			near = kir_program_alu(prog, kir_subf, zero, w);
+		} else {
+			near = kir_program_immf(prog, 0.0f);
+		}
+
+		struct kir_reg nf = kir_program_alu(prog, kir_cmpf, near, z, _CMP_LT_OS);
+		f = kir_program_alu(prog, kir_or, f, nf);
+	}
+
+	if (gt.clip.viewport_zfar_clip_test_enable) {
+		struct kir_reg ff = kir_program_alu(prog, kir_cmpf, w, z, _CMP_GT_OS);
+		f = kir_program_alu(prog, kir_or, f, ff);
+	}
 
 	kir_program_store_v8(prog, vue_offset(base, clip_flags), f);
 }
@@ -801,13 +964,15 @@ emit_viewport_transform(struct kir_program *prog, uint32_t base)
 void
 emit_vertex_post_processing(struct kir_program *prog, uint32_t base)
 {
-	if (!gt.clip.perspective_divide_disable)
-		emit_perspective_divide(prog, base);
-
 	if (gt.clip.guardband_clip_test_enable ||
-	    gt.clip.viewport_clip_test_enable)
+	    gt.clip.viewport_clip_test_enable ||
+	    gt.clip.viewport_znear_clip_test_enable ||
+	    gt.clip.viewport_zfar_clip_test_enable)
 		emit_clip_test(prog, base);
 
+	if (!gt.clip.perspective_divide_disable)
+		emit_perspective_divide(prog, base);
+
 	if (gt.sf.viewport_transform_enable)
 		emit_viewport_transform(prog, base);
 }
@@ -886,6 +1051,13 @@ init_vs_thread(struct vs_thread *t)
 	t->base_vertex = gt.prim.base_vertex;
 	t->start_instance = gt.prim.start_instance;
 
+	if (gt.prim.access_type == RANDOM) {
+		uint64_t range;
+
+		t->index_buffer = map_gtt_offset(gt.vf.ib.address, &range);
+		t->index_buffer_size = min_u64(gt.vf.ib.size, range);
+	}
+
 	init_vue_buffer(&t->buffer);
 
 	load_constants(&t->t, &gt.vs.curbe);
@@ -925,6 +1097,8 @@ dispatch_primitive(void)
 	uint64_t range;
 	gt.depth.hiz_buffer = map_gtt_offset(gt.depth.hiz_address, &range);
 	gt.depth.buffer = map_gtt_offset(gt.depth.address, &range);
+	if (gt.stencil.enable)
+		gt.stencil.buffer = map_gtt_offset(gt.stencil.address, &range);
 
 	/* Configure csr to round toward zero to make vcvtps2dq match
 	 * the GEN EU behavior when converting from float to int. This
@@ -963,8 +1137,13 @@ dispatch_primitive(void)
 	prim_queue_init(&pq, gt.ia.topology, &gt.vs.urb);
 
 	for (uint32_t iid = 0; iid < gt.prim.instance_count; iid++) {
-		for (uint32_t i = 0; i < gt.prim.vertex_count; i += 8) {
-			dispatch_vs(&t, iid, i, &state);
+		for (uint32_t i = 0; i < gt.prim.vertex_count; ) {
+			if (gt.prim.access_type == RANDOM) {
+				i = dispatch_indexed_vs(&t, iid, i, &state);
+			} else {
+				dispatch_vs(&t, iid, i, &state);
+				i += 8;
+			}
 
 			tail = ia_state_flush(&state, &pq);
 			for (uint32_t i = tail; i < state.tail; i++)
@@ -974,6 +1153,9 @@ dispatch_primitive(void)
 		tail = ia_state_cut(&state, &pq);
 		for (uint32_t i = tail; i < state.tail; i++)
 			prim_queue_free_vue(&pq, ia_state_peek(&state, i));
+
+		if (gt.prim.access_type == RANDOM)
+			flush_vertex_cache();
 	}
 
 	prim_queue_flush(&pq);
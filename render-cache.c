@@ -26,680 +26,847 @@
 #include "eu.h"
 #include "kir.h"
 
+/* SIMD16 writes are split into two SIMD8 writes. The color payload
+ * then has the upper and lower halves of each channel in consecutive
+ * registers, so channels are stride registers apart. The quarter
+ * selects which 8 channels of the dispatch, and thus which subspans
+ * and pixel mask, the write covers. */
 struct sfid_render_cache_args {
 	int src;
+	int stride;
+	int quarter;
 	struct surface rt;
+	bool tile_buffer;
+	void (*write)(struct thread *t, const struct sfid_render_cache_args *args);
 };
 
-static inline void
-blend_unorm8_argb(struct reg *src, __m256i dst_argb)
+/* Subspan coordinates are in g1.2-5, and g2.2-5 for SIMD32. */
+static inline int
+subspan_x(const struct thread *t, int subspan)
 {
-	if (gt.blend.enable) {
-		const __m256i mask = _mm256_set1_epi32(0xff);
-		const __m256 scale = _mm256_set1_ps(1.0f / 255.0f);
-		struct reg dst[4];
-
-		/* Convert to float */
-		dst[2].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(dst_argb, mask)), scale);
-		dst_argb = _mm256_srli_epi32(dst_argb, 8);
-		dst[1].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(dst_argb, mask)), scale);
-		dst_argb = _mm256_srli_epi32(dst_argb, 8);
-		dst[0].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(dst_argb, mask)), scale);
-		dst_argb = _mm256_srli_epi32(dst_argb, 8);
-		dst[3].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(dst_argb, mask)), scale);
-
-		/* Blend, assuming src BLENDFACTOR_SRC_ALPHA, dst
-		 * BLENDFACTOR_INV_SRC_ALPHA, and BLENDFUNCTION_ADD. */
-		const __m256 inv_alpha = _mm256_sub_ps(_mm256_set1_ps(1.0f), src[3].reg);
-		src[0].reg = _mm256_add_ps(_mm256_mul_ps(src[3].reg, src[0].reg),
-					   _mm256_mul_ps(inv_alpha, dst[0].reg));
-		src[1].reg = _mm256_add_ps(_mm256_mul_ps(src[3].reg, src[1].reg),
-					   _mm256_mul_ps(inv_alpha, dst[1].reg));
-		src[2].reg = _mm256_add_ps(_mm256_mul_ps(src[3].reg, src[2].reg),
-					   _mm256_mul_ps(inv_alpha, dst[2].reg));
-		src[3].reg = _mm256_add_ps(_mm256_mul_ps(src[3].reg, src[3].reg),
-					   _mm256_mul_ps(inv_alpha, dst[3].reg));
-	}
+	return t->grf[1 + subspan / 4].uw[4 + (subspan & 3) * 2];
 }
 
-__m256 _ZGVdN8vv_powf(__m256 x, __m256 y);
-
-static inline void
-gamma_correct(enum GEN9_SURFACE_FORMAT format, struct reg *c)
+static inline int
+subspan_y(const struct thread *t, int subspan)
 {
-	if (srgb_format(format)) {
-		const __m256 inv_gamma = _mm256_set1_ps(1.0f / 2.4f);
-		c[0].reg = _ZGVdN8vv_powf(c[0].reg, inv_gamma);
-		c[1].reg = _ZGVdN8vv_powf(c[1].reg, inv_gamma);
-		c[2].reg = _ZGVdN8vv_powf(c[2].reg, inv_gamma);
-	}
+	return t->grf[1 + subspan / 4].uw[5 + (subspan & 3) * 2];
 }
 
+enum message_type {
+	MSD_RTW = 0x0c,
+	MSD_RTR = 0x0d,
+};
+
+enum message_subtype {
+	MESSAGE_SUBTYPE_SIMD16,
+	MESSAGE_SUBTYPE_SIMD16_REPDATA,
+	MESSAGE_SUBTYPE_SIMD8_DUALSRC_LO,
+	MESSAGE_SUBTYPE_SIMD8_DUALSRC_HI,
+	MESSAGE_SUBTYPE_SIMD8_LO,
+	MESSAGE_SUBTYPE_SIMD16_REPDATA_TILED = 7
+};
+
+struct message_descriptor {
+	/* Vol 2a, "MSD_RTW*" (p473+) */
+	uint32_t		binding_table_index;
+	enum message_subtype	message_subtype;
+	uint32_t		slot_group;
+	bool			last_rt;
+	bool			per_sample;
+	enum message_type	message_type;
+	bool			header_present;
+	uint32_t		response_length;
+	uint32_t		message_length;
+	uint32_t		data_format;
+	bool			eot;
+};
+
+/* Multisampled render targets use the MSS layout where each sample
+ * is its own array slice. Pixels that have all their samples covered
+ * write the same color to every slice with the pixel mask as is, and
+ * only partially covered blocks narrow the mask per sample. */
 static void
-sfid_render_cache_rt_write_rep16_bgra_unorm8_xmajor(struct thread *t,
-						    const struct sfid_render_cache_args *args)
+sfid_render_cache_rt_write_samples(struct thread *t,
+				   const struct sfid_render_cache_args *args)
 {
-	const __m128 scale = _mm_set1_ps(255.0f);
-	const __m128 half =  _mm_set1_ps(0.5f);
-	struct reg src[1];
+	struct sfid_render_cache_args sample_args = *args;
+	const __m256i mask = t->mask[0].q[args->quarter];
+	const __m256i coverage = t->coverage.q[args->quarter];
+	const __m256i all = _mm256_set1_epi32((1 << args->rt.samples) - 1);
+	const __m256i covered =
+		_mm256_cmpeq_epi32(_mm256_and_si256(coverage, all), all);
+	const bool full = _mm256_testc_si256(covered, mask);
+
+	for (int s = 0; s < args->rt.samples; s++) {
+		const __m256i bit = _mm256_set1_epi32(1 << s);
+
+		sample_args.rt.minimum_array_element =
+			args->rt.minimum_array_element * args->rt.samples + s;
+		if (!full)
+			t->mask[0].q[args->quarter] =
+				_mm256_and_si256(mask,
+						 _mm256_cmpeq_epi32(_mm256_and_si256(coverage, bit), bit));
+		args->write(t, &sample_args);
+	}
 
-	src[0] = t->grf[args->src];
+	t->mask[0].q[args->quarter] = mask;
+}
 
-	if (srgb_format(args->rt.format)) {
-		const __m256 inv_gamma = _mm256_set1_ps(1.0f / 2.4f);
-		src[0].reg = _ZGVdN8vv_powf(src[0].reg, inv_gamma);
-		/* Don't gamma correct alpha */
-		src[0].f[3] = t->grf[args->src].f[3];
+static inline uint32_t
+rt_offset(const struct surface *rt, int x, int y)
+{
+	switch (rt->tile_mode) {
+	case LINEAR:
+		return x * rt->cpp + y * rt->stride;
+	case XMAJOR:
+		return xmajor_offset(rt->pixels, x, y, rt->stride, rt->cpp) - rt->pixels;
+	case YMAJOR:
+		return ymajor_offset(rt->pixels, x, y, rt->stride, rt->cpp) - rt->pixels;
+	default:
+		stub("rt read tile mode %d", rt->tile_mode);
+		return 0;
 	}
+}
 
-	__m128 bgra = _mm_shuffle_ps(_mm256_castps256_ps128(src[0].reg),
-				     _mm256_castps256_ps128(src[0].reg),
-				     SWIZZLE(2, 1, 0, 3));
+/* Offset of pixel x, y from args->rt.pixels, which is color_tile for
+ * writes that go to the tile buffer. */
+static inline uint32_t
+pixel_offset(const struct sfid_render_cache_args *args, int x, int y)
+{
+	if (args->tile_buffer)
+		return ((y & 31) * 32 + (x & 31)) * args->rt.cpp;
 
-	bgra = _mm_mul_ps(bgra, scale);
-	bgra = _mm_add_ps(bgra, half);
+	return rt_offset(&args->rt, x, y);
+}
 
-	__m128i bgra_i = _mm_cvtps_epi32(bgra);
-	bgra_i = _mm_packus_epi32(bgra_i, bgra_i);
-	bgra_i = _mm_packus_epi16(bgra_i, bgra_i);
+/* Read the render target pixels under the two subspans of the
+ * quarter back into rt_dst, in the same float or integer form as the
+ * color payload. */
+static void
+sfid_render_cache_rt_read(struct thread *t,
+			  const struct sfid_render_cache_args *args)
+{
+	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
+	struct reg offsets;
 
-	/* Swizzle two middle mask pairs so that dword 0-3 and 4-7
-	 * form linear owords of pixels. */
-	__m256i mask = _mm256_permute4x64_epi64(t->mask[0].q[0], SWIZZLE(0, 2, 1, 3));
+	for (int c = 0; c < 8; c++) {
+		const int subspan = args->quarter * 2 + c / 4;
+		const int x = subspan_x(t, subspan) + (c & 1);
+		const int y = subspan_y(t, subspan) + ((c >> 1) & 1) + slice_y;
 
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x0 = t->grf[1].uw[4];
-	const int y0 = t->grf[1].uw[5] + slice_y;
-	const int cpp = 4;
-	void *base0 = xmajor_offset(args->rt.pixels, x0,  y0, args->rt.stride, cpp);
+		offsets.ud[c] = pixel_offset(args, x, y);
+	}
 
-	_mm_maskstore_epi32(base0, _mm256_extractf128_si256(mask, 0), bgra_i);
-	_mm_maskstore_epi32(base0 + 512, _mm256_extractf128_si256(mask, 1), bgra_i);
+	load_format_simd8(args->rt.pixels, args->rt.format, offsets.ireg,
+			  t->mask[0].q[args->quarter], t->rt_dst, 4);
+}
 
-	const int x1 = t->grf[1].uw[8];
-	const int y1 = t->grf[1].uw[9] + slice_y;
-	void *base1 = xmajor_offset(args->rt.pixels, x1,  y1, args->rt.stride, 4);
+static bool
+integer_format(enum GEN9_SURFACE_FORMAT format)
+{
+	const struct format_layout *layout = format_layout(format);
 
-	__m256i mask1 = _mm256_permute4x64_epi64(t->mask[0].q[1], SWIZZLE(0, 2, 1, 3));
-	_mm_maskstore_epi32(base1, _mm256_extractf128_si256(mask1, 0), bgra_i);
-	_mm_maskstore_epi32(base1 + 512, _mm256_extractf128_si256(mask1, 1), bgra_i);
+	return layout &&
+		(layout->type == FORMAT_UINT || layout->type == FORMAT_SINT);
 }
 
-static void
-sfid_render_cache_rt_write_rep16_rgba_unorm8_ymajor(struct thread *t,
-						    const struct sfid_render_cache_args *args)
+static struct kir_reg
+emit_not(struct kir_program *prog, struct kir_reg reg)
 {
-	const __m128 scale = _mm_set1_ps(255.0f);
-	const __m128 half =  _mm_set1_ps(0.5f);
-	struct reg src[1];
+	kir_program_immd(prog, -1);
+	return kir_program_alu(prog, kir_xor, reg, prog->dst);
+}
 
-	src[0] = t->grf[args->src];
+static struct kir_reg
+emit_clamp(struct kir_program *prog, struct kir_reg reg, float min, float max)
+{
+	reg = kir_program_alu(prog, kir_maxf, reg, kir_program_immf(prog, min));
+	return kir_program_alu(prog, kir_minf, reg, kir_program_immf(prog, max));
+}
+
+/* Scale a normalized channel to max and convert to integer, rounding
+ * to nearest. The shaders run with the csr set to round toward zero,
+ * so vcvtps2dq alone would truncate. */
+static struct kir_reg
+emit_scale_to_int(struct kir_program *prog, struct kir_reg reg, uint32_t max)
+{
+	reg = kir_program_alu(prog, kir_mulf, reg, kir_program_immf(prog, max));
+	reg = kir_program_alu(prog, kir_rnde, reg);
+	return kir_program_alu(prog, kir_ps2d, reg);
+}
 
-	if (srgb_format(args->rt.format)) {
-		const __m256 inv_gamma = _mm256_set1_ps(1.0f / 2.4f);
-		src[0].reg = _ZGVdN8vv_powf(src[0].reg, inv_gamma);
-		/* Don't gamma correct alpha */
-		src[0].f[3] = t->grf[args->src].f[3];
+static struct kir_reg
+emit_color_clamp(struct kir_program *prog, struct kir_reg reg,
+		 enum GEN9_Color_Clamp range)
+{
+	switch (range) {
+	case COLORCLAMP_UNORM:
+		return emit_clamp(prog, reg, 0.0f, 1.0f);
+	case COLORCLAMP_SNORM:
+		return emit_clamp(prog, reg, -1.0f, 1.0f);
+	default:
+		/* The render target writes clamp to the range of the
+		 * format when they convert. */
+		return reg;
 	}
+}
 
-	__m128 rgba = _mm256_castps256_ps128(src[0].reg);
+static struct kir_reg
+emit_blend_factor(struct kir_program *prog,
+		  enum GEN9_3D_Color_Buffer_Blend_Factor factor,
+		  const struct kir_reg *src, const struct kir_reg *dst, int c)
+{
+	switch (factor) {
+	case BLENDFACTOR_ZERO:
+		return kir_program_immf(prog, 0.0f);
+	case BLENDFACTOR_ONE:
+		return kir_program_immf(prog, 1.0f);
+	case BLENDFACTOR_SRC_COLOR:
+		return src[c];
+	case BLENDFACTOR_SRC_ALPHA:
+		return src[3];
+	case BLENDFACTOR_DST_ALPHA:
+		return dst[3];
+	case BLENDFACTOR_DST_COLOR:
+		return dst[c];
+	case BLENDFACTOR_SRC_ALPHA_SATURATE:
+		if (c == 3)
+			return kir_program_immf(prog, 1.0f);
+		kir_program_alu(prog, kir_subf, kir_program_immf(prog, 1.0f), dst[3]);
+		return kir_program_alu(prog, kir_minf, src[3], prog->dst);
+	case BLENDFACTOR_CONST_COLOR:
+		return kir_program_immf(prog, gt.cc.blend_constant[c]);
+	case BLENDFACTOR_CONST_ALPHA:
+		return kir_program_immf(prog, gt.cc.blend_constant[3]);
+	case BLENDFACTOR_INV_SRC_COLOR:
+	case BLENDFACTOR_INV_SRC_ALPHA:
+	case BLENDFACTOR_INV_DST_ALPHA:
+	case BLENDFACTOR_INV_DST_COLOR:
+	case BLENDFACTOR_INV_CONST_COLOR:
+	case BLENDFACTOR_INV_CONST_ALPHA:
+	case BLENDFACTOR_INV_SRC1_COLOR:
+	case BLENDFACTOR_INV_SRC1_ALPHA: {
+		/* The inverted factors are 16 after the regular ones. */
+		struct kir_reg f = emit_blend_factor(prog, factor - 16, src, dst, c);
+		return kir_program_alu(prog, kir_subf, kir_program_immf(prog, 1.0f), f);
+	}
+	case BLENDFACTOR_SRC1_COLOR:
+	case BLENDFACTOR_SRC1_ALPHA:
+		stub("dual source blending");
+		return kir_program_immf(prog, 1.0f);
+	default:
+		stub("blend factor %d", factor);
+		return kir_program_immf(prog, 1.0f);
+	}
+}
 
-	rgba = _mm_mul_ps(rgba, scale);
-	rgba = _mm_add_ps(rgba, half);
+static struct kir_reg
+emit_blend_function(struct kir_program *prog,
+		    enum GEN9_3D_Color_Buffer_Blend_Function function,
+		    enum GEN9_3D_Color_Buffer_Blend_Factor src_factor,
+		    enum GEN9_3D_Color_Buffer_Blend_Factor dst_factor,
+		    const struct kir_reg *src, const struct kir_reg *dst, int c)
+{
+	struct kir_reg sf, df, term;
+
+	/* Min and max ignore the blend factors. */
+	switch (function) {
+	case BLENDFUNCTION_MIN:
+		return kir_program_alu(prog, kir_minf, src[c], dst[c]);
+	case BLENDFUNCTION_MAX:
+		return kir_program_alu(prog, kir_maxf, src[c], dst[c]);
+	default:
+		break;
+	}
 
-	__m128i rgba_i = _mm_cvtps_epi32(rgba);
-	rgba_i = _mm_packus_epi32(rgba_i, rgba_i);
-	rgba_i = _mm_packus_epi16(rgba_i, rgba_i);
+	sf = emit_blend_factor(prog, src_factor, src, dst, c);
+	df = emit_blend_factor(prog, dst_factor, src, dst, c);
+
+	switch (function) {
+	case BLENDFUNCTION_ADD:
+		term = kir_program_alu(prog, kir_mulf, src[c], sf);
+		return kir_program_alu(prog, kir_maddf, dst[c], df, term);
+	case BLENDFUNCTION_SUBTRACT:
+		term = kir_program_alu(prog, kir_mulf, src[c], sf);
+		return kir_program_alu(prog, kir_nmaddf, dst[c], df, term);
+	case BLENDFUNCTION_REVERSE_SUBTRACT:
+		term = kir_program_alu(prog, kir_mulf, dst[c], df);
+		return kir_program_alu(prog, kir_nmaddf, src[c], sf, term);
+	default:
+		stub("blend function %d", function);
+		return src[c];
+	}
+}
 
-	/* Swizzle two middle mask pairs so that dword 0-3 and 4-7
-	 * form linear owords of pixels. */
-	__m256i mask0 = _mm256_permute4x64_epi64(t->mask[0].q[0], SWIZZLE(0, 2, 1, 3));
+static struct kir_reg
+emit_logic_op(struct kir_program *prog, enum GEN9_3D_Logic_Op_Function op,
+	      struct kir_reg s, struct kir_reg d)
+{
+	switch (op) {
+	case LOGICOP_CLEAR:
+		return kir_program_immd(prog, 0);
+	case LOGICOP_NOR:
+		return emit_not(prog, kir_program_alu(prog, kir_or, s, d));
+	case LOGICOP_AND_INVERTED:
+		return kir_program_alu(prog, kir_andn, d, s);
+	case LOGICOP_COPY_INVERTED:
+		return emit_not(prog, s);
+	case LOGICOP_AND_REVERSE:
+		return kir_program_alu(prog, kir_andn, s, d);
+	case LOGICOP_INVERT:
+		return emit_not(prog, d);
+	case LOGICOP_XOR:
+		return kir_program_alu(prog, kir_xor, s, d);
+	case LOGICOP_NAND:
+		return emit_not(prog, kir_program_alu(prog, kir_and, s, d));
+	case LOGICOP_AND:
+		return kir_program_alu(prog, kir_and, s, d);
+	case LOGICOP_EQUIV:
+		return emit_not(prog, kir_program_alu(prog, kir_xor, s, d));
+	case LOGICOP_NOOP:
+		return d;
+	case LOGICOP_OR_INVERTED:
+		return kir_program_alu(prog, kir_or, emit_not(prog, s), d);
+	case LOGICOP_COPY:
+		return s;
+	case LOGICOP_OR_REVERSE:
+		return kir_program_alu(prog, kir_or, s, emit_not(prog, d));
+	case LOGICOP_OR:
+		return kir_program_alu(prog, kir_or, s, d);
+	case LOGICOP_SET:
+	default:
+		return kir_program_immd(prog, -1);
+	}
+}
 
-	const int cpp = 4;
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x0 = t->grf[1].uw[4];
-	const int y0 = t->grf[1].uw[5] + slice_y;
-	void *base0 = ymajor_offset(args->rt.pixels, x0, y0, args->rt.stride, cpp);
+/* Logic ops work on the integer channel values, so unorm colors are
+ * converted to integers and back around the op. */
+static void
+emit_logic_ops(struct kir_program *prog, const struct sfid_render_cache_args *args,
+	       const struct blend_rt *b, struct kir_reg *src, const struct kir_reg *dst)
+{
+	const struct format_layout *layout = format_layout(args->rt.format);
+	const bool unorm = layout && layout->type == FORMAT_UNORM;
 
-	_mm_maskstore_epi32(base0, _mm256_extractf128_si256(mask0, 0), rgba_i);
-	_mm_maskstore_epi32(base0 + 16, _mm256_extractf128_si256(mask0, 1), rgba_i);
+	if (!unorm && !integer_format(args->rt.format)) {
+		stub("logic op on format %d", args->rt.format);
+		return;
+	}
 
-	const int x1 = t->grf[1].uw[8];
-	const int y1 = t->grf[1].uw[9] + slice_y;
-	void *base1 = ymajor_offset(args->rt.pixels, x1, y1, args->rt.stride, cpp);
-	__m256i mask1 = _mm256_permute4x64_epi64(t->mask[0].q[1], SWIZZLE(0, 2, 1, 3));
+	for (int c = 0; c < 4; c++) {
+		const uint32_t max = unorm ? (1 << layout->bits[c]) - 1 : 0;
+		struct kir_reg s = src[c], d = dst[c];
 
-	_mm_maskstore_epi32(base1, _mm256_extractf128_si256(mask1, 0), rgba_i);
-	_mm_maskstore_epi32(base1 + 16, _mm256_extractf128_si256(mask1, 1), rgba_i);
-}
+		if (unorm && max == 0)
+			continue;
 
-static inline __m256i
-to_unorm(__m256 reg, float scale_f)
-{
-	const __m256 scale = _mm256_set1_ps(scale_f);
-	const __m256 one = _mm256_set1_ps(1.0f);
-	const __m256 zero = _mm256_set1_ps(0.0f);
-	const __m256 half =  _mm256_set1_ps(0.5f);
+		if (max > 0) {
+			s = emit_clamp(prog, s, 0.0f, 1.0f);
+			s = emit_scale_to_int(prog, s, max);
+			d = emit_scale_to_int(prog, d, max);
+		}
 
-	const __m256 clamped = _mm256_max_ps(_mm256_min_ps(reg, one), zero);
+		src[c] = emit_logic_op(prog, b->logic_op_function, s, d);
 
-	return _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(clamped, scale), half));
+		if (max > 0) {
+			src[c] = kir_program_alu(prog, kir_and, src[c], kir_program_immd(prog, max));
+			src[c] = kir_program_alu(prog, kir_d2ps, src[c]);
+			src[c] = kir_program_alu(prog, kir_mulf, src[c],
+						 kir_program_immf(prog, 1.0f / max));
+		}
+	}
 }
 
+/* Blending, logic ops and color write masks for a SIMD8 render target
+ * write. We read back the render target and combine it with the color
+ * in src using only the arithmetic the blend state asks for. */
 static void
-sfid_render_cache_rt_write_simd8_bgra_unorm8_xmajor(struct thread *t,
-						    const struct sfid_render_cache_args *args)
+emit_blend(struct kir_program *prog, struct sfid_render_cache_args *args,
+	   const struct blend_rt *b, struct kir_reg *src)
 {
-	__m256i argb;
-	const float scale = 255.0f;
-	struct reg src[4];
+	struct kir_reg dst[4];
 
-	src[0] = t->grf[args->src + 0];
-	src[1] = t->grf[args->src + 1];
-	src[2] = t->grf[args->src + 2];
-	src[3] = t->grf[args->src + 3];
+	if (args->rt.samples > 1) {
+		stub("blending with multisampling");
+		return;
+	}
 
-	const int cpp = 4;
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x = t->grf[1].uw[4];
-	const int y = t->grf[1].uw[5] + slice_y;
-	void *base = xmajor_offset(args->rt.pixels, x, y, args->rt.stride, cpp);
-
-	if (gt.blend.enable) {
-		/* Load unorm8 */
-		__m128i lo = _mm_load_si128(base);
-		__m128i hi = _mm_load_si128(base + 512);
-		__m256i dst_argb = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
-		dst_argb = _mm256_permute4x64_epi64(dst_argb, SWIZZLE(0, 2, 1, 3));
-
-		blend_unorm8_argb(src, dst_argb);
+	kir_program_comment(prog, "blend: read render target");
+	struct kir_insn *insn = kir_program_add_insn(prog, kir_send);
+	insn->send.exec_size = 8;
+	insn->send.src = args->src;
+	insn->send.mlen = 0;
+	insn->send.dst = offsetof(struct thread, rt_dst) / sizeof(struct reg);
+	insn->send.rlen = 4;
+	insn->send.func = (void *) sfid_render_cache_rt_read;
+	insn->send.args = args;
+
+	for (int c = 0; c < 4; c++)
+		dst[c] = kir_program_load_v8(prog, offsetof(struct thread, rt_dst[c]));
+
+	/* Logic ops take precedence over blending and integer formats
+	 * don't blend. */
+	if (b->logic_op_enable) {
+		kir_program_comment(prog, "blend: logic op");
+		emit_logic_ops(prog, args, b, src, dst);
+	} else if (b->enable && !integer_format(args->rt.format)) {
+		kir_program_comment(prog, "blend: blend equation");
+
+		if (b->pre_blend_clamp)
+			for (int c = 0; c < 4; c++)
+				src[c] = emit_color_clamp(prog, src[c], b->clamp_range);
+
+		struct kir_reg blended[4];
+		for (int c = 0; c < 3; c++)
+			blended[c] = emit_blend_function(prog, b->function,
+							 b->src_factor, b->dst_factor,
+							 src, dst, c);
+		blended[3] = emit_blend_function(prog, b->alpha_function,
+						 b->src_alpha_factor, b->dst_alpha_factor,
+						 src, dst, 3);
+
+		for (int c = 0; c < 4; c++) {
+			src[c] = blended[c];
+			if (b->post_blend_clamp)
+				src[c] = emit_color_clamp(prog, src[c], b->clamp_range);
+		}
 	}
 
-	gamma_correct(args->rt.format, src);
-
-	const __m256i r = to_unorm(src[0].reg, scale);
-	const __m256i g = to_unorm(src[1].reg, scale);
-	const __m256i b = to_unorm(src[2].reg, scale);
-	const __m256i a = to_unorm(src[3].reg, scale);
-
-	argb = _mm256_slli_epi32(a, 8);
-	argb = _mm256_or_si256(argb, r);
-	argb = _mm256_slli_epi32(argb, 8);
-	argb = _mm256_or_si256(argb, g);
-	argb = _mm256_slli_epi32(argb, 8);
-	argb = _mm256_or_si256(argb, b);
-
-	/* Swizzle two middle pixel pairs so that dword 0-3 and 4-7
-	 * form linear owords of pixels. */
-	argb = _mm256_permute4x64_epi64(argb, SWIZZLE(0, 2, 1, 3));
-	__m256i mask = _mm256_permute4x64_epi64(t->mask[0].q[0], SWIZZLE(0, 2, 1, 3));
-
-	_mm_maskstore_epi32(base,
-			    _mm256_extractf128_si256(mask, 0),
-			    _mm256_extractf128_si256(argb, 0));
-	_mm_maskstore_epi32(base + 512,
-			    _mm256_extractf128_si256(mask, 1),
-			    _mm256_extractf128_si256(argb, 1));
+	for (int c = 0; c < 4; c++)
+		if (b->write_disable & (1 << c))
+			src[c] = dst[c];
 }
 
+/* Store the pixels packed by emit_pack() to the two subspans of the
+ * quarter. */
 static void
-write_uint8_linear(struct thread *t,
-		   const struct sfid_render_cache_args *args,
-		   __m256i r, __m256i g, __m256i b, __m256i a)
+sfid_render_cache_rt_write(struct thread *t,
+			   const struct sfid_render_cache_args *args)
 {
 	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x = t->grf[1].uw[4];
-	const int y = t->grf[1].uw[5] + slice_y;
-	__m256i rgba;
-
-	rgba = _mm256_slli_epi32(a, 8);
-	rgba = _mm256_or_si256(rgba, b);
-	rgba = _mm256_slli_epi32(rgba, 8);
-	rgba = _mm256_or_si256(rgba, g);
-	rgba = _mm256_slli_epi32(rgba, 8);
-	rgba = _mm256_or_si256(rgba, r);
-
-#define SWIZZLE(x, y, z, w) \
-	( ((x) << 0) | ((y) << 2) | ((z) << 4) | ((w) << 6) )
-
-	/* Swizzle two middle pixel pairs so that dword 0-3 and 4-7
-	 * form linear owords of pixels. */
-	rgba = _mm256_permute4x64_epi64(rgba, SWIZZLE(0, 2, 1, 3));
-	__m256i mask = _mm256_permute4x64_epi64(t->mask[0].q[0], SWIZZLE(0, 2, 1, 3));
-
-	void *base = args->rt.pixels + x * args->rt.cpp + y * args->rt.stride;
-
-	_mm_maskstore_epi32(base,
-			    _mm256_extractf128_si256(mask, 0),
-			    _mm256_extractf128_si256(rgba, 0));
-	_mm_maskstore_epi32(base + args->rt.stride,
-			    _mm256_extractf128_si256(mask, 1),
-			    _mm256_extractf128_si256(rgba, 1));
-}
+	const int x = subspan_x(t, args->quarter * 2);
+	const int y = subspan_y(t, args->quarter * 2) + slice_y;
+	struct reg mask = { .ireg = t->mask[0].q[args->quarter] };
+
+	if (args->tile_buffer)
+		color_tile.dirty = true;
+
+	/* A row of four 32 bpp pixels is an oword in all tilings.
+	 * Swizzle the two middle pixel pairs so that dword 0-3 and 4-7
+	 * form the two rows. */
+	if (args->rt.cpp == 4) {
+		const __m256i pixels =
+			_mm256_permute4x64_epi64(t->rt_pixels[0].ireg, SWIZZLE(0, 2, 1, 3));
+		mask.ireg = _mm256_permute4x64_epi64(mask.ireg, SWIZZLE(0, 2, 1, 3));
+
+		_mm_maskstore_epi32(args->rt.pixels + pixel_offset(args, x, y),
+				    _mm256_extractf128_si256(mask.ireg, 0),
+				    _mm256_extractf128_si256(pixels, 0));
+		_mm_maskstore_epi32(args->rt.pixels + pixel_offset(args, x, y + 1),
+				    _mm256_extractf128_si256(mask.ireg, 1),
+				    _mm256_extractf128_si256(pixels, 1));
+		return;
+	}
 
-static void
-sfid_render_cache_rt_write_simd8_rgba_unorm8_linear(struct thread *t,
-						    const struct sfid_render_cache_args *args)
-{
-	const float scale = 255.0f;
-	const struct reg *src = &t->grf[args->src];
+	for (int c = 0; c < 8; c++) {
+		if (mask.d[c] == 0)
+			continue;
 
-	const __m256i r = to_unorm(src[0].reg, scale);
-	const __m256i g = to_unorm(src[1].reg, scale);
-	const __m256i b = to_unorm(src[2].reg, scale);
-	const __m256i a = to_unorm(src[3].reg, scale);
+		const int px = x + (c & 1) + (c / 4) * 2;
+		const int py = y + ((c >> 1) & 1);
+		void *p = args->rt.pixels + pixel_offset(args, px, py);
 
-	write_uint8_linear(t, args, r, g, b, a);
+		switch (args->rt.cpp) {
+		case 1:
+			*(uint8_t *) p = t->rt_pixels[0].ud[c];
+			break;
+		case 2:
+			*(uint16_t *) p = t->rt_pixels[0].ud[c];
+			break;
+		default:
+			for (int i = 0; i < args->rt.cpp / 4; i++)
+				((uint32_t *) p)[i] = t->rt_pixels[i].ud[c];
+			break;
+		}
+	}
 }
 
-static void
-sfid_render_cache_rt_write_simd8_rgba_uint8_linear(struct thread *t,
-						   const struct sfid_render_cache_args *args)
+/* Convert one channel to its bits in the pixel, still at bit 0. */
+static struct kir_reg
+emit_pack_channel(struct kir_program *prog, const struct format_layout *layout,
+		  int c, struct kir_reg v)
 {
-	__m256i r, g, b, a;
-	struct reg *src = &t->grf[args->src];
+	const uint32_t bits = layout->bits[c];
+	const uint32_t max = bits == 32 ? ~0u : (1u << bits) - 1;
 
-	r = src[0].ireg;
-	g = src[1].ireg;
-	b = src[2].ireg;
-	a = src[3].ireg;
+	switch (layout->type) {
+	case FORMAT_UNORM:
+		v = emit_clamp(prog, v, 0.0f, 1.0f);
+		v = emit_scale_to_int(prog, v, max);
+		break;
+	case FORMAT_SNORM:
+		/* Round to nearest is symmetric around 0, unlike adding
+		 * 0.5 before truncating. */
+		v = emit_clamp(prog, v, -1.0f, 1.0f);
+		v = emit_scale_to_int(prog, v, max >> 1);
+		break;
+	case FORMAT_FLOAT:
+		if (bits == 32)
+			return v;
+
+		/* The 11 and 10 bit floats are half floats without the
+		 * sign bit and the low mantissa bits, which we
+		 * truncate. */
+		if (bits < 16)
+			v = kir_program_alu(prog, kir_maxf, v, kir_program_immf(prog, 0.0f));
+		v = kir_program_alu(prog, kir_ps2ph, v);
+		v = kir_program_alu(prog, kir_zxwd, v);
+		if (bits < 16)
+			v = kir_program_alu(prog, kir_shri, v, 15 - bits);
+		break;
+	default:
+		break;
+	}
 
-	write_uint8_linear(t, args, r, g, b, a);
+	if (bits < 32)
+		v = kir_program_alu(prog, kir_and, v, kir_program_immd(prog, max));
+
+	return v;
 }
 
-static void
-sfid_render_cache_rt_write_simd16(struct thread *t,
-				  const struct sfid_render_cache_args *args)
+/* The CPU version of emit_scale_to_int(), which rounds to nearest
+ * whatever rounding mode the csr is in. */
+static uint32_t
+scale_to_int(float f, uint32_t max)
 {
-	stub("sfid_render_cache_rt_write_simd16");
+	const __m128 v = _mm_set_ss(f * max);
+
+	return (int32_t) _mm_cvtss_f32(_mm_round_ss(v, v, _MM_FROUND_TO_NEAREST_INT |
+							 _MM_FROUND_NO_EXC));
 }
 
-struct unpacked_rgba_uint32 {
-	__m256i rgba04;
-	__m256i rgba15;
-	__m256i rgba26;
-	__m256i rgba37;
-};
+static float
+clampf(float f, float min, float max)
+{
+	if (!(f > min))
+		return min;
+	if (f > max)
+		return max;
+
+	return f;
+}
 
-static inline struct unpacked_rgba_uint32
-unpack_rgba_uint32(const struct reg *src)
+/* The CPU version of emit_pack_channel(), for channel c of a color in
+ * render target write payload format. */
+static uint32_t
+pack_channel(const struct format_layout *layout, int c, uint32_t u)
 {
-	struct unpacked_rgba_uint32 u;
+	const uint32_t bits = layout->bits[c];
+	const uint32_t max = bits == 32 ? ~0u : (1u << bits) - 1;
+	float f = u32_to_float(u);
 
-	__m256i rg0145 = _mm256_unpacklo_epi32(src[0].ireg, src[1].ireg);
-	__m256i rg2367 = _mm256_unpackhi_epi32(src[0].ireg, src[1].ireg);
-	__m256i ba0145 = _mm256_unpacklo_epi32(src[2].ireg, src[3].ireg);
-	__m256i ba2367 = _mm256_unpackhi_epi32(src[2].ireg, src[3].ireg);
+	switch (layout->type) {
+	case FORMAT_UNORM:
+		u = scale_to_int(clampf(f, 0.0f, 1.0f), max);
+		break;
+	case FORMAT_SNORM:
+		u = scale_to_int(clampf(f, -1.0f, 1.0f), max >> 1);
+		break;
+	case FORMAT_FLOAT:
+		if (bits == 32)
+			return u;
+
+		if (bits < 16 && !(f > 0.0f))
+			f = 0.0f;
+		u = _cvtss_sh(f, 0);
+		if (bits < 16)
+			u >>= 15 - bits;
+		break;
+	default:
+		break;
+	}
 
-	u.rgba04 = _mm256_unpacklo_epi64(rg0145, ba0145);
-	u.rgba15 = _mm256_unpackhi_epi64(rg0145, ba0145);
-	u.rgba26 = _mm256_unpacklo_epi64(rg2367, ba2367);
-	u.rgba37 = _mm256_unpackhi_epi64(rg2367, ba2367);
+	if (bits < 32)
+		u &= max;
 
 	return u;
 }
 
-static void
-sfid_render_cache_rt_write_simd8_rgba_uint32_linear(struct thread *t,
-						    const struct sfid_render_cache_args *args)
+/* Pack a color given as render target write payload dwords into a
+ * pixel of the given format, with the same conversions the render
+ * target writes use, so that fast clears and fills write the same
+ * bytes a draw would. Writes 16 bytes to pixel, of which the first
+ * cpp are the pixel. Returns false if the format isn't in the layout
+ * table. */
+bool
+pack_rt_color(uint32_t format, const uint32_t *color, void *pixel)
 {
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x = t->grf[1].uw[4];
-	const int y = t->grf[1].uw[5] + slice_y;
-
-	__m128i *base0 = args->rt.pixels + x * args->rt.cpp + y * args->rt.stride;
-	__m128i *base1 = (void *) base0 + args->rt.stride;
-
-	struct unpacked_rgba_uint32 u = unpack_rgba_uint32(&t->grf[args->src]);
-	struct reg mask = { .ireg = t->mask[0].q[0] };
-
-	if (mask.d[0] < 0)
-		base0[0] = _mm256_extractf128_si256(u.rgba04, 0);
-	if (mask.d[1] < 0)
-		base0[1] = _mm256_extractf128_si256(u.rgba15, 0);
-	if (mask.d[2] < 0)
-		base1[0] = _mm256_extractf128_si256(u.rgba26, 0);
-	if (mask.d[3] < 0)
-		base1[1] = _mm256_extractf128_si256(u.rgba37, 0);
-
-	if (mask.d[4] < 0)
-		base0[2] = _mm256_extractf128_si256(u.rgba04, 1);
-	if (mask.d[5] < 0)
-		base0[3] = _mm256_extractf128_si256(u.rgba15, 1);
-	if (mask.d[6] < 0)
-		base1[2] = _mm256_extractf128_si256(u.rgba26, 1);
-	if (mask.d[7] < 0)
-		base1[3] = _mm256_extractf128_si256(u.rgba37, 1);
-}
+	const struct format_layout *layout = format_layout(format);
+	const bool srgb = srgb_format(format);
+	uint32_t dwords[4] = { 0, };
 
-static void
-sfid_render_cache_rt_write_simd8_rgba_uint32_ymajor(struct thread *t,
-						    const struct sfid_render_cache_args *args)
-{
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x = t->grf[1].uw[4];
-	const int y = t->grf[1].uw[5] + slice_y;
-
-	const int cpp = 16;
-	__m128i *base = ymajor_offset(args->rt.pixels, x, y, args->rt.stride, cpp);
-	struct unpacked_rgba_uint32 u = unpack_rgba_uint32(&t->grf[args->src]);
-	struct reg mask = { .ireg = t->mask[0].q[0] };
-
-	if (mask.d[0] < 0)
-		base[0] = _mm256_extractf128_si256(u.rgba04, 0);
-	if (mask.d[1] < 0)
-		base[32] = _mm256_extractf128_si256(u.rgba15, 0);
-	if (mask.d[2] < 0)
-		base[1] = _mm256_extractf128_si256(u.rgba26, 0);
-	if (mask.d[3] < 0)
-		base[33] = _mm256_extractf128_si256(u.rgba37, 0);
-
-	if (mask.d[4] < 0)
-		base[64] = _mm256_extractf128_si256(u.rgba04, 1);
-	if (mask.d[5] < 0)
-		base[96] = _mm256_extractf128_si256(u.rgba15, 1);
-	if (mask.d[6] < 0)
-		base[65] = _mm256_extractf128_si256(u.rgba26, 1);
-	if (mask.d[7] < 0)
-		base[97] = _mm256_extractf128_si256(u.rgba37, 1);
+	if (layout == NULL)
+		return false;
+
+	for (int c = 0; c < 4; c++) {
+		uint32_t v;
+
+		if (layout->bits[c] == 0)
+			continue;
+
+		if (srgb && c < 3)
+			v = linear_to_srgb8(u32_to_float(color[c]));
+		else
+			v = pack_channel(layout, c, color[c]);
+
+		dwords[layout->offset[c] / 32] |= v << (layout->offset[c] % 32);
+	}
+
+	memcpy(pixel, dwords, sizeof(dwords));
+
+	return true;
 }
 
-static void
-write_uint16_linear(struct thread *t,
-		    const struct sfid_render_cache_args *args,
-		    __m256i r, __m256i g, __m256i b, __m256i a)
+/* Encode a linear color channel as 8 bit sRGB, like
+ * linear_to_srgb8() does. */
+static struct kir_reg
+emit_srgb_encode(struct kir_program *prog, struct kir_reg v)
 {
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x = t->grf[1].uw[4];
-	const int y = t->grf[1].uw[5] + slice_y;
-	__m256i rg, ba;
-
-	rg = _mm256_slli_epi32(g, 16);
-	rg = _mm256_or_si256(rg, r);
-	ba = _mm256_slli_epi32(a, 16);
-	ba = _mm256_or_si256(ba, b);
-
-	__m256i p0 = _mm256_unpacklo_epi32(rg, ba);
-	__m256i m0 = _mm256_cvtepi32_epi64(_mm256_extractf128_si256(t->mask[0].q[0], 0));
-
-	__m256i p1 = _mm256_unpackhi_epi32(rg, ba);
-	__m256i m1 = _mm256_cvtepi32_epi64(_mm256_extractf128_si256(t->mask[0].q[0], 1));
-
-	void *base = args->rt.pixels + x * args->rt.cpp + y * args->rt.stride;
-
-	_mm_maskstore_epi64(base,
-			    _mm256_extractf128_si256(m0, 0),
-			    _mm256_extractf128_si256(p0, 0));
-	_mm_maskstore_epi64((base + 16),
-			    _mm256_extractf128_si256(m1, 0),
-			    _mm256_extractf128_si256(p0, 1));
-
-	_mm_maskstore_epi64((base + args->rt.stride),
-			    _mm256_extractf128_si256(m0, 1),
-			    _mm256_extractf128_si256(p1, 0));
-	_mm_maskstore_epi64((base + args->rt.stride + 16),
-			    _mm256_extractf128_si256(m1, 1),
-			    _mm256_extractf128_si256(p1, 1));
+	const uint32_t min = (127 - 13) << 23;
+	struct kir_reg base, entry, bias, scale, t;
+
+	v = kir_program_alu(prog, kir_maxf, v, kir_program_immd(prog, min));
+	v = kir_program_alu(prog, kir_minf, v, kir_program_immd(prog, 0x3f7fffff));
+
+	t = kir_program_alu(prog, kir_subd, v, kir_program_immd(prog, min));
+	t = kir_program_alu(prog, kir_shri, t, 20);
+
+	/* vpgatherdd clears the mask, so it gets a fresh one. */
+	base = kir_program_set_load_base_imm(prog, (void *) srgb_encode_table);
+	entry = kir_program_gather(prog, base, t, kir_program_immd(prog, -1), 4, 0);
+
+	bias = kir_program_alu(prog, kir_shri, entry, 16);
+	bias = kir_program_alu(prog, kir_shli, bias, 9);
+	scale = kir_program_alu(prog, kir_and, entry, kir_program_immd(prog, 0xffff));
+
+	t = kir_program_alu(prog, kir_shri, v, 12);
+	t = kir_program_alu(prog, kir_and, t, kir_program_immd(prog, 0xff));
+	v = kir_program_alu(prog, kir_muld, scale, t);
+	v = kir_program_alu(prog, kir_addd, v, bias);
+
+	return kir_program_alu(prog, kir_shri, v, 16);
 }
 
+/* Convert a SIMD8 color to the render target format and pack it into
+ * rt_pixels, one register per dword of the pixel. The layout is known
+ * when we compile the shader, so this is straight-line code for only
+ * the channels the format has. */
 static void
-sfid_render_cache_rt_write_simd8_rgba_unorm16_linear(struct thread *t,
-						     const struct sfid_render_cache_args *args)
+emit_pack(struct kir_program *prog, const struct sfid_render_cache_args *args,
+	  const struct format_layout *layout, struct kir_reg *src)
 {
-	__m256i r, g, b, a;
-	const __m256 scale = _mm256_set1_ps(65535.0f);
-	const __m256 half =  _mm256_set1_ps(0.5f);
-	struct reg *src = &t->grf[args->src];
-
-	r = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[0].reg, scale), half));
-	g = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[1].reg, scale), half));
-	b = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[2].reg, scale), half));
-	a = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[3].reg, scale), half));
+	const int dwords = args->rt.cpp < 4 ? 1 : args->rt.cpp / 4;
+	const bool srgb = srgb_format(args->rt.format);
+	struct kir_reg pixel[4], v;
+	bool written[4] = { false, };
+
+	for (int c = 0; c < 4; c++) {
+		if (layout->bits[c] == 0)
+			continue;
+
+		const int d = layout->offset[c] / 32;
+		const int shift = layout->offset[c] % 32;
+
+		/* The sRGB formats we write are all 8 bits per
+		 * channel, and alpha stays linear. */
+		if (srgb && c < 3)
+			v = emit_srgb_encode(prog, src[c]);
+		else
+			v = emit_pack_channel(prog, layout, c, src[c]);
+
+		if (shift > 0)
+			v = kir_program_alu(prog, kir_shli, v, shift);
+		if (written[d])
+			v = kir_program_alu(prog, kir_or, pixel[d], v);
+		pixel[d] = v;
+		written[d] = true;
+	}
 
-	write_uint16_linear(t, args, r, g, b, a);
+	for (int i = 0; i < dwords; i++) {
+		if (!written[i])
+			pixel[i] = kir_program_immd(prog, 0);
+		kir_program_store_v8(prog, offsetof(struct thread, rt_pixels[i]), pixel[i]);
+	}
 }
 
 static void
-sfid_render_cache_rt_write_simd8_rgba_uint16_linear(struct thread *t,
-						    const struct sfid_render_cache_args *args)
+emit_rt_store(struct kir_program *prog, uint32_t exec_size,
+	      struct sfid_render_cache_args *args)
 {
-	__m256i r, g, b, a;
-	struct reg *src = &t->grf[args->src];
-
-	r = src[0].ireg;
-	g = src[1].ireg;
-	b = src[2].ireg;
-	a = src[3].ireg;
+	struct kir_insn *insn = kir_program_add_insn(prog, kir_send);
+	insn->send.exec_size = exec_size;
+	insn->send.src = offsetof(struct thread, rt_pixels) / sizeof(struct reg);
+	insn->send.mlen = args->rt.cpp < 4 ? 1 : args->rt.cpp / 4;
+	insn->send.dst = 0;
+	insn->send.rlen = 0;
+	insn->send.func = (void *) sfid_render_cache_rt_write;
+	insn->send.args = args;
 
-	write_uint16_linear(t, args, r, g, b, a);
+	if (args->rt.samples > 1) {
+		args->write = sfid_render_cache_rt_write;
+		insn->send.func = (void *) sfid_render_cache_rt_write_samples;
+	}
 }
 
+/* Render target writes for all formats in the layout table and all
+ * tilings. SIMD8 writes have a color per channel, the replicated data
+ * writes have one color for the 16 channels in the first register,
+ * which we pack once and store to both quarters. */
 static void
-sfid_render_cache_rt_write_simd8_r_uint8_ymajor(struct thread *t,
-						const struct sfid_render_cache_args *args)
+emit_rt_write(struct kir_program *prog, uint32_t exec_size, uint32_t subtype,
+	      uint32_t surface, struct sfid_render_cache_args *args)
 {
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x = t->grf[1].uw[4];
-	const int y = t->grf[1].uw[5] + slice_y;
-	const int cpp = 1;
+	const struct format_layout *layout = format_layout(args->rt.format);
+	struct kir_reg src[4];
 
-	void *base = ymajor_offset(args->rt.pixels, x, y, args->rt.stride, cpp);
-
-	struct reg *src = &t->grf[args->src];
+	if (layout == NULL) {
+		stub("rt write format %d", args->rt.format);
+		return;
+	}
 
-	__m256i r32 = _mm256_permute4x64_epi64(src[0].ireg, SWIZZLE(0, 2, 1, 3));
+	switch (subtype) {
+	case MESSAGE_SUBTYPE_SIMD8_LO:
+		for (int c = 0; c < 4; c++)
+			src[c] = kir_program_load_v8(prog, offsetof(struct thread,
+								   grf[args->src + c * args->stride]));
 
-	__m128i lo = _mm256_extractf128_si256(r32, 0);
-	__m128i hi = _mm256_extractf128_si256(r32, 1);
-	__m128i r16 = _mm_packus_epi32(lo, hi);
-	__m128i r8 = _mm_packus_epi16(r16, r16);
+		if (surface < ARRAY_LENGTH(gt.blend.rt) &&
+		    blend_reads_dst(&gt.blend.rt[surface]))
+			emit_blend(prog, args, &gt.blend.rt[surface], src);
+		break;
 
-	/* FIXME: Needs masking. */
-	*(uint32_t *) (base +  0) = _mm_extract_epi32(r8, 0);
-	*(uint32_t *) (base + 16) = _mm_extract_epi32(r8, 1);
-}
+	case MESSAGE_SUBTYPE_SIMD16_REPDATA:
+	case MESSAGE_SUBTYPE_SIMD16_REPDATA_TILED:
+		if (surface < ARRAY_LENGTH(gt.blend.rt) &&
+		    blend_reads_dst(&gt.blend.rt[surface]))
+			stub("blending replicated color");
 
-static void
-sfid_render_cache_rt_write_simd8_rgba8_ymajor(struct thread *t,
-					      const struct sfid_render_cache_args *args)
-{
-	const int slice_y = args->rt.minimum_array_element * args->rt.qpitch;
-	const int x = t->grf[1].uw[4];
-	const int y = t->grf[1].uw[5] + slice_y;
-	const int cpp = 4;
-	struct reg *src = &t->grf[args->src];
-	const __m256 scale = _mm256_set1_ps(255.0f);
-	const __m256 half =  _mm256_set1_ps(0.5f);
-	__m256i r, g, b, a;
-	__m256i rgba;
-
-	switch (args->rt.format) {
-	case SF_R8G8B8A8_UNORM:
-		r = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[0].reg, scale), half));
-		g = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[1].reg, scale), half));
-		b = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[2].reg, scale), half));
-		a = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[3].reg, scale), half));
-		break;
-	case SF_B8G8R8A8_UNORM:
-		b = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[0].reg, scale), half));
-		g = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[1].reg, scale), half));
-		r = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[2].reg, scale), half));
-		a = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(src[3].reg, scale), half));
-		break;
-	case SF_R8G8B8A8_UINT:
-		r = src[0].ireg;
-		g = src[1].ireg;
-		b = src[2].ireg;
-		a = src[3].ireg;
+		for (int c = 0; c < 4; c++)
+			src[c] = kir_program_load_uniform(prog, offsetof(struct thread,
+									grf[args->src].ud[c]));
 		break;
+
 	default:
-		stub("unorm8 ymajor format");
+		stub("rt write subtype %d", subtype);
 		return;
 	}
 
-	rgba = _mm256_slli_epi32(a, 8);
-	rgba = _mm256_or_si256(rgba, b);
-	rgba = _mm256_slli_epi32(rgba, 8);
-	rgba = _mm256_or_si256(rgba, g);
-	rgba = _mm256_slli_epi32(rgba, 8);
-	rgba = _mm256_or_si256(rgba, r);
-
-	/* Swizzle two middle pixel pairs so that dword 0-3 and 4-7
-	 * form linear owords of pixels. */
-	rgba = _mm256_permute4x64_epi64(rgba, SWIZZLE(0, 2, 1, 3));
-	__m256i mask = _mm256_permute4x64_epi64(t->mask[0].q[0], SWIZZLE(0, 2, 1, 3));
-
-	void *base = ymajor_offset(args->rt.pixels, x, y, args->rt.stride, cpp);
-
-	_mm_maskstore_epi32(base,
-			    _mm256_extractf128_si256(mask, 0),
-			    _mm256_extractf128_si256(rgba, 0));
-	_mm_maskstore_epi32(base + 16,
-			    _mm256_extractf128_si256(mask, 1),
-			    _mm256_extractf128_si256(rgba, 1));
-}
+	kir_program_comment(prog, "rt write: pack format %d", args->rt.format);
+	emit_pack(prog, args, layout, src);
+	emit_rt_store(prog, exec_size, args);
 
-enum message_type {
-	MSD_RTW = 0x0c,
-	MSD_RTR = 0x0d,
-};
+	if (subtype != MESSAGE_SUBTYPE_SIMD8_LO) {
+		struct sfid_render_cache_args *hi = get_const_data(sizeof *hi, 32);
 
-enum message_subtype {
-	MESSAGE_SUBTYPE_SIMD16,
-	MESSAGE_SUBTYPE_SIMD16_REPDATA,
-	MESSAGE_SUBTYPE_SIMD8_DUALSRC_LO,
-	MESSAGE_SUBTYPE_SIMD8_DUALSRC_HI,
-	MESSAGE_SUBTYPE_SIMD8_LO,
-	MESSAGE_SUBTYPE_SIMD16_REPDATA_TILED = 7
-};
+		*hi = *args;
+		hi->quarter = args->quarter + 1;
+		emit_rt_store(prog, exec_size, hi);
+	}
+}
 
-struct message_descriptor {
-	/* Vol 2a, "MSD_RTW*" (p473+) */
-	uint32_t		binding_table_index;
-	enum message_subtype	message_subtype;
-	uint32_t		slot_group;
-	bool			last_rt;
-	bool			per_sample;
-	enum message_type	message_type;
-	bool			header_present;
-	uint32_t		response_length;
-	uint32_t		message_length;
-	uint32_t		data_format;
-	bool			eot;
+struct rt_stats_args {
+	int quarter;
+	int blocks;
+	int cpp;
 };
 
-static void *
-pick_render_cache_function(enum message_type type, enum message_subtype subtype,
-			   struct sfid_render_cache_args *args)
+static void
+count_rt_bytes(struct thread *t, const struct rt_stats_args *args)
 {
-	/* vol 2d, p445 */
-	switch (type) {
-	case MSD_RTW:
-		switch (subtype) {
-		case MESSAGE_SUBTYPE_SIMD16:
-			return sfid_render_cache_rt_write_simd16;
-		case MESSAGE_SUBTYPE_SIMD16_REPDATA:
-		case MESSAGE_SUBTYPE_SIMD16_REPDATA_TILED:
-			if (args->rt.format == SF_B8G8R8A8_UNORM &&
-			    args->rt.tile_mode == XMAJOR)
-				return sfid_render_cache_rt_write_rep16_bgra_unorm8_xmajor;
-			else if (args->rt.format == SF_B8G8R8A8_UNORM_SRGB &&
-				 args->rt.tile_mode == XMAJOR)
-				return sfid_render_cache_rt_write_rep16_bgra_unorm8_xmajor;
-			else if (args->rt.format == SF_B8G8R8X8_UNORM &&
-				 args->rt.tile_mode == XMAJOR)
-				return sfid_render_cache_rt_write_rep16_bgra_unorm8_xmajor;
-			else if (args->rt.format == SF_B8G8R8X8_UNORM_SRGB &&
-				 args->rt.tile_mode == XMAJOR)
-				return sfid_render_cache_rt_write_rep16_bgra_unorm8_xmajor;
-			else if (args->rt.format == SF_R8G8B8A8_UNORM &&
-				 args->rt.tile_mode == YMAJOR)
-				return sfid_render_cache_rt_write_rep16_rgba_unorm8_ymajor;
-			else
-				stub("rep16 rt write format/tile_mode: %d %d",
-				     args->rt.format, args->rt.tile_mode);
-			break;
-
-		case MESSAGE_SUBTYPE_SIMD8_LO:
-			if (args->rt.format == SF_R16G16B16A16_UNORM &&
-			    args->rt.tile_mode == LINEAR)
-				return sfid_render_cache_rt_write_simd8_rgba_unorm16_linear;
-			else if (args->rt.format == SF_R8G8B8A8_UNORM &&
-				 args->rt.tile_mode == LINEAR)
-				return sfid_render_cache_rt_write_simd8_rgba_unorm8_linear;
-			else if (args->rt.format == SF_R8G8B8A8_UINT &&
-				 args->rt.tile_mode == LINEAR)
-				return sfid_render_cache_rt_write_simd8_rgba_uint8_linear;
-			else if (args->rt.format == SF_B8G8R8A8_UNORM &&
-				 args->rt.tile_mode == XMAJOR)
-				return sfid_render_cache_rt_write_simd8_bgra_unorm8_xmajor;
-			else if (args->rt.format == SF_B8G8R8X8_UNORM &&
-				 args->rt.tile_mode == XMAJOR)
-				return sfid_render_cache_rt_write_simd8_bgra_unorm8_xmajor;
-			else if (args->rt.format == SF_B8G8R8A8_UNORM_SRGB &&
-				 args->rt.tile_mode == XMAJOR)
-				return sfid_render_cache_rt_write_simd8_bgra_unorm8_xmajor;
-			else if (args->rt.format == SF_R32G32B32A32_UINT &&
-				 args->rt.tile_mode == LINEAR)
-				return sfid_render_cache_rt_write_simd8_rgba_uint32_linear;
-			else if (args->rt.format == SF_R16G16B16A16_UINT &&
-				 args->rt.tile_mode == LINEAR)
-				return sfid_render_cache_rt_write_simd8_rgba_uint16_linear;
-			else if (args->rt.format == SF_R8_UINT &&
-				 args->rt.tile_mode == YMAJOR)
-				return sfid_render_cache_rt_write_simd8_r_uint8_ymajor;
-			else if (args->rt.format == SF_R8G8B8A8_UNORM &&
-				 args->rt.tile_mode == YMAJOR)
-				return sfid_render_cache_rt_write_simd8_rgba8_ymajor;
-			else if (args->rt.format == SF_B8G8R8A8_UNORM &&
-				 args->rt.tile_mode == YMAJOR)
-				return sfid_render_cache_rt_write_simd8_rgba8_ymajor;
-			else if (args->rt.format == SF_R8G8B8A8_UINT &&
-				 args->rt.tile_mode == YMAJOR)
-				return sfid_render_cache_rt_write_simd8_rgba8_ymajor;
-			else if (args->rt.format == SF_R32G32B32A32_UINT &&
-				 args->rt.tile_mode == YMAJOR)
-				return sfid_render_cache_rt_write_simd8_rgba_uint32_ymajor;
-
-			stub("simd8 rt write format/tile_mode: %d %d",
-			     args->rt.format, args->rt.tile_mode);
-			return NULL;
-		default:
-			stub("rt write subtype %d", subtype);
-			return NULL;
-		}
-	default:
-		stub("render cache message type %d", type);
-		return NULL;
+	for (int i = 0; i < args->blocks; i++) {
+		struct reg mask = { .ireg = t->mask[0].q[args->quarter + i] };
+		ps_stats.rt_bytes +=
+			__builtin_popcount(_mm256_movemask_ps(mask.reg)) * args->cpp;
 	}
 }
 
-void
-builder_emit_sfid_render_cache_helper(struct kir_program *prog,
-				      uint32_t exec_size,
-				      uint32_t type, uint32_t subtype,
-				      uint32_t src, uint32_t mlen,
-				      uint32_t surface)
+static void
+emit_render_cache_send(struct kir_program *prog, uint32_t exec_size,
+		       uint32_t type, uint32_t subtype,
+		       uint32_t src, uint32_t mlen, uint32_t surface,
+		       uint32_t stride, uint32_t quarter)
 {
 	struct sfid_render_cache_args *args;
 	bool rt_valid;
 
 	args = get_const_data(sizeof *args, 32);
 	args->src = src;
+	args->stride = stride;
+	args->quarter = quarter;
 
 	rt_valid = get_surface(prog->binding_table_address, surface, &args->rt);
+	if (!rt_valid && args->rt.type == SURFTYPE_NULL)
+		return;
 	ksim_assert(rt_valid);
 	if (!rt_valid)
 		return;
 
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_send);
-	insn->send.exec_size = exec_size;
-	insn->send.src = src;
-	insn->send.mlen = mlen;
-	insn->send.dst = 0;
-	insn->send.rlen = 0;
-	insn->send.func = pick_render_cache_function(type, subtype, args);
-	insn->send.args = args;
+	/* Render target 0 is resolved tile by tile as the rasterizer
+	 * gets to the tiles. */
+	if (surface != 0)
+		fast_clear_resolve(&args->rt);
+	invalidate_shadow_surface(&args->rt);
+
+	args->tile_buffer = surface == 0 && color_tile_enabled(&args->rt);
+	if (args->tile_buffer)
+		args->rt.pixels = color_tile.pixels;
+
+	if (type != MSD_RTW) {
+		stub("render cache message type %d", type);
+		return;
+	}
+
+	emit_rt_write(prog, exec_size, subtype, surface, args);
+
+	if (stats_file) {
+		struct rt_stats_args *stats_args;
+
+		stats_args = get_const_data(sizeof *stats_args, 8);
+		stats_args->quarter = quarter;
+		stats_args->blocks = exec_size > 8 ? exec_size / 8 : 1;
+		stats_args->cpp = args->rt.cpp;
+
+		struct kir_insn *insn = kir_program_add_insn(prog, kir_send);
+		insn->send.exec_size = exec_size;
+		insn->send.src = src;
+		insn->send.mlen = 0;
+		insn->send.dst = 0;
+		insn->send.rlen = 0;
+		insn->send.func = (void *) count_rt_bytes;
+		insn->send.args = stats_args;
+	}
+}
+
+void
+builder_emit_sfid_render_cache_helper(struct kir_program *prog,
+				      uint32_t exec_size,
+				      uint32_t type, uint32_t subtype,
+				      uint32_t src, uint32_t mlen,
+				      uint32_t surface)
+{
+	if (type == MSD_RTW && subtype == MESSAGE_SUBTYPE_SIMD16) {
+		/* Write each half with the SIMD8 writers. For SIMD32
+		 * dispatch, the second SIMD16 write has quarter
+		 * control set to the upper 16 channels. */
+		emit_render_cache_send(prog, 8, type, MESSAGE_SUBTYPE_SIMD8_LO,
+				       src, mlen, surface, 2, prog->quarter);
+		emit_render_cache_send(prog, 8, type, MESSAGE_SUBTYPE_SIMD8_LO,
+				       src + 1, mlen - 1, surface, 2, prog->quarter + 1);
+	} else {
+		emit_render_cache_send(prog, exec_size, type, subtype,
+				       src, mlen, surface, 1, prog->quarter);
+	}
 }
 
 static inline struct message_descriptor
@@ -726,10 +893,20 @@ builder_emit_sfid_render_cache(struct kir_program *prog, struct inst *inst)
 	struct message_descriptor d =
 		unpack_message_descriptor(send.function_control);
 	uint32_t src = unpack_inst_2src_src0(inst).num;
+	uint32_t mlen = send.mlen;
 	uint32_t exec_size = 1 << unpack_inst_common(inst).exec_size;
 
+	/* The color payload follows the two header registers. Each
+	 * render target of an MRT shader gets its own write, keyed on
+	 * the binding table index, which is also the render target
+	 * index for the blend state. */
+	if (d.header_present) {
+		src += 2;
+		mlen -= 2;
+	}
+
 	builder_emit_sfid_render_cache_helper(prog, exec_size, d.message_type,
 					      d.message_subtype,
-					      src, send.mlen,
+					      src, mlen,
 					      d.binding_table_index);
 }
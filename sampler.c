@@ -135,12 +135,60 @@ unpack_message_header(const struct reg h)
 	};
 }
 
+enum lod_mode {
+	LOD_IMPLICIT,
+	LOD_BIAS,
+	LOD_EXPLICIT,
+	LOD_ZERO,
+};
+
 struct sfid_sampler_args {
 	int src;
 	int dst;
 	int header;
 	int rlen;
+	int stride;
+	int quarter;
 	struct surface tex;
+
+	/* Sample message payload layout: the index of the u
+	 * parameter and of the LOD or bias parameter. */
+	int coord;
+	int lod_param;
+	enum lod_mode lod_mode;
+	int params;		/* number of payload parameters */
+
+	/* LD messages take integer coordinates in u, v, lod, r
+	 * order. r_param is -1 when there is no array index or
+	 * slice. */
+	int r_param;
+
+	/* gather4 returns one channel of the four texels in the
+	 * bilinear footprint at level 0. */
+	bool gather;
+
+	/* Decoded SAMPLER_STATE */
+	bool min_linear;
+	bool mag_linear;
+	bool filterable;	/* format returns floats */
+	bool bilinear;		/* filterable and either filter is linear */
+	uint32_t mip_filter;
+	uint32_t wrap_u;
+	uint32_t wrap_v;
+	bool normalized;
+	float lod_bias;
+	float min_lod;
+	float max_lod;
+	float border_color[4];
+
+	/* Origin and size of the accessible mip levels, starting
+	 * at the surface min LOD. */
+	int max_level;
+	int level_x[16];
+	int level_y[16];
+	float level_width[16];
+	float level_height[16];
+	float level_depth[16];
 };
 
 static void
@@ -177,126 +225,82 @@ struct sample_position {
 	struct reg r;
 };
 
-static void
-decode_bc1(void *p, __m256i offsets, __m256i emask, struct reg *dst,
-	   struct sample_position *block_pos)
+/* Convert 8 bit unorm color channels to float, through the decode
+ * table for sRGB formats. */
+static inline __m256
+unorm8_color_to_float(__m256i c, bool srgb)
 {
-	const __m256i zero = _mm256_set1_epi32(0);
-
-	__m256i c0;
-
-	c0 = _mm256_mask_i32gather_epi32(zero, (p + 0), offsets, emask, 1);
-#if 0
-	__m256i c1 = _mm256_srli_epi32(c0, 16);
-	__m256i order = _mm256_cmpgt_epi32(c0, c1);
-#endif
-
-	__m256i mask5 = _mm256_set1_epi32(0x1f);
-	__m256i mask6 = _mm256_set1_epi32(0x3f);
-
-	__m256i b0 = _mm256_and_si256(c0, mask5);
-	__m256i b1 = _mm256_and_si256(_mm256_srli_epi32(c0, 16), mask5);
-
-	__m256i g0 = _mm256_and_si256(_mm256_srli_epi32(c0, 5), mask6);
-	__m256i g1 = _mm256_and_si256(_mm256_srli_epi32(c0, 21), mask6);
-
-	__m256i r0 = _mm256_and_si256(_mm256_srli_epi32(c0, 11), mask5);
-	__m256i r1 = _mm256_srli_epi32(c0, 27);
-
-	__m256i bits = _mm256_mask_i32gather_epi32(zero, (p + 4), offsets, emask, 1);
+	if (srgb)
+		return _mm256_i32gather_ps(srgb_decode_table, c, 4);
 
-	__m256i bit_position =
-		_mm256_or_si256(_mm256_slli_epi32(block_pos->u.ireg, 1),
-				_mm256_slli_epi32(block_pos->v.ireg, 3));
-
-	bits = _mm256_and_si256(_mm256_srlv_epi32(bits, bit_position),
-				_mm256_set1_epi32(0x3));
-
-	__m256 third = _mm256_set1_ps(1.0f / 3.0f);
-	__m256 scale5 = _mm256_set1_ps(1.0f / 31.0f);
-	__m256 scale6 = _mm256_set1_ps(1.0f / 63.0f);
-
-	__m256 tv = _mm256_mul_ps(_mm256_cvtepi32_ps(bits), third);
-
-	__m256 rd = _mm256_cvtepi32_ps(_mm256_sub_epi32(r1, r0));
-	dst[0].reg = _mm256_mul_ps(_mm256_fmadd_ps(tv, rd, _mm256_cvtepi32_ps(r0)), scale5);
-
-	__m256 gd = _mm256_cvtepi32_ps(_mm256_sub_epi32(g1, g0));
-	dst[1].reg = _mm256_mul_ps(_mm256_fmadd_ps(tv, gd, _mm256_cvtepi32_ps(g0)), scale6);
-
-	__m256 bd = _mm256_cvtepi32_ps(_mm256_sub_epi32(b1, b0));
-	dst[2].reg = _mm256_mul_ps(_mm256_fmadd_ps(tv, bd, _mm256_cvtepi32_ps(b0)), scale5);
-
-	dst[3].reg = _mm256_set1_ps(1.0f);
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(c), _mm256_set1_ps(1.0f / 255.0f));
 }
 
-static void
-decode_bc4(void *p, __m256i offsets, __m256i emask, struct reg *dst,
-	   struct sample_position *block_pos)
+static inline __m256
+snorm8_color_to_float(__m256i c)
 {
-	/* Single channel format. two bytes are endpoints, 6 bytes are
-	 * 16 unorm3 coefficients. */
-	const __m256i zero = _mm256_set1_epi32(0);
-	__m256i c0 = _mm256_mask_i32gather_epi32(zero, (p + 0), offsets, emask, 1);
-	__m256i c1 = _mm256_mask_i32gather_epi32(zero, (p + 4), offsets, emask, 1);
-
-	const __m256i mask8 = _mm256_set1_epi32(0xff);
-	__m256i a0 = _mm256_and_si256(c0, mask8);
-	__m256i a1 = _mm256_and_si256(_mm256_srli_epi32(c0, 8), mask8);
+	const __m256i s = _mm256_srai_epi32(_mm256_slli_epi32(c, 24), 24);
 
-	__m256 scale8 = _mm256_set1_ps(1.0f / 255.0f);
-
-	/* FIXME: cmp, then blendv to pick c0 or c1 */;
-	(void) a1;
-	(void) c1;
-
-	dst[0].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(a0), scale8);
+	return _mm256_max_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(s),
+					   _mm256_set1_ps(1.0f / 127.0f)),
+			     _mm256_set1_ps(-1.0f));
 }
 
-void
+/* Block formats are decoded a block at a time into the decoded
+ * block cache. Look up each enabled lane's block, pick out its
+ * RGBA8 texel and convert all lanes to float in one go. */
+static void
 load_block_format_simd8(void *p, enum GEN9_SURFACE_FORMAT format,
 			__m256i offsets, __m256i emask, struct reg *dst, int rlen,
 			struct sample_position *block_pos)
 {
-	struct reg v[4];
+	const __m256i mask8 = _mm256_set1_epi32(0xff);
+	struct reg o, m, texel, v[4];
+
+	o.ireg = offsets;
+	m.ireg = emask;
+	texel.ireg = _mm256_or_si256(block_pos->u.ireg,
+				     _mm256_slli_epi32(block_pos->v.ireg, 2));
+
+	for (int i = 0; i < 8; i++) {
+		if (m.d[i] == 0)
+			continue;
+		const uint32_t *block = get_decoded_block(format, p + o.ud[i]);
+		texel.ud[i] = block[texel.ud[i]];
+	}
 
-	/* Default color for unsupported sampler formats: red. */
-	v[0].reg = _mm256_set1_ps(1.0f);
-	v[1].reg = _mm256_setzero_ps();
-	v[2].reg = _mm256_set1_ps(0.0f);
-	v[3].reg = _mm256_set1_ps(1.0f);
+	texel.ireg = _mm256_and_si256(texel.ireg, m.ireg);
 
 	switch (format) {
-	case SF_BC1_UNORM:
-		decode_bc1(p, offsets, emask, &v[0], block_pos);
-		v[3].reg = _mm256_set1_ps(1.0f);
-		break;
-
-	case SF_BC2_UNORM:
-		ksim_unreachable();
+	case SF_BC4_SNORM:
+	case SF_BC5_SNORM:
+		for (int c = 0; c < 4; c++)
+			v[c].reg = snorm8_color_to_float(_mm256_srli_epi32(texel.ireg, c * 8));
 		break;
+	default: {
+		const bool srgb = srgb_format(format);
 
-	case SF_BC3_UNORM:
-		decode_bc1(p + 8, offsets, emask, &v[0], block_pos);
-		decode_bc4(p, offsets, emask, &v[3], block_pos);
+		for (int c = 0; c < 3; c++)
+			v[c].reg = unorm8_color_to_float(
+				_mm256_and_si256(_mm256_srli_epi32(texel.ireg, c * 8), mask8), srgb);
+		v[3].reg = unorm8_color_to_float(_mm256_srli_epi32(texel.ireg, 24), false);
 		break;
+	}
+	}
 
+	/* Single and two channel formats return 0 for the missing
+	 * color channels and 1 for alpha. */
+	switch (format) {
 	case SF_BC4_UNORM:
-		decode_bc4(p, offsets, emask, &v[0], block_pos);
-		v[1].reg = _mm256_set1_ps(0.0f);
-		v[2].reg = _mm256_set1_ps(0.0f);
-		v[3].reg = _mm256_set1_ps(1.0f);
-		break;
-
+	case SF_BC4_SNORM:
+		v[1].reg = _mm256_setzero_ps();
+		/* fall through */
 	case SF_BC5_UNORM:
-		decode_bc4(p, offsets, emask, &v[0], block_pos);
-		decode_bc4(p + 8, offsets, emask, &v[1], block_pos);
-		v[2].reg = _mm256_set1_ps(0.0f);
+	case SF_BC5_SNORM:
+		v[2].reg = _mm256_setzero_ps();
 		v[3].reg = _mm256_set1_ps(1.0f);
 		break;
-
 	default:
-		stub("block format");
 		break;
 	}
 
@@ -304,11 +308,12 @@ load_block_format_simd8(void *p, enum GEN9_SURFACE_FORMAT format,
 		dst[i].ireg = v[i].ireg;
 }
 
-static void
+void
 load_format_simd8(void *p, enum GEN9_SURFACE_FORMAT format,
 		  __m256i offsets, __m256i emask, struct reg *dst, int rlen)
 {
 	const __m256i zero = _mm256_set1_epi32(0);
+	const bool srgb = srgb_format(format);
 	struct reg v[4];
 
 	/* Default color for unsupported sampler formats: red. */
@@ -404,51 +409,69 @@ load_format_simd8(void *p, enum GEN9_SURFACE_FORMAT format,
 		break;
 	}
 
-	case SF_R8G8B8X8_UNORM: {
+	case SF_R8G8B8X8_UNORM:
+	case SF_R8G8B8X8_UNORM_SRGB: {
 		const __m256i mask = _mm256_set1_epi32(0xff);
-		const __m256 scale = _mm256_set1_ps(1.0f / 255.0f);
 		struct reg rgbx;
 
 		rgbx.ireg = _mm256_mask_i32gather_epi32(zero, p, offsets, emask, 1);
-		v[0].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(rgbx.ireg, mask)), scale);
+		v[0].reg = unorm8_color_to_float(_mm256_and_si256(rgbx.ireg, mask), srgb);
 		rgbx.ireg = _mm256_srli_epi32(rgbx.ireg, 8);
-		v[1].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(rgbx.ireg, mask)), scale);
+		v[1].reg = unorm8_color_to_float(_mm256_and_si256(rgbx.ireg, mask), srgb);
 		rgbx.ireg = _mm256_srli_epi32(rgbx.ireg, 8);
-		v[2].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(rgbx.ireg, mask)), scale);
+		v[2].reg = unorm8_color_to_float(_mm256_and_si256(rgbx.ireg, mask), srgb);
 		break;
 	}
 
-	case SF_R8G8B8A8_UNORM: {
+	case SF_R8G8B8A8_UNORM:
+	case SF_R8G8B8A8_UNORM_SRGB: {
 		const __m256i mask = _mm256_set1_epi32(0xff);
 		const __m256 scale = _mm256_set1_ps(1.0f / 255.0f);
 		struct reg rgba;
 
 		rgba.ireg = _mm256_mask_i32gather_epi32(zero, p, offsets, emask, 1);
-		v[0].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(rgba.ireg, mask)), scale);
+		v[0].reg = unorm8_color_to_float(_mm256_and_si256(rgba.ireg, mask), srgb);
 		rgba.ireg = _mm256_srli_epi32(rgba.ireg, 8);
-		v[1].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(rgba.ireg, mask)), scale);
+		v[1].reg = unorm8_color_to_float(_mm256_and_si256(rgba.ireg, mask), srgb);
 		rgba.ireg = _mm256_srli_epi32(rgba.ireg, 8);
-		v[2].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(rgba.ireg, mask)), scale);
+		v[2].reg = unorm8_color_to_float(_mm256_and_si256(rgba.ireg, mask), srgb);
 		rgba.ireg = _mm256_srli_epi32(rgba.ireg, 8);
 		v[3].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(rgba.ireg, mask)), scale);
 		break;
 	}
 
-	case SF_B8G8R8X8_UNORM: {
+	case SF_B8G8R8X8_UNORM:
+	case SF_B8G8R8X8_UNORM_SRGB: {
 		const __m256i mask = _mm256_set1_epi32(0xff);
-		const __m256 scale = _mm256_set1_ps(1.0f / 255.0f);
 		struct reg bgrx;
 
 		bgrx.ireg = _mm256_mask_i32gather_epi32(zero, p, offsets, emask, 1);
-		v[2].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bgrx.ireg, mask)), scale);
+		v[2].reg = unorm8_color_to_float(_mm256_and_si256(bgrx.ireg, mask), srgb);
 		bgrx.ireg = _mm256_srli_epi32(bgrx.ireg, 8);
-		v[1].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bgrx.ireg, mask)), scale);
+		v[1].reg = unorm8_color_to_float(_mm256_and_si256(bgrx.ireg, mask), srgb);
 		bgrx.ireg = _mm256_srli_epi32(bgrx.ireg, 8);
-		v[0].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bgrx.ireg, mask)), scale);
+		v[0].reg = unorm8_color_to_float(_mm256_and_si256(bgrx.ireg, mask), srgb);
 		v[3].reg = _mm256_set1_ps(1.0f);
 		break;
 	}
 
+	case SF_B8G8R8A8_UNORM:
+	case SF_B8G8R8A8_UNORM_SRGB: {
+		const __m256i mask = _mm256_set1_epi32(0xff);
+		const __m256 scale = _mm256_set1_ps(1.0f / 255.0f);
+		struct reg bgra;
+
+		bgra.ireg = _mm256_mask_i32gather_epi32(zero, p, offsets, emask, 1);
+		v[2].reg = unorm8_color_to_float(_mm256_and_si256(bgra.ireg, mask), srgb);
+		bgra.ireg = _mm256_srli_epi32(bgra.ireg, 8);
+		v[1].reg = unorm8_color_to_float(_mm256_and_si256(bgra.ireg, mask), srgb);
+		bgra.ireg = _mm256_srli_epi32(bgra.ireg, 8);
+		v[0].reg = unorm8_color_to_float(_mm256_and_si256(bgra.ireg, mask), srgb);
+		bgra.ireg = _mm256_srli_epi32(bgra.ireg, 8);
+		v[3].reg = _mm256_mul_ps(_mm256_cvtepi32_ps(bgra.ireg), scale);
+		break;
+	}
+
 	case SF_R8G8B8A8_UINT: {
 		const __m256i mask = _mm256_set1_epi32(0xff);
 		struct reg rgba;
@@ -522,57 +545,10 @@ load_format_simd8(void *p, enum GEN9_SURFACE_FORMAT format,
 		dst[i].ireg = v[i].ireg;
 }
 
-static void
-sfid_sampler_ld_simd8_linear(struct thread *t, const struct sfid_sampler_args *args)
-{
-	struct reg u, v;
-
-	u.ireg = t->grf[args->src].ireg;
-	v.ireg = t->grf[args->src + 1].ireg;
-	void *p = args->tex.pixels;
-
-	struct reg offsets;
-	offsets.ireg =
-		_mm256_add_epi32(_mm256_mullo_epi32(u.ireg, _mm256_set1_epi32(args->tex.cpp)),
-				 _mm256_mullo_epi32(v.ireg, _mm256_set1_epi32(args->tex.stride)));
-
-	load_format_simd8(p, args->tex.format,
-			  offsets.ireg, t->mask[0].q[0], &t->grf[args->dst], args->rlen);
-}
-
-static void
-sfid_sampler_ld_simd16_linear(struct thread *t, const struct sfid_sampler_args *args)
-{
-	struct reg u, v;
-	void *p = args->tex.pixels;
-	struct reg offsets;
-
-	u.ireg = t->grf[args->src].ireg;
-	v.ireg = t->grf[args->src + 1].ireg;
-	offsets.ireg =
-		_mm256_add_epi32(_mm256_mullo_epi32(u.ireg, _mm256_set1_epi32(args->tex.cpp)),
-				 _mm256_mullo_epi32(v.ireg, _mm256_set1_epi32(args->tex.stride)));
-
-	load_format_simd8(p, args->tex.format,
-			  offsets.ireg, t->mask[0].q[0], &t->grf[args->dst], args->rlen);
-
-	u.ireg = t->grf[args->src + 2].ireg;
-	v.ireg = t->grf[args->src + 3].ireg;
-	offsets.ireg =
-		_mm256_add_epi32(_mm256_mullo_epi32(u.ireg, _mm256_set1_epi32(args->tex.cpp)),
-				 _mm256_mullo_epi32(v.ireg, _mm256_set1_epi32(args->tex.stride)));
-
-	uint32_t dst1 = args->dst + format_channels(args->tex.format);
-	load_format_simd8(p, args->tex.format,
-			  offsets.ireg, t->mask[0].q[1], &t->grf[dst1], args->rlen);
-}
-
 static void
 transform_sample_position(const struct sfid_sampler_args *args, struct reg *src,
 			  struct sample_position *coords)
 {
-	struct reg u, v;
-
 	if (args->tex.type == SURFTYPE_CUBE) {
 		/* Compare x and z first so we end up with x or z as u. */
 		__m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
@@ -603,8 +579,8 @@ transform_sample_position(const struct sfid_sampler_args *args, struct reg *src,
 		 * those. */
 		__m256i swap_xz_mask = _mm256_and_si256((__m256i) xz_mask,
 							(__m256i) y_mask);
-		u.reg = _mm256_blendv_ps(us, vs, (__m256) swap_xz_mask);
-		v.reg = _mm256_blendv_ps(vs, us, (__m256) swap_xz_mask);
+		coords->u.reg = _mm256_blendv_ps(us, vs, (__m256) swap_xz_mask);
+		coords->v.reg = _mm256_blendv_ps(vs, us, (__m256) swap_xz_mask);
 
 		/* FIXME: Missing negation on u for +x and -z cases,
 		 * on v for +y case. */
@@ -612,129 +588,599 @@ transform_sample_position(const struct sfid_sampler_args *args, struct reg *src,
 		/* Add sign bit to determine positive or negative face */
 		coords->r.ireg =
 			_mm256_add_epi32(face, _mm256_srli_epi32((__m256i) major, 31));
-
+	} else if (args->tex.type == SURFTYPE_1D) {
+		/* 1D arrays have the array index in v. Sample the
+		 * center of the single row. */
+		coords->u = src[0];
+		coords->v.reg = _mm256_set1_ps(0.5f);
+		coords->r = src[1];
 	} else {
-		/* Wrap */
-		u.reg = _mm256_floor_ps(src[0].reg);
-		u.reg = _mm256_sub_ps(src[0].reg, u.reg);
+		coords->u = src[0];
+		coords->v = src[1];
+		coords->r = src[2];
+	}
+}
 
-		v.reg = _mm256_floor_ps(src[1].reg);
-		v.reg = _mm256_sub_ps(src[1].reg, v.reg);
+/* log2 for LOD computation: the exponent plus a cubic fit of
+ * log2(1 + t) over the mantissa, good to about 1/1000th of a level. */
+static inline __m256
+log2_ps(__m256 x)
+{
+	const __m256i bits = _mm256_castps_si256(x);
+	const __m256 e =
+		_mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+						    _mm256_set1_epi32(127)));
+	const __m256i mantissa =
+		_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+				_mm256_set1_epi32(0x3f800000));
+	const __m256 t = _mm256_sub_ps(_mm256_castsi256_ps(mantissa),
+				       _mm256_set1_ps(1.0f));
+
+	__m256 p = _mm256_set1_ps(0.16555885f);
+	p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(-0.58773377f));
+	p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(1.42348532f));
+
+	return _mm256_fmadd_ps(p, t, e);
+}
 
-#if 0
-		/* Clamp */
-		u.reg = _mm256_min_ps(src[0].reg, _mm256_set1_ps(1.0f));
-		u.reg = _mm256_max_ps(u.reg, _mm256_setzero_ps());
+/* The LOD before clamping. Implicit LOD comes from the derivatives
+ * across each 2x2 subspan, which are the two 128 bit halves of a
+ * SIMD8 register. */
+static __m256
+compute_lod(const struct sfid_sampler_args *args, const struct reg *src,
+	    const struct sample_position *pos)
+{
+	__m256 lod;
+
+	switch (args->lod_mode) {
+	case LOD_IMPLICIT:
+	case LOD_BIAS: {
+		__m256 u = pos->u.reg, v = pos->v.reg;
+
+		if (args->normalized) {
+			u = _mm256_mul_ps(u, _mm256_set1_ps(args->level_width[0]));
+			v = _mm256_mul_ps(v, _mm256_set1_ps(args->level_height[0]));
+		}
 
-		v.reg = _mm256_min_ps(src[1].reg, _mm256_set1_ps(1.0f));
-		v.reg = _mm256_max_ps(v.reg, _mm256_setzero_ps());
-#endif
+		const __m256 u0 = _mm256_permute_ps(u, 0x00);
+		const __m256 v0 = _mm256_permute_ps(v, 0x00);
+		const __m256 dudx = _mm256_sub_ps(_mm256_permute_ps(u, 0x55), u0);
+		const __m256 dvdx = _mm256_sub_ps(_mm256_permute_ps(v, 0x55), v0);
+		const __m256 dudy = _mm256_sub_ps(_mm256_permute_ps(u, 0xaa), u0);
+		const __m256 dvdy = _mm256_sub_ps(_mm256_permute_ps(v, 0xaa), v0);
+
+		const __m256 rho_x = _mm256_fmadd_ps(dudx, dudx, _mm256_mul_ps(dvdx, dvdx));
+		const __m256 rho_y = _mm256_fmadd_ps(dudy, dudy, _mm256_mul_ps(dvdy, dvdy));
+
+		/* log2 of the squared scale factor, so halve it. */
+		lod = _mm256_mul_ps(log2_ps(_mm256_max_ps(rho_x, rho_y)),
+				    _mm256_set1_ps(0.5f));
+		if (args->lod_mode == LOD_BIAS)
+			lod = _mm256_add_ps(lod, src[args->lod_param].reg);
+		break;
 	}
+	case LOD_EXPLICIT:
+		lod = src[args->lod_param].reg;
+		break;
+	case LOD_ZERO:
+		return _mm256_setzero_ps();
+	default:
+		ksim_unreachable();
+	}
+
+	return _mm256_add_ps(lod, _mm256_set1_ps(args->lod_bias));
+}
 
-	u.reg = _mm256_mul_ps(u.reg, _mm256_set1_ps(args->tex.width - 1));
-	v.reg = _mm256_mul_ps(v.reg, _mm256_set1_ps(args->tex.height - 1));
+/* Apply a texture coordinate mode to integer texel coordinates held
+ * in floats. Coordinates are always clamped at the end, which also
+ * takes care of NaN and infinite coordinates. border is set for the
+ * lanes that sample the border color. */
+static inline __m256
+wrap_texel(uint32_t mode, __m256 i, __m256 size, __m256 *border)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+
+	*border = zero;
+	switch (mode) {
+	case TCM_WRAP:
+		i = _mm256_sub_ps(i, _mm256_mul_ps(size, _mm256_floor_ps(_mm256_div_ps(i, size))));
+		break;
+	case TCM_MIRROR: {
+		const __m256 size2 = _mm256_add_ps(size, size);
 
-	u.reg = _mm256_add_ps(u.reg, _mm256_set1_ps(0.25f));
-	v.reg = _mm256_add_ps(v.reg, _mm256_set1_ps(0.25f));
+		i = _mm256_sub_ps(i, _mm256_mul_ps(size2, _mm256_floor_ps(_mm256_div_ps(i, size2))));
+		i = _mm256_blendv_ps(i, _mm256_sub_ps(_mm256_sub_ps(size2, one), i),
+				     _mm256_cmp_ps(i, size, _CMP_GE_OQ));
+		break;
+	}
+	case TCM_MIRROR_ONCE:
+		i = _mm256_blendv_ps(i, _mm256_sub_ps(_mm256_set1_ps(-1.0f), i),
+				     _mm256_cmp_ps(i, zero, _CMP_LT_OQ));
+		break;
+	case TCM_CLAMP_BORDER:
+		*border = _mm256_or_ps(_mm256_cmp_ps(i, zero, _CMP_LT_OQ),
+				       _mm256_cmp_ps(i, size, _CMP_GE_OQ));
+		break;
+	default:
+		break;
+	}
 
-	coords->u.ireg = _mm256_cvttps_epi32(u.reg);
-	coords->v.ireg = _mm256_cvttps_epi32(v.reg);
+	return _mm256_min_ps(_mm256_max_ps(i, zero), _mm256_sub_ps(size, one));
 }
 
-static void
-sfid_sampler_sample_simd8_linear(struct thread *t, const struct sfid_sampler_args *args)
+/* Byte offset of the texel or compression block at x, y in the
+ * surface. */
+static inline __m256i
+texel_offset(const struct surface *tex, enum GEN9_TILE_MODE tile_mode,
+	     __m256i x, __m256i y)
 {
-	struct sample_position pos;
+	const int log2_cpp = __builtin_ffs(tex->cpp) - 1;
+
+	ksim_assert(tile_mode == LINEAR || is_power_of_two(tex->cpp));
+
+	if (tile_mode == TILE_BLOCKED) {
+		__m256i block_row = _mm256_mullo_epi32(_mm256_srli_epi32(y, 2),
+						       _mm256_set1_epi32(tex->stride * 4));
+		__m256i block = _mm256_slli_epi32(_mm256_andnot_si256(_mm256_set1_epi32(3), x),
+						  log2_cpp + 2);
+		__m256i texel = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(y, _mm256_set1_epi32(3)), 2),
+						_mm256_and_si256(x, _mm256_set1_epi32(3)));
+
+		return _mm256_add_epi32(_mm256_add_epi32(block_row, block),
+					_mm256_slli_epi32(texel, log2_cpp));
+	}
+
+	switch (tile_mode) {
+	case LINEAR:
+		return _mm256_add_epi32(_mm256_mullo_epi32(x, _mm256_set1_epi32(tex->cpp)),
+					_mm256_mullo_epi32(y, _mm256_set1_epi32(tex->stride)));
 
-	transform_sample_position(args, &t->grf[args->src], &pos);
+	case XMAJOR: {
+		__m256i u_bytes = _mm256_slli_epi32(x, log2_cpp);
+		__m256i tile_y = _mm256_srli_epi32(y, 3);
+		__m256i stride_in_tiles = _mm256_set1_epi32(4096 * tex->stride / 512);
+		__m256i tile_base = _mm256_mullo_epi32(tile_y, stride_in_tiles);
 
-	struct reg offsets;
-	offsets.ireg =
-		_mm256_add_epi32(_mm256_mullo_epi32(pos.u.ireg, _mm256_set1_epi32(args->tex.cpp)),
-				 _mm256_mullo_epi32(pos.v.ireg, _mm256_set1_epi32(args->tex.stride)));
+		__m256i intra_column_offset = _mm256_and_si256(u_bytes, _mm256_set1_epi32(511));
+		__m256i column_offset = _mm256_slli_epi32(_mm256_srli_epi32(u_bytes, 9), 12);
+		__m256i row = _mm256_and_si256(y, _mm256_set1_epi32(0x7));
+		__m256i row_offset = _mm256_slli_epi32(row, 9);
+
+		return _mm256_add_epi32(_mm256_add_epi32(tile_base, row_offset),
+					_mm256_add_epi32(intra_column_offset, column_offset));
+	}
+
+	case YMAJOR: {
+		__m256i u_bytes = _mm256_slli_epi32(x, log2_cpp);
+		__m256i tile_y = _mm256_srli_epi32(y, 5);
+		__m256i stride_in_tiles = _mm256_set1_epi32(4096 * tex->stride / 128);
+		__m256i tile_base = _mm256_mullo_epi32(tile_y, stride_in_tiles);
+
+		__m256i oword_offset = _mm256_and_si256(u_bytes, _mm256_set1_epi32(0xf));
+		__m256i column_offset = _mm256_slli_epi32(_mm256_srli_epi32(u_bytes, 4), 9);
+		__m256i row = _mm256_and_si256(y, _mm256_set1_epi32(0x1f));
+		__m256i row_offset = _mm256_slli_epi32(row, 4);
+
+		return _mm256_add_epi32(_mm256_add_epi32(tile_base, row_offset),
+					_mm256_add_epi32(oword_offset, column_offset));
+	}
 
-	load_format_simd8(args->tex.pixels, args->tex.format,
-			  offsets.ireg, t->mask[0].q[0], &t->grf[args->dst], args->rlen);
+	default:
+		ksim_unreachable();
+		return _mm256_setzero_si256();
+	}
 }
 
-static void
-sfid_sampler_sample_simd8_ymajor(struct thread *t, const struct sfid_sampler_args *args)
+static inline bool
+surface_has_slices(const struct surface *tex)
 {
-	struct sample_position pos;
+	return tex->type == SURFTYPE_CUBE || tex->type == SURFTYPE_3D ||
+		tex->depth > 1 || tex->minimum_array_element > 0;
+}
+
+/* Fetch the texels at level relative x, y in slice r. Array slices,
+ * cube faces and 3D slices are all qpitch rows apart, with every
+ * level of the slice inside. */
+static inline void
+fetch_texels(const struct sfid_sampler_args *args, enum GEN9_TILE_MODE tile_mode,
+	     __m256i x, __m256i y, __m256i r, __m256i level, __m256i emask,
+	     struct reg *dst)
+{
+	const struct surface *tex = &args->tex;
 	struct sample_position block_pos;
 
-	transform_sample_position(args, &t->grf[args->src], &pos);
+	x = _mm256_add_epi32(x, _mm256_i32gather_epi32(args->level_x, level, 4));
+	y = _mm256_add_epi32(y, _mm256_i32gather_epi32(args->level_y, level, 4));
+	if (surface_has_slices(tex))
+		y = _mm256_add_epi32(y, _mm256_mullo_epi32(r, _mm256_set1_epi32(tex->qpitch)));
 
-	uint32_t bs = format_block_size(args->tex.format);
+	const uint32_t bs = format_block_size(tex->format);
 	if (bs > 1) {
 		const int log2_bs = __builtin_ffs(bs) - 1;
-		__m256i mask = _mm256_set1_epi32(bs - 1);
-		block_pos.u.ireg = _mm256_and_si256(pos.u.ireg, mask);
-		block_pos.v.ireg = _mm256_and_si256(pos.v.ireg, mask);
+		const __m256i mask = _mm256_set1_epi32(bs - 1);
 
-		pos.u.ireg = _mm256_srli_epi32(pos.u.ireg, log2_bs);
-		pos.v.ireg = _mm256_srli_epi32(pos.v.ireg, log2_bs);
+		block_pos.u.ireg = _mm256_and_si256(x, mask);
+		block_pos.v.ireg = _mm256_and_si256(y, mask);
+		x = _mm256_srli_epi32(x, log2_bs);
+		y = _mm256_srli_epi32(y, log2_bs);
 	}
 
-	ksim_assert(is_power_of_two(args->tex.cpp));
-	const int log2_cpp = __builtin_ffs(args->tex.cpp) - 1;
-	__m256i u_bytes = _mm256_slli_epi32(pos.u.ireg, log2_cpp);
+	const __m256i offset = texel_offset(tex, tile_mode, x, y);
 
-	__m256i tile_y = _mm256_srli_epi32(pos.v.ireg, 5);
-	__m256i stride_in_tiles = _mm256_set1_epi32(4096 * args->tex.stride / 128);
-	__m256i tile_base = _mm256_mullo_epi32(tile_y, stride_in_tiles);
+	if (bs == 1)
+		load_format_simd8(tex->pixels, tex->format, offset, emask, dst, 4);
+	else
+		load_block_format_simd8(tex->pixels, tex->format, offset, emask,
+					dst, 4, &block_pos);
+}
 
-	if (args->tex.type == SURFTYPE_CUBE) {
-		__m256i slice_stride =
-			_mm256_set1_epi32(args->tex.stride * args->tex.qpitch);
-		__m256i slice_base =
-			_mm256_mullo_epi32(pos.r.ireg, slice_stride);
+/* The slice to sample at level: the cube face, the rounded array
+ * index or the nearest 3D slice. We don't filter between 3D
+ * slices. */
+static inline __m256i
+sample_slice(const struct sfid_sampler_args *args, const struct sample_position *pos,
+	     __m256i level)
+{
+	const struct surface *tex = &args->tex;
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 r = pos->r.reg;
+
+	switch (tex->type) {
+	case SURFTYPE_CUBE:
+		return pos->r.ireg;
 
-		tile_base = _mm256_add_epi32(tile_base, slice_base);
+	case SURFTYPE_3D: {
+		const __m256 depth = _mm256_i32gather_ps(args->level_depth, level, 4);
+
+		if (args->normalized)
+			r = _mm256_mul_ps(r, depth);
+		r = _mm256_min_ps(_mm256_max_ps(_mm256_floor_ps(r), zero),
+				  _mm256_sub_ps(depth, _mm256_set1_ps(1.0f)));
+
+		return _mm256_cvttps_epi32(r);
 	}
 
-	__m256i oword_offset = _mm256_and_si256(u_bytes, _mm256_set1_epi32(0xf));
-	__m256i column_offset = _mm256_slli_epi32(_mm256_srli_epi32(u_bytes, 4), 9);
-	__m256i row = _mm256_and_si256(pos.v.ireg, _mm256_set1_epi32(0x1f));
-	__m256i row_offset = _mm256_slli_epi32(row, 4);
+	default:
+		if (tex->depth == 1)
+			return _mm256_set1_epi32(tex->minimum_array_element);
 
-	__m256i offset = _mm256_add_epi32(_mm256_add_epi32(tile_base, row_offset),
-					  _mm256_add_epi32(oword_offset, column_offset));
+		r = _mm256_round_ps(r, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		r = _mm256_min_ps(_mm256_max_ps(r, zero), _mm256_set1_ps(tex->depth - 1));
 
-	if (bs == 1)
-		load_format_simd8(args->tex.pixels, args->tex.format,
-				  offset, t->mask[0].q[0], &t->grf[args->dst], args->rlen);
-	else
-		load_block_format_simd8(args->tex.pixels, args->tex.format,
-					offset, t->mask[0].q[0], &t->grf[args->dst],
-					args->rlen, &block_pos);
+		return _mm256_add_epi32(_mm256_cvttps_epi32(r),
+					_mm256_set1_epi32(tex->minimum_array_element));
+	}
+}
+
+static inline void
+lerp_texels(struct reg *dst, const struct reg *a, const struct reg *b, __m256 f)
+{
+	for (int c = 0; c < 4; c++)
+		dst[c].reg = _mm256_fmadd_ps(f, _mm256_sub_ps(b[c].reg, a[c].reg), a[c].reg);
+}
+
+static inline void
+apply_border_color(const struct sfid_sampler_args *args, struct reg *texels,
+		   __m256 border)
+{
+	for (int c = 0; c < 4; c++)
+		texels[c].reg = _mm256_blendv_ps(texels[c].reg,
+						 _mm256_set1_ps(args->border_color[c]),
+						 border);
+}
+
+/* The texels around a sample position at one level: x0, y0 is the
+ * nearest texel, or the top left of the 2x2 footprint in the lanes
+ * in half, where fx and fy are the weights of x1 and y1. The b
+ * masks select the border color. */
+struct footprint {
+	__m256i x0, y0, x1, y1;
+	__m256 bx0, by0, bx1, by1;
+	__m256 fx, fy;
+};
+
+static inline void
+compute_footprint(const struct sfid_sampler_args *args,
+		  const struct sample_position *pos, __m256i level, __m256 linear,
+		  bool bilinear, struct footprint *fp)
+{
+	const __m256 half = _mm256_and_ps(linear, _mm256_set1_ps(0.5f));
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 width = _mm256_i32gather_ps(args->level_width, level, 4);
+	const __m256 height = _mm256_i32gather_ps(args->level_height, level, 4);
+	__m256 x = pos->u.reg, y = pos->v.reg;
+
+	if (args->normalized) {
+		x = _mm256_mul_ps(x, width);
+		y = _mm256_mul_ps(y, height);
+	}
+
+	x = _mm256_sub_ps(x, half);
+	y = _mm256_sub_ps(y, half);
+	const __m256 x0 = _mm256_floor_ps(x);
+	const __m256 y0 = _mm256_floor_ps(y);
+
+	fp->x0 = _mm256_cvttps_epi32(wrap_texel(args->wrap_u, x0, width, &fp->bx0));
+	fp->y0 = _mm256_cvttps_epi32(wrap_texel(args->wrap_v, y0, height, &fp->by0));
+	if (!bilinear)
+		return;
+
+	fp->x1 = _mm256_cvttps_epi32(wrap_texel(args->wrap_u, _mm256_add_ps(x0, one),
+						width, &fp->bx1));
+	fp->y1 = _mm256_cvttps_epi32(wrap_texel(args->wrap_v, _mm256_add_ps(y0, one),
+						height, &fp->by1));
+	fp->fx = _mm256_and_ps(linear, _mm256_sub_ps(x, x0));
+	fp->fy = _mm256_and_ps(linear, _mm256_sub_ps(y, y0));
+}
+
+/* Fetch the 2x2 footprint as x0 y0, x1 y0, x0 y1 and x1 y1. */
+static inline void
+fetch_footprint(const struct sfid_sampler_args *args, enum GEN9_TILE_MODE tile_mode,
+		const struct footprint *fp, __m256i slice, __m256i level,
+		__m256i emask, struct reg t[4][4])
+{
+	fetch_texels(args, tile_mode, fp->x0, fp->y0, slice, level, emask, t[0]);
+	fetch_texels(args, tile_mode, fp->x1, fp->y0, slice, level, emask, t[1]);
+	fetch_texels(args, tile_mode, fp->x0, fp->y1, slice, level, emask, t[2]);
+	fetch_texels(args, tile_mode, fp->x1, fp->y1, slice, level, emask, t[3]);
+
+	if (args->wrap_u == TCM_CLAMP_BORDER || args->wrap_v == TCM_CLAMP_BORDER) {
+		apply_border_color(args, t[0], _mm256_or_ps(fp->bx0, fp->by0));
+		apply_border_color(args, t[1], _mm256_or_ps(fp->bx1, fp->by0));
+		apply_border_color(args, t[2], _mm256_or_ps(fp->bx0, fp->by1));
+		apply_border_color(args, t[3], _mm256_or_ps(fp->bx1, fp->by1));
+	}
+}
+
+/* Sample one mip level, per lane. Lanes in linear get a bilinear
+ * filtered result, the rest the nearest texel. */
+static inline void
+sample_level(const struct sfid_sampler_args *args, enum GEN9_TILE_MODE tile_mode,
+	     const struct sample_position *pos, __m256i level, __m256 linear,
+	     __m256i emask, struct reg *dst)
+{
+	const __m256i slice = sample_slice(args, pos, level);
+	struct footprint fp;
+
+	compute_footprint(args, pos, level, linear, args->bilinear, &fp);
+
+	if (!args->bilinear) {
+		fetch_texels(args, tile_mode, fp.x0, fp.y0, slice, level, emask, dst);
+		if (args->wrap_u == TCM_CLAMP_BORDER || args->wrap_v == TCM_CLAMP_BORDER)
+			apply_border_color(args, dst, _mm256_or_ps(fp.bx0, fp.by0));
+		return;
+	}
+
+	struct reg t[4][4];
+	fetch_footprint(args, tile_mode, &fp, slice, level, emask, t);
+
+	lerp_texels(t[0], t[0], t[1], fp.fx);
+	lerp_texels(t[2], t[2], t[3], fp.fx);
+	lerp_texels(dst, t[0], t[2], fp.fy);
+}
+
+/* SIMD16 sample and LD messages are split into two SIMD8 messages.
+ * The payload and the response then have the upper and lower halves
+ * of each parameter or channel in consecutive registers, so they are
+ * stride registers apart. */
+static inline void
+load_sample_src(const struct thread *t, const struct sfid_sampler_args *args,
+		struct reg *src)
+{
+	for (int i = 0; i < args->params; i++)
+		src[i] = t->grf[args->src + i * args->stride];
+}
+
+static inline void
+store_sample_dst(struct thread *t, const struct sfid_sampler_args *args,
+		 const struct reg *dst)
+{
+	for (int i = 0; i < args->rlen; i++)
+		t->grf[args->dst + i * args->stride] = dst[i];
+}
+
+/* gather4 returns the selected channel of the footprint texels in
+ * the order x0 y1, x1 y1, x1 y0, x0 y0. */
+static inline void
+gather4_level(const struct thread *t, const struct sfid_sampler_args *args,
+	      enum GEN9_TILE_MODE tile_mode, const struct sample_position *pos,
+	      __m256i emask, struct reg *dst)
+{
+	const __m256i level = _mm256_setzero_si256();
+	const __m256i slice = sample_slice(args, pos, level);
+	const __m256 all = (__m256) _mm256_set1_epi32(-1);
+	struct footprint fp;
+	struct reg texels[4][4];
+	uint32_t c = 0;
+
+	if (args->header >= 0)
+		c = unpack_message_header(t->grf[args->header]).gather4_source_channel_select;
+
+	compute_footprint(args, pos, level, all, true, &fp);
+	fetch_footprint(args, tile_mode, &fp, slice, level, emask, texels);
+
+	dst[0] = texels[2][c];
+	dst[1] = texels[3][c];
+	dst[2] = texels[1][c];
+	dst[3] = texels[0][c];
+}
+
+static inline void
+sample_simd8(struct thread *t, const struct sfid_sampler_args *args,
+	     enum GEN9_TILE_MODE tile_mode)
+{
+	const __m256i emask = t->mask[0].q[args->quarter];
+	struct sample_position pos;
+	struct reg src[5], dst[4];
+
+	load_sample_src(t, args, src);
+	transform_sample_position(args, &src[args->coord], &pos);
+
+	if (args->gather) {
+		gather4_level(t, args, tile_mode, &pos, emask, dst);
+		store_sample_dst(t, args, dst);
+		return;
+	}
+
+	const __m256 lod = compute_lod(args, src, &pos);
+	const __m256 clamped =
+		_mm256_min_ps(_mm256_max_ps(lod, _mm256_set1_ps(args->min_lod)),
+			      _mm256_set1_ps(args->max_lod));
+
+	/* Magnification is decided per lane on the clamped LOD. */
+	const __m256 all = (__m256) _mm256_set1_epi32(-1);
+	const __m256 none = _mm256_setzero_ps();
+	const __m256 minify = _mm256_cmp_ps(clamped, none, _CMP_GT_OQ);
+	const __m256 linear = _mm256_blendv_ps(args->mag_linear ? all : none,
+					       args->min_linear ? all : none,
+					       minify);
+
+	__m256 level_lod;
+	switch (args->mip_filter) {
+	case MIPFILTER_NEAREST:
+		level_lod = _mm256_floor_ps(_mm256_add_ps(clamped, _mm256_set1_ps(0.5f)));
+		break;
+	case MIPFILTER_LINEAR:
+		level_lod = _mm256_floor_ps(clamped);
+		break;
+	default:
+		level_lod = _mm256_setzero_ps();
+		break;
+	}
+
+	const __m256i max_level = _mm256_set1_epi32(args->max_level);
+	const __m256i level =
+		_mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(level_lod),
+						  _mm256_setzero_si256()),
+				 max_level);
+
+	sample_level(args, tile_mode, &pos, level, linear, emask, dst);
+
+	if (args->mip_filter == MIPFILTER_LINEAR && args->filterable) {
+		const __m256 f = _mm256_sub_ps(clamped, level_lod);
+		const __m256 blend = _mm256_cmp_ps(f, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+		/* Skip the second level when no lane is between
+		 * levels, which is the common case when magnifying. */
+		if (_mm256_movemask_ps(_mm256_and_ps(blend, (__m256) emask))) {
+			const __m256i level1 =
+				_mm256_min_epi32(_mm256_add_epi32(level, _mm256_set1_epi32(1)),
+						 max_level);
+			struct reg dst1[4];
+
+			sample_level(args, tile_mode, &pos, level1, linear, emask, dst1);
+			lerp_texels(dst, dst, dst1, _mm256_and_ps(blend, f));
+		}
+	}
+
+	store_sample_dst(t, args, dst);
+}
+
+static void
+sfid_sampler_sample_simd8_linear(struct thread *t, const struct sfid_sampler_args *args)
+{
+	sample_simd8(t, args, LINEAR);
+}
+
+static void
+sfid_sampler_sample_simd8_ymajor(struct thread *t, const struct sfid_sampler_args *args)
+{
+	sample_simd8(t, args, YMAJOR);
 }
 
 static void
 sfid_sampler_sample_simd8_xmajor(struct thread *t, const struct sfid_sampler_args *args)
 {
-	struct sample_position pos;
+	sample_simd8(t, args, XMAJOR);
+}
 
-	transform_sample_position(args, &t->grf[args->src], &pos);
+static void
+sfid_sampler_sample_simd8_blocked(struct thread *t, const struct sfid_sampler_args *args)
+{
+	sample_simd8(t, args, TILE_BLOCKED);
+}
 
-	ksim_assert(is_power_of_two(args->tex.cpp));
-	const int log2_cpp = __builtin_ffs(args->tex.cpp) - 1;
-	__m256i u_bytes = _mm256_slli_epi32(pos.u.ireg, log2_cpp);
+/* Out of bounds LD messages return zero. The compare is unsigned so
+ * negative coordinates are out of bounds too. */
+static inline __m256i
+in_bounds(__m256i x, __m256i max)
+{
+	return _mm256_cmpeq_epi32(_mm256_min_epu32(x, max), x);
+}
 
-	__m256i tile_y = _mm256_srli_epi32(pos.v.ireg, 3);
-	__m256i stride_in_tiles = _mm256_set1_epi32(4096 * args->tex.stride / 512);
-	__m256i tile_base = _mm256_mullo_epi32(tile_y, stride_in_tiles);
+static inline void
+ld_simd8(struct thread *t, const struct sfid_sampler_args *args,
+	 enum GEN9_TILE_MODE tile_mode)
+{
+	const struct surface *tex = &args->tex;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi32(1);
+	struct reg src[4], dst[4];
+
+	load_sample_src(t, args, src);
+
+	const __m256i u = src[0].ireg;
+	const __m256i v = tex->type == SURFTYPE_1D ? zero : src[1].ireg;
+	const __m256i lod = args->lod_param >= 0 ? src[args->lod_param].ireg : zero;
+	__m256i r = args->r_param >= 0 ? src[args->r_param].ireg : zero;
+
+	__m256i valid = in_bounds(lod, _mm256_set1_epi32(args->max_level));
+	const __m256i level = _mm256_and_si256(lod, valid);
+
+	const __m256i width =
+		_mm256_cvttps_epi32(_mm256_i32gather_ps(args->level_width, level, 4));
+	const __m256i height =
+		_mm256_cvttps_epi32(_mm256_i32gather_ps(args->level_height, level, 4));
+	valid = _mm256_and_si256(valid, in_bounds(u, _mm256_sub_epi32(width, one)));
+	valid = _mm256_and_si256(valid, in_bounds(v, _mm256_sub_epi32(height, one)));
+
+	if (tex->type == SURFTYPE_3D) {
+		const __m256i depth =
+			_mm256_cvttps_epi32(_mm256_i32gather_ps(args->level_depth, level, 4));
+
+		valid = _mm256_and_si256(valid, in_bounds(r, _mm256_sub_epi32(depth, one)));
+	} else if (args->r_param >= 0) {
+		/* Cube faces are addressed as array slices. */
+		const int slices = tex->type == SURFTYPE_CUBE ? tex->depth * 6 : tex->depth;
+
+		valid = _mm256_and_si256(valid, in_bounds(r, _mm256_set1_epi32(slices - 1)));
+		r = _mm256_add_epi32(r, _mm256_set1_epi32(tex->minimum_array_element));
+	} else {
+		r = _mm256_set1_epi32(tex->minimum_array_element);
+	}
 
-	__m256i intra_column_offset = _mm256_and_si256(u_bytes, _mm256_set1_epi32(511));
-	__m256i column_offset = _mm256_slli_epi32(_mm256_srli_epi32(u_bytes, 9), 12);
-	__m256i row = _mm256_and_si256(pos.v.ireg, _mm256_set1_epi32(0x7));
-	__m256i row_offset = _mm256_slli_epi32(row, 9);
+	const __m256i emask = _mm256_and_si256(t->mask[0].q[args->quarter], valid);
+	fetch_texels(args, tile_mode, u, v, r, level, emask, dst);
+
+	for (int c = 0; c < 4; c++)
+		dst[c].ireg = _mm256_and_si256(dst[c].ireg, valid);
+
+	store_sample_dst(t, args, dst);
+}
 
-	__m256i offset = _mm256_add_epi32(_mm256_add_epi32(tile_base, row_offset),
-					  _mm256_add_epi32(intra_column_offset, column_offset));
+static void
+sfid_sampler_ld_simd8_linear(struct thread *t, const struct sfid_sampler_args *args)
+{
+	ld_simd8(t, args, LINEAR);
+}
 
-	load_format_simd8(args->tex.pixels, args->tex.format,
-			  offset, t->mask[0].q[0], &t->grf[args->dst], args->rlen);
+static void
+sfid_sampler_ld_simd8_ymajor(struct thread *t, const struct sfid_sampler_args *args)
+{
+	ld_simd8(t, args, YMAJOR);
+}
+
+static void
+sfid_sampler_ld_simd8_xmajor(struct thread *t, const struct sfid_sampler_args *args)
+{
+	ld_simd8(t, args, XMAJOR);
+}
+
+static void
+sfid_sampler_ld_simd8_blocked(struct thread *t, const struct sfid_sampler_args *args)
+{
+	ld_simd8(t, args, TILE_BLOCKED);
 }
 
 static void
@@ -748,12 +1194,519 @@ sfid_sampler_noop_stub(struct thread *t, const struct sfid_sampler_args *args)
 	dst[3].reg = _mm256_set1_ps(1.0f);
 }
 
+static bool
+integer_texture_format(enum GEN9_SURFACE_FORMAT format)
+{
+	switch (format) {
+	case SF_R32_SINT:
+	case SF_R32_UINT:
+	case SF_R32G32_SINT:
+	case SF_R32G32_UINT:
+	case SF_R32G32B32_SINT:
+	case SF_R32G32B32_UINT:
+	case SF_R32G32B32A32_SINT:
+	case SF_R32G32B32A32_UINT:
+	case SF_R16G16B16A16_UINT:
+	case SF_R8G8B8A8_UINT:
+	case SF_R8_UINT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Payload layout of the SIMD8 and SIMD16 sample messages, Vol 7,
+ * "Message Types". The shadow comparison reference comes first,
+ * then the LOD or bias, then the coordinates. */
+static void
+decode_sample_message(uint32_t type, struct sfid_sampler_args *args)
+{
+	args->coord = 0;
+	args->lod_param = -1;
+	args->lod_mode = LOD_IMPLICIT;
+	args->r_param = -1;
+	args->gather = false;
+
+	switch (type) {
+	case SAMPLE_MESSAGE_SAMPLE:
+		break;
+	case SAMPLE_MESSAGE_GATHER4:
+		args->lod_mode = LOD_ZERO;
+		args->gather = true;
+		break;
+	case SAMPLE_MESSAGE_SAMPLE_B:
+		args->lod_mode = LOD_BIAS;
+		args->lod_param = 0;
+		args->coord = 1;
+		break;
+	case SAMPLE_MESSAGE_SAMPLE_L:
+		args->lod_mode = LOD_EXPLICIT;
+		args->lod_param = 0;
+		args->coord = 1;
+		break;
+	case SAMPLE_MESSAGE_LZ:
+		args->lod_mode = LOD_ZERO;
+		break;
+	case SAMPLE_MESSAGE_SAMPLE_C:
+		stub("shadow compare");
+		args->coord = 1;
+		break;
+	case SAMPLE_MESSAGE_SAMPLE_B_C:
+		stub("shadow compare");
+		args->lod_mode = LOD_BIAS;
+		args->lod_param = 1;
+		args->coord = 2;
+		break;
+	case SAMPLE_MESSAGE_SAMPLE_L_C:
+		stub("shadow compare");
+		args->lod_mode = LOD_EXPLICIT;
+		args->lod_param = 1;
+		args->coord = 2;
+		break;
+	case SAMPLE_MESSAGE_C_LZ:
+		stub("shadow compare");
+		args->lod_mode = LOD_ZERO;
+		args->coord = 1;
+		break;
+	default:
+		stub("sample message type %d", type);
+		break;
+	}
+
+	args->params = args->coord + 3;
+}
+
+/* LD payloads have u, v and lod followed by the array index or 3D
+ * slice. 1D surfaces have no v, the slot holds 0, or the array index
+ * for 1D arrays, and the lod still comes third. LD_LZ drops the
+ * lod. */
+static void
+decode_ld_message(uint32_t type, struct sfid_sampler_args *args)
+{
+	const struct surface *tex = &args->tex;
+	const bool lz = type == SAMPLE_MESSAGE_LD_LZ;
+	int n;
+
+	args->coord = 0;
+	args->lod_mode = lz ? LOD_ZERO : LOD_EXPLICIT;
+	args->r_param = -1;
+	args->gather = false;
+
+	n = 2;
+	if (tex->type == SURFTYPE_1D) {
+		if (tex->depth > 1)
+			args->r_param = 1;
+	} else if (surface_has_slices(tex)) {
+		args->r_param = lz ? 2 : 3;
+	}
+
+	args->lod_param = lz ? -1 : n;
+	args->params = max_u64(n + !lz, args->r_param + 1);
+}
+
+static void
+decode_sampler_state(const struct kir_program *prog, uint32_t index,
+		     struct sfid_sampler_args *args)
+{
+	struct GEN9_SAMPLER_STATE v = {
+		.MinModeFilter = MAPFILTER_NEAREST,
+		.MagModeFilter = MAPFILTER_NEAREST,
+		.MipModeFilter = MIPFILTER_NONE,
+		.MaxLOD = 14.0f,
+		.TCXAddressControlMode = TCM_WRAP,
+		.TCYAddressControlMode = TCM_WRAP,
+	};
+	uint64_t range;
+
+	const void *state =
+		map_gtt_offset(prog->sampler_state_address +
+			       gt.dynamic_state_base_address + index * 16, &range);
+	if (range >= 16)
+		GEN9_SAMPLER_STATE_unpack(state, &v);
+	else
+		stub("sampler state out of range");
+
+	/* Anisotropic filtering is approximated by trilinear. */
+	args->min_linear = v.MinModeFilter == MAPFILTER_LINEAR ||
+		v.MinModeFilter == MAPFILTER_ANISOTROPIC;
+	args->mag_linear = v.MagModeFilter == MAPFILTER_LINEAR ||
+		v.MagModeFilter == MAPFILTER_ANISOTROPIC;
+	args->filterable = !integer_texture_format(args->tex.format);
+	args->bilinear = args->filterable &&
+		(args->min_linear || args->mag_linear);
+	args->mip_filter = v.MipModeFilter;
+	args->lod_bias = v.TextureLODBias;
+	args->min_lod = v.MinLOD;
+	args->max_lod = v.MaxLOD;
+	args->normalized = !v.NonnormalizedCoordinateEnable;
+
+	/* Cube maps sample each face clamped, we don't filter across
+	 * faces. Half border is treated as clamp. */
+	if (args->tex.type == SURFTYPE_CUBE) {
+		args->wrap_u = TCM_CLAMP;
+		args->wrap_v = TCM_CLAMP;
+	} else {
+		args->wrap_u = v.TCXAddressControlMode;
+		args->wrap_v = v.TCYAddressControlMode;
+	}
+
+	if (args->wrap_u == TCM_CLAMP_BORDER || args->wrap_v == TCM_CLAMP_BORDER) {
+		const float *color =
+			map_gtt_offset(v.BorderColorPointer +
+				       gt.dynamic_state_base_address, &range);
+		ksim_assert(range >= sizeof(args->border_color));
+		for (int c = 0; c < 4; c++)
+			args->border_color[c] = color[c];
+	}
+}
+
+/* Origin and size of the mip levels accessible through the surface
+ * state, starting at the surface min LOD. */
+static void
+decode_surface_levels(struct sfid_sampler_args *args)
+{
+	const struct surface *tex = &args->tex;
+	int levels = tex->mip_count;
+	if (tex->min_lod + levels > 16)
+		levels = 16 - tex->min_lod;
+
+	args->max_level = levels - 1;
+	for (int l = 0; l < levels; l++) {
+		const int level = tex->min_lod + l;
+
+		surface_level_origin(tex, level, &args->level_x[l], &args->level_y[l]);
+		args->level_width[l] = max_u64(tex->width >> level, 1);
+		args->level_height[l] = max_u64(tex->height >> level, 1);
+		args->level_depth[l] = max_u64(tex->depth >> level, 1);
+	}
+}
+
+/* Texel coordinates along one axis for a sampler with a fixed level
+ * and filter: x[0] is the texel at or before the sample point and,
+ * when filtering, x[1] the one after it and frac the weight of x[1].
+ * The result is clamped to the level last, which also maps NaN
+ * coordinates to texel 0. */
+static void
+emit_texel_coords(struct kir_program *prog, struct kir_reg u, uint32_t wrap,
+		  float size, bool linear, struct kir_reg *x, struct kir_reg *frac)
+{
+	struct kir_reg s, xf[2], t;
+	const int count = linear ? 2 : 1;
+
+	if (wrap == TCM_WRAP)
+		u = kir_program_alu(prog, kir_subf, u, kir_program_alu(prog, kir_rndd, u));
+
+	s = kir_program_alu(prog, kir_mulf, u, kir_program_immf(prog, size));
+	if (linear)
+		s = kir_program_alu(prog, kir_subf, s, kir_program_immf(prog, 0.5f));
+	xf[0] = kir_program_alu(prog, kir_rndd, s);
+
+	if (linear) {
+		*frac = kir_program_alu(prog, kir_subf, s, xf[0]);
+		xf[1] = kir_program_alu(prog, kir_addf, xf[0], kir_program_immf(prog, 1.0f));
+	}
+
+	if (wrap == TCM_WRAP && linear) {
+		/* The wrapped coordinate is in [0, 1), so only the
+		 * filter taps just outside the level need wrapping. */
+		t = kir_program_alu(prog, kir_cmpf, kir_program_immf(prog, 0.0f), xf[0], _CMP_LT_OQ);
+		xf[0] = kir_program_alu(prog, kir_blend,
+					kir_program_alu(prog, kir_addf, xf[0], kir_program_immf(prog, size)),
+					xf[0], t);
+		t = kir_program_alu(prog, kir_cmpf, kir_program_immf(prog, size), xf[1], _CMP_GE_OQ);
+		xf[1] = kir_program_alu(prog, kir_blend,
+					kir_program_alu(prog, kir_subf, xf[1], kir_program_immf(prog, size)),
+					xf[1], t);
+	}
+
+	for (int i = 0; i < count; i++) {
+		/* maxf returns its first source if either is NaN. */
+		t = kir_program_alu(prog, kir_maxf, kir_program_immf(prog, 0.0f), xf[i]);
+		t = kir_program_alu(prog, kir_minf, t, kir_program_immf(prog, size - 1.0f));
+		x[i] = kir_program_alu(prog, kir_ps2d, t);
+	}
+}
+
+static struct kir_reg
+emit_texel_offset(struct kir_program *prog, const struct surface *tex,
+		  struct kir_reg x, struct kir_reg y)
+{
+	const int log2_cpp = __builtin_ffs(tex->cpp) - 1;
+	struct kir_reg u_bytes, tile_base, column, row;
+
+	if (tex->tile_mode == TILE_BLOCKED) {
+		struct kir_reg block, texel;
+
+		row = kir_program_alu(prog, kir_shri, y, 2);
+		row = kir_program_alu(prog, kir_muld, row,
+				      kir_program_immd(prog, tex->stride * 4));
+		block = kir_program_alu(prog, kir_and, x, kir_program_immd(prog, ~3));
+		block = kir_program_alu(prog, kir_shli, block, log2_cpp + 2);
+		texel = kir_program_alu(prog, kir_and, y, kir_program_immd(prog, 3));
+		texel = kir_program_alu(prog, kir_shli, texel, 2);
+		u_bytes = kir_program_alu(prog, kir_and, x, kir_program_immd(prog, 3));
+		texel = kir_program_alu(prog, kir_or, texel, u_bytes);
+		texel = kir_program_alu(prog, kir_shli, texel, log2_cpp);
+		row = kir_program_alu(prog, kir_addd, row, block);
+
+		return kir_program_alu(prog, kir_addd, row, texel);
+	}
+
+	u_bytes = kir_program_alu(prog, kir_shli, x, log2_cpp);
+
+	switch (tex->tile_mode) {
+	case LINEAR:
+		row = kir_program_alu(prog, kir_muld, y, kir_program_immd(prog, tex->stride));
+		return kir_program_alu(prog, kir_addd, u_bytes, row);
+
+	case XMAJOR:
+		tile_base = kir_program_alu(prog, kir_shri, y, 3);
+		tile_base = kir_program_alu(prog, kir_muld, tile_base,
+					    kir_program_immd(prog, 4096 * tex->stride / 512));
+		column = kir_program_alu(prog, kir_shri, u_bytes, 9);
+		column = kir_program_alu(prog, kir_shli, column, 12);
+		u_bytes = kir_program_alu(prog, kir_and, u_bytes, kir_program_immd(prog, 511));
+		row = kir_program_alu(prog, kir_and, y, kir_program_immd(prog, 0x7));
+		row = kir_program_alu(prog, kir_shli, row, 9);
+		break;
+
+	case YMAJOR:
+		tile_base = kir_program_alu(prog, kir_shri, y, 5);
+		tile_base = kir_program_alu(prog, kir_muld, tile_base,
+					    kir_program_immd(prog, 4096 * tex->stride / 128));
+		column = kir_program_alu(prog, kir_shri, u_bytes, 4);
+		column = kir_program_alu(prog, kir_shli, column, 9);
+		u_bytes = kir_program_alu(prog, kir_and, u_bytes, kir_program_immd(prog, 0xf));
+		row = kir_program_alu(prog, kir_and, y, kir_program_immd(prog, 0x1f));
+		row = kir_program_alu(prog, kir_shli, row, 4);
+		break;
+
+	default:
+		ksim_unreachable();
+	}
+
+	tile_base = kir_program_alu(prog, kir_addd, tile_base, row);
+	column = kir_program_alu(prog, kir_addd, column, u_bytes);
+
+	return kir_program_alu(prog, kir_addd, tile_base, column);
+}
+
+/* Gather the dwords of the texels at offset. Formats smaller than a
+ * dword read the bytes following the texel too, like
+ * load_format_simd8(). */
+static void
+emit_texel_fetch(struct kir_program *prog, const struct surface *tex,
+		 struct kir_reg offset, struct kir_reg *raw)
+{
+	const int dwords = tex->cpp < 4 ? 1 : tex->cpp / 4;
+
+	for (int d = 0; d < dwords; d++) {
+		/* vpgatherdd clears the mask, so it gets a fresh one. */
+		struct kir_reg base = kir_program_set_load_base_imm(prog, tex->pixels);
+		raw[d] = kir_program_gather(prog, base, offset,
+					    kir_program_immd(prog, -1), 1, d * 4);
+	}
+}
+
+/* Decode channel c of a texel, which must be in the format layout. */
+static struct kir_reg
+emit_texel_channel(struct kir_program *prog, const struct format_layout *layout,
+		   bool srgb, const struct kir_reg *raw, int c)
+{
+	const uint32_t bits = layout->bits[c];
+	const uint32_t shift = layout->offset[c] & 31;
+	struct kir_reg v = raw[layout->offset[c] / 32];
+
+	if (bits == 0) {
+		if (c < 3)
+			return kir_program_immd(prog, 0);
+		else if (layout->type == FORMAT_UINT || layout->type == FORMAT_SINT)
+			return kir_program_immd(prog, 1);
+		else
+			return kir_program_immf(prog, 1.0f);
+	}
+
+	if (bits == 32)
+		return v;
+
+	if (layout->type == FORMAT_SNORM || layout->type == FORMAT_SINT) {
+		/* Sign extend by moving the channel to the top. */
+		if (shift + bits < 32)
+			v = kir_program_alu(prog, kir_shli, v, 32 - shift - bits);
+		v = kir_program_alu(prog, kir_asr, kir_program_immd(prog, 32 - bits), v);
+	} else {
+		if (shift > 0)
+			v = kir_program_alu(prog, kir_shri, v, shift);
+		if (shift + bits < 32)
+			v = kir_program_alu(prog, kir_and, v,
+					    kir_program_immd(prog, (1u << bits) - 1));
+	}
+
+	switch (layout->type) {
+	case FORMAT_UNORM:
+		if (srgb && c < 3 && bits == 8) {
+			struct kir_reg base =
+				kir_program_set_load_base_imm(prog, (void *) srgb_decode_table);
+			return kir_program_gather(prog, base, v,
+						  kir_program_immd(prog, -1), 4, 0);
+		}
+		v = kir_program_alu(prog, kir_d2ps, v);
+		return kir_program_alu(prog, kir_mulf, v,
+				       kir_program_immf(prog, 1.0f / ((1u << bits) - 1)));
+	case FORMAT_SNORM:
+		v = kir_program_alu(prog, kir_d2ps, v);
+		v = kir_program_alu(prog, kir_mulf, v,
+				    kir_program_immf(prog, 1.0f / ((1u << (bits - 1)) - 1)));
+		return kir_program_alu(prog, kir_maxf, v, kir_program_immf(prog, -1.0f));
+	case FORMAT_UINT:
+	case FORMAT_SINT:
+		return v;
+	default:
+		ksim_unreachable();
+		return v;
+	}
+}
+
+/* Whether the sample message can be compiled to KIR. That covers
+ * non-block formats in the format layout table that decode without
+ * half or small floats, with a level and filter that are known when
+ * we compile. Everything else goes through the C helpers. */
+static bool
+sample_jit_supported(const struct sfid_sampler_args *args,
+		     const struct format_layout *layout, int *level, bool *linear)
+{
+	const struct surface *tex = &args->tex;
+
+	if (layout == NULL || tex->type != SURFTYPE_2D || tex->depth > 1 ||
+	    tex->minimum_array_element > 0 || args->gather ||
+	    format_block_size(tex->format) > 1 || !args->normalized ||
+	    !is_power_of_two(tex->cpp) || tex->cpp > 16)
+		return false;
+
+	if (tex->tile_mode != LINEAR && tex->tile_mode != XMAJOR &&
+	    tex->tile_mode != YMAJOR && tex->tile_mode != TILE_BLOCKED)
+		return false;
+
+	for (int c = 0; c < 4; c++)
+		if (layout->type == FORMAT_FLOAT &&
+		    layout->bits[c] != 0 && layout->bits[c] != 32)
+			return false;
+
+	if ((args->wrap_u != TCM_WRAP && args->wrap_u != TCM_CLAMP) ||
+	    (args->wrap_v != TCM_WRAP && args->wrap_v != TCM_CLAMP))
+		return false;
+
+	if (args->lod_mode == LOD_ZERO) {
+		float lod = 0.0f;
+
+		if (lod < args->min_lod)
+			lod = args->min_lod;
+		if (lod > args->max_lod)
+			lod = args->max_lod;
+
+		*linear = lod > 0.0f ? args->min_linear : args->mag_linear;
+		switch (args->mip_filter) {
+		case MIPFILTER_NEAREST:
+			*level = floorf(lod + 0.5f);
+			break;
+		case MIPFILTER_LINEAR:
+			if (lod != floorf(lod))
+				return false;
+			*level = lod;
+			break;
+		default:
+			*level = 0;
+			break;
+		}
+		if (*level > args->max_level)
+			*level = args->max_level;
+	} else if ((args->mip_filter == MIPFILTER_NONE || args->max_level == 0) &&
+		   args->min_linear == args->mag_linear) {
+		*level = 0;
+		*linear = args->min_linear;
+	} else {
+		return false;
+	}
+
+	*linear = *linear && args->filterable;
+
+	return true;
+}
+
+/* Compile a SIMD8 sample message to KIR, specialized on the format,
+ * tiling, level and sampler state. Returns false if the message
+ * needs the C helper. */
+static bool
+emit_sample_simd8(struct kir_program *prog, const struct sfid_sampler_args *args)
+{
+	const struct surface *tex = &args->tex;
+	const struct format_layout *layout = format_layout(tex->format);
+	const bool srgb = srgb_format(tex->format);
+	struct kir_reg u, v, x[2], y[2], fx, fy, offset, raw[4][4], t[4], c0, c1;
+	int level;
+	bool linear;
+
+	if (!sample_jit_supported(args, layout, &level, &linear))
+		return false;
+
+	kir_program_comment(prog, "sample format %d, tile mode %d, level %d, %s",
+			    tex->format, tex->tile_mode, level,
+			    linear ? "linear" : "nearest");
+
+	u = kir_program_load_v8(prog, offsetof(struct thread,
+					       grf[args->src + args->coord * args->stride]));
+	v = kir_program_load_v8(prog, offsetof(struct thread,
+					       grf[args->src + (args->coord + 1) * args->stride]));
+
+	emit_texel_coords(prog, u, args->wrap_u, args->level_width[level], linear, x, &fx);
+	emit_texel_coords(prog, v, args->wrap_v, args->level_height[level], linear, y, &fy);
+
+	const int count = linear ? 2 : 1;
+	for (int i = 0; i < count; i++) {
+		if (args->level_x[level] > 0)
+			x[i] = kir_program_alu(prog, kir_addd, x[i],
+					       kir_program_immd(prog, args->level_x[level]));
+		if (args->level_y[level] > 0)
+			y[i] = kir_program_alu(prog, kir_addd, y[i],
+					       kir_program_immd(prog, args->level_y[level]));
+	}
+
+	for (int j = 0; j < count; j++) {
+		for (int i = 0; i < count; i++) {
+			offset = emit_texel_offset(prog, tex, x[i], y[j]);
+			emit_texel_fetch(prog, tex, offset, raw[j * 2 + i]);
+		}
+	}
+
+	for (int c = 0; c < args->rlen; c++) {
+		if (!linear) {
+			t[0] = emit_texel_channel(prog, layout, srgb, raw[0], c);
+		} else {
+			for (int i = 0; i < 4; i++)
+				t[i] = emit_texel_channel(prog, layout, srgb, raw[i], c);
+
+			c0 = kir_program_alu(prog, kir_subf, t[1], t[0]);
+			c0 = kir_program_alu(prog, kir_maddf, fx, c0, t[0]);
+			c1 = kir_program_alu(prog, kir_subf, t[3], t[2]);
+			c1 = kir_program_alu(prog, kir_maddf, fx, c1, t[2]);
+			t[0] = kir_program_alu(prog, kir_subf, c1, c0);
+			t[0] = kir_program_alu(prog, kir_maddf, fy, t[0], c0);
+		}
+
+		kir_program_store_v8(prog, offsetof(struct thread,
+						    grf[args->dst + c * args->stride]), t[0]);
+	}
+
+	return true;
+}
+
 void
 builder_emit_sfid_sampler(struct kir_program *prog, struct inst *inst)
 {
 	struct inst_send send = unpack_inst_send(inst);
 	const int exec_size = 1 << unpack_inst_common(inst).exec_size;
 	struct sfid_sampler_args *args;
+	struct surface shadow;
 	void *func;
 	int num;
 
@@ -773,46 +1726,105 @@ builder_emit_sfid_sampler(struct kir_program *prog, struct inst *inst)
 	bool tex_valid = get_surface(prog->binding_table_address,
 				     d.binding_table_index, &args->tex);
 	ksim_assert(tex_valid);
-
-	switch (d.message_type) {
-	case SAMPLE_MESSAGE_LD:
-	case SAMPLE_MESSAGE_LD_LZ:
-		if (d.simd_mode == SIMD_MODE_SIMD8D_SIMD4x2 &&
-		    args->tex.tile_mode == LINEAR) {
-			/* We only handle 4x2, which on SKL requires
-			 * the simd mode extension bit in the header
-			 * to be set. Assert we have a header. */
-			ksim_assert(d.header_present);
-			ksim_assert(exec_size == 4);
+	fast_clear_resolve(&args->tex);
+
+	const bool ld = d.message_type == SAMPLE_MESSAGE_LD ||
+		d.message_type == SAMPLE_MESSAGE_LD_LZ;
+
+	if (ld && d.simd_mode == SIMD_MODE_SIMD8D_SIMD4x2) {
+		/* We only handle 4x2, which on SKL requires the simd
+		 * mode extension bit in the header to be set. Assert
+		 * we have a header. 4x2 loads are buffer loads and
+		 * buffers are always linear. */
+		ksim_assert(d.header_present);
+		ksim_assert(exec_size == 4);
+		if (args->tex.tile_mode == LINEAR) {
 			func = sfid_sampler_ld_simd4x2_linear;
-		} else if (d.simd_mode == SIMD_MODE_SIMD8 &&
-			   args->tex.tile_mode == LINEAR) {
+		} else {
+			stub("ld simd4x2 tile mode %d", args->tex.tile_mode);
+			func = sfid_sampler_noop_stub;
+		}
+	} else if (d.simd_mode != SIMD_MODE_SIMD8 &&
+		   d.simd_mode != SIMD_MODE_SIMD16) {
+		stub("sampler simd mode %d", d.simd_mode);
+		func = sfid_sampler_noop_stub;
+	} else if (ld) {
+		if (get_shadow_surface(&args->tex, &shadow))
+			args->tex = shadow;
+		decode_ld_message(d.message_type, args);
+		decode_surface_levels(args);
+
+		if (args->tex.tile_mode == LINEAR) {
 			func = sfid_sampler_ld_simd8_linear;
-		} else if (d.simd_mode == SIMD_MODE_SIMD16 &&
-			   args->tex.tile_mode == LINEAR) {
-			func = sfid_sampler_ld_simd16_linear;
+		} else if (args->tex.tile_mode == YMAJOR) {
+			func = sfid_sampler_ld_simd8_ymajor;
+		} else if (args->tex.tile_mode == XMAJOR) {
+			func = sfid_sampler_ld_simd8_xmajor;
+		} else if (args->tex.tile_mode == TILE_BLOCKED) {
+			func = sfid_sampler_ld_simd8_blocked;
 		} else {
-			stub("ld simd mode %d", d.simd_mode);
+			stub("ld tile mode %d", args->tex.tile_mode);
 			func = sfid_sampler_noop_stub;
 		}
-		break;
-	default:
+	} else {
+		if (get_shadow_surface(&args->tex, &shadow))
+			args->tex = shadow;
+		decode_sample_message(d.message_type, args);
+		decode_sampler_state(prog, d.sampler_index, args);
+		decode_surface_levels(args);
+
 		if (args->tex.tile_mode == LINEAR) {
 			func = sfid_sampler_sample_simd8_linear;
 		} else if (args->tex.tile_mode == YMAJOR) {
 			func = sfid_sampler_sample_simd8_ymajor;
 		} else if (args->tex.tile_mode == XMAJOR) {
 			func = sfid_sampler_sample_simd8_xmajor;
+		} else if (args->tex.tile_mode == TILE_BLOCKED) {
+			func = sfid_sampler_sample_simd8_blocked;
 		} else {
 			stub("sampler tile mode %d", args->tex.tile_mode);
 			func = sfid_sampler_noop_stub;
 		}
-		break;
 	}
 
+	args->rlen = send.rlen;
+	args->stride = 1;
+	args->quarter = prog->quarter;
+
+	const bool split = func != sfid_sampler_noop_stub &&
+		func != sfid_sampler_ld_simd4x2_linear && send.rlen > 0;
+	const bool sample = split && !ld;
+
+	if (split && d.simd_mode == SIMD_MODE_SIMD16) {
+		/* Split SIMD16 sample and LD messages into two SIMD8
+		 * halves. Both sends keep the full payload and
+		 * response range of the instruction. */
+		struct sfid_sampler_args *hi;
+
+		args->stride = 2;
+		args->rlen = send.rlen / 2;
+		hi = get_const_data(sizeof *hi, 8);
+		*hi = *args;
+		hi->src++;
+		hi->dst++;
+		hi->quarter++;
+
+		if (sample && emit_sample_simd8(prog, args)) {
+			emit_sample_simd8(prog, hi);
+			return;
+		}
+
+		kir_program_const_send(prog, inst, func, args);
+		kir_program_const_send(prog, inst, func, hi);
+		return;
+	}
+
+	if (sample && d.simd_mode == SIMD_MODE_SIMD8 &&
+	    emit_sample_simd8(prog, args))
+		return;
+
 	kir_program_const_send(prog, inst, func, args);
 
-	args->rlen = send.rlen;
 	if (args->rlen == 0) {
 		const uint32_t bti = 0; /* Should be M0.2 from header */
 		const uint32_t opcode = 12;
@@ -21,6 +21,7 @@
  * IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include <libpng16/png.h>
 #include "ksim.h"
 
@@ -44,18 +45,36 @@ get_surface(uint32_t binding_table_offset, int i, struct surface *s)
 	struct GEN9_RENDER_SURFACE_STATE v;
 	GEN9_RENDER_SURFACE_STATE_unpack(state, &v);
 
+	/* Null surfaces have no storage. Render target writes to them,
+	 * such as for unused MRT slots, are dropped. */
 	s->type = v.SurfaceType;
+	if (s->type == SURFTYPE_NULL)
+		return false;
+
 	s->width = v.Width + 1;
 	s->height = v.Height + 1;
+	s->depth = v.Depth + 1;
 	s->stride = v.SurfacePitch + 1;
 	s->format = v.SurfaceFormat;
 	s->cpp = format_size(s->format);
 	s->tile_mode = v.TileMode;
 	s->qpitch = v.SurfaceQPitch << 2;
 	s->minimum_array_element = v.MinimumArrayElement;
+	s->samples = 1 << v.NumberofMultisamples;
+	s->min_lod = v.SurfaceMinLOD;
+	s->mip_count = v.MIPCountLOD + 1;
+	s->clear_color[0] = v.RedClearColor;
+	s->clear_color[1] = v.GreenClearColor;
+	s->clear_color[2] = v.BlueClearColor;
+	s->clear_color[3] = v.AlphaClearColor;
 	s->pixels = map_gtt_offset(v.SurfaceBaseAddress, &range);
 
+	/* The alignment fields are in units of compression blocks
+	 * and encode 4, 8 or 16. */
 	const uint32_t block_size = format_block_size(s->format);
+	s->halign = (2 << v.SurfaceHorizontalAlignment) * block_size;
+	s->valign = (2 << v.SurfaceVerticalAlignment) * block_size;
+
 	const uint32_t height_in_blocks = DIV_ROUND_UP(s->height, block_size);
 
 	if (range < height_in_blocks * s->stride) {
@@ -66,6 +85,28 @@ get_surface(uint32_t binding_table_offset, int i, struct surface *s)
 	return true;
 }
 
+/* Position in pixels of a mip level within the array slice, in the
+ * gen9 2D layout: level 1 sits below level 0, and levels 2 and up
+ * are stacked below each other to the right of level 1. */
+void
+surface_level_origin(const struct surface *s, int level, int *x, int *y)
+{
+	const int h0 = align_u64(s->height, s->valign);
+
+	*x = 0;
+	*y = 0;
+	if (level == 0)
+		return;
+
+	*y = h0;
+	if (level == 1)
+		return;
+
+	*x = align_u64(max_u64(s->width >> 1, 1), s->halign);
+	for (int l = 2; l < level; l++)
+		*y += align_u64(max_u64(s->height >> l, 1), s->valign);
+}
+
 static char *
 detile_xmajor(struct surface *s, __m256i alpha)
 {
@@ -129,6 +170,25 @@ detile_ymajor(struct surface *s, __m256i alpha)
 	return pixels;
 }
 
+static void
+write_png(const char *filename, int width, int height, int stride,
+	  int format, const void *pixels)
+{
+	FILE *f = fopen(filename, "wb");
+	ksim_assert(f != NULL);
+
+	png_image pi = {
+		.version = PNG_IMAGE_VERSION,
+		.width = width,
+		.height = height,
+		.format = format
+	};
+
+	ksim_assert(png_image_write_to_stdio(&pi, f, 0, pixels, stride, NULL));
+
+	fclose(f);
+}
+
 void
 dump_surface(const char *filename, struct surface *s)
 {
@@ -182,20 +242,402 @@ dump_surface(const char *filename, struct surface *s)
 		break;
 	}
 
-	FILE *f = fopen(filename, "wb");
-	ksim_assert(f != NULL);
+	write_png(filename, s->width, s->height, s->stride, png_format, linear);
 
-	png_image pi = {
-		.version = PNG_IMAGE_VERSION,
-		.width = s->width,
-		.height = s->height,
-		.format = png_format
-	};
+	if (linear != s->pixels)
+		free(linear);
+}
 
-	ksim_assert(png_image_write_to_stdio(&pi, f, 0, linear, s->stride, NULL));
+void
+dump_rgba(const char *filename, int width, int height, const uint32_t *pixels)
+{
+	write_png(filename, width, height, width * 4, PNG_FORMAT_RGBA, pixels);
+}
 
-	fclose(f);
+/* Return the address of pixel x, y and the number of pixels from x
+ * that follow it contiguously in memory. */
+static void *
+surface_span(const struct surface *s, int x, int y, int *length)
+{
+	int n;
 
-	if (linear != s->pixels)
-		free(linear);
+	switch (s->tile_mode) {
+	case LINEAR:
+		*length = s->width - x;
+		return s->pixels + y * s->stride + x * s->cpp;
+	case XMAJOR:
+		ksim_assert(is_power_of_two(s->cpp));
+		n = 512 / s->cpp;
+		*length = n - (x & (n - 1));
+		return xmajor_offset(s->pixels, x, y, s->stride, s->cpp);
+	case YMAJOR:
+		ksim_assert(is_power_of_two(s->cpp));
+		n = 16 / s->cpp;
+		*length = n - (x & (n - 1));
+		return ymajor_offset(s->pixels, x, y, s->stride, s->cpp);
+	default:
+		ksim_unreachable("unsupported tile mode");
+		return NULL;
+	}
+}
+
+static void
+fill_bytes(void *p, uint32_t size, __m256i pattern)
+{
+	uint32_t i;
+
+	for (i = 0; i + 32 <= size; i += 32)
+		_mm256_storeu_si256(p + i, pattern);
+	for (; i + 16 <= size; i += 16)
+		_mm_storeu_si128(p + i, _mm256_castsi256_si128(pattern));
+	memcpy(p + i, &pattern, size - i);
+}
+
+static void
+fill_row(const struct surface *s, int x0, int x1, int y, __m256i pattern)
+{
+	int x = x0, n;
+
+	while (x < x1) {
+		void *p = surface_span(s, x, y, &n);
+		if (n > x1 - x)
+			n = x1 - x;
+		fill_bytes(p, n * s->cpp, pattern);
+		x += n;
+	}
+}
+
+/* Fill the rectangle r of the surface with pixel, which is in the
+ * surface format. */
+void
+surface_fill_rect(const struct surface *s, const struct rectangle *r,
+		  const void *pixel)
+{
+	uint8_t bytes[32];
+	__m256i pattern;
+
+	ksim_assert(32 % s->cpp == 0);
+	for (int i = 0; i < 32; i += s->cpp)
+		memcpy(bytes + i, pixel, s->cpp);
+	pattern = _mm256_loadu_si256((void *) bytes);
+
+	if (s->tile_mode != YMAJOR) {
+		for (int y = r->y0; y < r->y1; y++)
+			fill_row(s, r->x0, r->x1, y, pattern);
+		return;
+	}
+
+	/* The 16 byte columns of a row of Y-major tiles are 512 bytes
+	 * each and follow each other in memory, so where the rectangle
+	 * covers all 32 rows of a tile row, we fill the whole columns
+	 * in one go and only do the partial columns a row at a
+	 * time. */
+	const int column = 16 / s->cpp;
+	const int cx0 = align_u64(r->x0, column);
+	const int cx1 = r->x1 & ~(column - 1);
+
+	for (int y = r->y0; y < r->y1; ) {
+		if ((y & 31) || y + 32 > r->y1 || cx0 >= cx1) {
+			fill_row(s, r->x0, r->x1, y, pattern);
+			y++;
+			continue;
+		}
+
+		fill_bytes(ymajor_offset(s->pixels, cx0, y, s->stride, s->cpp),
+			   (cx1 - cx0) / column * 512, pattern);
+		for (int i = 0; i < 32; i++) {
+			fill_row(s, r->x0, cx0, y + i, pattern);
+			fill_row(s, cx1, r->x1, y + i, pattern);
+		}
+		y += 32;
+	}
+}
+
+static void
+store_bytes(void *d, const void *s, uint32_t size, bool streaming)
+{
+	uint32_t i = 0;
+
+	if (streaming && ((uintptr_t) d & 15) == 0)
+		for (; i + 16 <= size; i += 16)
+			_mm_stream_si128(d + i, _mm_loadu_si128(s + i));
+	memcpy(d + i, s + i, size - i);
+}
+
+/* Copy the rectangle r of the surface to the linear buffer dst, which
+ * has the given stride and starts at the top left corner of r. */
+void
+surface_read_rect(const struct surface *s, const struct rectangle *r,
+		  void *dst, uint32_t stride)
+{
+	for (int y = r->y0; y < r->y1; y++) {
+		void *row = dst + (y - r->y0) * stride - r->x0 * s->cpp;
+		int x = r->x0, n;
+
+		while (x < r->x1) {
+			void *p = surface_span(s, x, y, &n);
+			if (n > r->x1 - x)
+				n = r->x1 - x;
+			memcpy(row + x * s->cpp, p, n * s->cpp);
+			x += n;
+		}
+	}
+}
+
+/* The reverse of surface_read_rect(). With streaming set, the aligned
+ * parts of the spans are written with non-temporal stores, so they
+ * don't evict the tiles we're about to shade. */
+void
+surface_write_rect(const struct surface *s, const struct rectangle *r,
+		   const void *src, uint32_t stride, bool streaming)
+{
+	for (int y = r->y0; y < r->y1; y++) {
+		const void *row = src + (y - r->y0) * stride - r->x0 * s->cpp;
+		int x = r->x0, n;
+
+		while (x < r->x1) {
+			void *p = surface_span(s, x, y, &n);
+			if (n > r->x1 - x)
+				n = r->x1 - x;
+			store_bytes(p, row + x * s->cpp, n * s->cpp, streaming);
+			x += n;
+		}
+	}
+
+	if (streaming)
+		_mm_sfence();
+}
+
+/* Copy the rectangle r of src, offset by dx, dy, to r of dst. The
+ * surfaces must have the same format. */
+void
+surface_copy_rect(const struct surface *dst, const struct rectangle *r,
+		  const struct surface *src, int dx, int dy)
+{
+	ksim_assert(dst->cpp == src->cpp);
+
+	for (int y = r->y0; y < r->y1; y++) {
+		int x = r->x0, n, m;
+
+		while (x < r->x1) {
+			void *d = surface_span(dst, x, y, &n);
+			void *s = surface_span(src, x + dx, y + dy, &m);
+			if (n > m)
+				n = m;
+			if (n > r->x1 - x)
+				n = r->x1 - x;
+			memmove(d, s, n * dst->cpp);
+			x += n;
+		}
+	}
+}
+
+/* Shadow copies of hot tiled textures. Bilinear taps and the lanes
+ * of a sample message are close in x and y, but in X and Y tiles a
+ * step in y is 512 or 16 bytes away and the texture quickly spans
+ * more 4KB tiles than the TLB covers. Once a large tiled surface has
+ * been sampled by enough sample messages, we copy it to a layout of
+ * 4x4 texel blocks, in row major order, so that a 2x2 footprint
+ * touches at most four blocks and a block of 4 byte texels is one
+ * cache line. The sampler then reads the copy as a TILE_BLOCKED
+ * surface.
+ *
+ * A copy goes stale when its pixels are written, which is through
+ * GEM pwrite, a CPU map, the blitter, or a render target, depth or
+ * dataport write. Copies are only rebuilt or freed between draws,
+ * since the compiled shaders of the current draw point into them, and
+ * copies that weren't sampled in a batch are freed at the start of
+ * the next. */
+
+#define SHADOW_SURFACE_COUNT 16
+#define SHADOW_HOT_SAMPLES 8
+#define SHADOW_MIN_SIZE (256 * 1024)
+
+struct shadow_surface {
+	struct surface source;	/* source.pixels is NULL for free entries */
+	uint64_t size;		/* bytes of the source surface */
+	uint32_t samples;	/* sample messages since the last write */
+	bool valid;
+	bool used;		/* sampled in the current batch */
+	void *pixels;
+	uint64_t alloc_size;
+};
+
+static struct shadow_surface shadow_surfaces[SHADOW_SURFACE_COUNT];
+
+/* The number of rows covered by all levels and slices of s. */
+static uint64_t
+surface_rows(const struct surface *s)
+{
+	const int levels = min_u64(s->min_lod + s->mip_count, 16);
+	uint64_t rows = 0;
+	uint32_t slices;
+	int x, y;
+
+	for (int l = 0; l < levels; l++) {
+		const uint64_t h = max_u64(s->height >> l, 1);
+
+		surface_level_origin(s, l, &x, &y);
+		rows = max_u64(rows, y + align_u64(h, s->valign));
+	}
+
+	if (s->type == SURFTYPE_CUBE)
+		slices = s->depth * 6;
+	else if (s->type == SURFTYPE_3D)
+		slices = s->depth;
+	else
+		slices = s->depth + s->minimum_array_element;
+
+	return rows + (uint64_t) (slices - 1) * s->qpitch;
+}
+
+static bool
+shadow_overlaps(const struct shadow_surface *e, const void *p, uint64_t size)
+{
+	return e->source.pixels != NULL &&
+		p < e->source.pixels + e->size && e->source.pixels < p + size;
+}
+
+static void
+copy_to_shadow(struct shadow_surface *e)
+{
+	const struct surface *s = &e->source;
+	const uint32_t width = s->stride / s->cpp;
+	const uint64_t rows = e->size / s->stride;
+	const uint32_t block_size = 16 * s->cpp;
+	void *dst = e->pixels;
+	int n;
+
+	for (uint64_t y = 0; y < rows; y += 4) {
+		for (uint32_t x = 0; x < width; x += 4) {
+			for (uint32_t i = 0; i < 4; i++) {
+				for (uint32_t j = 0; j < 4; j += n) {
+					void *src = surface_span(s, x + j, y + i, &n);
+
+					n = min_u64(n, 4 - j);
+					memcpy(dst + (i * 4 + j) * s->cpp, src, n * s->cpp);
+				}
+			}
+			dst += block_size;
+		}
+	}
+}
+
+/* Look up the shadow copy of the tiled texture s and count one more
+ * sample message against it. Returns true and fills out shadow when
+ * there is a valid copy to sample from instead. */
+bool
+get_shadow_surface(const struct surface *s, struct surface *shadow)
+{
+	struct shadow_surface *e = NULL, *free_entry = NULL;
+
+	if (!texture_shadow_enable)
+		return false;
+
+	if ((s->tile_mode != XMAJOR && s->tile_mode != YMAJOR) ||
+	    format_block_size(s->format) > 1 ||
+	    !is_power_of_two(s->cpp) || s->cpp > 16)
+		return false;
+
+	const uint32_t tile_height = s->tile_mode == YMAJOR ? 32 : 8;
+	const uint64_t size = align_u64(surface_rows(s), tile_height) * s->stride;
+	if (size < SHADOW_MIN_SIZE)
+		return false;
+
+	for (int i = 0; i < SHADOW_SURFACE_COUNT; i++) {
+		struct shadow_surface *c = &shadow_surfaces[i];
+
+		if (c->source.pixels == s->pixels && c->source.cpp == s->cpp &&
+		    c->source.stride == s->stride &&
+		    c->source.tile_mode == s->tile_mode && c->size >= size) {
+			e = c;
+			break;
+		}
+		if (free_entry == NULL && !c->used)
+			free_entry = c;
+	}
+
+	if (e == NULL) {
+		if (free_entry == NULL)
+			return false;
+
+		e = free_entry;
+		e->source = *s;
+		e->size = size;
+		e->samples = 0;
+		e->valid = false;
+	}
+
+	e->used = true;
+	if (!e->valid) {
+		if (++e->samples < SHADOW_HOT_SAMPLES)
+			return false;
+
+		if (e->alloc_size < size) {
+			free(e->pixels);
+			e->pixels = aligned_alloc(4096, size);
+			e->alloc_size = e->pixels ? size : 0;
+			if (e->pixels == NULL)
+				return false;
+		}
+
+		trace(TRACE_DEBUG, "shadow copy of %p, %ld bytes\n",
+		      e->source.pixels, e->size);
+		copy_to_shadow(e);
+		e->valid = true;
+	}
+
+	*shadow = *s;
+	shadow->pixels = e->pixels;
+	shadow->tile_mode = TILE_BLOCKED;
+
+	return true;
+}
+
+void
+invalidate_shadow_range(const void *p, uint64_t size)
+{
+	for (int i = 0; i < SHADOW_SURFACE_COUNT; i++) {
+		struct shadow_surface *e = &shadow_surfaces[i];
+
+		if (shadow_overlaps(e, p, size)) {
+			e->valid = false;
+			e->samples = 0;
+		}
+	}
+}
+
+void
+invalidate_shadow_surface(const struct surface *s)
+{
+	uint64_t size;
+
+	/* Buffer sizes are split over the width, height and depth
+	 * fields. */
+	if (s->type == SURFTYPE_BUFFER)
+		size = ((uint64_t) (s->depth - 1) << 21 | (s->height - 1) << 7 |
+			(s->width - 1)) + 1;
+	else
+		size = surface_rows(s);
+
+	invalidate_shadow_range(s->pixels, size * s->stride);
+}
+
+/* Free the copies and counters of the surfaces that weren't sampled
+ * in the last batch. */
+void
+start_shadow_batch(void)
+{
+	for (int i = 0; i < SHADOW_SURFACE_COUNT; i++) {
+		struct shadow_surface *e = &shadow_surfaces[i];
+
+		if (!e->used) {
+			free(e->pixels);
+			e->pixels = NULL;
+			e->alloc_size = 0;
+			e->source.pixels = NULL;
+			e->valid = false;
+		}
+		e->used = false;
+	}
 }
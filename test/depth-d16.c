@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Runs the D16 depth load and store helpers on one 4x2 block of a Y
+ * tile. */
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "../ksim.h"
+#include "../kir.h"
+
+uint32_t trace_mask = 0;
+uint32_t breakpoint_mask = 0;
+FILE *trace_file;
+
+struct d16_thread {
+	struct thread t;
+	void *base;
+	void *out;
+	struct reg value;
+	struct reg mask;
+};
+
+/* Word index in the tile of each pixel of the 4x2 block. */
+static const int block_words[8] = { 0, 1, 2, 3, 8, 9, 10, 11 };
+
+static void
+check_d16_load(void)
+{
+	uint16_t tile[32] __attribute__((__aligned__(32)));
+	struct d16_thread t;
+	struct kir_program prog;
+	struct kir_reg base, out, depth;
+	struct reg result;
+
+	for (int i = 0; i < 32; i++)
+		tile[i] = 0x1000 + i;
+	t.base = tile;
+	t.out = &result;
+
+	reset_shader_pool();
+	kir_program_init(&prog, 0, 0);
+	base = kir_program_set_load_base_indirect(&prog, offsetof(struct d16_thread, base));
+	depth = emit_load_d16(&prog, base);
+	out = kir_program_set_load_base_indirect(&prog, offsetof(struct d16_thread, out));
+	kir_program_mask_store(&prog, out, 0, depth, kir_program_immd(&prog, -1));
+	kir_program_add_insn(&prog, kir_eot);
+	kir_program_finish(&prog)(&t.t);
+
+	for (int c = 0; c < 8; c++) {
+		if (result.ud[c] != tile[block_words[c]]) {
+			printf("d16 load: channel %d: got 0x%x, expected 0x%x\n",
+			       c, result.ud[c], tile[block_words[c]]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void
+check_d16_store(void)
+{
+	uint16_t tile[32] __attribute__((__aligned__(32)));
+	struct d16_thread t;
+	struct kir_program prog;
+	struct kir_reg base, depth, value, mask;
+
+	for (int i = 0; i < 32; i++)
+		tile[i] = 0x1000 + i;
+	t.base = tile;
+
+	/* Write the odd channels only, the even channels and the rest
+	 * of the tile must keep their depth. */
+	for (int c = 0; c < 8; c++) {
+		t.value.ud[c] = 0xa000 + c;
+		t.mask.ud[c] = (c & 1) ? ~0u : 0;
+	}
+
+	reset_shader_pool();
+	kir_program_init(&prog, 0, 0);
+	base = kir_program_set_load_base_indirect(&prog, offsetof(struct d16_thread, base));
+	depth = emit_load_d16(&prog, base);
+	value = kir_program_load_v8(&prog, offsetof(struct d16_thread, value));
+	mask = kir_program_load_v8(&prog, offsetof(struct d16_thread, mask));
+	emit_store_d16(&prog, base, value, depth, mask);
+	kir_program_add_insn(&prog, kir_eot);
+	kir_program_finish(&prog)(&t.t);
+
+	for (int i = 0; i < 32; i++) {
+		uint16_t expected = 0x1000 + i;
+
+		for (int c = 1; c < 8; c += 2)
+			if (block_words[c] == i)
+				expected = 0xa000 + c;
+
+		if (tile[i] != expected) {
+			printf("d16 store: word %d: got 0x%x, expected 0x%x\n",
+			       i, tile[i], expected);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	trace_file = stdout;
+
+	check_d16_load();
+	check_d16_store();
+
+	return EXIT_SUCCESS;
+}
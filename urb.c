@@ -29,6 +29,12 @@ struct free_urb {
 	uint32_t next;
 };
 
+/* Reference counts for URB entries, indexed by URB handle. An entry
+ * starts out with one reference and only goes back on the free list
+ * when the last one is dropped. The post-transform vertex cache uses
+ * this to hand the same VS entry to several primitives. */
+static uint16_t urb_refs[URB_SIZE / 64];
+
 void
 set_urb_allocation(struct urb *urb, uint32_t address, uint32_t size, uint32_t total)
 {
@@ -59,9 +65,26 @@ alloc_urb_entry(struct urb *urb)
 	ksim_assert(p >= urb->data && p < urb->data + urb->total * urb->size);
 	ksim_assert(p >= (void *) gt.urb && p < (void *) gt.urb + sizeof(gt.urb));
 
+	urb_refs[urb_entry_to_handle(p)] = 1;
+
 	return p;
 }
 
+void
+ref_urb_entry(void *entry)
+{
+	uint32_t handle = urb_entry_to_handle(entry);
+
+	ksim_assert(urb_refs[handle] > 0 && urb_refs[handle] < UINT16_MAX);
+	urb_refs[handle]++;
+}
+
+bool
+urb_full(struct urb *urb)
+{
+	return urb->free_list == URB_EMPTY && urb->count == urb->total;
+}
+
 void
 free_urb_entry(struct urb* urb, void *entry)
 {
@@ -70,6 +93,11 @@ free_urb_entry(struct urb* urb, void *entry)
 	ksim_assert(entry >= urb->data &&
 		    entry < urb->data + urb->total * urb->size);
 
+	uint32_t handle = urb_entry_to_handle(entry);
+	ksim_assert(urb_refs[handle] > 0);
+	if (--urb_refs[handle] > 0)
+		return;
+
 	f->next = urb->free_list;
 	urb->free_list = entry - urb->data;
 }
@@ -41,39 +41,69 @@ struct dispatch {
 	struct reg int_w2, int_w1;
 	struct reg w2, w1;
 	struct reg w2_pc, w1_pc;
+	void *depth;
+	void *stencil;
+	struct reg stencil_value;
 	int x, y;
 };
 
 struct ps_primitive {
 	float w_deltas[4];
+	float inv_w_deltas[4];
 	int32_t area;
+	bool back_facing;
 	struct edge e01, e12, e20;
+
+	/* Edge function offsets from the pixel center to each sample
+	 * position, when multisampling. */
+	int32_t w2_sample[8], w0_sample[8], w1_sample[8];
 	struct reg attribute_deltas[64];
 
-	/* Tile iterator step values */
-	__m256i w2_offsets, w0_offsets, w1_offsets;
+	/* Tile iterator step values. The iterator steps through the
+	 * tile in 8x4 groups and the offsets are per 4x2 block in the
+	 * group. */
+	__m256i w2_offsets[4], w0_offsets[4], w1_offsets[4];
 	__m256i w2_step, w0_step, w1_step;
 	__m256i w2_row_step, w0_row_step, w1_row_step;
 };
 
+static const uint32_t perspective_modes =
+	BIM_PERSPECTIVE_PIXEL | BIM_PERSPECTIVE_CENTROID | BIM_PERSPECTIVE_SAMPLE;
+
 struct ps_thread {
 	struct thread t;
 	struct reg grf0;
-	struct dispatch queue[2];
+	struct dispatch queue[4];
 	int queue_length;
+	int queue_size;
 
 	float inv_area;
 	float w_deltas[4];
-	void *depth;
+	float inv_w_deltas[4];
 	int32_t e01_bias;
 	int32_t e20_bias;
+	uint32_t back_facing;
+	float sample_w_deltas[8];
 	struct reg attribute_deltas[64];
 
 	uint32_t invocation_count;
+	uint32_t dispatch_count[3];
+	uint32_t pixel_count;
+	uint32_t live_blocks;
+	uint32_t depth_killed_count;
 };
 
+struct ps_stats ps_stats;
+
+/* Per-pixel pixel shader invocations or cycles, accumulated over all
+ * draws for --heatmap. */
+static struct {
+	uint32_t width, height;
+	uint64_t *values;
+} heatmap;
+
 static void
-emit_barycentric_conversion(struct kir_program *prog)
+emit_barycentric_conversion(struct kir_program *prog, int width)
 {
 	kir_program_comment(prog, "compute barycentric coordinates");
 	struct kir_reg inv_area =
@@ -82,325 +112,1447 @@ emit_barycentric_conversion(struct kir_program *prog)
 		kir_program_load_uniform(prog, offsetof(struct ps_thread, e01_bias));
 	struct kir_reg e20_bias =
 		kir_program_load_uniform(prog, offsetof(struct ps_thread, e20_bias));
-	struct kir_reg w2 =
-		kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].int_w2));
-	struct kir_reg w1 =
-		kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].int_w1));
 
-	w2 = kir_program_alu(prog, kir_addd, w2, e01_bias);
-	w1 = kir_program_alu(prog, kir_addd, w1, e20_bias);
-	w2 = kir_program_alu(prog, kir_d2ps, w2);
-	w1 = kir_program_alu(prog, kir_d2ps, w1);
-	w2 = kir_program_alu(prog, kir_mulf, w2, inv_area);
-	w1 = kir_program_alu(prog, kir_mulf, w1, inv_area);
+	/* The VUE w component holds 1/w after the perspective divide,
+	 * which interpolates linearly in screen space. Interpolate it
+	 * once per pixel and use the reciprocal to weigh the screen
+	 * space barycentrics:
+	 *
+	 *   w1_pc = w1 * q1 / (q0 + w1 * (q1 - q0) + w2 * (q2 - q0))
+	 *
+	 * and similar for w2_pc. All attributes share the result.
+	 */
+	const bool perspective = gt.wm.barycentric_mode & perspective_modes;
+	struct kir_reg dq1, dq2, q0, q1, q2, two;
+	if (perspective) {
+		dq1 = kir_program_load_uniform(prog, offsetof(struct ps_thread, inv_w_deltas[0]));
+		dq2 = kir_program_load_uniform(prog, offsetof(struct ps_thread, inv_w_deltas[1]));
+		q0 = kir_program_load_uniform(prog, offsetof(struct ps_thread, inv_w_deltas[3]));
+		q1 = kir_program_alu(prog, kir_addf, dq1, q0);
+		q2 = kir_program_alu(prog, kir_addf, dq2, q0);
+		two = kir_program_immf(prog, 2.0f);
+	}
+
+	for (int q = 0; q < width / 8; q++) {
+		struct kir_reg w2 =
+			kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q].int_w2));
+		struct kir_reg w1 =
+			kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q].int_w1));
+
+		w2 = kir_program_alu(prog, kir_addd, w2, e01_bias);
+		w1 = kir_program_alu(prog, kir_addd, w1, e20_bias);
+		w2 = kir_program_alu(prog, kir_d2ps, w2);
+		w1 = kir_program_alu(prog, kir_d2ps, w1);
+		w2 = kir_program_alu(prog, kir_mulf, w2, inv_area);
+		w1 = kir_program_alu(prog, kir_mulf, w1, inv_area);
+
+		kir_program_store_v8(prog, offsetof(struct ps_thread, queue[q].w1), w1);
+		kir_program_store_v8(prog, offsetof(struct ps_thread, queue[q].w2), w2);
+
+		if (!perspective)
+			continue;
+
+		kir_program_alu(prog, kir_maddf, w1, dq1, q0);
+		struct kir_reg iw = kir_program_alu(prog, kir_maddf, w2, dq2, prog->dst);
+
+		/* NR step: w = w0 * (2 - iw * w0) */
+		struct kir_reg w0 = kir_program_alu(prog, kir_rcp, iw);
+		kir_program_alu(prog, kir_nmaddf, iw, w0, two);
+		struct kir_reg w = kir_program_alu(prog, kir_mulf, w0, prog->dst);
+
+		kir_program_alu(prog, kir_mulf, q1, w);
+		kir_program_alu(prog, kir_mulf, w1, prog->dst);
+		kir_program_store_v8(prog, offsetof(struct ps_thread, queue[q].w1_pc), prog->dst);
+
+		kir_program_alu(prog, kir_mulf, q2, w);
+		kir_program_alu(prog, kir_mulf, w2, prog->dst);
+		kir_program_store_v8(prog, offsetof(struct ps_thread, queue[q].w2_pc), prog->dst);
+	}
+}
+
+static inline bool
+stencil_test_enabled(void)
+{
+	return gt.stencil.enable && gt.stencil.test_enable;
+}
 
-	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].w1), w1);
-	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].w1_pc), w1);
-	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].w2), w2);
-	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].w2_pc), w2);
+static inline bool
+stencil_write_enabled(void)
+{
+	return stencil_test_enabled() && gt.stencil.write_enable;
 }
 
 static void
-emit_depth_test(struct kir_program *prog)
+write_stencil(struct dispatch *d)
 {
-	struct kir_reg base, depth;
+	/* Pick the low byte of each dword and move the upper lane
+	 * bytes next to the lower lane bytes. */
+	const __m256i bytes =
+		_mm256_shuffle_epi8(d->stencil_value.ireg,
+				    _mm256_set1_epi32(0x0c080400));
+	const __m256i packed =
+		_mm256_permutevar8x32_epi32(bytes,
+					    _mm256_set_epi32(0, 0, 0, 0, 0, 0, 4, 0));
+
+	_mm_storel_epi64(d->stencil, _mm256_castsi256_si128(packed));
+}
+
+static struct kir_reg
+emit_not(struct kir_program *prog, struct kir_reg reg)
+{
+	kir_program_immd(prog, -1);
+	return kir_program_alu(prog, kir_xor, reg, prog->dst);
+}
+
+/* Integer compare, a function b. We use signed dword compares, which
+ * work since stencil and unorm depth values are at most 24 bits. */
+static struct kir_reg
+emit_compare_d(struct kir_program *prog, uint32_t function,
+	       struct kir_reg a, struct kir_reg b)
+{
+	switch (function) {
+	case COMPAREFUNCTION_ALWAYS:
+		return kir_program_immd(prog, -1);
+	case COMPAREFUNCTION_NEVER:
+		return kir_program_immd(prog, 0);
+	case COMPAREFUNCTION_LESS:
+		return kir_program_alu(prog, kir_cmpgtd, a, b);
+	case COMPAREFUNCTION_EQUAL:
+		return kir_program_alu(prog, kir_cmpeqd, a, b);
+	case COMPAREFUNCTION_LEQUAL:
+		return emit_not(prog, kir_program_alu(prog, kir_cmpgtd, b, a));
+	case COMPAREFUNCTION_GREATER:
+		return kir_program_alu(prog, kir_cmpgtd, b, a);
+	case COMPAREFUNCTION_NOTEQUAL:
+		return emit_not(prog, kir_program_alu(prog, kir_cmpeqd, a, b));
+	case COMPAREFUNCTION_GEQUAL:
+		return emit_not(prog, kir_program_alu(prog, kir_cmpgtd, a, b));
+	default:
+		ksim_unreachable("invalid compare function");
+	}
+}
+
+static struct kir_reg
+emit_stencil_op(struct kir_program *prog, uint32_t op,
+		struct kir_reg stencil, uint8_t ref)
+{
+	struct kir_reg one, step, value;
+
+	switch (op) {
+	case STENCILOP_KEEP:
+		return stencil;
+	case STENCILOP_ZERO:
+		return kir_program_immd(prog, 0);
+	case STENCILOP_REPLACE:
+		return kir_program_immd(prog, ref);
+	case STENCILOP_INCRSAT:
+		/* The inverted compare is -1 unless we're saturated. */
+		kir_program_immd(prog, 255);
+		kir_program_alu(prog, kir_cmpeqd, stencil, prog->dst);
+		step = emit_not(prog, prog->dst);
+		return kir_program_alu(prog, kir_subd, stencil, step);
+	case STENCILOP_DECRSAT:
+		kir_program_immd(prog, 0);
+		kir_program_alu(prog, kir_cmpeqd, stencil, prog->dst);
+		step = emit_not(prog, prog->dst);
+		return kir_program_alu(prog, kir_addd, stencil, step);
+	case STENCILOP_INCR:
+		one = kir_program_immd(prog, 1);
+		value = kir_program_alu(prog, kir_addd, stencil, one);
+		kir_program_immd(prog, 255);
+		return kir_program_alu(prog, kir_and, value, prog->dst);
+	case STENCILOP_DECR:
+		one = kir_program_immd(prog, 1);
+		value = kir_program_alu(prog, kir_subd, stencil, one);
+		kir_program_immd(prog, 255);
+		return kir_program_alu(prog, kir_and, value, prog->dst);
+	case STENCILOP_INVERT:
+		kir_program_immd(prog, 255);
+		return kir_program_alu(prog, kir_xor, stencil, prog->dst);
+	default:
+		ksim_unreachable("invalid stencil op");
+	}
+}
+
+/* Run the stencil test and pick the new stencil values for one face.
+ * Returns the new values and sets *pass to the pixels that pass both
+ * the stencil and the depth test. */
+static struct kir_reg
+emit_stencil_face(struct kir_program *prog, const struct stencil_face *face,
+		  struct kir_reg stencil, struct kir_reg mask,
+		  struct kir_reg depth_pass, struct kir_reg *pass)
+{
+	kir_program_immd(prog, face->test_mask);
+	struct kir_reg masked = kir_program_alu(prog, kir_and, stencil, prog->dst);
+	struct kir_reg ref = kir_program_immd(prog, face->ref & face->test_mask);
+	struct kir_reg stencil_pass =
+		emit_compare_d(prog, face->test_function, ref, masked);
+
+	struct kir_reg fail = emit_stencil_op(prog, face->fail_op, stencil, face->ref);
+	struct kir_reg passed;
+	if (gt.depth.test_enable) {
+		struct kir_reg depth_fail =
+			emit_stencil_op(prog, face->depth_fail_op, stencil, face->ref);
+		struct kir_reg depth_passed =
+			emit_stencil_op(prog, face->pass_op, stencil, face->ref);
+		passed = kir_program_alu(prog, kir_blend, depth_passed, depth_fail, depth_pass);
+		*pass = kir_program_alu(prog, kir_and, stencil_pass, depth_pass);
+	} else {
+		passed = emit_stencil_op(prog, face->pass_op, stencil, face->ref);
+		*pass = stencil_pass;
+	}
+
+	struct kir_reg value = kir_program_alu(prog, kir_blend, passed, fail, stencil_pass);
+
+	if (face->write_mask != 0xff) {
+		struct kir_reg write_mask = kir_program_immd(prog, face->write_mask);
+		value = kir_program_alu(prog, kir_and, value, write_mask);
+		kir_program_alu(prog, kir_andn, stencil, write_mask);
+		value = kir_program_alu(prog, kir_or, value, prog->dst);
+	}
+
+	/* Only covered pixels update the stencil buffer. */
+	return kir_program_alu(prog, kir_blend, value, stencil, mask);
+}
+
+/* Stencil test the block and update the stencil values in the
+ * dispatch, which run_ps() writes back. Returns the mask of pixels
+ * that pass both stencil and depth test. */
+static struct kir_reg
+emit_stencil_test(struct kir_program *prog, int q,
+		  struct kir_reg mask, struct kir_reg depth_pass)
+{
+	struct kir_reg pass, back_pass;
+
+	kir_program_comment(prog, "stencil test");
+	struct kir_reg stencil =
+		kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q].stencil_value));
+
+	struct kir_reg value =
+		emit_stencil_face(prog, &gt.stencil.front, stencil, mask, depth_pass, &pass);
+
+	if (gt.stencil.double_sided) {
+		struct kir_reg back_value =
+			emit_stencil_face(prog, &gt.stencil.back, stencil, mask, depth_pass, &back_pass);
+		struct kir_reg back_facing =
+			kir_program_load_uniform(prog, offsetof(struct ps_thread, back_facing));
+		value = kir_program_alu(prog, kir_blend, back_value, value, back_facing);
+		pass = kir_program_alu(prog, kir_blend, back_pass, pass, back_facing);
+	}
+
+	if (gt.stencil.write_enable)
+		kir_program_store_v8(prog, offsetof(struct ps_thread, queue[q].stencil_value), value);
+
+	return kir_program_alu(prog, kir_and, mask, pass);
+}
+
+/* Clamp the computed depth to [0, 1] and convert to unorm, rounding
+ * to nearest. vcvtps2dq truncates with the csr we run the shaders
+ * with, so add 0.5 first. */
+static struct kir_reg
+emit_depth_to_unorm(struct kir_program *prog, struct kir_reg w, float scale)
+{
+	kir_program_immf(prog, 0.0f);
+	kir_program_alu(prog, kir_maxf, w, prog->dst);
+	struct kir_reg clamped = prog->dst;
+	kir_program_immf(prog, 1.0f);
+	kir_program_alu(prog, kir_minf, clamped, prog->dst);
+	struct kir_reg r = prog->dst;
+	kir_program_immf(prog, scale);
+	r = kir_program_alu(prog, kir_mulf, r, prog->dst);
+	kir_program_immf(prog, 0.5f);
+	kir_program_alu(prog, kir_addf, r, prog->dst);
+
+	return kir_program_alu(prog, kir_ps2d, prog->dst);
+}
+
+static const uint32_t gen_function_to_avx2[] = {
+	[COMPAREFUNCTION_ALWAYS]	= _CMP_TRUE_US,
+	[COMPAREFUNCTION_NEVER]		= _CMP_FALSE_OS,
+	[COMPAREFUNCTION_LESS]		= _CMP_LT_OS,
+	[COMPAREFUNCTION_EQUAL]		= _CMP_EQ_OS,
+	[COMPAREFUNCTION_LEQUAL]	= _CMP_LE_OS,
+	[COMPAREFUNCTION_GREATER]	= _CMP_GT_OS,
+	[COMPAREFUNCTION_NOTEQUAL]	= _CMP_NEQ_OS,
+	[COMPAREFUNCTION_GEQUAL]	= _CMP_GE_OS,
+};
 
+static struct kir_reg
+emit_compute_depth(struct kir_program *prog, int q)
+{
 	kir_program_comment(prog, "compute depth");
 	struct kir_reg b =
 		kir_program_load_uniform(prog, offsetof(struct ps_thread, w_deltas[1]));
 	struct kir_reg c =
 		kir_program_load_uniform(prog, offsetof(struct ps_thread, w_deltas[3]));
-	kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].w2));
+	kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q].w2));
 	struct kir_reg d = kir_program_alu(prog, kir_maddf, b, prog->dst, c);
 
 	struct kir_reg a =
 		kir_program_load_uniform(prog, offsetof(struct ps_thread, w_deltas[0]));
-	kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].w1));
+	kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q].w1));
 	struct kir_reg w =
 		kir_program_alu(prog, kir_maddf, a, prog->dst, d);
 
-	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].w), w);
+	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[q].w), w);
 
 	struct kir_reg z = kir_program_alu(prog, kir_rcp, w);
-	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].z), z);
+	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[q].z), z);
 
-	if (!gt.depth.test_enable && !gt.depth.write_enable)
-		return;
+	return w;
+}
+
+static struct kir_reg
+emit_depth_test_block(struct kir_program *prog, int q)
+{
+	struct kir_reg base, depth;
+	struct kir_reg w = emit_compute_depth(prog, q);
+
+	struct kir_reg mask =
+		kir_program_load_v8(prog, offsetof(struct thread, mask[0].q[q]));
+
+	if (!gt.depth.test_enable && !gt.depth.write_enable) {
+		if (stencil_test_enabled()) {
+			mask = emit_stencil_test(prog, q, mask, mask);
+			kir_program_store_v8(prog, offsetof(struct thread, mask[0].q[q]), mask);
+		}
+		return mask;
+	}
 
 	kir_program_comment(prog, "load depth");
-	base = kir_program_set_load_base_indirect(prog, offsetof(struct ps_thread, depth));
+	base = kir_program_set_load_base_indirect(prog, offsetof(struct ps_thread, queue[q].depth));
+
+	/* We compare and store unorm depth as integers so that depth
+	 * rounds the same way in the test and in the buffer. */
+	struct kir_reg computed_depth;
 	switch (gt.depth.format) {
 	case D32_FLOAT:
 		depth = kir_program_load(prog, base, 0);
+		computed_depth = w;
 		break;
 	case D24_UNORM_X8_UINT:
 		depth = kir_program_load(prog, base, 0);
-		depth = kir_program_alu(prog, kir_d2ps, depth);
-		kir_program_immf(prog, 1.0f / 16777215.0f);
-		depth = kir_program_alu(prog, kir_mulf, depth, prog->dst);
+		kir_program_immd(prog, 0xffffff);
+		depth = kir_program_alu(prog, kir_and, depth, prog->dst);
+		computed_depth = emit_depth_to_unorm(prog, w, 16777215.0f);
 		break;
 	case D16_UNORM:
-		stub("D16_UNORM");
+		depth = emit_load_d16(prog, base);
+		computed_depth = emit_depth_to_unorm(prog, w, 65535.0f);
+		break;
 	default:
 		ksim_unreachable("invalid depth format");
 	}
 
-	/* Swizzle two middle pixel pairs so that dword 0-3 and 4-7
-	 * match the shader dispatch subspan ordering. */
-	// d_f.ireg = _mm256_permute4x64_epi64(d_f.ireg, SWIZZLE(0, 2, 1, 3));
-
-	struct kir_reg computed_depth = w;
-	struct kir_reg mask =
-		kir_program_load_v8(prog, offsetof(struct ps_thread, t.mask[0].q[0]));
-
 	if (gt.depth.test_enable) {
 		kir_program_comment(prog, "depth test");
 
-		static const uint32_t gen_function_to_avx2[] = {
-			[COMPAREFUNCTION_ALWAYS]	= _CMP_TRUE_US,
-			[COMPAREFUNCTION_NEVER]		= _CMP_FALSE_OS,
-			[COMPAREFUNCTION_LESS]		= _CMP_LT_OS,
-			[COMPAREFUNCTION_EQUAL]		= _CMP_EQ_OS,
-			[COMPAREFUNCTION_LEQUAL]	= _CMP_LE_OS,
-			[COMPAREFUNCTION_GREATER]	= _CMP_GT_OS,
-			[COMPAREFUNCTION_NOTEQUAL]	= _CMP_NEQ_OS,
-			[COMPAREFUNCTION_GEQUAL]	= _CMP_GE_OS,
-		};
+		struct kir_reg depth_pass;
+		if (gt.depth.format == D32_FLOAT)
+			depth_pass = kir_program_alu(prog, kir_cmpf, computed_depth, depth,
+						     gen_function_to_avx2[gt.depth.test_function]);
+		else
+			depth_pass = emit_compare_d(prog, gt.depth.test_function,
+						    depth, computed_depth);
 
-		kir_program_alu(prog, kir_cmpf, computed_depth, depth,
-				gen_function_to_avx2[gt.depth.test_function]);
-		mask = kir_program_alu(prog, kir_and, mask, prog->dst);
-		kir_program_store_v8(prog, offsetof(struct ps_thread, t.mask[0].q[0]), mask);
+		if (stencil_test_enabled())
+			mask = emit_stencil_test(prog, q, mask, depth_pass);
+		else
+			mask = kir_program_alu(prog, kir_and, mask, depth_pass);
+		kir_program_store_v8(prog, offsetof(struct thread, mask[0].q[q]), mask);
+	} else if (stencil_test_enabled()) {
+		mask = emit_stencil_test(prog, q, mask, mask);
+		kir_program_store_v8(prog, offsetof(struct thread, mask[0].q[q]), mask);
 	}
 
 	if (gt.depth.write_enable) {
 		kir_program_comment(prog, "write depth");
 
-#if 0
-		struct reg w;
-		w.ireg = _mm256_permute4x64_epi64(d->w.ireg, SWIZZLE(0, 2, 1, 3));
-		__m256i m = _mm256_permute4x64_epi64(d->mask.ireg,
-						     SWIZZLE(0, 2, 1, 3));
-#endif
-		struct kir_reg r;
-
 		switch (gt.depth.format) {
 		case D32_FLOAT:
-			kir_program_mask_store(prog, base, 0, computed_depth, mask);
-			break;
 		case D24_UNORM_X8_UINT:
-			r = computed_depth;
-			kir_program_immf(prog, 16777215.0f);
-			r = kir_program_alu(prog, kir_mulf, r, prog->dst);
-			kir_program_immf(prog, 0.5f);
-			kir_program_alu(prog, kir_addf, r, prog->dst);
-			kir_program_alu(prog, kir_ps2d, prog->dst);
-			kir_program_mask_store(prog, base, 0, prog->dst, mask);
+			kir_program_mask_store(prog, base, 0, computed_depth, mask);
 			break;
 		case D16_UNORM:
-			stub("D16_UNORM");
+			emit_store_d16(prog, base, computed_depth, depth, mask);
 			break;
 		default:
 			ksim_unreachable("invalid depth format");
 		}
-
 	}
 
-	if (gt.depth.test_enable) {
-		struct kir_insn *insn = kir_program_add_insn(prog, kir_eot_if_dead);
-		insn->eot.src = mask;
-	}
+	return mask;
 }
 
 static void
-dispatch_ps(struct ps_thread *t)
+count_depth_killed(struct thread *t)
 {
-	struct dispatch *d = &t->queue[0];
-	int count = t->queue_length;
-	/* Not sure what we should make this. */
-	struct reg *grf = &t->t.grf[0];
-
-	uint32_t mask = _mm256_movemask_ps((__m256) t->t.mask[0].q[0]);
-	grf[1] = (struct reg) {
-		.ud = {
-			/* R1.0-1: MBZ */
-			0,
-			0,
-			/* R1.2: x, y for subspan 0  */
-			(d[0].y << 16) | d[0].x,
-			/* R1.3: x, y for subspan 1  */
-			(d[0].y << 16) | (d[0].x + 2),
-			/* R1.4: x, y for subspan 2 (SIMD16) */
-			(d[1].y << 16) | d[1].x,
-			/* R1.5: x, y for subspan 3 (SIMD16) */
-			(d[1].y << 16) | (d[1].x + 2),
-			/* R1.6: MBZ */
-			0 | 0,
-			/* R1.7: Pixel sample mask and copy */
-			mask | (mask << 16)
+	struct ps_thread *pt = (struct ps_thread *) t;
+	int q;
 
-		}
-	};
+	for_each_bit(q, pt->live_blocks) {
+		struct reg mask = { .ireg = t->mask[0].q[q] };
+		if (_mm256_movemask_ps(mask.reg) == 0)
+			pt->depth_killed_count++;
+	}
+}
 
-	t->invocation_count++;
+/* Channel offsets within a 4x2 block, in dispatch order. */
+static const int channel_x[8] = { 0, 1, 0, 1, 2, 3, 2, 3 };
+static const int channel_y[8] = { 0, 0, 1, 1, 0, 0, 1, 1 };
 
-	if (count == 1 && gt.ps.enable_simd8) {
-		gt.ps.avx_shader_simd8(&t->t);
-	} else {
-		ksim_assert(gt.ps.enable_simd16);
-		gt.ps.avx_shader_simd16(&t->t);
+/* Multisampled depth buffers interleave the samples of a pixel in a
+ * 2x1, 2x2 or 4x2 block of the surface (IMS layout). */
+static void *
+ims_depth_offset(int x, int y, uint32_t s, uint32_t cpp)
+{
+	switch (gt.multisample.samples) {
+	case 2:
+		x = x * 2 + s;
+		break;
+	case 4:
+		x = x * 2 + (s & 1);
+		y = y * 2 + (s >> 1);
+		break;
+	case 8:
+		x = x * 4 + (s & 1) + ((s >> 1) & 2);
+		y = y * 2 + ((s >> 1) & 1);
+		break;
+	default:
+		ksim_unreachable("invalid sample count");
 	}
-}
 
-const int tile_width = 128 / 4;
-const int tile_height = 32;
+	return ymajor_offset(gt.depth.buffer, x, y, gt.depth.stride, cpp);
+}
 
-struct tile_iterator {
-	int x, y, x0, y0;
-	__m256i w2, w0, w1;
-};
+static uint32_t
+ims_height_scale(void)
+{
+	return gt.multisample.samples >= 4 ? 2 : 1;
+}
 
-static void
-clear_depth_tile(uint32_t x, uint32_t y)
+/* Stored depth, function, computed depth. Unorm depth is exact as
+ * float. */
+static bool
+depth_compare(uint32_t function, float a, float b)
 {
-	uint32_t tile_stride = DIV_ROUND_UP(gt.depth.width, 32);
-	uint8_t *hiz_tile = gt.depth.hiz_buffer + x / 32 + tile_stride * (y / 32);
+	switch (function) {
+	case COMPAREFUNCTION_ALWAYS:
+		return true;
+	case COMPAREFUNCTION_NEVER:
+		return false;
+	case COMPAREFUNCTION_LESS:
+		return a < b;
+	case COMPAREFUNCTION_EQUAL:
+		return a == b;
+	case COMPAREFUNCTION_LEQUAL:
+		return a <= b;
+	case COMPAREFUNCTION_GREATER:
+		return a > b;
+	case COMPAREFUNCTION_NOTEQUAL:
+		return a != b;
+	case COMPAREFUNCTION_GEQUAL:
+		return a >= b;
+	default:
+		ksim_unreachable("invalid depth test function");
+	}
+}
 
-	if (*hiz_tile)
-		return;
-	*hiz_tile = 1;
+static inline uint32_t
+depth_to_unorm(float w, float scale)
+{
+	return fminf(fmaxf(w, 0.0f), 1.0f) * scale + 0.5f;
+}
 
-	struct reg clear_value;
-	uint32_t cpp = depth_format_size(gt.depth.format);
-	void *depth = ymajor_offset(gt.depth.buffer, x, y, gt.depth.stride, cpp);
+static bool
+depth_test_sample(void *p, float w)
+{
+	float stored, computed;
+	uint32_t value = 0;
 
 	switch (gt.depth.format) {
 	case D32_FLOAT:
-		clear_value.reg = _mm256_set1_ps(gt.depth.clear_value);
+		stored = *(float *) p;
+		computed = w;
 		break;
 	case D24_UNORM_X8_UINT:
-		clear_value.ireg = _mm256_set1_epi32(gt.depth.clear_value * 16777215.0f);
+		stored = *(uint32_t *) p & 0xffffff;
+		value = depth_to_unorm(w, 16777215.0f);
+		computed = value;
 		break;
 	case D16_UNORM:
-		stub("D16_UNORM clear");
+		stored = *(uint16_t *) p;
+		value = depth_to_unorm(w, 65535.0f);
+		computed = value;
+		break;
 	default:
 		ksim_unreachable("invalid depth format");
 	}
 
-	for (uint32_t i = 0; i < 4096; i += 128) {
-		_mm256_store_si256((depth + i +   0), clear_value.ireg);
-		_mm256_store_si256((depth + i +  32), clear_value.ireg);
-		_mm256_store_si256((depth + i +  64), clear_value.ireg);
-		_mm256_store_si256((depth + i +  96), clear_value.ireg);
+	if (gt.depth.test_enable &&
+	    !depth_compare(gt.depth.test_function, stored, computed))
+		return false;
+
+	if (gt.depth.write_enable) {
+		switch (gt.depth.format) {
+		case D32_FLOAT:
+			*(float *) p = computed;
+			break;
+		case D24_UNORM_X8_UINT:
+			*(uint32_t *) p = value;
+			break;
+		case D16_UNORM:
+			*(uint16_t *) p = value;
+			break;
+		}
 	}
+
+	return true;
 }
 
-struct bbox_iter {
-	uint32_t x, y;
-	struct rectangle rect;
-	int32_t w2, w0, w1;
-	int32_t w2_step, w0_step, w1_step;
-	int32_t w2_row_step, w0_row_step, w1_row_step;
-};
+/* The per-sample depth values don't line up with the 4x2 blocks, so
+ * the JIT calls out to test each covered sample. Samples that fail
+ * drop out of the coverage and pixels with no samples left out of
+ * the mask. */
+static void
+depth_test_samples(struct thread *t)
+{
+	struct ps_thread *pt = (struct ps_thread *) t;
+	const uint32_t cpp = depth_format_size(gt.depth.format);
+	int q;
+
+	for_each_bit(q, pt->live_blocks) {
+		const struct dispatch *d = &pt->queue[q];
+		struct reg mask = { .ireg = t->mask[0].q[q] };
+		struct reg coverage = { .ireg = t->coverage.q[q] };
+
+		for (int c = 0; c < 8; c++) {
+			uint32_t s;
+
+			if (mask.d[c] >= 0)
+				continue;
+
+			for_each_bit(s, coverage.ud[c]) {
+				void *p = ims_depth_offset(d->x + channel_x[c],
+							   d->y + channel_y[c], s, cpp);
+				const float w = d->w.f[c] + pt->sample_w_deltas[s];
+				if (!depth_test_sample(p, w))
+					coverage.ud[c] &= ~(1 << s);
+			}
+
+			if (coverage.ud[c] == 0)
+				mask.d[c] = 0;
+		}
+
+		t->mask[0].q[q] = mask.ireg;
+		t->coverage.q[q] = coverage.ireg;
+	}
+}
 
 static void
-tile_iterator_init(struct tile_iterator *iter,
-		   struct ps_primitive *p, const struct bbox_iter *bbox_iter)
+emit_depth_test_samples(struct kir_program *prog, int width)
 {
-	iter->x = 0;
-	iter->y = 0;
-	iter->x0 = bbox_iter->x;
-	iter->y0 = bbox_iter->y;
+	if (stencil_test_enabled())
+		stub("stencil with multisampling");
 
-	if (gt.depth.write_enable || gt.depth.test_enable)
-		if (gt.depth.hiz_enable)
-			clear_depth_tile(iter->x0, iter->y0);
+	for (int q = 0; q < width / 8; q++)
+		emit_compute_depth(prog, q);
+
+	kir_program_call(prog, depth_test_samples, 0);
 
-	iter->w2 = _mm256_add_epi32(_mm256_set1_epi32(bbox_iter->w2),
-				    p->w2_offsets);
+	if (stats_file)
+		kir_program_call(prog, count_depth_killed, 0);
 
-	iter->w0 = _mm256_add_epi32(_mm256_set1_epi32(bbox_iter->w0),
-				    p->w0_offsets);
+	if (gt.depth.test_enable) {
+		struct kir_reg mask =
+			kir_program_load_v8(prog, offsetof(struct thread, mask[0].q[0]));
+		for (int q = 1; q < width / 8; q++) {
+			struct kir_reg m =
+				kir_program_load_v8(prog, offsetof(struct thread, mask[0].q[q]));
+			mask = kir_program_alu(prog, kir_or, mask, m);
+		}
 
-	iter->w1 = _mm256_add_epi32(_mm256_set1_epi32(bbox_iter->w1),
-				    p->w1_offsets);
+		struct kir_insn *insn = kir_program_add_insn(prog, kir_eot_if_dead);
+		insn->eot.src = mask;
+	}
 }
 
-static bool
-tile_iterator_done(struct tile_iterator *iter)
+static void
+emit_depth_test(struct kir_program *prog, int width)
 {
-	return iter->y == tile_height;
+	if (gt.multisample.samples > 1 &&
+	    (gt.depth.test_enable || gt.depth.write_enable)) {
+		emit_depth_test_samples(prog, width);
+		return;
+	}
+
+	struct kir_reg mask = emit_depth_test_block(prog, 0);
+
+	/* The depth buffer pointer lives in rax, so test one 4x2
+	 * block at a time and combine the masks for the early out.
+	 * Blocks killed by the stencil test drop out the same way. */
+	for (int q = 1; q < width / 8; q++) {
+		struct kir_reg m = emit_depth_test_block(prog, q);
+		mask = kir_program_alu(prog, kir_or, mask, m);
+	}
+
+	if (stats_file)
+		kir_program_call(prog, count_depth_killed, 0);
+
+	if (gt.depth.test_enable || stencil_test_enabled()) {
+		struct kir_insn *insn = kir_program_add_insn(prog, kir_eot_if_dead);
+		insn->eot.src = mask;
+	}
 }
 
-static void
-tile_iterator_next(struct tile_iterator *iter, struct ps_primitive *p)
+static shader_t
+ps_shader_for_width(int width)
 {
-	iter->x += 4;
-	if (iter->x == tile_width) {
-		iter->x = 0;
-		iter->y += 2;
+	switch (width) {
+	case 8:
+		return gt.ps.avx_shader_simd8;
+	case 16:
+		return gt.ps.avx_shader_simd16;
+	case 32:
+		return gt.ps.avx_shader_simd32;
+	default:
+		ksim_unreachable("invalid dispatch width");
+	}
+}
 
-		iter->w2 = _mm256_add_epi32(iter->w2, p->w2_row_step);
-		iter->w0 = _mm256_add_epi32(iter->w0, p->w0_row_step);
-		iter->w1 = _mm256_add_epi32(iter->w1, p->w1_row_step);
-	} else {
-		iter->w2 = _mm256_add_epi32(iter->w2, p->w2_step);
-		iter->w0 = _mm256_add_epi32(iter->w0, p->w0_step);
-		iter->w1 = _mm256_add_epi32(iter->w1, p->w1_step);
+/* Pick the widest compiled kernel that we can fill with count 4x2
+ * blocks, capped by the dispatch width policy. If there is no such
+ * kernel, pick the narrowest kernel and pad the dispatch with empty
+ * blocks. */
+static int
+ps_dispatch_width(int count)
+{
+	for (int width = 32; width >= 8; width /= 2) {
+		if (width <= ps_max_dispatch_width && width <= count * 8 &&
+		    ps_shader_for_width(width))
+			return width;
+	}
+
+	for (int width = 8; width <= 32; width *= 2) {
+		if (ps_shader_for_width(width))
+			return width;
 	}
 
+	ksim_unreachable("no ps kernel");
+}
+
+static inline uint32_t
+subspan_mask(struct ps_thread *t, int q)
+{
+	return _mm256_movemask_ps((__m256) t->t.mask[0].q[q]);
 }
 
 static void
-fill_dispatch(struct ps_thread *pt,
-	      struct tile_iterator *iter, struct reg mask)
+heatmap_add(struct ps_thread *t, int width, const uint32_t *masks, uint64_t cycles)
 {
-	uint32_t q = pt->queue_length;
-	struct dispatch *d = &pt->queue[q];
+	uint32_t pixels = 0;
+	uint64_t value = 1;
+	int i;
 
-	if (_mm256_movemask_ps(mask.reg) == 0)
-		return;
+	if (heatmap_cycles) {
+		for (int q = 0; q < width / 8; q++)
+			pixels += __builtin_popcount(masks[q]);
+		if (pixels == 0)
+			return;
+		value = cycles / pixels;
+	}
 
-	/* Some pixels are covered and we have to calculate
-	 * barycentric coordinates. We add back the tie-breaker
-	 * adjustment so as to not distort the barycentric
-	 * coordinates.*/
-	d->int_w2.ireg = iter->w2;
-	d->int_w1.ireg = iter->w1;
-	
-	pt->t.mask[0].q[q] = mask.ireg;
-	d->x = iter->x0 + iter->x;
-	d->y = iter->y0 + iter->y;
+	for (int q = 0; q < width / 8; q++) {
+		const struct dispatch *d = &t->queue[q];
 
-	if (gt.depth.write_enable || gt.depth.test_enable) {
-		uint32_t cpp = depth_format_size(gt.depth.format);
-		pt->depth = ymajor_offset(gt.depth.buffer, d->x, d->y, gt.depth.stride, cpp);
-	}
+		for_each_bit(i, masks[q]) {
+			const uint32_t x = d->x + channel_x[i];
+			const uint32_t y = d->y + channel_y[i];
 
-	pt->queue_length++;
-	if (gt.ps.enable_simd8 || pt->queue_length == 2) {
-		dispatch_ps(pt);
-		pt->queue_length = 0;
+			if (x < heatmap.width && y < heatmap.height)
+				heatmap.values[y * heatmap.width + x] += value;
+		}
 	}
 }
 
 static void
-init_ps_thread(struct ps_thread *pt, struct ps_primitive *p)
+heatmap_resize(void)
 {
-	pt->queue_length = 0;
-	pt->invocation_count = 0;
-	pt->inv_area = 1.0f / p->area;
-	memcpy(pt->w_deltas, p->w_deltas, sizeof(pt->w_deltas));
-	pt->e01_bias = p->e01.bias;
-	pt->e20_bias = p->e20.bias;
+	const uint32_t width = gt.drawing_rectangle.rect.x1 + 1;
+	const uint32_t height = gt.drawing_rectangle.rect.y1 + 1;
 
-	for (uint32_t i = 0; i < gt.sbe.num_attributes * 2; i++)
-		pt->attribute_deltas[i] = p->attribute_deltas[i];
+	if (width <= heatmap.width && height <= heatmap.height)
+		return;
 
-	uint32_t fftid = 0;
-	pt->grf0 = (struct reg) {
-		.ud = {
-			/* R0.0 */
+	/* Start over if the render target grows. */
+	free(heatmap.values);
+	heatmap.width = width;
+	heatmap.height = height;
+	heatmap.values = calloc((size_t) width * height, sizeof(heatmap.values[0]));
+	ksim_assert(heatmap.values != NULL);
+}
+
+/* Map v in [0, 1] onto a black, blue, cyan, green, yellow, red
+ * gradient. */
+static uint32_t
+heatmap_color(float v)
+{
+	static const uint8_t stops[6][3] = {
+		{   0,   0,   0 },
+		{   0,   0, 255 },
+		{   0, 255, 255 },
+		{   0, 255,   0 },
+		{ 255, 255,   0 },
+		{ 255,   0,   0 },
+	};
+
+	const float s = v * (ARRAY_LENGTH(stops) - 1);
+	const int i = s >= ARRAY_LENGTH(stops) - 1 ? ARRAY_LENGTH(stops) - 2 : (int) s;
+	const float f = s - i;
+	uint32_t color = 0xff000000;
+
+	for (int c = 0; c < 3; c++) {
+		float x = stops[i][c] + (stops[i + 1][c] - stops[i][c]) * f;
+		color |= (uint32_t) x << (c * 8);
+	}
+
+	return color;
+}
+
+static void
+write_heatmap(void)
+{
+	const uint32_t count = heatmap.width * heatmap.height;
+	uint64_t max = 0;
+
+	if (count == 0)
+		return;
+
+	for (uint32_t i = 0; i < count; i++)
+		if (max < heatmap.values[i])
+			max = heatmap.values[i];
+
+	uint32_t *pixels = malloc(count * sizeof(pixels[0]));
+	ksim_assert(pixels != NULL);
+
+	/* Log scale, so a few very hot pixels don't wash out the
+	 * rest of the image. Untouched pixels stay black. */
+	const float scale = max > 0 ? 1.0f / log1pf(max) : 0.0f;
+	for (uint32_t i = 0; i < count; i++)
+		pixels[i] = heatmap_color(log1pf(heatmap.values[i]) * scale);
+
+	dump_rgba(heatmap_filename, heatmap.width, heatmap.height, pixels);
+
+	free(pixels);
+}
+
+static void
+run_ps(struct ps_thread *t, int width)
+{
+	struct dispatch *d = &t->queue[0];
+	/* Not sure what we should make this. */
+	struct reg *grf = &t->t.grf[0];
+
+	uint32_t mask0 = subspan_mask(t, 0) | (subspan_mask(t, 1) << 8);
+	grf[1] = (struct reg) {
+		.ud = {
+			/* R1.0-1: MBZ */
+			0,
+			0,
+			/* R1.2: x, y for subspan 0  */
+			(d[0].y << 16) | d[0].x,
+			/* R1.3: x, y for subspan 1  */
+			(d[0].y << 16) | (d[0].x + 2),
+			/* R1.4: x, y for subspan 2 (SIMD16) */
+			(d[1].y << 16) | d[1].x,
+			/* R1.5: x, y for subspan 3 (SIMD16) */
+			(d[1].y << 16) | (d[1].x + 2),
+			/* R1.6: MBZ */
+			0 | 0,
+			/* R1.7: Pixel sample mask and copy */
+			mask0 | (mask0 << 16)
+
+		}
+	};
+
+	if (width == 32) {
+		uint32_t mask1 = subspan_mask(t, 2) | (subspan_mask(t, 3) << 8);
+		grf[2] = (struct reg) {
+			.ud = {
+				/* R2.0-1: MBZ */
+				0,
+				0,
+				/* R2.2-5: x, y for subspan 4-7 */
+				(d[2].y << 16) | d[2].x,
+				(d[2].y << 16) | (d[2].x + 2),
+				(d[3].y << 16) | d[3].x,
+				(d[3].y << 16) | (d[3].x + 2),
+				/* R2.6: MBZ */
+				0,
+				/* R2.7: Pixel sample mask and copy */
+				mask1 | (mask1 << 16)
+			}
+		};
+	}
+
+	t->live_blocks = 0;
+	for (int q = 0; q < width / 8; q++)
+		if (subspan_mask(t, q))
+			t->live_blocks |= 1 << q;
+
+	t->invocation_count++;
+	t->dispatch_count[__builtin_ctz(width) - 3]++;
+	t->pixel_count += __builtin_popcount(mask0);
+	if (width == 32)
+		t->pixel_count += __builtin_popcount(grf[2].ud[7] & 0xffff);
+
+	if (heatmap_filename) {
+		uint32_t masks[4];
+
+		/* The shader updates the masks for depth test and
+		 * discard, so grab the dispatched pixels first. */
+		for (int q = 0; q < width / 8; q++)
+			masks[q] = subspan_mask(t, q);
+
+		uint64_t start = __rdtsc();
+		ps_shader_for_width(width)(&t->t);
+		uint64_t cycles = __rdtsc() - start;
+
+		heatmap_add(t, width, masks, cycles);
+	} else {
+		ps_shader_for_width(width)(&t->t);
+	}
+
+	/* The shader updates the stencil values before it runs the
+	 * kernel or bails out, so write back all live blocks. */
+	if (stencil_write_enabled()) {
+		int q;
+		for_each_bit(q, t->live_blocks)
+			write_stencil(&t->queue[q]);
+	}
+}
+
+static void
+dispatch_ps(struct ps_thread *t)
+{
+	while (t->queue_length > 0) {
+		const int count = t->queue_length;
+		const int width = ps_dispatch_width(count);
+		const int blocks = width / 8;
+
+		/* Pad partial dispatches with empty blocks. They
+		 * point to valid depth, but are masked off. */
+		for (int i = count; i < blocks; i++) {
+			t->queue[i] = t->queue[0];
+			t->t.mask[0].q[i] = _mm256_setzero_si256();
+			t->t.coverage.q[i] = _mm256_setzero_si256();
+		}
+
+		run_ps(t, width);
+
+		if (count <= blocks) {
+			t->queue_length = 0;
+		} else {
+			/* Move the blocks we didn't dispatch to the
+			 * front of the queue. */
+			for (int i = blocks; i < count; i++) {
+				t->queue[i - blocks] = t->queue[i];
+				t->t.mask[0].q[i - blocks] = t->t.mask[0].q[i];
+				t->t.coverage.q[i - blocks] = t->t.coverage.q[i];
+			}
+			t->queue_length = count - blocks;
+		}
+	}
+}
+
+const int tile_width = 128 / 4;
+const int tile_height = 32;
+
+/* The tile iterator steps through the tile in 8x4 groups of four
+ * 4x2 blocks, so that a SIMD32 dispatch covers a compact footprint. */
+const int group_width = 8;
+const int group_height = 4;
+
+static const struct {
+	int x, y;
+} group_blocks[4] = {
+	{ 0, 0 }, { 4, 0 }, { 0, 2 }, { 4, 2 }
+};
+
+struct tile_iterator {
+	int x, y, x0, y0;
+	__m256i w2, w0, w1;
+};
+
+static struct reg
+depth_clear_value(void)
+{
+	struct reg clear_value;
+
+	switch (gt.depth.format) {
+	case D32_FLOAT:
+		clear_value.reg = _mm256_set1_ps(gt.depth.clear_value);
+		break;
+	case D24_UNORM_X8_UINT:
+		clear_value.ireg = _mm256_set1_epi32(gt.depth.clear_value * 16777215.0f + 0.5f);
+		break;
+	case D16_UNORM:
+		clear_value.ireg = _mm256_set1_epi16((uint16_t) (gt.depth.clear_value * 65535.0f + 0.5f));
+		break;
+	default:
+		ksim_unreachable("invalid depth format");
+	}
+
+	return clear_value;
+}
+
+static void
+clear_depth_tile(uint32_t x, uint32_t y)
+{
+	uint32_t tile_stride = DIV_ROUND_UP(gt.depth.width, 32);
+	uint8_t *hiz_tile = gt.depth.hiz_buffer + x / 32 + tile_stride * (y / 32);
+
+	if (*hiz_tile)
+		return;
+	*hiz_tile = 1;
+
+	struct reg clear_value = depth_clear_value();
+	uint32_t cpp = depth_format_size(gt.depth.format);
+	void *depth = ymajor_offset(gt.depth.buffer, x, y, gt.depth.stride, cpp);
+
+	/* A 32x32 HiZ tile is a whole Y tile for 32 bpp depth and
+	 * half of one for D16. Either way it's contiguous. */
+	for (uint32_t i = 0; i < 32 * 32 * cpp; i += 128) {
+		_mm256_store_si256((depth + i +   0), clear_value.ireg);
+		_mm256_store_si256((depth + i +  32), clear_value.ireg);
+		_mm256_store_si256((depth + i +  64), clear_value.ireg);
+		_mm256_store_si256((depth + i +  96), clear_value.ireg);
+	}
+}
+
+/* The bbox iterator visits the tiles of the bounding box either in
+ * raster order or in 2x2 groups of tiles. The groups are visited in
+ * serpentine order and the tiles within a group in Z order. For
+ * 32bpp Y-major surfaces, a tile is a 4k page and horizontal
+ * neighbours are consecutive pages, so the groups keep both the
+ * pages and the edge of the previous row warm in the caches. */
+struct bbox_iter {
+	uint32_t x, y;
+	struct rectangle rect;
+	uint32_t i, count;
+	uint32_t width, height, groups_x;
+	int32_t w2, w0, w1;
+	int32_t w2_origin, w0_origin, w1_origin;
+	int32_t w2_step, w0_step, w1_step;
+	int32_t w2_row_step, w0_row_step, w1_row_step;
+};
+
+/* Render target 0 of the current pixel shader. */
+static struct {
+	struct surface surface;
+	bool valid;
+	bool tile_buffer;
+} ps_rt;
+
+static struct ps_meta ps_meta;
+
+static inline void
+prefetch_range(const void *p, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i += 64)
+		_mm_prefetch(p + i, _MM_HINT_T0);
+}
+
+/* Prefetch the depth and render target cachelines for the tile at
+ * x, y, so they're in cache by the time we get to it. */
+static void
+prefetch_tile(uint32_t x, uint32_t y)
+{
+	if (gt.depth.write_enable || gt.depth.test_enable) {
+		uint32_t cpp = depth_format_size(gt.depth.format);
+
+		/* A Y-major tile column is 16 bytes by 32 rows, so a
+		 * tile of depth is contiguous. */
+		prefetch_range(ymajor_offset(gt.depth.buffer, x, y,
+					     gt.depth.stride, cpp),
+			       tile_width * tile_height * cpp);
+	}
+
+	if (!ps_rt.valid)
+		return;
+
+	const struct surface *rt = &ps_rt.surface;
+	switch (rt->tile_mode) {
+	case YMAJOR:
+		prefetch_range(ymajor_offset(rt->pixels, x, y, rt->stride, rt->cpp),
+			       tile_width * tile_height * rt->cpp);
+		break;
+	case XMAJOR:
+		for (int i = 0; i < tile_height; i++)
+			prefetch_range(xmajor_offset(rt->pixels, x, y + i,
+						     rt->stride, rt->cpp),
+				       tile_width * rt->cpp);
+		break;
+	case LINEAR:
+		for (int i = 0; i < tile_height; i++)
+			prefetch_range(rt->pixels + (y + i) * rt->stride + x * rt->cpp,
+				       tile_width * rt->cpp);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+intersect_rectangle(struct rectangle *r, const struct rectangle *other)
+{
+	if (r->x0 < other->x0)
+		r->x0 = other->x0;
+	if (r->y0 < other->y0)
+		r->y0 = other->y0;
+	if (r->x1 > other->x1)
+		r->x1 = other->x1;
+	if (r->y1 > other->y1)
+		r->y1 = other->y1;
+}
+
+/* Fast clear state for one render target. A fast clear only marks
+ * the 32x32 tiles it fully covers as cleared, much like the HiZ
+ * cleared byte for depth, and we write the clear color into a tile
+ * the first time the pixel shader touches it, or when a resolve,
+ * a surface read or a CPU map needs the pixels. We only track the
+ * most recently fast cleared surface and resolve it completely
+ * when another surface gets fast cleared. */
+static struct {
+	bool pending;
+	struct surface rt;
+	uint8_t *tiles;
+	uint32_t tile_stride, tile_rows;
+	uint8_t pixel[16];
+} fast_clear;
+
+/* Write the clear color to the part of tile x, y that is inside the
+ * surface. */
+static void
+fill_clear_tile(uint32_t x, uint32_t y)
+{
+	const struct surface *s = &fast_clear.rt;
+	struct rectangle r = { x, y, x + tile_width, y + tile_height };
+	const struct rectangle extent = { 0, 0, s->width, s->height };
+
+	intersect_rectangle(&r, &extent);
+	surface_fill_rect(s, &r, fast_clear.pixel);
+}
+
+static inline uint8_t *
+fast_clear_tile(uint32_t x, uint32_t y)
+{
+	const uint32_t tx = x / tile_width;
+	const uint32_t ty = y / tile_height;
+
+	if (tx >= fast_clear.tile_stride || ty >= fast_clear.tile_rows)
+		return NULL;
+
+	return &fast_clear.tiles[ty * fast_clear.tile_stride + tx];
+}
+
+static void
+resolve_color_tile(uint32_t x, uint32_t y)
+{
+	uint8_t *tile = fast_clear_tile(x, y);
+
+	if (tile && *tile) {
+		fill_clear_tile(x, y);
+		*tile = 0;
+	}
+}
+
+static void
+resolve_color_rect(const struct rectangle *rect)
+{
+	struct rectangle r = *rect;
+	const struct rectangle extent = {
+		0, 0, fast_clear.rt.width, fast_clear.rt.height
+	};
+
+	intersect_rectangle(&r, &extent);
+	for (int32_t y = r.y0 & ~(tile_height - 1); y < r.y1; y += tile_height)
+		for (int32_t x = r.x0 & ~(tile_width - 1); x < r.x1; x += tile_width)
+			resolve_color_tile(x, y);
+}
+
+void
+fast_clear_resolve_all(void)
+{
+	if (!fast_clear.pending)
+		return;
+
+	struct rectangle all = {
+		0, 0, fast_clear.rt.width, fast_clear.rt.height
+	};
+
+	resolve_color_rect(&all);
+	fast_clear.pending = false;
+}
+
+void
+fast_clear_resolve(const struct surface *s)
+{
+	if (fast_clear.pending && s->pixels == fast_clear.rt.pixels)
+		fast_clear_resolve_all();
+}
+
+static inline bool
+fast_clear_tile_pending(uint32_t x, uint32_t y)
+{
+	const uint8_t *tile = fast_clear_tile(x, y);
+
+	return tile && *tile;
+}
+
+/* Mark the tiles the fast clear rectangle fully covers. Returns false
+ * if we can't fast clear the render target, in which case the clear
+ * shader runs as a regular draw. */
+static bool
+fast_clear_rect(const struct rectangle *rect)
+{
+	const struct surface *s = &ps_rt.surface;
+	uint8_t pixel[16];
+
+	if (!ps_rt.valid || !pack_rt_color(s->format, s->clear_color, pixel))
+		return false;
+
+	if (!is_power_of_two(s->cpp) ||
+	    (s->tile_mode != YMAJOR && s->tile_mode != XMAJOR &&
+	     s->tile_mode != LINEAR))
+		return false;
+
+	struct rectangle r = *rect;
+	const struct rectangle extent = { 0, 0, s->width, s->height };
+	intersect_rectangle(&r, &extent);
+	if (r.x0 >= r.x1 || r.y0 >= r.y1)
+		return true;
+
+	const bool covers_surface =
+		r.x0 == 0 && r.y0 == 0 && r.x1 == s->width && r.y1 == s->height;
+
+	/* Tiles still pending from an earlier clear of a different
+	 * color or surface need their pixels before we start over,
+	 * unless this clear overwrites all of them. */
+	if (fast_clear.pending &&
+	    !(covers_surface && s->pixels == fast_clear.rt.pixels) &&
+	    (s->pixels != fast_clear.rt.pixels ||
+	     memcmp(pixel, fast_clear.pixel, s->cpp) != 0))
+		fast_clear_resolve_all();
+
+	const uint32_t tile_stride = DIV_ROUND_UP(s->width, tile_width);
+	const uint32_t tile_rows = DIV_ROUND_UP(s->height, tile_height);
+
+	if (!fast_clear.pending) {
+		fast_clear.tiles = realloc(fast_clear.tiles, tile_stride * tile_rows);
+		ksim_assert(fast_clear.tiles != NULL);
+		memset(fast_clear.tiles, 0, tile_stride * tile_rows);
+	}
+
+	fast_clear.rt = *s;
+	fast_clear.tile_stride = tile_stride;
+	fast_clear.tile_rows = tile_rows;
+	memcpy(fast_clear.pixel, pixel, s->cpp);
+	fast_clear.pending = true;
+
+	/* A tile is fully covered if the part of it inside the surface
+	 * is inside the rectangle. */
+	const uint32_t tx0 = DIV_ROUND_UP(r.x0, tile_width);
+	const uint32_t ty0 = DIV_ROUND_UP(r.y0, tile_height);
+	const uint32_t tx1 = r.x1 == s->width ? tile_stride : r.x1 / tile_width;
+	const uint32_t ty1 = r.y1 == s->height ? tile_rows : r.y1 / tile_height;
+
+	for (uint32_t ty = ty0; ty < ty1; ty++)
+		for (uint32_t tx = tx0; tx < tx1; tx++)
+			fast_clear.tiles[ty * tile_stride + tx] = 1;
+
+	return true;
+}
+
+/* With the tile buffer, the pixel shader writes render target 0 to
+ * color_tile, a linear copy of the tile the rasterizer is in, in the
+ * format of the render target. The tile stays in L1 while we shade
+ * it, and blending reads it from there too. We write the tile back
+ * in one pass when the rasterizer moves on to another tile, before a
+ * draw writes the surface directly and at the end of the draw. */
+struct color_tile color_tile;
+
+bool
+color_tile_enabled(const struct surface *s)
+{
+	return tile_buffer_enable && s->samples <= 1 &&
+		s->minimum_array_element == 0 &&
+		is_power_of_two(s->cpp) && s->cpp <= 16 &&
+		(s->tile_mode == LINEAR || s->tile_mode == XMAJOR ||
+		 s->tile_mode == YMAJOR);
+}
+
+static void
+color_tile_flush(void)
+{
+	if (!color_tile.valid)
+		return;
+
+	if (color_tile.dirty)
+		surface_write_rect(&ps_rt.surface, &color_tile.rect,
+				   color_tile.pixels, tile_width * ps_rt.surface.cpp,
+				   tile_buffer_streaming);
+
+	color_tile.valid = false;
+	color_tile.dirty = false;
+}
+
+static void
+color_tile_load(int32_t x, int32_t y)
+{
+	const struct surface *s = &ps_rt.surface;
+
+	if (color_tile.valid && color_tile.rect.x0 == x && color_tile.rect.y0 == y)
+		return;
+
+	color_tile_flush();
+
+	color_tile.rect = (struct rectangle) {
+		x, y, x + tile_width, y + tile_height
+	};
+	intersect_rectangle(&color_tile.rect, &(struct rectangle) {
+		0, 0, s->width, s->height });
+	surface_read_rect(s, &color_tile.rect, color_tile.pixels,
+			  tile_width * s->cpp);
+	color_tile.valid = true;
+}
+
+static void
+tile_iterator_init(struct tile_iterator *iter,
+		   struct ps_primitive *p, const struct bbox_iter *bbox_iter)
+{
+	iter->x = 0;
+	iter->y = 0;
+	iter->x0 = bbox_iter->x;
+	iter->y0 = bbox_iter->y;
+
+	if (gt.depth.write_enable || gt.depth.test_enable)
+		if (gt.depth.hiz_enable && gt.multisample.samples <= 1)
+			clear_depth_tile(iter->x0, iter->y0);
+
+	if (fast_clear.pending && ps_rt.valid &&
+	    ps_rt.surface.pixels == fast_clear.rt.pixels)
+		resolve_color_tile(iter->x0, iter->y0);
+
+	if (ps_rt.tile_buffer)
+		color_tile_load(iter->x0, iter->y0);
+
+	iter->w2 = _mm256_set1_epi32(bbox_iter->w2);
+	iter->w0 = _mm256_set1_epi32(bbox_iter->w0);
+	iter->w1 = _mm256_set1_epi32(bbox_iter->w1);
+}
+
+static bool
+tile_iterator_done(struct tile_iterator *iter)
+{
+	return iter->y == tile_height;
+}
+
+static void
+tile_iterator_next(struct tile_iterator *iter, struct ps_primitive *p)
+{
+	iter->x += group_width;
+	if (iter->x == tile_width) {
+		iter->x = 0;
+		iter->y += group_height;
+
+		iter->w2 = _mm256_add_epi32(iter->w2, p->w2_row_step);
+		iter->w0 = _mm256_add_epi32(iter->w0, p->w0_row_step);
+		iter->w1 = _mm256_add_epi32(iter->w1, p->w1_row_step);
+	} else {
+		iter->w2 = _mm256_add_epi32(iter->w2, p->w2_step);
+		iter->w0 = _mm256_add_epi32(iter->w0, p->w0_step);
+		iter->w1 = _mm256_add_epi32(iter->w1, p->w1_step);
+	}
+
+}
+
+static void
+fill_dispatch(struct ps_thread *pt, struct tile_iterator *iter, int block,
+	      __m256i w2, __m256i w1, struct reg mask, __m256i coverage)
+{
+	uint32_t q = pt->queue_length;
+	struct dispatch *d = &pt->queue[q];
+
+	const int m = _mm256_movemask_ps(mask.reg);
+	if (m == 0) {
+		ps_stats.empty_blocks++;
+		return;
+	} else if (m == 0xff) {
+		ps_stats.full_blocks++;
+	} else {
+		ps_stats.partial_blocks++;
+	}
+
+	/* Some pixels are covered and we have to calculate
+	 * barycentric coordinates. We add back the tie-breaker
+	 * adjustment so as to not distort the barycentric
+	 * coordinates.*/
+	d->int_w2.ireg = w2;
+	d->int_w1.ireg = w1;
+
+	pt->t.mask[0].q[q] = mask.ireg;
+	pt->t.coverage.q[q] = coverage;
+	d->x = iter->x0 + iter->x + group_blocks[block].x;
+	d->y = iter->y0 + iter->y + group_blocks[block].y;
+
+	if (gt.depth.write_enable || gt.depth.test_enable) {
+		uint32_t cpp = depth_format_size(gt.depth.format);
+		d->depth = ymajor_offset(gt.depth.buffer, d->x, d->y, gt.depth.stride, cpp);
+	}
+
+	if (stencil_test_enabled()) {
+		/* The 8 stencil bytes of the block are contiguous and
+		 * in dispatch order, see wmajor_offset(). */
+		d->stencil = wmajor_offset(gt.stencil.buffer, d->x, d->y, gt.stencil.stride);
+		d->stencil_value.ireg =
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64(d->stencil));
+	}
+
+	pt->queue_length++;
+	if (pt->queue_length == pt->queue_size)
+		dispatch_ps(pt);
+}
+
+/* Standard sample positions in 1/16th of a pixel from the upper left
+ * corner. */
+static const struct {
+	int8_t x, y;
+} sample_positions_2x[2] = {
+	{ 12, 12 }, { 4, 4 }
+}, sample_positions_4x[4] = {
+	{ 6, 2 }, { 14, 6 }, { 2, 10 }, { 10, 14 }
+}, sample_positions_8x[8] = {
+	{ 9, 5 }, { 7, 11 }, { 13, 9 }, { 5, 3 },
+	{ 3, 13 }, { 1, 7 }, { 11, 15 }, { 15, 1 }
+};
+
+static inline int32_t
+sample_edge_offset(const struct edge *e, uint32_t s)
+{
+	int x, y;
+
+	switch (gt.multisample.samples) {
+	case 2:
+		x = sample_positions_2x[s].x;
+		y = sample_positions_2x[s].y;
+		break;
+	case 4:
+		x = sample_positions_4x[s].x;
+		y = sample_positions_4x[s].y;
+		break;
+	case 8:
+		x = sample_positions_8x[s].x;
+		y = sample_positions_8x[s].y;
+		break;
+	default:
+		ksim_unreachable("invalid sample count");
+	}
+
+	/* Edge functions step by a and b per pixel and we evaluate
+	 * them at the pixel center. */
+	return (e->a * (x - 8) + e->b * (y - 8)) >> 4;
+}
+
+static inline __m256i
+all_samples_coverage(struct reg mask)
+{
+	const uint32_t samples =
+		gt.multisample.samples > 1 ? gt.multisample.samples : 1;
+
+	return _mm256_and_si256(mask.ireg, _mm256_set1_epi32((1 << samples) - 1));
+}
+
+/* Evaluate the edge functions at each sample position and dispatch
+ * the block once with the union of the covered samples, or once per
+ * sample if the shader runs per sample. w3 and w4 are the opposite
+ * edges for rectangles, computed as c - w2 and c - w0. */
+static void
+fill_dispatch_samples(struct ps_thread *pt, struct tile_iterator *iter, int block,
+		      const struct ps_primitive *p,
+		      __m256i w2, __m256i w0, __m256i w1, const __m256i *c)
+{
+	__m256i coverage = _mm256_setzero_si256();
+
+	for (uint32_t s = 0; s < gt.multisample.samples; s++) {
+		if (!(gt.multisample.sample_mask & (1 << s)))
+			continue;
+
+		const __m256i sw2 = _mm256_add_epi32(w2, _mm256_set1_epi32(p->w2_sample[s]));
+		const __m256i sw0 = _mm256_add_epi32(w0, _mm256_set1_epi32(p->w0_sample[s]));
+		const __m256i sw1 = _mm256_add_epi32(w1, _mm256_set1_epi32(p->w1_sample[s]));
+
+		struct reg mask;
+		if (c)
+			mask.ireg = _mm256_and_si256(_mm256_and_si256(sw2, sw0),
+						     _mm256_and_si256(_mm256_sub_epi32(*c, sw2),
+								      _mm256_sub_epi32(*c, sw0)));
+		else
+			mask.ireg = _mm256_and_si256(_mm256_and_si256(sw1, sw0), sw2);
+		mask.ireg = _mm256_srai_epi32(mask.ireg, 31);
+
+		const __m256i bit =
+			_mm256_and_si256(mask.ireg, _mm256_set1_epi32(1 << s));
+		if (gt.ps.per_sample)
+			fill_dispatch(pt, iter, block, sw2, sw1, mask, bit);
+		else
+			coverage = _mm256_or_si256(coverage, bit);
+	}
+
+	if (!gt.ps.per_sample) {
+		struct reg mask;
+		mask.ireg = _mm256_cmpgt_epi32(coverage, _mm256_setzero_si256());
+		fill_dispatch(pt, iter, block, w2, w1, mask, coverage);
+	}
+}
+
+static void
+init_ps_thread(struct ps_thread *pt, struct ps_primitive *p)
+{
+	pt->queue_length = 0;
+	pt->queue_size = ps_dispatch_width(4) / 8;
+	pt->invocation_count = 0;
+	memset(pt->dispatch_count, 0, sizeof(pt->dispatch_count));
+	pt->pixel_count = 0;
+	pt->depth_killed_count = 0;
+	pt->inv_area = 1.0f / p->area;
+	memcpy(pt->w_deltas, p->w_deltas, sizeof(pt->w_deltas));
+	memcpy(pt->inv_w_deltas, p->inv_w_deltas, sizeof(pt->inv_w_deltas));
+	pt->e01_bias = p->e01.bias;
+	pt->e20_bias = p->e20.bias;
+	pt->back_facing = p->back_facing ? ~0 : 0;
+
+	/* When shading per pixel, the block w is at the pixel center
+	 * and we step it to the sample positions for the depth test.
+	 * Per-sample dispatches already have w at the sample. */
+	if (gt.multisample.samples > 1) {
+		for (uint32_t s = 0; s < gt.multisample.samples; s++) {
+			if (gt.ps.per_sample)
+				pt->sample_w_deltas[s] = 0.0f;
+			else
+				pt->sample_w_deltas[s] =
+					(p->w_deltas[0] * p->w1_sample[s] +
+					 p->w_deltas[1] * p->w2_sample[s]) * pt->inv_area;
+		}
+	}
+
+	for (uint32_t i = 0; i < gt.sbe.num_attributes * 2; i++)
+		pt->attribute_deltas[i] = p->attribute_deltas[i];
+
+	uint32_t fftid = 0;
+	pt->grf0 = (struct reg) {
+		.ud = {
+			/* R0.0 */
 			gt.ia.topology |
 			0 /*  FIXME: More here */,
 			/* R0.1 */
@@ -429,6 +1581,12 @@ finish_ps_thread(struct ps_thread *pt)
 		dispatch_ps(pt);
 	if (gt.ps.statistics)
 		gt.ps_invocation_count += pt->invocation_count;
+
+	for (uint32_t i = 0; i < ARRAY_LENGTH(pt->dispatch_count); i++)
+		ps_stats.dispatch_count[i] += pt->dispatch_count[i];
+	ps_stats.pixel_count += pt->pixel_count;
+	ps_stats.depth_killed_blocks += pt->depth_killed_count;
+	ps_stats.tiles++;
 }
 
 static void
@@ -450,16 +1608,26 @@ rasterize_rectlist_tile(struct ps_primitive *p, struct bbox_iter *bbox_iter)
 	for (tile_iterator_init(&iter, p, bbox_iter);
 	     !tile_iterator_done(&iter);
 	     tile_iterator_next(&iter, p)) {
-		__m256i w2, w3;
+		for (int i = 0; i < 4; i++) {
+			__m256i w0, w1, w2, w3, w4;
+
+			w2 = _mm256_add_epi32(iter.w2, p->w2_offsets[i]);
+			w0 = _mm256_add_epi32(iter.w0, p->w0_offsets[i]);
+			w1 = _mm256_add_epi32(iter.w1, p->w1_offsets[i]);
+			if (gt.multisample.samples > 1) {
+				fill_dispatch_samples(&pt, &iter, i, p, w2, w0, w1, &c);
+				continue;
+			}
 
-		w2 = _mm256_sub_epi32(c, iter.w2);
-		w3 = _mm256_sub_epi32(c, iter.w0);
+			w3 = _mm256_sub_epi32(c, w2);
+			w4 = _mm256_sub_epi32(c, w0);
 
-		struct reg mask;
-		mask.ireg = _mm256_and_si256(_mm256_and_si256(iter.w2, iter.w0),
-					     _mm256_and_si256(w2, w3));
+			struct reg mask;
+			mask.ireg = _mm256_and_si256(_mm256_and_si256(w2, w0),
+						     _mm256_and_si256(w3, w4));
 
-		fill_dispatch(&pt, &iter, mask);
+			fill_dispatch(&pt, &iter, i, w2, w1, mask, mask.ireg);
+		}
 	}
 
 	finish_ps_thread(&pt);
@@ -476,374 +1644,849 @@ rasterize_triangle_tile(struct ps_primitive *p, const struct bbox_iter *bbox_ite
 	for (tile_iterator_init(&iter, p, bbox_iter);
 	     !tile_iterator_done(&iter);
 	     tile_iterator_next(&iter, p)) {
-		struct reg mask;
-		mask.ireg =
-			_mm256_and_si256(_mm256_and_si256(iter.w1,
-							  iter.w0), iter.w2);
+		for (int i = 0; i < 4; i++) {
+			__m256i w0, w1, w2;
+
+			w2 = _mm256_add_epi32(iter.w2, p->w2_offsets[i]);
+			w0 = _mm256_add_epi32(iter.w0, p->w0_offsets[i]);
+			w1 = _mm256_add_epi32(iter.w1, p->w1_offsets[i]);
+
+			if (gt.multisample.samples > 1) {
+				fill_dispatch_samples(&pt, &iter, i, p, w2, w0, w1, NULL);
+				continue;
+			}
+
+			struct reg mask;
+			mask.ireg =
+				_mm256_and_si256(_mm256_and_si256(w1, w0), w2);
+
+			fill_dispatch(&pt, &iter, i, w2, w1, mask, mask.ireg);
+		}
+	}
+
+	finish_ps_thread(&pt);
+}
+
+struct point {
+	int32_t x, y;
+};
+
+static inline struct point
+snap_point(float x, float y)
+{
+	return (struct point) {
+		(int32_t) (x * 256.0f),
+		(int32_t) (y * 256.0f)
+	};
+}
+
+static inline void
+init_edge(struct edge *e, struct point p0, struct point p1)
+{
+	e->a = (p0.y - p1.y);
+	e->b = (p1.x - p0.x);
+	e->c = ((int64_t) p1.y * p0.x - (int64_t) p1.x * p0.y) >> 8;
+	e->bias = e->a < 0 || (e->a == 0 && e->b < 0);
+}
+
+static inline void
+invert_edge(struct edge *e)
+{
+	e->a = -e->a;
+	e->b = -e->b;
+	e->c = -e->c;
+	e->bias = 1 - e->bias;
+}
+
+static inline int
+eval_edge(struct edge *e, struct point p)
+{
+	return (((int64_t) e->a * p.x + (int64_t) e->b * p.y) >> 8) + e->c - e->bias;
+}
+
+static void
+bbox_iter_seek(struct bbox_iter *iter)
+{
+	for (; iter->i < iter->count; iter->i++) {
+		uint32_t tx, ty;
+
+		if (tile_order_serpentine) {
+			const uint32_t g = iter->i / 4;
+			const uint32_t gx = g % iter->groups_x;
+			const uint32_t gy = g / iter->groups_x;
+			const uint32_t sub = iter->i & 3;
+
+			if (gy & 1)
+				tx = (iter->groups_x - 1 - gx) * 2 + 1 - (sub & 1);
+			else
+				tx = gx * 2 + (sub & 1);
+			ty = gy * 2 + (sub >> 1);
+		} else {
+			tx = iter->i % iter->width;
+			ty = iter->i / iter->width;
+		}
+
+		/* Groups at the right and bottom edge may stick out
+		 * of the bounding box. */
+		if (tx >= iter->width || ty >= iter->height)
+			continue;
+
+		iter->x = iter->rect.x0 + tx * tile_width;
+		iter->y = iter->rect.y0 + ty * tile_height;
+		iter->w2 = iter->w2_origin + tx * iter->w2_step + ty * iter->w2_row_step;
+		iter->w0 = iter->w0_origin + tx * iter->w0_step + ty * iter->w0_row_step;
+		iter->w1 = iter->w1_origin + tx * iter->w1_step + ty * iter->w1_row_step;
+		break;
+	}
+}
+
+static void
+bbox_iter_init(struct bbox_iter *iter, struct ps_primitive *p, struct rectangle *rect)
+{
+	iter->rect = *rect;
+
+	struct point min = snap_point(rect->x0, rect->y0);
+	min.x += 128;
+	min.y += 128;
+	iter->w2_origin = eval_edge(&p->e01, min);
+	iter->w0_origin = eval_edge(&p->e12, min);
+	iter->w1_origin = eval_edge(&p->e20, min);
+
+	iter->w2_step = tile_width * p->e01.a;
+	iter->w0_step = tile_width * p->e12.a;
+	iter->w1_step = tile_width * p->e20.a;
+
+	iter->w2_row_step = tile_height * p->e01.b;
+	iter->w0_row_step = tile_height * p->e12.b;
+	iter->w1_row_step = tile_height * p->e20.b;
+
+	iter->width = (rect->x1 - rect->x0) / tile_width;
+	iter->height = (rect->y1 - rect->y0) / tile_height;
+	iter->groups_x = DIV_ROUND_UP(iter->width, 2);
+	if (tile_order_serpentine)
+		iter->count = iter->groups_x * DIV_ROUND_UP(iter->height, 2) * 4;
+	else
+		iter->count = iter->width * iter->height;
+
+	ps_stats.bbox_tiles += iter->width * iter->height;
+
+	iter->i = 0;
+	bbox_iter_seek(iter);
+}
+
+static bool
+bbox_iter_done(struct bbox_iter *iter)
+{
+	return iter->i == iter->count;
+}
+
+static void
+bbox_iter_next(struct bbox_iter *iter)
+{
+	iter->i++;
+	bbox_iter_seek(iter);
+}
+
+void
+rasterize_rectlist(struct ps_primitive *p, struct rectangle *rect,
+		   bool skip_cleared)
+{
+	struct bbox_iter iter, next;
+
+	bbox_iter_init(&iter, p, rect);
+	while (!bbox_iter_done(&iter)) {
+		next = iter;
+		bbox_iter_next(&next);
+		if (!bbox_iter_done(&next))
+			prefetch_tile(next.x, next.y);
+
+		/* Tiles marked by the fast clear don't need the
+		 * clear shader, only the partially covered ones. */
+		if (!skip_cleared || !fast_clear_tile_pending(iter.x, iter.y))
+			rasterize_rectlist_tile(p, &iter);
+		iter = next;
+	}
+}
+
+static int32_t
+edge_delta_to_tile_min(struct edge *e)
+{
+	const int32_t sign_x = (uint32_t) e->a >> 31;
+	const int32_t sign_y = (uint32_t) e->b >> 31;
+
+	const int tile_max_x = tile_width - 1;
+	const int tile_max_y = tile_height - 1;
+
+	/* This is the delta from w in top-left corner to minimum w in tile. */
+
+	return e->a * sign_x * tile_max_x + e->b * sign_y * tile_max_y;
+}
+
+static int32_t
+edge_delta_to_tile_max(struct edge *e)
+{
+	const int32_t sign_x = (uint32_t) e->a >> 31;
+	const int32_t sign_y = (uint32_t) e->b >> 31;
+
+	const int tile_max_x = tile_width - 1;
+	const int tile_max_y = tile_height - 1;
+
+	/* This is the delta from w in top-left corner to maximum w in tile. */
+
+	return e->a * (1 - sign_x) * tile_max_x + e->b * (1 - sign_y) * tile_max_y;
+}
+
+static inline bool
+triangle_tile_covered(const struct bbox_iter *iter, const int32_t *min_delta)
+{
+	int32_t min_w2 = iter->w2 + min_delta[0];
+	int32_t min_w0 = iter->w0 + min_delta[1];
+	int32_t min_w1 = iter->w1 + min_delta[2];
+
+	return (min_w2 & min_w0 & min_w1) < 0;
+}
+
+void
+rasterize_triangle(struct ps_primitive *p, struct rectangle *rect)
+{
+	const int32_t min_delta[3] = {
+		edge_delta_to_tile_min(&p->e01),
+		edge_delta_to_tile_min(&p->e12),
+		edge_delta_to_tile_min(&p->e20)
+	};
+
+	/* Find the next tile that's at least partially covered before
+	 * rasterizing the current one, so we can prefetch it. */
+	struct bbox_iter iter, next;
+	bbox_iter_init(&iter, p, rect);
+	while (!bbox_iter_done(&iter) && !triangle_tile_covered(&iter, min_delta))
+		bbox_iter_next(&iter);
+
+	while (!bbox_iter_done(&iter)) {
+		next = iter;
+		do
+			bbox_iter_next(&next);
+		while (!bbox_iter_done(&next) && !triangle_tile_covered(&next, min_delta));
+
+		if (!bbox_iter_done(&next))
+			prefetch_tile(next.x, next.y);
+
+		rasterize_triangle_tile(p, &iter);
+		iter = next;
+	}
+}
+
+static void
+compute_bounding_box(struct rectangle *r, const struct vec4 *v, int count)
+{
+	r->x0 = INT_MAX;
+	r->y0 = INT_MAX;
+	r->x1 = INT_MIN;
+	r->y1 = INT_MIN;
+
+	for (int i = 0; i < count; i++) {
+		int32_t x, y;
+
+		x = floor(v[i].x);
+		if (x < r->x0)
+			r->x0 = x;
+		y = floor(v[i].y);
+		if (y < r->y0)
+			r->y0 = y;
+
+		x = ceil(v[i].x);
+		if (r->x1 < x)
+			r->x1 = x;
+		y = ceil(v[i].y);
+		if (r->y1 < y)
+			r->y1 = y;
+	}
+}
+
+static void
+init_edge_offsets(__m256i *offsets, const struct edge *e)
+{
+	static const struct reg sx = { .d = {  0, 1, 0, 1, 2, 3, 2, 3 } };
+	static const struct reg sy = { .d = {  0, 0, 1, 1, 0, 0, 1, 1 } };
+
+	for (int i = 0; i < 4; i++) {
+		__m256i x = _mm256_add_epi32(sx.ireg, _mm256_set1_epi32(group_blocks[i].x));
+		__m256i y = _mm256_add_epi32(sy.ireg, _mm256_set1_epi32(group_blocks[i].y));
+
+		offsets[i] =
+			_mm256_mullo_epi32(_mm256_set1_epi32(e->a), x) +
+			_mm256_mullo_epi32(_mm256_set1_epi32(e->b), y);
+	}
+}
+
+static bool
+compute_raster_rect(struct rectangle *rect, const struct vec4 *v, int count)
+{
+	compute_bounding_box(rect, v, count);
+	intersect_rectangle(rect, &gt.drawing_rectangle.rect);
+
+	if (gt.wm.scissor_rectangle_enable)
+		intersect_rectangle(rect, &gt.wm.scissor_rect);
+
+	rect->x0 = rect->x0 & ~(tile_width - 1);
+	rect->y0 = rect->y0 & ~(tile_height - 1);
+	rect->x1 = (rect->x1 + tile_width - 1) & ~(tile_width - 1);
+	rect->y1 = (rect->y1 + tile_height - 1) & ~(tile_height - 1);
+
+	return rect->x0 < rect->x1 && rect->y0 <= rect->y1;
+}
+
+/* Compute the pixels whose centers are inside the axis aligned
+ * rectangle bounding v, clipped to the drawing rectangle and the
+ * scissor, which both have inclusive max coordinates. */
+static bool
+compute_pixel_rect(struct rectangle *rect, const struct vec4 *v, int count)
+{
+	float x0 = v[0].x, y0 = v[0].y, x1 = v[0].x, y1 = v[0].y;
+
+	for (int i = 1; i < count; i++) {
+		x0 = fminf(x0, v[i].x);
+		y0 = fminf(y0, v[i].y);
+		x1 = fmaxf(x1, v[i].x);
+		y1 = fmaxf(y1, v[i].y);
+	}
+
+	rect->x0 = ceilf(x0 - 0.5f);
+	rect->y0 = ceilf(y0 - 0.5f);
+	rect->x1 = ceilf(x1 - 0.5f);
+	rect->y1 = ceilf(y1 - 0.5f);
+
+	const struct rectangle *d = &gt.drawing_rectangle.rect;
+	intersect_rectangle(rect, &(struct rectangle) {
+		d->x0, d->y0, d->x1 + 1, d->y1 + 1 });
+
+	if (gt.wm.scissor_rectangle_enable) {
+		const struct rectangle *s = &gt.wm.scissor_rect;
+		intersect_rectangle(rect, &(struct rectangle) {
+			s->x0, s->y0, s->x1 + 1, s->y1 + 1 });
+	}
+
+	return rect->x0 < rect->x1 && rect->y0 < rect->y1;
+}
+
+static void
+init_primitive_edges(struct ps_primitive *p, const struct vec4 *v)
+{
+	struct point p0 = snap_point(v[0].x, v[0].y);
+	struct point p1 = snap_point(v[1].x, v[1].y);
+	struct point p2 = snap_point(v[2].x, v[2].y);
+
+	init_edge(&p->e01, p0, p1);
+	init_edge(&p->e12, p1, p2);
+	init_edge(&p->e20, p2, p0);
+	p->area = eval_edge(&p->e01, p2);
+}
+
+static void
+invert_primitive(struct ps_primitive *p)
+{
+	invert_edge(&p->e01);
+	invert_edge(&p->e12);
+	invert_edge(&p->e20);
+	p->area = -p->area;
+}
+
+static void
+init_primitive(struct ps_primitive *p, struct value **vue, const struct vec4 *v)
+{
+	float w[3] = {
+		1.0f / v[0].z,
+		1.0f / v[1].z,
+		1.0f / v[2].z
+	};
+
+	p->w_deltas[0] = w[1] - w[0];
+	p->w_deltas[1] = w[2] - w[0];
+	p->w_deltas[2] = 0.0f;
+	p->w_deltas[3] = w[0];
+
+	p->inv_w_deltas[0] = v[1].w - v[0].w;
+	p->inv_w_deltas[1] = v[2].w - v[0].w;
+	p->inv_w_deltas[2] = 0.0f;
+	p->inv_w_deltas[3] = v[0].w;
+
+	p->back_facing = false;
+
+	/* Each attribute becomes two registers of (a1 - a0, a2 - a0,
+	 * 0, a0) per component, which we build with shuffles from the
+	 * three vec4s instead of element by element. */
+	const __m128 zero = _mm_setzero_ps();
+	for (uint32_t i = 0; i < gt.sbe.num_attributes; i++) {
+		const __m128 a0 = _mm_loadu_ps(vue[0][i + 2].f);
+		const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(vue[1][i + 2].f), a0);
+		const __m128 d2 = _mm_sub_ps(_mm_loadu_ps(vue[2][i + 2].f), a0);
+
+		/* d1.x d2.x d1.y d2.y and 0 a0.x 0 a0.y, same for zw */
+		const __m128 xy = _mm_unpacklo_ps(d1, d2);
+		const __m128 zw = _mm_unpackhi_ps(d1, d2);
+		const __m128 a0xy = _mm_unpacklo_ps(zero, a0);
+		const __m128 a0zw = _mm_unpackhi_ps(zero, a0);
+
+		p->attribute_deltas[i * 2].reg =
+			_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_movelh_ps(xy, a0xy)),
+					     _mm_movehl_ps(a0xy, xy), 1);
+		p->attribute_deltas[i * 2 + 1].reg =
+			_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_movelh_ps(zw, a0zw)),
+					     _mm_movehl_ps(a0zw, zw), 1);
+	}
+
+	init_edge_offsets(p->w2_offsets, &p->e01);
+	init_edge_offsets(p->w0_offsets, &p->e12);
+	init_edge_offsets(p->w1_offsets, &p->e20);
 
-		fill_dispatch(&pt, &iter, mask);
+	if (gt.multisample.samples > 1) {
+		for (uint32_t s = 0; s < gt.multisample.samples; s++) {
+			p->w2_sample[s] = sample_edge_offset(&p->e01, s);
+			p->w0_sample[s] = sample_edge_offset(&p->e12, s);
+			p->w1_sample[s] = sample_edge_offset(&p->e20, s);
+		}
 	}
 
-	finish_ps_thread(&pt);
+	const uint32_t dx = group_width;
+	const uint32_t dy = group_height;
+
+	p->w2_step = _mm256_set1_epi32(p->e01.a * dx);
+	p->w0_step = _mm256_set1_epi32(p->e12.a * dx);
+	p->w1_step = _mm256_set1_epi32(p->e20.a * dx);
+
+	p->w2_row_step = _mm256_set1_epi32(p->e01.b * dy - p->e01.a * (tile_width - dx));
+	p->w0_row_step = _mm256_set1_epi32(p->e12.b * dy - p->e12.a * (tile_width - dx));
+	p->w1_row_step = _mm256_set1_epi32(p->e20.b * dy - p->e20.a * (tile_width - dx));
 }
 
-struct point {
-	int32_t x, y;
+/* Lines, points and wireframe edges are rasterized as parallelograms
+ * with corners c0 - c3. Like for rectlists, coverage is computed
+ * from the two edges c0-c1 and c1-c2 and the area, which gives us
+ * the opposite edges. The barycentric coordinates come from the
+ * ps_primitive edges, which for wireframe is the triangle the edge
+ * belongs to, so we don't set up a new primitive per edge. */
+struct ps_line {
+	struct edge e0, e1;
+	int32_t area;
+	struct rectangle rect;
+	__m256i e0_offsets[4], e1_offsets[4];
 };
 
-static inline struct point
-snap_point(float x, float y)
+static bool
+init_line(struct ps_line *line, const struct vec4 *c)
 {
-	return (struct point) {
-		(int32_t) (x * 256.0f),
-		(int32_t) (y * 256.0f)
-	};
-}
+	struct point p0 = snap_point(c[0].x, c[0].y);
+	struct point p1 = snap_point(c[1].x, c[1].y);
+	struct point p2 = snap_point(c[2].x, c[2].y);
+
+	init_edge(&line->e0, p0, p1);
+	init_edge(&line->e1, p1, p2);
+	line->area = eval_edge(&line->e0, p2);
+
+	if (line->area > 0) {
+		invert_edge(&line->e0);
+		invert_edge(&line->e1);
+		line->area = -line->area;
+	}
 
-static inline void
-init_edge(struct edge *e, struct point p0, struct point p1)
-{
-	e->a = (p0.y - p1.y);
-	e->b = (p1.x - p0.x);
-	e->c = ((int64_t) p1.y * p0.x - (int64_t) p1.x * p0.y) >> 8;
-	e->bias = e->a < 0 || (e->a == 0 && e->b < 0);
-}
+	if (line->area >= 0)
+		return false;
 
-static inline void
-invert_edge(struct edge *e)
-{
-	e->a = -e->a;
-	e->b = -e->b;
-	e->c = -e->c;
-	e->bias = 1 - e->bias;
-}
+	if (!compute_raster_rect(&line->rect, c, 4))
+		return false;
 
-static inline int
-eval_edge(struct edge *e, struct point p)
-{
-	return (((int64_t) e->a * p.x + (int64_t) e->b * p.y) >> 8) + e->c - e->bias;
+	init_edge_offsets(line->e0_offsets, &line->e0);
+	init_edge_offsets(line->e1_offsets, &line->e1);
+
+	return true;
 }
 
-static void
-bbox_iter_init(struct bbox_iter *iter, struct ps_primitive *p, struct rectangle *rect)
+static bool
+line_corners(struct vec4 *c, struct vec4 v0, struct vec4 v1, float width)
 {
-	iter->x = rect->x0;
-	iter->y = rect->y0;
-	iter->rect = *rect;
+	float length, dx, dy, px, py;
 
-	struct point min = snap_point(rect->x0, rect->y0);
-	min.x += 128;
-	min.y += 128;
-	iter->w2 = eval_edge(&p->e01, min);
-	iter->w0 = eval_edge(&p->e12, min);
-	iter->w1 = eval_edge(&p->e20, min);
+	dx = v1.x - v0.x;
+	dy = v1.y - v0.y;
+	length = hypot(dx, dy);
+	if (length == 0.0f)
+		return false;
 
-	iter->w2_step = tile_width * p->e01.a;
-	iter->w0_step = tile_width * p->e12.a;
-	iter->w1_step = tile_width * p->e20.a;
+	/* Mesa programs a width of 0 for regular lines narrower than
+	 * 1.5 pixels, which the hardware draws as the thinnest line it
+	 * can. Draw those, and anything else below 1, 1 pixel wide. */
+	if (width < 1.0f)
+		width = 1.0f;
 
-	int32_t w = rect->x1 - rect->x0 - tile_width;
-	iter->w2_row_step = tile_height * p->e01.b - w * p->e01.a;
-	iter->w0_row_step = tile_height * p->e12.b - w * p->e12.a;
-	iter->w1_row_step = tile_height * p->e20.b - w * p->e20.a;
-}
+	length = width / 2.0f / length;
+	dx *= length;
+	dy *= length;
+	px = -dy;
+	py = dx;
 
-static bool
-bbox_iter_done(struct bbox_iter *iter)
-{
-	return iter->y == iter->rect.y1;
+	c[0] = v0;
+	c[0].x = v0.x - dx - px;
+	c[0].y = v0.y - dy - py;
+	c[1] = v1;
+	c[1].x = v1.x + dx - px;
+	c[1].y = v1.y + dy - py;
+	c[2] = v1;
+	c[2].x = v1.x + dx + px;
+	c[2].y = v1.y + dy + py;
+	c[3] = v0;
+	c[3].x = v0.x - dx + px;
+	c[3].y = v0.y - dy + py;
+
+	return true;
 }
 
 static void
-bbox_iter_next(struct bbox_iter *iter)
+point_corners(struct vec4 *c, struct vec4 v, float width)
 {
-	iter->x += tile_width;
-	if (iter->x == iter->rect.x1) {
-		iter->x = iter->rect.x0;
-		iter->y += tile_height;
-		iter->w2 += iter->w2_row_step;
-		iter->w0 += iter->w0_row_step;
-		iter->w1 += iter->w1_row_step;
-	} else {
-		iter->w2 += iter->w2_step;
-		iter->w0 += iter->w0_step;
-		iter->w1 += iter->w1_step;
-	}
+	const float r = width / 2.0f;
+
+	for (int i = 0; i < 4; i++)
+		c[i] = v;
+
+	c[0].x = v.x - r;
+	c[0].y = v.y - r;
+	c[1].x = v.x + r;
+	c[1].y = v.y - r;
+	c[2].x = v.x + r;
+	c[2].y = v.y + r;
+	c[3].x = v.x - r;
+	c[3].y = v.y + r;
 }
 
-void
-rasterize_rectlist(struct ps_primitive *p, struct rectangle *rect)
+static float
+point_width(struct value *vue)
 {
-	struct bbox_iter iter;
-
-	for (bbox_iter_init(&iter, p, rect);
-	     !bbox_iter_done(&iter); bbox_iter_next(&iter))
-		rasterize_rectlist_tile(p, &iter);
+	if (gt.sf.point_width_source == Vertex)
+		return vue[0].header.point_width;
+	else
+		return gt.sf.point_width;
 }
 
-static int32_t
-edge_delta_to_tile_min(struct edge *e)
+static void
+rasterize_line_tile(struct ps_primitive *p, const struct ps_line *line,
+		    const struct bbox_iter *bbox_iter, int32_t l0, int32_t l1)
 {
-	const int32_t sign_x = (uint32_t) e->a >> 31;
-	const int32_t sign_y = (uint32_t) e->b >> 31;
+	struct tile_iterator iter;
+	struct ps_thread pt;
 
-	const int tile_max_x = tile_width - 1;
-	const int tile_max_y = tile_height - 1;
+	init_ps_thread(&pt, p);
 
-	/* This is the delta from w in top-left corner to minimum w in tile. */
+	/* See rasterize_rectlist_tile() for how we get the opposite
+	 * edges. */
+	__m256i c = _mm256_set1_epi32(line->area - 1);
 
-	return e->a * sign_x * tile_max_x + e->b * sign_y * tile_max_y;
+	for (tile_iterator_init(&iter, p, bbox_iter);
+	     !tile_iterator_done(&iter);
+	     tile_iterator_next(&iter, p)) {
+		const int32_t g0 = l0 + line->e0.a * iter.x + line->e0.b * iter.y;
+		const int32_t g1 = l1 + line->e1.a * iter.x + line->e1.b * iter.y;
+
+		for (int i = 0; i < 4; i++) {
+			__m256i c0, c1, c2, c3, w1, w2;
+
+			c0 = _mm256_add_epi32(_mm256_set1_epi32(g0), line->e0_offsets[i]);
+			c1 = _mm256_add_epi32(_mm256_set1_epi32(g1), line->e1_offsets[i]);
+			c2 = _mm256_sub_epi32(c, c0);
+			c3 = _mm256_sub_epi32(c, c1);
+
+			struct reg mask;
+			mask.ireg = _mm256_and_si256(_mm256_and_si256(c0, c1),
+						     _mm256_and_si256(c2, c3));
+
+			w2 = _mm256_add_epi32(iter.w2, p->w2_offsets[i]);
+			w1 = _mm256_add_epi32(iter.w1, p->w1_offsets[i]);
+
+			/* Lines cover all samples of the pixels they
+			 * cover. */
+			fill_dispatch(&pt, &iter, i, w2, w1, mask,
+				      all_samples_coverage(mask));
+		}
+	}
+
+	finish_ps_thread(&pt);
 }
 
-void
-rasterize_triangle(struct ps_primitive *p, struct rectangle *rect)
+static void
+rasterize_line(struct ps_primitive *p, struct ps_line *line)
 {
-	int32_t min_w2_delta = edge_delta_to_tile_min(&p->e01);
-	int32_t min_w0_delta = edge_delta_to_tile_min(&p->e12);
-	int32_t min_w1_delta = edge_delta_to_tile_min(&p->e20);
+	const int32_t c = line->area - 1;
+	const int32_t min_l0_delta = edge_delta_to_tile_min(&line->e0);
+	const int32_t min_l1_delta = edge_delta_to_tile_min(&line->e1);
+	const int32_t max_l0_delta = edge_delta_to_tile_max(&line->e0);
+	const int32_t max_l1_delta = edge_delta_to_tile_max(&line->e1);
 
 	struct bbox_iter iter;
-	for (bbox_iter_init(&iter, p, rect);
+	for (bbox_iter_init(&iter, p, &line->rect);
 	     !bbox_iter_done(&iter); bbox_iter_next(&iter)) {
-		int32_t min_w2 = iter.w2 + min_w2_delta;
-		int32_t min_w0 = iter.w0 + min_w0_delta;
-		int32_t min_w1 = iter.w1 + min_w1_delta;
-
-		if ((min_w2 & min_w0 & min_w1) < 0)
-			rasterize_triangle_tile(p, &iter);
+		struct point min = snap_point(iter.x, iter.y);
+		min.x += 128;
+		min.y += 128;
+		int32_t l0 = eval_edge(&line->e0, min);
+		int32_t l1 = eval_edge(&line->e1, min);
+
+		/* Skip tiles that are entirely outside one of the
+		 * four edges. Diagonal lines have mostly empty
+		 * bounding boxes. */
+		int32_t min_l0 = l0 + min_l0_delta;
+		int32_t min_l1 = l1 + min_l1_delta;
+		int32_t min_l2 = c - (l0 + max_l0_delta);
+		int32_t min_l3 = c - (l1 + max_l1_delta);
+
+		if ((min_l0 & min_l1 & min_l2 & min_l3) < 0)
+			rasterize_line_tile(p, line, &iter, l0, l1);
 	}
 }
 
 static void
-compute_bounding_box(struct rectangle *r, const struct vec4 *v, int count)
+rasterize_parallelogram(struct value **vue, const struct vec4 *c)
 {
-	r->x0 = INT_MAX;
-	r->y0 = INT_MAX;
-	r->x1 = INT_MIN;
-	r->y1 = INT_MIN;
+	struct ps_primitive p;
+	struct ps_line line;
 
-	for (int i = 0; i < count; i++) {
-		int32_t x, y;
+	if (!init_line(&line, c))
+		return;
 
-		x = floor(v[i].x);
-		if (x < r->x0)
-			r->x0 = x;
-		y = floor(v[i].y);
-		if (y < r->y0)
-			r->y0 = y;
+	/* The barycentric coordinates are relative to the first three
+	 * corners. The caller passes vertices so that attributes
+	 * interpolate along lines and are constant for points. */
+	init_primitive_edges(&p, c);
+	if (p.area > 0)
+		invert_primitive(&p);
+	init_primitive(&p, vue, c);
 
-		x = ceil(v[i].x);
-		if (r->x1 < x)
-			r->x1 = x;
-		y = ceil(v[i].y);
-		if (r->y1 < y)
-			r->y1 = y;
-	}
+	rasterize_line(&p, &line);
 }
 
-static void
-intersect_rectangle(struct rectangle *r, const struct rectangle *other)
+/* Draw a rectangle with a constant color or copy shader as a fill or
+ * a copy. We leave anything that needs more than the shader to the
+ * rasterizer, as well as draws we collect statistics for. */
+static bool
+draw_meta_rectangle(const struct vec4 *v)
 {
-	if (r->x0 < other->x0)
-		r->x0 = other->x0;
-	if (r->y0 < other->y0)
-		r->y0 = other->y0;
-	if (r->x1 > other->x1)
-		r->x1 = other->x1;
-	if (r->y1 > other->y1)
-		r->y1 = other->y1;
-}
+	const struct surface *dst = &ps_rt.surface;
+	struct rectangle rect;
+	struct surface src;
+	uint8_t pixel[16];
+
+	if (!ps_rt.valid || blend_reads_dst(&gt.blend.rt[0]) ||
+	    gt.depth.test_enable || gt.depth.write_enable ||
+	    stencil_test_enabled() || gt.multisample.samples > 1 ||
+	    gt.ps.statistics || stats_file || heatmap_filename)
+		return false;
+
+	if (!is_power_of_two(dst->cpp) || dst->cpp > 16 ||
+	    (dst->tile_mode != LINEAR && dst->tile_mode != XMAJOR &&
+	     dst->tile_mode != YMAJOR))
+		return false;
+
+	if (!compute_pixel_rect(&rect, v, 3))
+		return true;
+
+	intersect_rectangle(&rect, &(struct rectangle) {
+		0, 0, dst->width, dst->height });
+	if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1)
+		return true;
+
+	switch (ps_meta.kind) {
+	case PS_META_CONSTANT:
+		if (!pack_rt_color(dst->format, ps_meta.color, pixel))
+			return false;
+		break;
 
-static void
-rewrite_to_rectlist(struct value **vue, struct vec4 *v)
-{
-	float length, dx, dy, px, py;
+	case PS_META_COPY:
+		if (!get_surface(gt.ps.binding_table_address, ps_meta.bti, &src))
+			return false;
+		if (src.format != dst->format || src.type != SURFTYPE_2D ||
+		    src.minimum_array_element != 0 ||
+		    (src.tile_mode != LINEAR && src.tile_mode != XMAJOR &&
+		     src.tile_mode != YMAJOR))
+			return false;
+		if (rect.x0 + ps_meta.dx < 0 || rect.x1 + ps_meta.dx > src.width ||
+		    rect.y0 + ps_meta.dy < 0 || rect.y1 + ps_meta.dy > src.height)
+			return false;
+		break;
 
-	vue[2] = vue[1];
-	v[0] = vue[0][1].vec4;
-	v[1] = vue[1][1].vec4;
-	v[2] = vue[2][1].vec4;
+	default:
+		return false;
+	}
 
-	dx = v[1].x - v[0].x;
-	dy = v[1].y - v[0].y;
-	length = gt.sf.line_width / 2.0f / hypot(dx, dy);
-	dx *= length;
-	dy *= length;
-	px = -dy;
-	py = dx;
-	v[0].x = v[0].x - dx - px;
-	v[0].y = v[0].y - dy - py;
-	v[1].x = v[1].x + dx - px;
-	v[1].y = v[1].y + dy - py;
-	v[2].x = v[2].x + dx + px;
-	v[2].y = v[2].y + dy + py;
+	/* Write out cleared tiles we're about to partially overwrite. */
+	color_tile_flush();
+	if (fast_clear.pending && dst->pixels == fast_clear.rt.pixels)
+		resolve_color_rect(&rect);
+
+	if (ps_meta.kind == PS_META_CONSTANT)
+		surface_fill_rect(dst, &rect, pixel);
+	else
+		surface_copy_rect(dst, &rect, &src, ps_meta.dx, ps_meta.dy);
+
+	return true;
 }
 
 void
 rasterize_primitive(struct value **vue, enum GEN9_3D_Prim_Topo_Type topology)
 {
 	struct ps_primitive p;
-	struct vec4 v[3];
+	struct value *pvue[3];
+	struct vec4 v[3], c[4];
+	struct ps_line line;
+	bool fast_clear_draw = false;
 
 	switch (topology) {
+	case _3DPRIM_POINTLIST:
+		pvue[0] = vue[0];
+		pvue[1] = vue[0];
+		pvue[2] = vue[0];
+		point_corners(c, vue[0][1].vec4, point_width(vue[0]));
+		rasterize_parallelogram(pvue, c);
+		return;
 	case _3DPRIM_LINELOOP:
 	case _3DPRIM_LINELIST:
 	case _3DPRIM_LINESTRIP:
-		rewrite_to_rectlist(vue, v);
-		break;
+		pvue[0] = vue[0];
+		pvue[1] = vue[1];
+		pvue[2] = vue[1];
+		if (line_corners(c, vue[0][1].vec4, vue[1][1].vec4, gt.sf.line_width))
+			rasterize_parallelogram(pvue, c);
+		return;
 	default:
-		v[0] = vue[0][1].vec4;
-		v[1] = vue[1][1].vec4;
-		v[2] = vue[2][1].vec4;
 		break;
 	}
 
-	struct point p0 = snap_point(v[0].x, v[0].y);
-	struct point p1 = snap_point(v[1].x, v[1].y);
-	struct point p2 = snap_point(v[2].x, v[2].y);
+	v[0] = vue[0][1].vec4;
+	v[1] = vue[1][1].vec4;
+	v[2] = vue[2][1].vec4;
+
+	init_primitive_edges(&p, v);
 
-	init_edge(&p.e01, p0, p1);
-	init_edge(&p.e12, p1, p2);
-	init_edge(&p.e20, p2, p0);
-	p.area = eval_edge(&p.e01, p2);
+	/* Triangles with negative area are counter-clockwise. Grab
+	 * the winding before we flip the primitive for culling. */
+	const bool counter_clockwise = p.area < 0;
 
 	if ((gt.wm.front_winding == CounterClockwise &&
 	     gt.wm.cull_mode == CULLMODE_FRONT) ||
 	    (gt.wm.front_winding == Clockwise &&
 	     gt.wm.cull_mode == CULLMODE_BACK) ||
-	    (gt.wm.cull_mode == CULLMODE_NONE && p.area > 0)) {
-		invert_edge(&p.e01);
-		invert_edge(&p.e12);
-		invert_edge(&p.e20);
-		p.area = -p.area;
-	}
+	    (gt.wm.cull_mode == CULLMODE_NONE && p.area > 0))
+		invert_primitive(&p);
 
 	if (p.area >= 0)
 		return;
 
-	switch (topology) {
-	case _3DPRIM_LINELOOP:
-	case _3DPRIM_LINELIST:
-	case _3DPRIM_LINESTRIP:
-		break;
-	default:
-		if (gt.wm.front_face_fill_mode != FILL_MODE_WIREFRAME)
-			break;
+	init_primitive(&p, vue, v);
+	p.back_facing =
+		counter_clockwise != (gt.wm.front_winding == CounterClockwise);
 
-		/* Hacky wireframe implementation: turn each triangle
-		 * edge into a line and call back into
-		 * rasterize_primitive(). */
-		struct value *wf_vue[3];
-		wf_vue[0] = vue[0];
-		wf_vue[1] = vue[1];
-		rasterize_primitive(wf_vue, _3DPRIM_LINELIST);
-		wf_vue[0] = vue[1];
-		wf_vue[1] = vue[2];
-		rasterize_primitive(wf_vue, _3DPRIM_LINELIST);
-		wf_vue[0] = vue[2];
-		wf_vue[1] = vue[0];
-		rasterize_primitive(wf_vue, _3DPRIM_LINELIST);
+	switch (gt.wm.front_face_fill_mode) {
+	case FILL_MODE_WIREFRAME:
+		for (int i = 0; i < 3; i++) {
+			if (line_corners(c, v[i], v[(i + 1) % 3], gt.sf.line_width) &&
+			    init_line(&line, c))
+				rasterize_line(&p, &line);
+		}
 		return;
-	}
-
-	float w[3] = {
-		1.0f / v[0].z,
-		1.0f / v[1].z,
-		1.0f / v[2].z
-	};
-
-	p.w_deltas[0] = w[1] - w[0];
-	p.w_deltas[1] = w[2] - w[0];
-	p.w_deltas[2] = 0.0f;
-	p.w_deltas[3] = w[0];
-
-	for (uint32_t i = 0; i < gt.sbe.num_attributes; i++) {
-		const struct value a0 = vue[0][i + 2];
-		const struct value a1 = vue[1][i + 2];
-		const struct value a2 = vue[2][i + 2];
-
-		p.attribute_deltas[i * 2] = (struct reg) {
-			.f = {
-				a1.vec4.x - a0.vec4.x,
-				a2.vec4.x - a0.vec4.x,
-				0,
-				a0.vec4.x,
-				a1.vec4.y - a0.vec4.y,
-				a2.vec4.y - a0.vec4.y,
-				0,
-				a0.vec4.y,
-			}
-		};
-		p.attribute_deltas[i * 2 + 1] = (struct reg) {
-			.f = {
-				a1.vec4.z - a0.vec4.z,
-				a2.vec4.z - a0.vec4.z,
-				0,
-				a0.vec4.z,
-				a1.vec4.w - a0.vec4.w,
-				a2.vec4.w - a0.vec4.w,
-				0,
-				a0.vec4.w,
-			}
-		};
+	case FILL_MODE_POINT:
+		for (int i = 0; i < 3; i++) {
+			point_corners(c, v[i], point_width(vue[i]));
+			if (init_line(&line, c))
+				rasterize_line(&p, &line);
+		}
+		return;
+	default:
+		break;
 	}
 
 	struct rectangle rect;
-	compute_bounding_box(&rect, v, 3);
-	intersect_rectangle(&rect, &gt.drawing_rectangle.rect);
-
-	if (gt.wm.scissor_rectangle_enable)
-		intersect_rectangle(&rect, &gt.wm.scissor_rect);
-
-	rect.x0 = rect.x0 & ~(tile_width - 1);
-	rect.y0 = rect.y0 & ~(tile_height - 1);
-	rect.x1 = (rect.x1 + tile_width - 1) & ~(tile_width - 1);
-	rect.y1 = (rect.y1 + tile_height - 1) & ~(tile_height - 1);
+	if (topology == _3DPRIM_RECTLIST &&
+	    (gt.ps.fast_clear || gt.ps.resolve_type != RESOLVE_DISABLED)) {
+		if (!compute_pixel_rect(&rect, v, 3))
+			return;
+
+		color_tile_flush();
+
+		/* A resolve only has to write out the tiles that are
+		 * still cleared, which we do without the resolve
+		 * shader. */
+		if (gt.ps.resolve_type != RESOLVE_DISABLED) {
+			if (fast_clear.pending && ps_rt.valid &&
+			    ps_rt.surface.pixels == fast_clear.rt.pixels)
+				resolve_color_rect(&rect);
+			return;
+		}
 
-	if (rect.x1 <= rect.x0 || rect.y1 < rect.y0)
+		fast_clear_draw = fast_clear_rect(&rect);
+	} else if (topology == _3DPRIM_RECTLIST && ps_meta.kind != PS_META_NONE &&
+		   draw_meta_rectangle(v)) {
 		return;
+	}
 
-	const uint32_t dx = 4;
-	const uint32_t dy = 2;
-	static const struct reg sx = { .d = {  0, 1, 0, 1, 2, 3, 2, 3 } };
-	static const struct reg sy = { .d = {  0, 0, 1, 1, 0, 0, 1, 1 } };
-
-	p.w2_offsets =
-		_mm256_mullo_epi32(_mm256_set1_epi32(p.e01.a), sx.ireg) +
-		_mm256_mullo_epi32(_mm256_set1_epi32(p.e01.b), sy.ireg);
-	p.w0_offsets =
-		_mm256_mullo_epi32(_mm256_set1_epi32(p.e12.a), sx.ireg) +
-		_mm256_mullo_epi32(_mm256_set1_epi32(p.e12.b), sy.ireg);
-	p.w1_offsets =
-		_mm256_mullo_epi32(_mm256_set1_epi32(p.e20.a), sx.ireg) +
-		_mm256_mullo_epi32(_mm256_set1_epi32(p.e20.b), sy.ireg);
-
-	p.w2_step = _mm256_set1_epi32(p.e01.a * dx);
-	p.w0_step = _mm256_set1_epi32(p.e12.a * dx);
-	p.w1_step = _mm256_set1_epi32(p.e20.a * dx);
-
-	p.w2_row_step = _mm256_set1_epi32(p.e01.b * dy - p.e01.a * (tile_width - dx));
-	p.w0_row_step = _mm256_set1_epi32(p.e12.b * dy - p.e12.a * (tile_width - dx));
-	p.w1_row_step = _mm256_set1_epi32(p.e20.b * dy - p.e20.a * (tile_width - dx));
+	if (!compute_raster_rect(&rect, v, 3))
+		return;
 
-	switch (topology) {
-	case _3DPRIM_RECTLIST:
-	case _3DPRIM_LINELOOP:
-	case _3DPRIM_LINELIST:
-	case _3DPRIM_LINESTRIP:
-		rasterize_rectlist(&p, &rect);
-		break;
-	default:
+	if (topology == _3DPRIM_RECTLIST)
+		rasterize_rectlist(&p, &rect, fast_clear_draw);
+	else
 		rasterize_triangle(&p, &rect);
-	}
+}
+
+static void
+write_stats(void)
+{
+	static uint64_t draw;
+	const struct ps_stats *s = &ps_stats;
+
+	fprintf(stats_file,
+		"{ \"draw\": %lu, \"topology\": %d, "
+		"\"vertex_count\": %u, \"instance_count\": %u, "
+		"\"bbox_tiles\": %lu, \"tiles\": %lu, \"tiles_rejected\": %lu, "
+		"\"empty_blocks\": %lu, \"partial_blocks\": %lu, "
+		"\"full_blocks\": %lu, \"depth_killed_blocks\": %lu, "
+		"\"simd8\": %lu, \"simd16\": %lu, \"simd32\": %lu, "
+		"\"pixels\": %lu, \"rt_bytes\": %lu }\n",
+		draw++, gt.ia.topology,
+		gt.prim.vertex_count, gt.prim.instance_count,
+		s->bbox_tiles, s->tiles, s->bbox_tiles - s->tiles,
+		s->empty_blocks, s->partial_blocks,
+		s->full_blocks, s->depth_killed_blocks,
+		s->dispatch_count[0], s->dispatch_count[1], s->dispatch_count[2],
+		s->pixel_count, s->rt_bytes);
 }
 
 void
 wm_flush(void)
 {
+	const uint64_t dispatches = ps_stats.dispatch_count[0] +
+		ps_stats.dispatch_count[1] + ps_stats.dispatch_count[2];
+
+	color_tile_flush();
+
+	if (dispatches > 0) {
+		ksim_trace(TRACE_PS,
+			   "ps dispatch (max width %d): %lu simd8, %lu simd16, %lu simd32, "
+			   "%lu pixels, %.2f pixels/dispatch\n",
+			   ps_max_dispatch_width,
+			   ps_stats.dispatch_count[0], ps_stats.dispatch_count[1],
+			   ps_stats.dispatch_count[2], ps_stats.pixel_count,
+			   (double) ps_stats.pixel_count / dispatches);
+	}
+
+	if (stats_file)
+		write_stats();
+
+	memset(&ps_stats, 0, sizeof(ps_stats));
+
+	if (heatmap_filename)
+		write_heatmap();
+
 	if (framebuffer_filename) {
 		struct surface s;
 		get_surface(gt.ps.binding_table_address, 0, &s);
+		fast_clear_resolve(&s);
 		dump_surface(framebuffer_filename, &s);
 	}
 }
@@ -856,7 +2499,12 @@ depth_clear(void)
 	struct reg clear_value;
 	int i;
 
-	if (gt.depth.hiz_enable) {
+	depth = map_gtt_offset(gt.depth.address, &range);
+	invalidate_shadow_range(depth, range);
+
+	/* We only track cleared HiZ tiles for single sampled depth,
+	 * clear multisampled depth right away. */
+	if (gt.depth.hiz_enable && gt.multisample.samples <= 1) {
 		uint32_t tile_stride = DIV_ROUND_UP(gt.depth.width, 32);
 		uint32_t tile_height = DIV_ROUND_UP(gt.depth.height, 32);
 		uint32_t size = tile_stride * tile_height;
@@ -866,26 +2514,33 @@ depth_clear(void)
 		return;
 	}
 
-	switch (gt.depth.format) {
-	case D32_FLOAT:
-		clear_value.reg = _mm256_set1_ps(gt.depth.clear_value);
-		break;
-	case D24_UNORM_X8_UINT:
-		clear_value.ireg = _mm256_set1_epi32(gt.depth.clear_value * 16777215.0f);
-		break;
-	case D16_UNORM:
-		stub("D16_UNORM clear");
-	default:
-		ksim_unreachable("invalid depth format");
-	}
-
-	depth = map_gtt_offset(gt.depth.address, &range);
-	int height = (gt.depth.height + 31) & ~31;
+	clear_value = depth_clear_value();
+	int height = gt.depth.height;
+	if (gt.multisample.samples > 1)
+		height *= ims_height_scale();
+	height = (height + 31) & ~31;
 
 	for (i = 0; i < gt.depth.stride * height; i += 32)
 		_mm256_store_si256((depth + i), clear_value.ireg);
 }
 
+void
+stencil_clear(void)
+{
+	uint64_t range;
+
+	if (!gt.stencil.enable)
+		return;
+
+	/* The stencil buffer has the dimensions of the depth buffer,
+	 * padded to whole W tiles. */
+	const uint64_t height = align_u64(gt.depth.height, 64);
+	void *stencil = map_gtt_offset(gt.stencil.address, &range);
+
+	memset(stencil, gt.hiz.stencil_clear_value,
+	       min_u64(gt.stencil.stride * height, range));
+}
+
 #define NO_KERNEL 1
 
 static void
@@ -898,10 +2553,21 @@ emit_load_attributes_deltas(struct kir_program *prog, int g)
 	}
 }
 
+static void
+emit_load_payload_v8(struct kir_program *prog, int width, uint32_t offset, int *g)
+{
+	for (int q = 0; q < width / 8; q++) {
+		kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q]) + offset);
+		kir_program_store_v8(prog, offsetof(struct thread, grf[(*g)++]), prog->dst);
+	}
+}
+
 static void
 emit_load_payload(struct kir_program *prog, int width)
 {
-	int g = 2;
+	/* SIMD32 has the subspan coordinates for the upper 16
+	 * channels in g2. */
+	int g = width == 32 ? 3 : 2;
 
 	kir_program_load_v8(prog, offsetof(struct ps_thread, grf0));
 	kir_program_store_v8(prog, offsetof(struct thread, grf[0]), prog->dst);
@@ -910,15 +2576,22 @@ emit_load_payload(struct kir_program *prog, int width)
 		kir_program_comment(prog, "load payload: barycentric coordinates");
 	for (uint32_t i = 0; i < 6; i++) {
 		if (gt.wm.barycentric_mode & (1 << i)) {
-			kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].w1_pc));
-			kir_program_store_v8(prog, offsetof(struct thread, grf[g++]), prog->dst);
-			kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].w2_pc));
-			kir_program_store_v8(prog, offsetof(struct thread, grf[g++]), prog->dst);
+			uint32_t w1, w2;
+
+			/* Centroid and sample modes use the pixel
+			 * center barycentrics for now. */
+			if ((1 << i) & perspective_modes) {
+				w1 = offsetof(struct dispatch, w1_pc);
+				w2 = offsetof(struct dispatch, w2_pc);
+			} else {
+				w1 = offsetof(struct dispatch, w1);
+				w2 = offsetof(struct dispatch, w2);
+			}
 
-			if (width == 16) {
-				kir_program_load_v8(prog, offsetof(struct ps_thread, queue[1].w1_pc));
+			for (int q = 0; q < width / 8; q++) {
+				kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q]) + w1);
 				kir_program_store_v8(prog, offsetof(struct thread, grf[g++]), prog->dst);
-				kir_program_load_v8(prog, offsetof(struct ps_thread, queue[1].w2_pc));
+				kir_program_load_v8(prog, offsetof(struct ps_thread, queue[q]) + w2);
 				kir_program_store_v8(prog, offsetof(struct thread, grf[g++]), prog->dst);
 			}
 		}
@@ -926,14 +2599,12 @@ emit_load_payload(struct kir_program *prog, int width)
 
 	if (gt.ps.uses_source_depth) {
 		kir_program_comment(prog, "load payload: source depth");
-		kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].z));
-		kir_program_store_v8(prog, offsetof(struct thread, grf[g++]), prog->dst);
+		emit_load_payload_v8(prog, width, offsetof(struct dispatch, z), &g);
 	}
 
 	if (gt.ps.uses_source_w) {
 		kir_program_comment(prog, "load payload: source w");
-		kir_program_load_v8(prog, offsetof(struct ps_thread, queue[0].w));
-		kir_program_store_v8(prog, offsetof(struct thread, grf[g++]), prog->dst);
+		emit_load_payload_v8(prog, width, offsetof(struct dispatch, w), &g);
 	}
 
 	if (gt.ps.position_offset_xy == POSOFFSET_CENTROID) {
@@ -951,29 +2622,43 @@ emit_load_payload(struct kir_program *prog, int width)
 }
 
 static shader_t
-compile_ps_for_width(uint64_t kernel_offset, int width)
+compile_ps_for_width(uint64_t kernel_offset, uint32_t grf_start, int width)
 {
 	struct kir_program prog;
 
 	kir_program_init(&prog, gt.ps.binding_table_address,
 			 gt.ps.sampler_state_address);
+	if (gt.ps.kills_pixel)
+		prog.kill_width = width;
 
-	emit_barycentric_conversion(&prog);
+	emit_barycentric_conversion(&prog, width);
 
-	emit_depth_test(&prog);
+	emit_depth_test(&prog, width);
 
 	if (gt.ps.enable) {
 		emit_load_payload(&prog, width);
 
 		int g;
 		if (gt.ps.push_constant_enable)
-			g = emit_load_constants(&prog, &gt.ps.curbe, gt.ps.grf_start0);
+			g = emit_load_constants(&prog, &gt.ps.curbe, grf_start);
 		else
-			g = gt.ps.grf_start0;
+			g = grf_start;
 
 		if (gt.ps.attribute_enable)
 			emit_load_attributes_deltas(&prog, g);
 
+		/* Look for clear and copy shaders, which we can run as
+		 * fills and copies when they draw rectangles. */
+		if (width < 32 && ps_meta.kind == PS_META_NONE) {
+			static struct thread t;
+			uint32_t n = 0;
+
+			if (gt.ps.push_constant_enable)
+				n = load_constants(&t, &gt.ps.curbe);
+			classify_ps(kernel_offset, grf_start, width,
+				    t.constants, n, &ps_meta);
+		}
+
 		kir_program_comment(&prog, "eu ps");
 		kir_program_emit_shader(&prog, kernel_offset);
 	}
@@ -987,45 +2672,80 @@ void
 compile_ps(void)
 {
 	uint64_t ksp_simd8 = NO_KERNEL, ksp_simd16 = NO_KERNEL, ksp_simd32 = NO_KERNEL;
+	uint32_t grf_simd8 = 0, grf_simd16 = 0, grf_simd32 = 0;
+
+	ps_rt.valid = false;
+	ps_rt.tile_buffer = false;
+	ps_meta.kind = PS_META_NONE;
+
+	/* Depth tests can write depth too, when they resolve HiZ
+	 * cleared tiles. */
+	if (gt.depth.buffer && (gt.depth.write_enable || gt.depth.test_enable)) {
+		uint64_t range;
+
+		invalidate_shadow_range(map_gtt_offset(gt.depth.address, &range), range);
+	}
 
 	if (!gt.ps.enable)
 		return;
 
+	ps_rt.valid =
+		get_surface(gt.ps.binding_table_address, 0, &ps_rt.surface);
+	if (ps_rt.valid)
+		invalidate_shadow_surface(&ps_rt.surface);
+	ps_rt.tile_buffer = ps_rt.valid && color_tile_enabled(&ps_rt.surface);
+
+	if (heatmap_filename)
+		heatmap_resize();
+
 	if (gt.ps.enable_simd8) {
 		ksp_simd8 = gt.ps.ksp0;
+		grf_simd8 = gt.ps.grf_start0;
 		if (gt.ps.enable_simd16) {
 			ksp_simd16 = gt.ps.ksp2;
-			if (gt.ps.enable_simd32)
+			grf_simd16 = gt.ps.grf_start2;
+			if (gt.ps.enable_simd32) {
 				ksp_simd32 = gt.ps.ksp1;
-		} else {
+				grf_simd32 = gt.ps.grf_start1;
+			}
+		} else if (gt.ps.enable_simd32) {
 			ksp_simd32 = gt.ps.ksp2;
+			grf_simd32 = gt.ps.grf_start2;
 		}
 	} else {
 		if (gt.ps.enable_simd16) {
 			if (gt.ps.enable_simd32) {
 				ksp_simd16 = gt.ps.ksp2;
+				grf_simd16 = gt.ps.grf_start2;
 				ksp_simd32 = gt.ps.ksp1;
+				grf_simd32 = gt.ps.grf_start1;
 			} else {
 				ksp_simd16 = gt.ps.ksp0;
+				grf_simd16 = gt.ps.grf_start0;
 			}
 		} else {
 			ksp_simd32 = gt.ps.ksp0;
+			grf_simd32 = gt.ps.grf_start0;
 		}
 	}
 
+	gt.ps.avx_shader_simd8 = NULL;
+	gt.ps.avx_shader_simd16 = NULL;
+	gt.ps.avx_shader_simd32 = NULL;
+
 	if (ksp_simd8 != NO_KERNEL) {
 		ksim_trace(TRACE_EU | TRACE_AVX, "jit simd8 ps\n");
 		gt.ps.avx_shader_simd8 =
-			compile_ps_for_width(ksp_simd8, 8);
+			compile_ps_for_width(ksp_simd8, grf_simd8, 8);
 	}
 	if (ksp_simd16 != NO_KERNEL) {
 		ksim_trace(TRACE_EU | TRACE_AVX, "jit simd16 ps\n");
 		gt.ps.avx_shader_simd16 =
-			compile_ps_for_width(ksp_simd16, 16);
+			compile_ps_for_width(ksp_simd16, grf_simd16, 16);
 	}
 	if (ksp_simd32 != NO_KERNEL) {
 		ksim_trace(TRACE_EU | TRACE_AVX, "jit simd32 ps\n");
 		gt.ps.avx_shader_simd32 =
-			compile_ps_for_width(ksp_simd32, 32);
+			compile_ps_for_width(ksp_simd32, grf_simd32, 32);
 	}
 }